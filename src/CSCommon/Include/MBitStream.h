@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include "GlobalTypes.h"
+
+// Writes values of up to 32 bits into a byte buffer, lowest bits first.
+class MBitWriter
+{
+public:
+	explicit MBitWriter(std::vector<u8>& Out) : Out(Out) {}
+
+	void Write(u32 Value, int Bits)
+	{
+		for (int i = 0; i < Bits; ++i)
+		{
+			if (BitPos == 0)
+				Out.push_back(0);
+			if (Value & (1u << i))
+				Out.back() |= u8(1 << BitPos);
+			BitPos = (BitPos + 1) & 7;
+		}
+	}
+
+	void WriteBool(bool Value) { Write(Value ? 1 : 0, 1); }
+
+private:
+	std::vector<u8>& Out;
+	int BitPos = 0;
+};
+
+// Reads what MBitWriter wrote. Reading past the end sets an error flag, which the
+// caller checks with IsValid once it's done, and returns zeroes.
+class MBitReader
+{
+public:
+	MBitReader(const u8* Data, size_t Size) : Data(Data), Size(Size) {}
+
+	u32 Read(int Bits)
+	{
+		u32 Value = 0;
+		for (int i = 0; i < Bits; ++i)
+		{
+			if (BytePos >= Size)
+			{
+				bError = true;
+				return 0;
+			}
+			if (Data[BytePos] & (1 << BitPos))
+				Value |= 1u << i;
+			if (++BitPos == 8)
+			{
+				BitPos = 0;
+				++BytePos;
+			}
+		}
+		return Value;
+	}
+
+	bool ReadBool() { return Read(1) != 0; }
+
+	bool IsValid() const { return !bError; }
+
+private:
+	const u8* Data;
+	size_t Size;
+	size_t BytePos = 0;
+	int BitPos = 0;
+	bool bError = false;
+};
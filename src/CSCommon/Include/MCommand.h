@@ -24,6 +24,10 @@
 
 #define MCCT_NON_ENCRYPTED		128
 #define MCCT_HSHIELD_ENCRYPTED	256
+// Send priority of server to client commands. See NetIO::SendPriority. Commands
+// without either flag are interactive.
+#define MCCT_PRIORITY_REALTIME	512
+#define MCCT_PRIORITY_BULK		1024
 
 #define MAX_COMMAND_PARAMS		255
 
@@ -60,6 +64,45 @@ public:
 	MCommandDesc* Clone();
 };
 
+// A view of a serialized command. Init checks the data against the command
+// description once, and the parameters are then read straight out of the
+// buffer without creating any MCommandParameter objects.
+// The reader doesn't own the data.
+class MCommandReader
+{
+public:
+	bool Init(const char* pData, unsigned short nDataLen, MCommandManager* pCM, bool ReadSerial = true);
+	bool Init(const char* pData, unsigned short nDataLen, const MCommandDesc* pDesc, bool ReadSerial = true);
+
+	const MCommandDesc* GetDesc() const { return m_pDesc; }
+	const char* GetData() const { return m_pData; }
+	int GetSize() const { return m_nSize; }
+	bool HasSerialNumber() const { return m_bHasSerial; }
+	unsigned char GetSerialNumber() const { return m_nSerialNumber; }
+	int GetParametersOffset() const { return m_Offsets[0]; }
+	int GetParameterCount() const { return m_pDesc ? m_pDesc->GetParameterDescCount() : 0; }
+
+	// Same semantics as MCommand::GetParameter.
+	bool GetParameter(void* pValue, int i, MCommandParameterType t, int nBufferSize = -1) const;
+	// These point into the command data, and so are only valid as long as it is.
+	const char* GetString(int i) const;
+	const void* GetBlob(int i, u32* pSize = nullptr) const;
+
+private:
+	const char* GetParameterData(int i, MCommandParameterType t) const;
+
+	// Offsets of the first parameters are saved by Init, the rest are found by
+	// walking forward from the last saved one.
+	static constexpr int NumSavedOffsets = 16;
+
+	const char*			m_pData = nullptr;
+	const MCommandDesc*	m_pDesc = nullptr;
+	unsigned short		m_nSize = 0;
+	unsigned short		m_Offsets[NumSavedOffsets]{};
+	unsigned char		m_nSerialNumber = 0;
+	bool				m_bHasSerial = false;
+};
+
 class MCommand : public CMemPool<MCommand> 
 {
 public:
@@ -68,6 +111,12 @@ public:
 	const MCommandDesc*			m_pCommandDesc;
 	std::vector<MCommandParameter*>	m_Params;
 	unsigned char				m_nSerialNumber;
+	// If not empty, the command is sent to all of these instead of m_Receiver.
+	// It's serialized once and only encrypted per receiver.
+	std::vector<MUID>			m_Receivers;
+	// Can be skipped for receivers that are falling behind, like relayed position
+	// updates that will be superseded by the next one anyway.
+	bool						m_bDroppable = false;
 	void ClearParam(int i);
 	void Reset();
 
@@ -113,6 +162,42 @@ public:
 	}
 
 	int GetSize() const;
+
+	// Validates and stores the serialized command without creating any
+	// parameters. They're only created if something asks for them through the
+	// MCommandParameter interface, so handlers can move to GetReader() one at a
+	// time.
+	bool SetRawData(const char* pData, MCommandManager* pCM,
+		unsigned short nDataLen = USHRT_MAX, bool ReadSerial = true);
+	// Reads the parameters without allocating. If the command wasn't made with
+	// SetRawData, the parameters are serialized on the first call.
+	const MCommandReader& GetReader();
+
+	// Makes this a command of type pDesc whose nSize bytes of serialized data are
+	// written by the caller into the returned buffer, then checked by EndRawData.
+	// Used by MCreateCommand in MCommandWriter.h.
+	char* BeginRawData(const MCommandDesc* pDesc, int nSize);
+	bool EndRawData(bool ReadSerial = true);
+
+private:
+	template <typename T>
+	bool ReadParameters(const char* pData, unsigned short nDataCount, unsigned short nTotalSize,
+		unsigned short nDataLen, T& Alloc);
+	// Creates m_Params from the raw data if that hasn't been done yet. Returns false,
+	// with no parameters, if the data couldn't be read.
+	bool ReadRawParameters() const;
+	char* AllocRawData(int nSize);
+
+	// Most commands are small enough to fit inline.
+	char				m_RawInline[128];
+	std::vector<char>	m_RawHeap;
+	MCommandReader		m_Reader;
+	unsigned short		m_nRawSize;
+	// m_Reader points to the serialized command.
+	bool				m_bRawData;
+	// m_Params has been filled in. Only false for commands from SetRawData
+	// whose parameters haven't been asked for yet.
+	bool				m_bParamsRead;
 };
 
 template <typename T>
@@ -152,6 +237,14 @@ bool MCommand::SetData(const char* pData, MCommandManager* pCM, unsigned short n
 		nDataCount += sizeof(m_nSerialNumber);
 	}
 
+	return ReadParameters(pData, nDataCount, nTotalSize, nDataLen, Alloc);
+}
+
+template <typename T>
+bool MCommand::ReadParameters(const char* pData, unsigned short nDataCount, unsigned short nTotalSize,
+	unsigned short nDataLen, T& Alloc)
+{
+	const MCommandDesc* pDesc = m_pCommandDesc;
 
 	// Parameters
 	int nParamCount = pDesc->GetParameterDescCount();
@@ -4,7 +4,17 @@
 #include "MPacket.h"
 #include "MDebug.h"
 #include "MPacketCrypter.h"
+#include "MPacketRateLimiter.h"
+#include <list>
+#include <memory>
+#include <vector>
 
+// Splits a TCP stream into packets and turns them into commands.
+//
+// Packets are framed, checksummed and decrypted in place, either in the caller's
+// read buffer or, for a packet that's split between reads, in m_Buffer. Only the
+// bytes of a split packet are ever copied, and nothing is shifted after a packet
+// has been taken off the front.
 class MCommandBuilder {	
 protected:
 	MUID					m_uidSender;	// client
@@ -13,21 +23,34 @@ protected:
 
 	#define COMMAND_BUFFER_LEN	16384
 
-	char					m_Buffer[COMMAND_BUFFER_LEN];
+	// Bytes that couldn't be framed yet. Usually this is the start of a single
+	// packet, but it can hold more if packets arrive before the crypter is set up.
+	std::vector<char>		m_Buffer;
+	int						m_nBufferStart;
 	int						m_nBufferNext;
 
-	MCommandList			m_CommandList;
+	// For GetCommand.
+	std::vector<MCommand*>	m_CommandList;
+	size_t					m_nCommandListPos;
 	std::list<MPacketHeader*>	m_NetCmdList;
 
+	// Decompressed MSGID_COMPRESSEDCOMMAND data.
+	std::vector<char>		m_DecompressBuffer;
+
 	MPacketCrypter*			m_pPacketCrypter;
 	MCommandSNChecker		m_CommandSNChecker;
 	bool					m_bCheckCommandSN;
+	bool					m_bAllowCompressed = true;
+	std::unique_ptr<MPacketRateLimiter>	m_pRateLimiter;
 protected:
-	bool CheckBufferEmpty();
-	bool EstimateBufferToCmd();
-	void AddBuffer(char* pBuffer, int nLen);
-	bool MoveBufferToFront(int nStart, int nLen);
-	int MakeCommand(char* pBuffer, int nBufferLen);
+	int GetBufferedSize() const { return m_nBufferNext - m_nBufferStart; }
+	bool AddBuffer(const char* pBuffer, int nLen);
+	// Returns the size of the packet at pPacket, 0 if it can't be known yet, or -1 if
+	// it's invalid.
+	int GetPacketSize(MPacketHeader* pPacket);
+	// Returns the command ID without decrypting the rest of the packet, or -1.
+	int PeekCommandID(MPacketHeader* pPacket, int nPacketSize);
+	bool MakeCommand(MPacketHeader* pPacket, int nPacketSize, std::vector<MCommand*>& Commands);
 	void Clear();
 	int _CalcPacketSize(MPacketHeader* pPacket);
 public:
@@ -35,8 +58,20 @@ public:
 	virtual ~MCommandBuilder();
 	void SetUID(MUID uidReceiver, MUID uidSender);
 	void InitCrypt(MPacketCrypter* pPacketCrypter, bool bCheckCommandSerialNumber);
+	// Appends the commands in every complete packet to Commands. pBuffer is modified.
+	// Returns false if the stream is invalid, in which case the connection should be
+	// dropped.
+	bool Read(char* pBuffer, int nBufferLen, std::vector<MCommand*>& Commands);
+	// Same as above, but the commands are picked up with GetCommand.
 	bool Read(char* pBuffer, int nBufferLen);
 	void SetCheckCommandSN(bool bCheck) { m_bCheckCommandSN = bCheck; }
+	// Compression is only negotiated for server to client commands, so the server
+	// turns this off for its connections. Compressed packets then make Read fail.
+	void SetAllowCompressed(bool bAllow) { m_bAllowCompressed = bAllow; }
+	// Packets that go over the limiter's budgets are skipped, or make Read fail if the
+	// budget's action is to kick. Null disables rate limiting.
+	void SetRateLimiter(std::unique_ptr<MPacketRateLimiter> pLimiter) { m_pRateLimiter = std::move(pLimiter); }
+	const MPacketRateLimiter* GetRateLimiter() const { return m_pRateLimiter.get(); }
 
 	MCommand* GetCommand();
 	MPacketHeader* GetNetCommand();
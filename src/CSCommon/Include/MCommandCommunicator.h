@@ -17,6 +17,11 @@
 class MCommandCommunicator;
 class MCommandBuilder;
 
+// Defined in MCommandWriter.h, which callers of CreateCommand<ID> include.
+template <int ID, typename... ArgTypes>
+MCommand* MCreateCommand(const MCommandDesc* pDesc, const MUID& Sender, const MUID& Receiver,
+	const ArgTypes&... Args);
+
 class MCommObject {
 protected:
 	MUID					m_uid;
@@ -31,6 +36,14 @@ protected:
 	int						m_nPort;
 	u32						m_dwIP;
 	bool					m_bAllowed;
+	// Set at login if the client can decode MSGID_COMPRESSEDCOMMAND.
+	bool					m_bAllowCompression = false;
+	// Set at login if the client can take relayed peer commands over UDP.
+	bool					m_bAllowUDPRelay = false;
+	// Set at login if the client understands MC_MATCH_PEER_SNAPSHOT.
+	bool					m_bAllowPeerSnapshot = false;
+	// Set at login if the client understands MC_MATCH_PEER_DELTA_SNAPSHOT.
+	bool					m_bAllowPeerDeltaSnapshot = false;
 
 public:
 	MCommObject(MCommandCommunicator* pCommunicator);
@@ -57,6 +70,14 @@ public:
 	}
 	void SetAllowed(bool bAllowed)	{ m_bAllowed = bAllowed; }
 	bool IsAllowed() const			{ return m_bAllowed; }
+	void SetAllowCompression(bool bAllow)	{ m_bAllowCompression = bAllow; }
+	bool IsCompressionAllowed() const		{ return m_bAllowCompression; }
+	void SetAllowUDPRelay(bool bAllow)		{ m_bAllowUDPRelay = bAllow; }
+	bool IsUDPRelayAllowed() const			{ return m_bAllowUDPRelay; }
+	void SetAllowPeerSnapshot(bool bAllow)	{ m_bAllowPeerSnapshot = bAllow; }
+	bool IsPeerSnapshotAllowed() const		{ return m_bAllowPeerSnapshot; }
+	void SetAllowPeerDeltaSnapshot(bool bAllow)	{ m_bAllowPeerDeltaSnapshot = bAllow; }
+	bool IsPeerDeltaSnapshotAllowed() const		{ return m_bAllowPeerDeltaSnapshot; }
 };
 
 
@@ -99,6 +120,14 @@ public:
 		return &m_CommandManager;
 	}
 	MCommand* CreateCommand(int nCmdID, const MUID& TargetUID);
+	// Typed version for the commands in MCOMMAND_SIGNATURES. The arguments are
+	// written straight into the command's data; see MCommandWriter.h, which has to be
+	// included wherever this is used.
+	template <int ID, typename... ArgTypes>
+	MCommand* CreateCommand(const MUID& TargetUID, const ArgTypes&... Args)
+	{
+		return MCreateCommand<ID>(m_CommandManager.GetCommandDescByID(ID), m_This, TargetUID, Args...);
+	}
 
 	enum _LogLevel	{ LOG_DEBUG = 1, LOG_FILE = 2, LOG_PROG = 4, LOG_ALL = 7,  };
 
@@ -125,6 +154,9 @@ protected:
 	virtual void OnPrepareRun();
 	virtual void OnPrepareCommand(MCommand* pCommand);
 	virtual void OnRun();
+	// Called at the end of Run, after the command queue has been drained and OnRun
+	// has been called.
+	virtual void OnRunFinished();
 
 	void SetDefaultReceiver(MUID Receiver);
 
@@ -3,6 +3,7 @@
 #include <map>
 #include <string>
 #include <list>
+#include "MPSCQueue.h"
 
 class MCommand;
 class MCommandDesc;
@@ -13,8 +14,9 @@ using MCommandAliasMap = std::map<std::string, std::string>;
 class MCommandManager{
 protected:
 	MCommandDescMap		m_CommandDescs;
-	// Queue for posted commands
-	MCommandList		m_CommandQueue;
+	// Queue for posted commands. Post can be called from any thread, GetCommand and
+	// PeekCommand only from the thread that runs the commands.
+	MPSCQueue<MCommand*, 4096>	m_CommandQueue;
 	MCommandAliasMap	m_CommandAlias;
 protected:
 	void InitializeCommandDesc();
@@ -28,6 +30,8 @@ public:
 
 	int GetCommandDescCount() const;
 	int GetCommandQueueCount() const;
+	int GetCommandQueueHighWaterMark() const;
+	void ResetCommandQueueHighWaterMark();
 	MCommandDesc* GetCommandDesc(int i);
 	MCommandDesc* GetCommandDescByID(int nID);
 	void AssignDescs(MCommandManager* pTarCM);
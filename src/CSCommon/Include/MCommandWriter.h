@@ -0,0 +1,230 @@
+#pragma once
+
+#include "MCommand.h"
+#include "MSharedCommandTable.h"
+#include "MMatchUtil.h"
+#include <cstring>
+#include <initializer_list>
+#include <type_traits>
+#include <utility>
+
+// Typed command construction.
+//
+// Commands listed in MCOMMAND_SIGNATURES get a compile-time signature, and can be
+// built with MCommandCommunicator::CreateCommand<ID>(Receiver, Args...) or
+// serialized into any buffer with MWriteCommand<ID>. The arguments are checked
+// against the signature at compile time (count, types and narrowing), and are
+// written straight into the command's wire buffer instead of creating a heap
+// MCommandParameter for each of them.
+//
+// The signatures have to match the descriptions in MSharedCommandTable.cpp.
+// MVerifyCommandSignatures checks this when the command table is registered.
+
+// ID, parameter types...
+#define MCOMMAND_SIGNATURES(X)\
+	X(MC_NET_PING, MPT_UINT)\
+	X(MC_NET_PONG, MPT_UINT)\
+	X(MC_MATCH_P2P_COMMAND, MPT_UID, MPT_BLOB)\
+	X(MC_MATCH_PEER_SNAPSHOT, MPT_BLOB)\
+	X(MC_MATCH_PEER_DELTA_SNAPSHOT, MPT_BLOB)\
+	X(MC_MATCH_PEER_SNAPSHOT_ACK, MPT_UINT, MPT_UINT, MPT_UINT)\
+	X(MC_MATCH_DAMAGE, MPT_UID, MPT_USHORT, MPT_FLOAT, MPT_UCHAR, MPT_UCHAR)\
+	X(MC_PEER_DIE, MPT_UID)\
+	X(MC_PEER_HPAPINFO, MPT_FLOAT, MPT_FLOAT)
+
+// A blob parameter. Doesn't own the data.
+struct MCommandBlob
+{
+	const void* Data;
+	u32 Size;
+};
+
+template <MCommandParameterType... Types>
+struct MCommandParameterTypes {};
+
+template <int ID>
+struct MCommandSignature;
+
+#define MCOMMAND_SIGNATURE(ID, ...)\
+	template <> struct MCommandSignature<ID> { using Types = MCommandParameterTypes<__VA_ARGS__>; };
+MCOMMAND_SIGNATURES(MCOMMAND_SIGNATURE)
+#undef MCOMMAND_SIGNATURE
+
+// Checks the signatures in MCOMMAND_SIGNATURES against the registered command
+// descriptions. Commands that aren't registered are skipped.
+bool MVerifyCommandSignatures(MCommandManager* pCM);
+
+namespace detail
+{
+template <typename T>
+struct MFixedCommandParameter
+{
+	using Type = T;
+	static int GetSize(const T&) { return sizeof(T); }
+	static void Write(char*& p, const T& Value) { memcpy(p, &Value, sizeof(T)); p += sizeof(T); }
+};
+
+struct MVectorCommandParameter
+{
+	using Type = v3;
+	static int GetSize(const v3&) { return sizeof(float) * 3; }
+	static void Write(char*& p, const v3& Value)
+	{
+		const float Values[] = { Value.x, Value.y, Value.z };
+		memcpy(p, Values, sizeof(Values));
+		p += sizeof(Values);
+	}
+};
+
+template <MCommandParameterType Type>
+struct MCommandParameterTraits;
+
+template <> struct MCommandParameterTraits<MPT_INT> : MFixedCommandParameter<int> {};
+template <> struct MCommandParameterTraits<MPT_UINT> : MFixedCommandParameter<unsigned int> {};
+template <> struct MCommandParameterTraits<MPT_FLOAT> : MFixedCommandParameter<float> {};
+template <> struct MCommandParameterTraits<MPT_BOOL> : MFixedCommandParameter<bool> {};
+template <> struct MCommandParameterTraits<MPT_UID> : MFixedCommandParameter<MUID> {};
+template <> struct MCommandParameterTraits<MPT_CHAR> : MFixedCommandParameter<char> {};
+template <> struct MCommandParameterTraits<MPT_UCHAR> : MFixedCommandParameter<unsigned char> {};
+template <> struct MCommandParameterTraits<MPT_SHORT> : MFixedCommandParameter<short> {};
+template <> struct MCommandParameterTraits<MPT_USHORT> : MFixedCommandParameter<unsigned short> {};
+template <> struct MCommandParameterTraits<MPT_INT64> : MFixedCommandParameter<int64_t> {};
+template <> struct MCommandParameterTraits<MPT_UINT64> : MFixedCommandParameter<uint64_t> {};
+template <> struct MCommandParameterTraits<MPT_SVECTOR> : MFixedCommandParameter<MShortVector> {};
+template <> struct MCommandParameterTraits<MPT_VECTOR> : MVectorCommandParameter {};
+template <> struct MCommandParameterTraits<MPT_POS> : MVectorCommandParameter {};
+template <> struct MCommandParameterTraits<MPT_DIR> : MVectorCommandParameter {};
+template <> struct MCommandParameterTraits<MPT_COLOR> : MVectorCommandParameter {};
+
+// Same layout as MCommandParameterString::GetData: the length includes the null
+// terminator and one extra byte.
+template <> struct MCommandParameterTraits<MPT_STR>
+{
+	using Type = const char*;
+	static int GetSize(const char* Value) { return sizeof(u16) + int(strlen(Value)) + 2; }
+	static void Write(char*& p, const char* Value)
+	{
+		u16 Size = u16(strlen(Value) + 2);
+		memcpy(p, &Size, sizeof(Size));
+		memcpy(p + sizeof(Size), Value, Size - 1);
+		p[sizeof(Size) + Size - 1] = 0;
+		p += sizeof(Size) + Size;
+	}
+};
+
+template <> struct MCommandParameterTraits<MPT_BLOB>
+{
+	using Type = MCommandBlob;
+	static int GetSize(const MCommandBlob& Value) { return sizeof(u32) + Value.Size; }
+	static void Write(char*& p, const MCommandBlob& Value)
+	{
+		memcpy(p, &Value.Size, sizeof(Value.Size));
+		memcpy(p + sizeof(Value.Size), Value.Data, Value.Size);
+		p += sizeof(Value.Size) + Value.Size;
+	}
+};
+
+template <typename...>
+struct MVoid { using Type = void; };
+
+template <typename To, typename From, typename = void>
+struct MIsConvertibleWithoutNarrowing : std::false_type {};
+template <typename To, typename From>
+struct MIsConvertibleWithoutNarrowing<To, From,
+	typename MVoid<decltype(To{ std::declval<From>() })>::Type> : std::true_type {};
+
+constexpr bool MAllOf(std::initializer_list<bool> Values)
+{
+	for (bool Value : Values)
+		if (!Value)
+			return false;
+	return true;
+}
+
+constexpr int MCommandHeaderSize = sizeof(u16) + sizeof(u16) + sizeof(u8);
+
+template <MCommandParameterType... Types, typename... ArgTypes>
+int MGetCommandSize(MCommandParameterTypes<Types...>, const ArgTypes&... Args)
+{
+	static_assert(sizeof...(Types) == sizeof...(ArgTypes),
+		"Wrong number of parameters for this command");
+	static_assert(MAllOf({ MIsConvertibleWithoutNarrowing<
+		typename MCommandParameterTraits<Types>::Type, const ArgTypes&>::value... }),
+		"Parameter type doesn't match the command signature");
+
+	int Size = MCommandHeaderSize;
+	int Sizes[] = { 0, MCommandParameterTraits<Types>::GetSize(Args)... };
+	for (auto ParamSize : Sizes)
+		Size += ParamSize;
+	return Size;
+}
+
+// Size has to fit in the u16 of the header; the callers check it.
+template <MCommandParameterType... Types, typename... ArgTypes>
+void MWriteCommand(MCommandParameterTypes<Types...>, char* pData, int ID, int Size,
+	const ArgTypes&... Args)
+{
+	_ASSERT(Size <= USHRT_MAX);
+	const u16 TotalSize = u16(Size);
+	const u16 CommandID = u16(ID);
+	const u8 SerialNumber = 0;
+	memcpy(pData, &TotalSize, sizeof(TotalSize));
+	memcpy(pData + sizeof(TotalSize), &CommandID, sizeof(CommandID));
+	memcpy(pData + sizeof(TotalSize) + sizeof(CommandID), &SerialNumber, sizeof(SerialNumber));
+
+	char* p = pData + MCommandHeaderSize;
+	int Unused[] = { 0, (MCommandParameterTraits<Types>::Write(p, Args), 0)... };
+	(void)Unused;
+}
+}
+
+// Returns the serialized size of the command with these arguments.
+template <int ID, typename... ArgTypes>
+int MGetCommandSize(const ArgTypes&... Args)
+{
+	return detail::MGetCommandSize(typename MCommandSignature<ID>::Types{}, Args...);
+}
+
+// Serializes the command into pData, in the same format as MCommand::GetData.
+// Returns the size written, or 0 if it doesn't fit in nDataSize.
+template <int ID, typename... ArgTypes>
+int MWriteCommand(char* pData, int nDataSize, const ArgTypes&... Args)
+{
+	int Size = MGetCommandSize<ID>(Args...);
+	if (Size > nDataSize || Size > USHRT_MAX)
+		return 0;
+
+	detail::MWriteCommand(typename MCommandSignature<ID>::Types{}, pData, ID, Size, Args...);
+	return Size;
+}
+
+// Creates a command whose parameters live only in its serialized data. See
+// MCommand::SetRawData.
+//
+// Returns null if the command is bigger than the 64KB its header can describe,
+// which can only happen with blob and string parameters, so callers that pass
+// those have to check.
+template <int ID, typename... ArgTypes>
+MCommand* MCreateCommand(const MCommandDesc* pDesc, const MUID& Sender, const MUID& Receiver,
+	const ArgTypes&... Args)
+{
+	_ASSERT(pDesc && pDesc->GetID() == ID);
+
+	int Size = MGetCommandSize<ID>(Args...);
+	if (Size > USHRT_MAX)
+		return nullptr;
+
+	auto* pCmd = new MCommand;
+	pCmd->m_Sender = Sender;
+	pCmd->m_Receiver = Receiver;
+
+	char* pData = pCmd->BeginRawData(pDesc, Size);
+	detail::MWriteCommand(typename MCommandSignature<ID>::Types{}, pData, ID, Size, Args...);
+	if (!pCmd->EndRawData())
+	{
+		delete pCmd;
+		return nullptr;
+	}
+
+	return pCmd;
+}
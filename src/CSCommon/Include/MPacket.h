@@ -2,6 +2,7 @@
 
 #include "MCommand.h"
 #include "MCommandManager.h"
+#include "MPacketCrypter.h"
 #include <algorithm>
 
 #define MAX_PACKET_SIZE			16384
@@ -11,8 +12,13 @@
 #define MSGID_REPLYCONNECT	10
 #define MSGID_RAWCOMMAND	100
 #define MSGID_COMMAND		101
+// Same as MSGID_COMMAND, but the body is a u16 with the size of the command
+// followed by the command compressed with zlib. Only sent to connections that
+// asked for it at login.
+#define MSGID_COMPRESSEDCOMMAND	102
 
-class MPacketCrypter;
+// Commands smaller than this are never compressed.
+#define MPACKET_COMPRESS_THRESHOLD	1024
 
 #pragma pack(push)
 #pragma pack(1)
@@ -25,6 +31,7 @@ struct MPacketHeader
 
 	MPacketHeader() { nMsg=MSG_COMMAND; nSize=0; nCheckSum=0; }
 	int CalcPacketSize(MPacketCrypter* pCrypter);
+	bool IsEncrypted() const { return nMsg == MSGID_COMMAND || nMsg == MSGID_COMPRESSEDCOMMAND; }
 };
 
 
@@ -44,6 +51,24 @@ struct MCommandMsg : public MPacketHeader
 
 #pragma pack(pop)
 
+// Writes the body of a MSGID_COMPRESSEDCOMMAND packet for the command data in pSrc.
+// Returns the size of the body, or 0 if it doesn't fit in nDstLen or wouldn't be
+// smaller than the command.
+int MCompressCommand(const char* pSrc, int nSrcLen, char* pDst, int nDstLen);
+// Reverse of MCompressCommand. Returns the size of the command, or 0 on failure.
+int MDecompressCommand(const char* pSrc, int nSrcLen, char* pDst, int nDstLen);
+
+// Finishes the checksum given the sum of the bytes after the header.
+inline unsigned short MFinishCheckSum(MPacketHeader* pPacket, u32 nBodySum)
+{
+	u8* pBulk = reinterpret_cast<u8*>(pPacket);
+
+	u32 nCheckSum = nBodySum;
+	nCheckSum -= (pBulk[0]+pBulk[1]+pBulk[2]+pBulk[3]);
+	unsigned short nShortCheckSum = (nCheckSum & 0xFFFF) + (nCheckSum >> 16);
+	return nShortCheckSum;
+}
+
 // Tiny CheckSum for MCommandMsg
 inline unsigned short MBuildCheckSum(MPacketHeader* pPacket, int nPacketSize)
 {
@@ -51,11 +76,5 @@ inline unsigned short MBuildCheckSum(MPacketHeader* pPacket, int nPacketSize)
 	u8* pBulk = reinterpret_cast<u8*>(pPacket);
 	nPacketSize = (std::min)(65535, nPacketSize);
 
-	u32 nCheckSum = 0;
-	for (int i=nStartOffset; i<nPacketSize; i++) {
-		nCheckSum += pBulk[i];
-	}
-	nCheckSum -= (pBulk[0]+pBulk[1]+pBulk[2]+pBulk[3]);
-	unsigned short nShortCheckSum = (nCheckSum & 0xFFFF) + (nCheckSum >> 16);
-	return nShortCheckSum;
+	return MFinishCheckSum(pPacket, MPacketCrypter::SumBytes(pBulk + nStartOffset, nPacketSize - nStartOffset));
 }
\ No newline at end of file
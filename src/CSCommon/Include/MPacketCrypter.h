@@ -1,5 +1,7 @@
 #pragma once
 
+#include "GlobalTypes.h"
+
 #define PACKET_CRYPTER_KEY_LEN		32
 
 struct MPacketCrypterKey
@@ -12,10 +14,6 @@ class MPacketCrypter
 private:
 	MPacketCrypterKey	m_Key;
 	static int				m_nSHL;
-	static unsigned char	m_ShlMask;
-
-	static char _Enc(char s, char key);
-	static char _Dec(char s, char key);
 public:
 	MPacketCrypter();
 	virtual ~MPacketCrypter() {}
@@ -35,4 +33,16 @@ public:
 		MPacketCrypterKey* pKey);
 	static bool Encrypt(char* pSource, int nSrcLen, MPacketCrypterKey* pKey);
 	static bool Decrypt(char* pSource, int nSrcLen, MPacketCrypterKey* pKey);
+
+	// Encrypts nSrcLen bytes into pTarget (which may be pSource) and returns the
+	// sum of the encrypted bytes, so the checksum doesn't need another pass.
+	static u32 EncryptAndSum(const char* pSource, int nSrcLen, char* pTarget,
+		const MPacketCrypterKey* pKey);
+	static u32 SumBytes(const void* pData, int nLen);
+
+	// Name of the kernel picked for this CPU (scalar, SSE2 or AVX2).
+	static const char* GetKernelName();
+	// Switches to the named kernel, for tests and benchmarks. Returns false if this
+	// CPU doesn't support it.
+	static bool SetKernel(const char* Name);
 };
\ No newline at end of file
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "GlobalTypes.h"
+#include <atomic>
+
+// Classes of received packets that are rate limited separately.
+enum class MPacketClass
+{
+	Raw,		// Unencrypted packets.
+	Chat,		// Channel, stage, game, chatroom and clan chat, and whispers.
+	Voice,		// MC_MATCH_SEND_VOICE_CHAT.
+	PeerRelay,	// MC_MATCH_P2P_COMMAND, which carries the peer commands in server-based netcode.
+	Other,
+	Count,
+};
+
+enum class MPacketLimitAction
+{
+	Drop,		// Skip the packet.
+	Kick,		// Disconnect the client.
+};
+
+struct MPacketRateLimits
+{
+	struct Bucket
+	{
+		// Packets per second, and how many can arrive at once. A rate of 0 disables
+		// the bucket.
+		float Rate;
+		float Burst;
+		MPacketLimitAction Action;
+	};
+
+	Bucket Buckets[size_t(MPacketClass::Count)] = {
+		{ 20, 60, MPacketLimitAction::Drop },		// Raw
+		{ 5, 20, MPacketLimitAction::Drop },		// Chat
+		{ 60, 120, MPacketLimitAction::Drop },		// Voice
+		{ 250, 500, MPacketLimitAction::Drop },		// PeerRelay
+		{ 200, 1000, MPacketLimitAction::Kick },	// Other
+	};
+
+	static const char* GetClassName(MPacketClass Class);
+};
+
+struct MPacketRateLimitStats
+{
+	std::atomic<u64> Dropped[size_t(MPacketClass::Count)]{};
+	std::atomic<u64> Kicked[size_t(MPacketClass::Count)]{};
+};
+
+// Per-connection token buckets for received packets. MCommandBuilder checks each
+// packet against them after framing it, but before verifying the checksum,
+// decrypting it past the command ID or creating the command.
+class MPacketRateLimiter
+{
+public:
+	MPacketRateLimiter(const MPacketRateLimits& Limits, MPacketRateLimitStats& Stats)
+		: Limits(Limits), Stats(Stats) {}
+
+	// nCommandID is -1 if it's not known.
+	static MPacketClass Classify(u16 nMsg, int nCommandID);
+
+	// Returns true if the packet should be processed. If it returns false, the packet
+	// should be skipped, or the client disconnected if IsKicked() is true.
+	bool Check(MPacketClass Class);
+
+	bool IsKicked() const { return KickedClass != MPacketClass::Count; }
+	MPacketClass GetKickedClass() const { return KickedClass; }
+
+private:
+	struct BucketState
+	{
+		float Tokens;
+		u64 LastTime;
+		bool Initialized;
+	};
+
+	const MPacketRateLimits& Limits;
+	MPacketRateLimitStats& Stats;
+	BucketState Buckets[size_t(MPacketClass::Count)]{};
+	MPacketClass KickedClass = MPacketClass::Count;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include "GlobalTypes.h"
+#include "MUID.h"
+#include "BasicInfo.h"
+#include "function_view.h"
+#include "MBitStream.h"
+
+// MC_MATCH_PEER_DELTA_SNAPSHOT carries MC_PEER_BASICINFO_RG updates that the server
+// has quantized and bit-packed as deltas against a state the receiver has already
+// acknowledged with MC_MATCH_PEER_SNAPSHOT_ACK. The receiver turns each entry back
+// into a MC_PEER_BASICINFO_RG command.
+//
+// Layout: u8 format, u32 epoch, u32 sequence number, u16 position step and u16
+// velocity step in 1/16 units, u8 entry count, then the entries as a bit stream.
+// The epoch increases whenever the server starts a new stream, e.g. when a game
+// starts, and baselines from an older epoch can't be used.
+
+// How finely the server quantizes positions and velocities, in world units. Clients
+// send both rounded to whole units, so coarser steps trade precision for size.
+struct MPeerDeltaPrecision
+{
+	float PosStep = 1.f;
+	float VelStep = 1.f;
+};
+
+// The header carries the steps in 1/16 units, so the server quantizes with steps
+// rounded by this, which is what the receiver dequantizes with.
+float MRoundPeerDeltaStep(float Step);
+
+struct MPeerQuantizedState
+{
+	i32 TimeMS;
+	i32 Pos[3];
+	i32 Vel[3];
+	// Yaw and pitch, as in PackedDirection.
+	i8 Dir[2];
+	i8 CamDir[2];
+	bool HasCamDir;
+	u8 LowerAni;
+	u8 UpperAni;
+	u8 Slot;
+};
+
+struct MPeerDeltaSnapshotHeader
+{
+	u32 Epoch;
+	u32 Seq;
+	MPeerDeltaPrecision Precision;
+	u8 Count;
+};
+
+// Entries can only be deltas against snapshots at most this many sequence numbers
+// older than the one they're in.
+constexpr u32 MPeerDeltaMaxBaselineAge = 31;
+constexpr size_t MPeerDeltaSnapshotHeaderSize = 14;
+constexpr u8 MPeerDeltaSnapshotFormat = 1;
+
+// The animations and slot aren't in every MC_PEER_BASICINFO_RG, so the caller
+// passes the last ones it saw.
+MPeerQuantizedState MQuantizePeerState(const NewBasicInfo& nbi,
+	ZC_STATE_LOWER LowerAni, ZC_STATE_UPPER UpperAni, MMatchCharItemParts Slot,
+	const MPeerDeltaPrecision& Precision);
+void MDequantizePeerState(const MPeerQuantizedState& State, const MPeerDeltaPrecision& Precision,
+	CharacterInfo& Out, float& OutTime);
+
+class MPeerDeltaSnapshotWriter
+{
+public:
+	// Appends the header to Out. Entries are appended by Add.
+	MPeerDeltaSnapshotWriter(std::vector<u8>& Out, u32 Epoch, u32 Seq,
+		const MPeerDeltaPrecision& Precision);
+
+	// Baseline is the state the receiver got for Sender in snapshot Seq - BaselineAge,
+	// or null to send the whole state.
+	void Add(const MUID& Sender, const MPeerQuantizedState& State,
+		const MPeerQuantizedState* Baseline, u32 BaselineAge);
+
+	u32 GetCount() const { return Count; }
+	size_t GetSize() const { return Out.size() - Start; }
+
+private:
+	std::vector<u8>& Out;
+	size_t Start;
+	u32 Count = 0;
+	MBitWriter Bits{ Out };
+};
+
+bool MReadPeerDeltaSnapshotHeader(const u8* Data, size_t Size, MPeerDeltaSnapshotHeader& Out);
+
+// Whether epoch A is newer than epoch B, allowing for wraparound.
+inline bool MIsNewerPeerDeltaEpoch(u32 A, u32 B) { return i32(A - B) > 0; }
+
+enum class MPeerDeltaReadResult
+{
+	Complete,
+	// Some entries were skipped for lack of their baseline. The snapshot must not be
+	// acknowledged, since the server would use those entries as baselines.
+	MissingBaselines,
+	Malformed,
+};
+
+// Calls OnEntry(Sender, State) for each entry. GetBaseline(Sender, Seq) returns the
+// state the reader got for Sender in snapshot Seq, or null if it doesn't have it, in
+// which case that entry is skipped.
+MPeerDeltaReadResult MReadPeerDeltaSnapshot(const u8* Data, size_t Size,
+	function_view<const MPeerQuantizedState*(const MUID&, u32)> GetBaseline,
+	function_view<void(const MUID&, const MPeerQuantizedState&)> OnEntry);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+#include "GlobalTypes.h"
+#include "MUID.h"
+
+// The data of MC_MATCH_PEER_SNAPSHOT, which carries several tunnelled peer commands
+// in one command. It's a list of entries, each made of the sender's UID, the size
+// of the blob as a u16, and the blob, which is what MC_MATCH_P2P_COMMAND would have
+// carried.
+struct MPeerSnapshotEntryHeader
+{
+	MUID Sender;
+	u16 Size;
+};
+
+constexpr size_t MPeerSnapshotEntryHeaderSize = sizeof(MUID) + sizeof(u16);
+
+inline size_t MPeerSnapshotEntrySize(size_t BlobSize)
+{
+	return MPeerSnapshotEntryHeaderSize + BlobSize;
+}
+
+inline void MAppendPeerSnapshotEntry(std::vector<char>& Out, const MUID& Sender,
+	const void* Blob, u16 Size)
+{
+	const auto Offset = Out.size();
+	Out.resize(Offset + MPeerSnapshotEntrySize(Size));
+	auto* p = Out.data() + Offset;
+	memcpy(p, &Sender, sizeof(Sender));
+	memcpy(p + sizeof(Sender), &Size, sizeof(Size));
+	memcpy(p + MPeerSnapshotEntryHeaderSize, Blob, Size);
+}
+
+// Calls Fn(const MUID& Sender, const char* Blob, u16 Size) for each entry. Returns
+// false if the data is malformed, in which case the entries before the bad one
+// have already been passed to Fn.
+template <typename FnType>
+bool MForEachPeerSnapshotEntry(const char* Data, size_t Size, FnType&& Fn)
+{
+	size_t Offset = 0;
+	while (Offset < Size)
+	{
+		if (Size - Offset < MPeerSnapshotEntryHeaderSize)
+			return false;
+
+		MPeerSnapshotEntryHeader Header;
+		memcpy(&Header.Sender, Data + Offset, sizeof(Header.Sender));
+		memcpy(&Header.Size, Data + Offset + sizeof(Header.Sender), sizeof(Header.Size));
+		Offset += MPeerSnapshotEntryHeaderSize;
+
+		if (Header.Size == 0 || Size - Offset < Header.Size)
+			return false;
+
+		Fn(Header.Sender, Data + Offset, Header.Size);
+		Offset += Header.Size;
+	}
+	return true;
+}
@@ -4,7 +4,10 @@
 #include "RealCPNet.h"
 #include "MDebug.h"
 #include <list>
+#include <unordered_map>
 #include "NetIO.h"
+#include "MPacketRateLimiter.h"
+#include "MShardedUIDRefCache.h"
 
 class MCommand;
 
@@ -12,22 +15,19 @@ class MServer : public MCommandCommunicator {
 protected:
 	NetIO Net;
 
-	std::list<MCommObject*>			m_AcceptWaitQueue;
-	MCriticalSection				m_csAcceptWaitQueue;
+	// Accepted connections waiting for MC_LOCAL_LOGIN, by their allocated UID.
+	std::unordered_map<MUID, MCommObject*>	m_AcceptWaitMap;
+	MCriticalSection				m_csAcceptWaitMap;
 
-	void LockAcceptWaitQueue() { m_csAcceptWaitQueue.lock(); }
-	void UnlockAcceptWaitQueue() { m_csAcceptWaitQueue.unlock(); }
+	void LockAcceptWaitMap() { m_csAcceptWaitMap.lock(); }
+	void UnlockAcceptWaitMap() { m_csAcceptWaitMap.unlock(); }
 
-	MUIDRefCache<MCommObject>	m_CommRefCache;
-	MCriticalSection			m_csCommList;
+	// Objects are added and removed (and deleted) only on the main thread.
+	MShardedUIDRefCache<MCommObject>	m_CommRefCache;
 
-	void LockCommList() { m_csCommList.lock(); }
-	void UnlockCommList() { m_csCommList.unlock(); }
-
-	MCommandList				m_SafeCmdQueue;
-	MCriticalSection			m_csSafeCmdQueue;
-	void LockSafeCmdQueue() { m_csSafeCmdQueue.lock(); }
-	void UnlockSafeCmdQueue() { m_csSafeCmdQueue.unlock(); }
+	// Commands posted from other threads (I/O, DB) for the main thread. Moved into
+	// the command manager in OnPrepareRun.
+	MPSCQueue<MCommand*, 16384>	m_SafeCmdQueue;
 
 	virtual MUID UseUID() = 0;
 
@@ -36,12 +36,39 @@ protected:
 	void InitCryptCommObject(MCommObject* pCommObj, unsigned int nTimeStamp);
 
 	void PostSafeQueue(MCommand* pNew);
+	void SetCompressionAllowed(const MUID& CommUID, bool bAllow);
+	void SetUDPRelayAllowed(const MUID& CommUID, bool bAllow);
+	void SetPeerSnapshotAllowed(const MUID& CommUID, bool bAllow);
+	void SetPeerDeltaSnapshotAllowed(const MUID& CommUID, bool bAllow);
+
+	struct SendTarget
+	{
+		uintptr_t nClientKey;
+		MPacketCrypterKey CrypterKey;
+		bool bCompression;
+	};
+
+	struct CompressionStats
+	{
+		u64 Commands;
+		u64 RawBytes;
+		u64 CompressedBytes;
+	};
+	CompressionStats m_CompressionStats{};
+
+	MPacketRateLimits			m_PacketRateLimits;
+	MPacketRateLimitStats		m_PacketRateLimitStats;
 
 	void SendCommand(MCommand* pCommand);
+	void SendCommandToReceivers(MCommand* pCommand);
+	// Sends the serialized command to each target, compressed if the target allows it.
+	void SendCommandData(const MCommand* pCommand, char* pData, int nSize,
+		SendTarget* pTargets, int nTargets);
 	void ParsePacket(MCommObject* pCommObj, MPacketHeader* pPacket);
 
 	virtual void OnPrepareRun();
 	virtual void OnRun();
+	virtual void OnRunFinished();
 	virtual bool OnCommand(MCommand* pCommand);
 
 	virtual void OnNetClear(const MUID& CommUID);
@@ -50,10 +77,16 @@ protected:
 	bool SendMsgReplyConnect(MUID* pHostUID, MUID* pAllocUID, unsigned int nTimeStamp,
 		MCommObject* pCommObj);
 	bool SendMsgCommand(uintptr_t nClientKey, char* pBuf, int nSize,
-		unsigned short nMsgHeaderID, MPacketCrypterKey* pCrypterKey);
-
+		unsigned short nMsgHeaderID, MPacketCrypterKey* pCrypterKey, bool bDroppable = false,
+		NetIO::SendPriority Priority = NetIO::SendPriority::Interactive);
+
+	// Called by NetIO on every I/O thread. Reads and disconnects for different
+	// connections run in parallel, but each connection's are serialized by its strand.
+	// Accepts, and with them OnAccept's UID allocation, only come from the acceptor on
+	// I/O thread 0. Commands are handed to OnRun through m_SafeCmdQueue, whose Push is
+	// safe from any number of threads, and anything else touched here has to be too.
 	static void RCPCallback(void* pCallbackContext, NetIO::IOOperation Op,
-		NetIO::ConnectionHandle Handle, const void* Data);	// Thread not safe
+		NetIO::ConnectionHandle Handle, const void* Data);
 
 public:	// For Debugging
 	char m_szName[128];
@@ -71,6 +104,15 @@ public:
 	bool Create(int nPort, const bool bReuse = false );
 	void Destroy();
 	int GetCommObjCount();
+	auto GetNetIOThreadStats() const { return Net.GetIOThreadStats(); }
+	auto GetCommRefCacheStats() const { return m_CommRefCache.GetStats(); }
+	auto GetNetSendQueueStats() const { return Net.GetSendQueueStats(); }
+	auto& GetCompressionStats() const { return m_CompressionStats; }
+	// Must be called before Create.
+	void SetPacketRateLimits(const MPacketRateLimits& Limits) { m_PacketRateLimits = Limits; }
+	auto& GetPacketRateLimitStats() const { return m_PacketRateLimitStats; }
+	int GetSafeCmdQueueHighWaterMark() const { return (int)m_SafeCmdQueue.GetHighWaterMark(); }
+	void ResetSafeCmdQueueHighWaterMark() { m_SafeCmdQueue.ResetHighWaterMark(); }
 
 	virtual int Connect(MCommObject* pCommObj);
 	int ReplyConnect(MUID* pTargetUID, MUID* pAllocUID, unsigned int nTimeStamp, MCommObject* pCommObj);
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "MUID.h"
+
+// MUID -> T* table that's split into shards by hash, each with its own lock, so
+// lookups of different UIDs from different threads don't serialize on one lock.
+//
+// Objects are only deleted by the thread that removes them, so Read can safely
+// access an object from any thread, since it holds the shard lock while Fn runs.
+// GetRef returns the pointer after unlocking, which is only safe on that thread.
+template <typename T, size_t NumShards = 16>
+class MShardedUIDRefCache
+{
+	static_assert(NumShards > 0 && (NumShards & (NumShards - 1)) == 0,
+		"NumShards must be a power of two");
+
+public:
+	struct Stats
+	{
+		u64 Locks;
+		// Locks that had to wait for another thread.
+		u64 Contentions;
+	};
+
+	void Insert(const MUID& uid, T* pRef)
+	{
+		auto& Shard = GetShard(uid);
+		std::lock_guard<std::mutex> Lock{ LockShard(Shard), std::adopt_lock };
+		// Like std::map::insert, an existing entry is left as it is.
+		if (Shard.Map.emplace(uid, pRef).second)
+			Size.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	T* Remove(const MUID& uid)
+	{
+		auto& Shard = GetShard(uid);
+		std::lock_guard<std::mutex> Lock{ LockShard(Shard), std::adopt_lock };
+		auto it = Shard.Map.find(uid);
+		if (it == Shard.Map.end())
+			return nullptr;
+		auto pRef = it->second;
+		Shard.Map.erase(it);
+		Size.fetch_sub(1, std::memory_order_relaxed);
+		return pRef;
+	}
+
+	// Calls Fn(T&) if uid is in the table. Returns false if it's not.
+	template <typename FnType>
+	bool Read(const MUID& uid, FnType&& Fn)
+	{
+		auto& Shard = GetShard(uid);
+		std::lock_guard<std::mutex> Lock{ LockShard(Shard), std::adopt_lock };
+		auto it = Shard.Map.find(uid);
+		if (it == Shard.Map.end())
+			return false;
+		Fn(*it->second);
+		return true;
+	}
+
+	T* GetRef(const MUID& uid)
+	{
+		T* pRef = nullptr;
+		Read(uid, [&](T& Ref) { pRef = &Ref; });
+		return pRef;
+	}
+
+	// Calls Fn(T&) on every object, locking one shard at a time.
+	template <typename FnType>
+	void ForEach(FnType&& Fn)
+	{
+		for (auto& Shard : Shards)
+		{
+			std::lock_guard<std::mutex> Lock{ LockShard(Shard), std::adopt_lock };
+			for (auto& Pair : Shard.Map)
+				Fn(*Pair.second);
+		}
+	}
+
+	// Removes everything and returns the objects that were in the table.
+	std::vector<T*> RemoveAll()
+	{
+		std::vector<T*> Refs;
+		for (auto& Shard : Shards)
+		{
+			std::lock_guard<std::mutex> Lock{ LockShard(Shard), std::adopt_lock };
+			for (auto& Pair : Shard.Map)
+				Refs.push_back(Pair.second);
+			Size.fetch_sub(Shard.Map.size(), std::memory_order_relaxed);
+			Shard.Map.clear();
+		}
+		return Refs;
+	}
+
+	size_t size() const { return Size.load(std::memory_order_relaxed); }
+
+	Stats GetStats() const
+	{
+		Stats Ret{};
+		for (auto& Shard : Shards)
+		{
+			Ret.Locks += Shard.Locks.load(std::memory_order_relaxed);
+			Ret.Contentions += Shard.Contentions.load(std::memory_order_relaxed);
+		}
+		return Ret;
+	}
+
+private:
+	struct Shard
+	{
+		std::mutex Mutex;
+		std::unordered_map<MUID, T*> Map;
+		std::atomic<u64> Locks{ 0 };
+		std::atomic<u64> Contentions{ 0 };
+		// Keeps neighbouring shards' locks off the same cache line.
+		char Pad[64];
+	};
+
+	Shard& GetShard(const MUID& uid)
+	{
+		// std::hash<u64> can be the identity, which would pick the shard by the
+		// bottom bits of MUID::High, and those are the same for all clients.
+		u64 Hash = std::hash<MUID>{}(uid);
+		Hash ^= Hash >> 32;
+		Hash *= 0x9E3779B97F4A7C15ull;
+		return Shards[(Hash >> 32) & (NumShards - 1)];
+	}
+
+	static std::mutex& LockShard(Shard& Shard)
+	{
+		Shard.Locks.fetch_add(1, std::memory_order_relaxed);
+		if (!Shard.Mutex.try_lock())
+		{
+			Shard.Contentions.fetch_add(1, std::memory_order_relaxed);
+			Shard.Mutex.lock();
+		}
+		return Shard.Mutex;
+	}
+
+	Shard Shards[NumShards];
+	std::atomic<size_t> Size{ 0 };
+};
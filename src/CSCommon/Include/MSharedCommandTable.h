@@ -2,7 +2,13 @@
 
 #include <cstdint>
 
-#define MCOMMAND_VERSION 55
+#define MCOMMAND_VERSION 56
+
+// Flags for the Capabilities parameter of MC_MATCH_LOGIN.
+#define MLOGIN_CAPABILITY_COMPRESSION	0x1	// Can decode MSGID_COMPRESSEDCOMMAND.
+#define MLOGIN_CAPABILITY_UDP_RELAY		0x2	// Can take relayed peer commands from the server over UDP.
+#define MLOGIN_CAPABILITY_PEER_SNAPSHOT	0x4	// Understands MC_MATCH_PEER_SNAPSHOT.
+#define MLOGIN_CAPABILITY_PEER_DELTA_SNAPSHOT	0x8	// Understands MC_MATCH_PEER_DELTA_SNAPSHOT.
 
 namespace MSharedCommandType
 {
@@ -503,6 +509,9 @@ enum Type : uint32_t
 #define MC_PEER_TUNNEL_BOT_COMMAND 8019
 #define MC_MATCH_REQUEST_SPEC 8020
 #define MC_MATCH_RESPONSE_SPEC 8021
+#define MC_MATCH_PEER_SNAPSHOT 8022
+#define MC_MATCH_PEER_DELTA_SNAPSHOT 8023
+#define MC_MATCH_PEER_SNAPSHOT_ACK 8024
 
 //
 // 10000-19999: Ingame peer-to-peer commands
@@ -644,3 +653,20 @@ enum Type : uint32_t
 #define MC_LOCAL_UPDATE_ACCEPT_INVALID_IP		50009
 
 void MAddSharedCommandTable(class MCommandManager*, MSharedCommandType::Type);
+
+// Peer commands whose state is superseded by the next one of the same kind, so losing
+// one is harmless. When they're tunnelled through the server, they go over UDP if
+// both ends can.
+inline bool MIsLossTolerantPeerCommand(int nCommandID)
+{
+	switch (nCommandID)
+	{
+	case MC_PEER_BASICINFO:
+	case MC_PEER_BASICINFO_RG:
+	case MC_PEER_HPINFO:
+	case MC_PEER_HPAPINFO:
+		return true;
+	default:
+		return false;
+	}
+}
@@ -2,14 +2,17 @@
 #include "GlobalTypes.h"
 #include "optional.h"
 #include "function_view.h"
+#include <vector>
 #ifndef _WIN32
 #define USE_ASIO 1
 #endif
 #ifndef USE_ASIO
 #include "RealCPNet.h"
 #else
-#include <vector>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <array>
 #define ASIO_STANDALONE
 #include "asio.hpp"
@@ -23,6 +26,27 @@ using io_context = io_service;
 
 struct NetIO
 {
+	// Each write to a connection takes all queued Realtime and Interactive packets,
+	// in that order, but only MaxBulkBytesPerWrite of Bulk packets (at least one), so
+	// large lobby transfers can't hold up game traffic for more than one write.
+	// Packets of one priority are always written in the order they were sent.
+	enum class SendPriority
+	{
+		Realtime,
+		Interactive,
+		Bulk,
+		Count,
+	};
+	static constexpr int MaxBulkBytesPerWrite = 16 * 1024;
+
+#ifndef USE_ASIO
+	using ConnectionHandle = SOCKET;
+#else
+	// Slot index in the low 32 bits, slot generation in the high 32 bits.
+	// Generations start at 1, so 0 is never a valid handle.
+	using ConnectionHandle = uintptr_t;
+#endif
+
 	struct Connection
 #ifdef USE_ASIO
 		: std::enable_shared_from_this<Connection>
@@ -33,18 +57,37 @@ struct NetIO
 #else	
 		Connection(asio::io_context& IOContext, asio::ip::tcp::socket Socket, void* Context = nullptr)
 			: Socket(std::move(Socket)), Strand(IOContext), Context(Context) {}
+		~Connection();
 		asio::ip::tcp::socket Socket;
 		asio::io_context::strand Strand;
 		void* Context;
+		size_t IOThreadIndex = 0;
+		ConnectionHandle Handle = 0;
+		std::atomic<bool> Disconnecting{false};
 		std::array<u8, 8192> ReadBuffer;
-#endif
-	};
 
-#ifndef USE_ASIO
-	using ConnectionHandle = SOCKET;
-#else
-	using ConnectionHandle = uintptr_t;
+		// Outbound queues, one per SendPriority. Packets sent while a write is in
+		// flight are gathered into one vectored write once it completes. Only touched
+		// from within Strand.
+		struct OutboundPacket
+		{
+			void* Data;
+			int Size;
+		};
+		std::vector<OutboundPacket> SendQueues[size_t(SendPriority::Count)];
+		std::vector<OutboundPacket> WritePackets;
+		std::vector<asio::const_buffer> WriteBuffers;
+		bool Writing = false;
+		std::atomic<bool> QueuedForFlush{false};
+
+		// Bytes and packets handed to Send that haven't been written yet. Given back
+		// to NetIO::QueuedBytes when the connection goes away.
+		std::atomic<u32> QueuedBytes{0};
+		std::atomic<u32> QueuedPackets{0};
+		std::atomic<u64>* TotalQueuedBytes = nullptr;
+		std::atomic<bool> Evicted{false};
 #endif
+	};
 
 	enum class IOOperation
 	{
@@ -54,6 +97,9 @@ struct NetIO
 		Disconnect,
 		Read,
 		Write,
+		// The connection went over its send limits and is about to be disconnected.
+		// Data is SendQueueFullData.
+		SendQueueFull,
 	};
 
 	struct AcceptData
@@ -67,16 +113,96 @@ struct NetIO
 		ArrayView<u8> Data;
 	};
 
+	struct SendQueueFullData
+	{
+		u32 QueuedBytes;
+		u32 QueuedPackets;
+	};
+
+	struct IOThreadStats
+	{
+		u32 Connections;
+		u64 Reads;
+		// Number of write operations, and the number of packets they carried.
+		u64 Writes;
+		u64 PacketsWritten;
+	};
+
+	// Per-connection budgets for data that has been sent but not written to the
+	// socket yet. Past the drop limits, droppable packets are discarded. Past the
+	// max limits, the connection is disconnected. 0 means no limit.
+	struct SendLimits
+	{
+		u32 DropBytes = 256 * 1024;
+		u32 DropPackets = 1024;
+		u32 MaxBytes = 1024 * 1024;
+		u32 MaxPackets = 4096;
+	};
+
+	struct SendQueueStats
+	{
+		// Over all connections.
+		u64 QueuedBytes;
+		u64 PeakQueuedBytes;
+		u64 DroppedPackets;
+		u64 Evictions;
+	};
+
+	// Finishes a packet (e.g. encrypts and checksums it) on the connection's I/O
+	// thread rather than on the thread that sends it. Data is a copy of the encoder's
+	// Data, so it doesn't need to outlive the Send call.
+	struct PacketEncoder
+	{
+		using FunctionType = void(void* Packet, int Size, const void* Data);
+		static constexpr size_t MaxDataSize = 32;
+
+		FunctionType* Function;
+		alignas(8) u8 Data[MaxDataSize];
+	};
+
 	using CallbackType = function_view<void(IOOperation, ConnectionHandle, const void*)>;
 	using LogCallbackType = void(const char*, ...);
 
+#ifdef USE_ASIO
+	~NetIO() { Destroy(); }
+#endif
+
+	// Must be called before Create. 0 means one thread per hardware thread.
+	// Ignored on Windows, where RealCPNet manages its own IOCP workers.
+	void SetNumIOThreads(int Num);
+
+	// Must be called before Create. 0 means the system maximum (SOMAXCONN), which is
+	// also the default. Linux additionally caps it at net.core.somaxconn.
+	void SetListenBacklog(int Backlog);
+
 	bool Create(int Port, CallbackType Callback, bool Reuse = false);
 	void Destroy();
 
+	// Per-thread load counters of the I/O pool. Empty on Windows.
+	std::vector<IOThreadStats> GetIOThreadStats() const;
+
 	ConnectionHandle Connect(u32 Address, int Port, void* Context);
 	void Disconnect(ConnectionHandle Handle);
 
-	bool Send(ConnectionHandle Handle, void* Packet, int Size);
+	// Takes ownership of Packet, which must have been allocated with malloc.
+	// Returns false if the packet was not queued, and true if it was, or if it was
+	// droppable and dropped because the connection is over its drop limits.
+	// If Encoder is given, it's applied to the packet before it's written. On Windows,
+	// that happens right away, on the calling thread, and Priority is ignored.
+	bool Send(ConnectionHandle Handle, void* Packet, int Size, bool Droppable = false,
+		const PacketEncoder* Encoder = nullptr, SendPriority Priority = SendPriority::Interactive);
+
+	// Must be called before Create. Ignored on Windows.
+	void SetSendLimits(const SendLimits& Limits);
+	// Zeroes on Windows.
+	SendQueueStats GetSendQueueStats() const;
+
+	// If enabled, Send only queues packets and nothing is written until Flush is
+	// called, so that everything sent to a connection during a tick goes out in a
+	// single write. Otherwise, packets are only held back while a previous write is
+	// still in flight. No-ops on Windows.
+	void SetDeferSendUntilFlush(bool Value);
+	void Flush();
 
 	void* GetContext(ConnectionHandle Handle);
 	void SetContext(ConnectionHandle Handle, void* Context);
@@ -89,15 +215,55 @@ private:
 #ifndef USE_ASIO
 	MRealCPNet RealCPNet;
 #else
+	// Each I/O thread runs its own io_context. Connections are assigned to the
+	// least loaded thread on accept and stay there, so all completions of one
+	// connection run on one thread, serialized by Connection::Strand.
+	struct IOThread
+	{
+		asio::io_context Context;
+		optional<asio::io_context::work> Work;
+		std::thread Thread;
+		std::atomic<u32> NumConnections{0};
+		std::atomic<u64> NumReads{0};
+		std::atomic<u64> NumWrites{0};
+		std::atomic<u64> NumPacketsWritten{0};
+	};
+
 	void Accept();
 	void Read(std::shared_ptr<Connection> Conn);
-	
-	asio::io_context IOContext;
-	asio::ip::tcp::socket ListenSocket{IOContext};
-	asio::ip::tcp::acceptor Acceptor{IOContext};
-	asio::ip::tcp::socket AcceptSocket{IOContext};
-	std::vector<std::shared_ptr<Connection>> Connections;
+	void WriteQueued(const std::shared_ptr<Connection>& Conn);
+	void OnPacketsWritten(Connection& Conn, const std::vector<Connection::OutboundPacket>& Packets);
+	void Evict(const std::shared_ptr<Connection>& Conn, int Size);
+	size_t PickIOThread() const;
+
+	// Generational slot map of live connections. Lookup and removal are O(1), and a
+	// handle whose slot has been reused fails the generation check instead of
+	// aliasing the new connection.
+	struct ConnectionSlot
+	{
+		std::shared_ptr<Connection> Conn;
+		u32 Generation = 1;
+	};
+
+	ConnectionHandle AddConnection(std::shared_ptr<Connection> Conn);
+	std::shared_ptr<Connection> GetConnection(ConnectionHandle Handle);
+	void RemoveConnection(ConnectionHandle Handle);
+
+	int NumIOThreads = 0;
+	int ListenBacklog = 0;
+	std::vector<std::unique_ptr<IOThread>> IOThreads;
+	optional<asio::ip::tcp::acceptor> Acceptor;
+	std::vector<ConnectionSlot> ConnectionSlots;
+	std::vector<u32> FreeConnectionSlots;
 	std::mutex ConnectionsMutex;
+	bool DeferSendUntilFlush = false;
+	SendLimits Limits;
+	std::atomic<u64> QueuedBytes{0};
+	std::atomic<u64> PeakQueuedBytes{0};
+	std::atomic<u64> NumDroppedPackets{0};
+	std::atomic<u64> NumEvictions{0};
+	std::vector<std::shared_ptr<Connection>> FlushList;
+	std::mutex FlushMutex;
 	std::atomic<bool> Stopped{false};
 
 	template <typename... Args>
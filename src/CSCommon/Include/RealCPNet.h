@@ -159,6 +159,7 @@ private:
 	bool				m_bVerbose{};
 	HANDLE				m_hIOCP{};
 	SOCKET				m_sdListen = MSocket::InvalidSocket;
+	int					m_nListenBacklog{};
 	u32					m_dwThreadCount{};
 	MSignalEvent		m_hCleanupEvent{};
 
@@ -197,6 +198,9 @@ public:
 	bool Create(int nPort, const bool bReuse = false );
 	void Destroy();
 
+	// Must be called before Create. 0 means SOMAXCONN.
+	void SetListenBacklog(int nBacklog) { m_nListenBacklog = nBacklog; }
+
 	void SetLogLevel(int nLevel) { m_bVerbose = nLevel > 0; }
 	void SetCallback(RCPCALLBACK* pCallback, void* pCallbackContext) {
 		m_fnCallback = pCallback; m_pCallbackContext = pCallbackContext; }
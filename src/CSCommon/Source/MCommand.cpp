@@ -48,12 +48,19 @@ void MCommand::Reset(void)
 	m_nSerialNumber = 0;
 	m_Sender.SetZero();
 	m_Receiver.SetZero();
+	m_Receivers.clear();
+	m_bDroppable = false;
 	ClearParam();
+	m_RawHeap.clear();
+	m_Reader = MCommandReader{};
+	m_nRawSize = 0;
+	m_bRawData = false;
+	m_bParamsRead = true;
 }
 
 void MCommand::ClearParam(void)
 {
-	const int nParamCount = GetParameterCount();
+	const int nParamCount = (int)m_Params.size();
 	for(int i=0; i<nParamCount; ++i){
 		delete m_Params[i];
 	}
@@ -62,7 +69,11 @@ void MCommand::ClearParam(void)
 
 void MCommand::ClearParam(int i)
 {
-	_ASSERT(GetParameterCount() >= i);
+	ReadRawParameters();
+	m_bRawData = false;
+	_ASSERT(GetParameterCount() > i);
+	if (i < 0 || i >= (int)m_Params.size())
+		return;
 	delete m_Params[i];
 	m_Params.erase(m_Params.begin() + i);
 }
@@ -112,6 +123,10 @@ void MCommand::SetID(int nID, MCommandManager* pCommandManager)
 
 bool MCommand::AddParameter(MCommandParameter* pParam)
 {
+	if (!ReadRawParameters())
+		return false;
+	m_bRawData = false;
+
 	_ASSERT(m_Params.capacity()==m_pCommandDesc->GetParameterDescCount());	// ̸  ȮǾ ־ Ѵ.
 
 	int nCount = (int)m_Params.size();
@@ -131,11 +146,13 @@ bool MCommand::AddParameter(MCommandParameter* pParam)
 
 int MCommand::GetParameterCount(void) const
 {
+	ReadRawParameters();
 	return (int)m_Params.size();
 }
 
 MCommandParameter* MCommand::GetParameter(int i) const
 {
+	ReadRawParameters();
 	if(i<0 || i>=(int)m_Params.size()) return NULL;
 
 	return m_Params[i];
@@ -185,8 +202,25 @@ bool MCommand::GetParameter(void* pValue, int i, MCommandParameterType t, int nB
 MCommand* MCommand::Clone(void) const
 {
 	if(m_pCommandDesc==NULL) return NULL;
+
+	if (!m_bParamsRead)
+	{
+		MCommand* pClone = new MCommand;
+		char* pRawData = pClone->BeginRawData(m_pCommandDesc, m_Reader.GetSize());
+		memcpy(pRawData, m_Reader.GetData(), m_Reader.GetSize());
+		pClone->EndRawData(m_Reader.HasSerialNumber());
+		pClone->m_Sender = m_Sender;
+		pClone->m_Receiver = m_Receiver;
+		pClone->m_Receivers = m_Receivers;
+		pClone->m_bDroppable = m_bDroppable;
+		pClone->m_nSerialNumber = m_nSerialNumber;
+		return pClone;
+	}
+
 	MCommand* pClone = new MCommand(m_pCommandDesc, m_Receiver, m_Sender);
 	if( 0 == pClone ) return NULL;
+	pClone->m_Receivers = m_Receivers;
+	pClone->m_bDroppable = m_bDroppable;
 	const int nParamCount = GetParameterCount();
 	for(int i=0; i<nParamCount; ++i){
 		MCommandParameter* pParameter = GetParameter(i);
@@ -204,6 +238,17 @@ bool MCommand::CheckRule(void)
 	_ASSERT(m_pCommandDesc!=NULL);
 	if(m_pCommandDesc==NULL) return false;
 
+	// The reader has already checked the parameter types, so the parameters only
+	// need to be created if there are conditions to check.
+	if (!m_bParamsRead)
+	{
+		bool bHasConditions = false;
+		for (int i = 0; i < m_pCommandDesc->GetParameterDescCount(); i++)
+			bHasConditions |= m_pCommandDesc->GetParameterDesc(i)->HasConditions();
+		if (!bHasConditions)
+			return true;
+	}
+
 	int nCount = GetParameterCount();
 	if(nCount!=m_pCommandDesc->GetParameterDescCount()) return false;
 
@@ -234,6 +279,14 @@ int MCommand::GetData(char* pData, int nSize) const
 {
 	if(m_pCommandDesc==NULL) return 0;
 
+	if (m_bRawData && m_Reader.HasSerialNumber())
+	{
+		if (m_Reader.GetSize() > nSize) return 0;
+		memcpy(pData, m_Reader.GetData(), m_Reader.GetSize());
+		memcpy(pData + sizeof(unsigned short) * 2, &m_nSerialNumber, sizeof(m_nSerialNumber));
+		return m_Reader.GetSize();
+	}
+
 	int nParamCount = GetParameterCount();
 
 	unsigned short int nDataCount = sizeof(nDataCount);
@@ -269,12 +322,15 @@ int MCommand::GetSize() const
 {
 	if(m_pCommandDesc==NULL) return 0;
 
+	if (m_bRawData)
+		return m_Reader.GetSize() + (m_Reader.HasSerialNumber() ? 0 : sizeof(m_nSerialNumber));
+
 	int nSize = 0;
 
 	// size + command id + serial number
 	nSize = sizeof(unsigned short int) + sizeof(unsigned short int) + sizeof(m_nSerialNumber);
 
-	int nParamCount = (int)m_Params.size();
+	int nParamCount = GetParameterCount();
 
 	// Parameter Types
 	//nSize += (sizeof(BYTE) * nParamCount);
@@ -289,6 +345,281 @@ int MCommand::GetSize() const
 	return nSize;
 }
 
+char* MCommand::AllocRawData(int nSize)
+{
+	if (nSize <= (int)sizeof(m_RawInline))
+		return m_RawInline;
+
+	m_RawHeap.resize(nSize);
+	return m_RawHeap.data();
+}
+
+bool MCommand::SetRawData(const char* pData, MCommandManager* pCM,
+	unsigned short nDataLen, bool ReadSerial)
+{
+	Reset();
+
+	unsigned short nTotalSize = 0;
+	memcpy(&nTotalSize, pData, sizeof(nTotalSize));
+	if ((nDataLen != USHRT_MAX) && (nDataLen != nTotalSize)) return false;
+
+	char* pRawData = AllocRawData(nTotalSize);
+	memcpy(pRawData, pData, nTotalSize);
+
+	if (!m_Reader.Init(pRawData, nTotalSize, pCM, ReadSerial))
+	{
+		Reset();
+		return false;
+	}
+
+	m_pCommandDesc = m_Reader.GetDesc();
+	m_nSerialNumber = m_Reader.GetSerialNumber();
+	m_bRawData = true;
+	m_bParamsRead = false;
+
+	return true;
+}
+
+char* MCommand::BeginRawData(const MCommandDesc* pDesc, int nSize)
+{
+	Reset();
+	m_pCommandDesc = pDesc;
+	m_nRawSize = (unsigned short)nSize;
+	return AllocRawData(nSize);
+}
+
+bool MCommand::EndRawData(bool ReadSerial)
+{
+	char* pRawData = m_nRawSize <= sizeof(m_RawInline) ? m_RawInline : m_RawHeap.data();
+	m_bRawData = m_Reader.Init(pRawData, m_nRawSize, m_pCommandDesc, ReadSerial);
+	_ASSERT(m_bRawData);
+	if (!m_bRawData)
+		return false;
+
+	m_nSerialNumber = m_Reader.GetSerialNumber();
+	m_bParamsRead = false;
+	return true;
+}
+
+const MCommandReader& MCommand::GetReader()
+{
+	if (!m_bRawData)
+	{
+		ReadRawParameters();
+
+		int nSize = GetSize();
+		char* pRawData = AllocRawData(nSize);
+		nSize = GetData(pRawData, nSize);
+		m_bRawData = m_Reader.Init(pRawData, (unsigned short)nSize, m_pCommandDesc);
+		_ASSERT(m_bRawData);
+	}
+
+	return m_Reader;
+}
+
+bool MCommand::ReadRawParameters() const
+{
+	if (m_bParamsRead)
+		return true;
+
+	// The parameters are created lazily, but they're still part of the command's
+	// value, so this is logically const.
+	auto* This = const_cast<MCommand*>(this);
+	This->m_bParamsRead = true;
+	This->m_Params.reserve(m_pCommandDesc->GetParameterDescCount());
+
+	std::allocator<u8> Alloc;
+	auto nSize = (unsigned short)m_Reader.GetSize();
+	if (!This->ReadParameters(m_Reader.GetData(), m_Reader.GetParametersOffset(),
+		nSize, nSize, Alloc))
+	{
+		// m_Reader already validated the data, so this shouldn't happen, but don't
+		// leave the command with only some of its parameters if it does.
+		_ASSERT(false);
+		This->ClearParam();
+		return false;
+	}
+
+	return true;
+}
+
+static int GetFixedParameterSize(MCommandParameterType Type)
+{
+	switch (Type)
+	{
+	case MPT_INT: return sizeof(int);
+	case MPT_UINT: return sizeof(unsigned int);
+	case MPT_FLOAT: return sizeof(float);
+	case MPT_BOOL: return sizeof(bool);
+	case MPT_VECTOR:
+	case MPT_POS:
+	case MPT_DIR:
+	case MPT_COLOR: return sizeof(float) * 3;
+	case MPT_UID: return sizeof(MUID);
+	case MPT_CHAR: return sizeof(char);
+	case MPT_UCHAR: return sizeof(unsigned char);
+	case MPT_SHORT: return sizeof(short);
+	case MPT_USHORT: return sizeof(unsigned short);
+	case MPT_INT64: return sizeof(int64_t);
+	case MPT_UINT64: return sizeof(uint64_t);
+	case MPT_SVECTOR: return sizeof(short) * 3;
+	default: return -1;
+	}
+}
+
+// Returns the serialized size of the parameter at pParam, or -1 if it's invalid.
+static int GetParameterSize(MCommandParameterType Type, const char* pParam, int nRemaining)
+{
+	if (Type == MPT_STR)
+	{
+		unsigned short nValueSize = 0;
+		if (nRemaining < (int)sizeof(nValueSize)) return -1;
+		memcpy(&nValueSize, pParam, sizeof(nValueSize));
+		if (nValueSize == 0 || nValueSize > nRemaining - (int)sizeof(nValueSize)) return -1;
+		// GetString hands out a pointer to the string, so it has to be terminated.
+		if (!memchr(pParam + sizeof(nValueSize), 0, nValueSize)) return -1;
+		return nValueSize + sizeof(nValueSize);
+	}
+
+	if (Type == MPT_BLOB)
+	{
+		u32 nValueSize = 0;
+		if (nRemaining < (int)sizeof(nValueSize)) return -1;
+		memcpy(&nValueSize, pParam, sizeof(nValueSize));
+		// Unlike strings, blobs can be empty.
+		if (nValueSize > MAX_BLOB_SIZE ||
+			nValueSize > u32(nRemaining - sizeof(nValueSize))) return -1;
+		return nValueSize + sizeof(nValueSize);
+	}
+
+	int nSize = GetFixedParameterSize(Type);
+	if (nSize > nRemaining) return -1;
+	return nSize;
+}
+
+bool MCommandReader::Init(const char* pData, unsigned short nDataLen, MCommandManager* pCM, bool ReadSerial)
+{
+	unsigned short nCommandID = 0;
+	if (nDataLen < sizeof(unsigned short) + sizeof(nCommandID)) return false;
+	memcpy(&nCommandID, pData + sizeof(unsigned short), sizeof(nCommandID));
+
+	const MCommandDesc* pDesc = pCM->GetCommandDescByID(nCommandID);
+	if (pDesc == NULL) return false;
+
+	return Init(pData, nDataLen, pDesc, ReadSerial);
+}
+
+bool MCommandReader::Init(const char* pData, unsigned short nDataLen, const MCommandDesc* pDesc, bool ReadSerial)
+{
+	*this = MCommandReader{};
+
+	unsigned short nTotalSize = 0;
+	int nDataCount = sizeof(nTotalSize) + sizeof(unsigned short);
+	if (nDataLen < nDataCount) return false;
+	memcpy(&nTotalSize, pData, sizeof(nTotalSize));
+	if (nTotalSize != nDataLen) return false;
+
+	if (ReadSerial)
+	{
+		if (nDataLen < nDataCount + sizeof(m_nSerialNumber)) return false;
+		memcpy(&m_nSerialNumber, pData + nDataCount, sizeof(m_nSerialNumber));
+		nDataCount += sizeof(m_nSerialNumber);
+	}
+
+	int nParamCount = pDesc->GetParameterDescCount();
+	for (int i = 0; i < nParamCount; i++)
+	{
+		if (i < NumSavedOffsets)
+			m_Offsets[i] = (unsigned short)nDataCount;
+
+		int nSize = GetParameterSize(pDesc->GetParameterType(i), pData + nDataCount, nDataLen - nDataCount);
+		if (nSize < 0) return false;
+		nDataCount += nSize;
+	}
+
+	if (nDataCount != nTotalSize) return false;
+
+	if (nParamCount == 0)
+		m_Offsets[0] = (unsigned short)nDataCount;
+
+	m_pData = pData;
+	m_pDesc = pDesc;
+	m_nSize = nTotalSize;
+	m_bHasSerial = ReadSerial;
+
+	return true;
+}
+
+const char* MCommandReader::GetParameterData(int i, MCommandParameterType t) const
+{
+	if (i < 0 || i >= GetParameterCount()) return nullptr;
+	if (m_pDesc->GetParameterType(i) != t) return nullptr;
+
+	int j = (std::min)(i, NumSavedOffsets - 1);
+	int nOffset = m_Offsets[j];
+	for (; j < i; j++)
+		nOffset += GetParameterSize(m_pDesc->GetParameterType(j), m_pData + nOffset, m_nSize - nOffset);
+
+	return m_pData + nOffset;
+}
+
+bool MCommandReader::GetParameter(void* pValue, int i, MCommandParameterType t, int nBufferSize) const
+{
+	if (pValue == nullptr) return false;
+
+	auto* pParam = GetParameterData(i, t);
+	if (pParam == nullptr) return false;
+
+	if (t == MPT_STR)
+	{
+		auto* szParamString = pParam + sizeof(unsigned short);
+		if (nBufferSize < 0)
+		{
+			strcpy_safe((char*)pValue, 65535, szParamString);
+			return true;
+		}
+
+		int nLength = (int)strlen(szParamString);
+		if (nLength >= nBufferSize - 1) {
+			strncpy_safe((char*)pValue, nBufferSize, szParamString, nBufferSize - 2);
+			((char*)pValue)[nBufferSize - 1] = 0;
+		}
+		else {
+			strcpy_safe((char*)pValue, nBufferSize, szParamString);
+		}
+	}
+	else if (t == MPT_BLOB)
+	{
+		u32 nSize = 0;
+		memcpy(&nSize, pParam, sizeof(nSize));
+		memcpy(pValue, pParam + sizeof(nSize), nSize);
+	}
+	else
+	{
+		memcpy(pValue, pParam, GetFixedParameterSize(t));
+	}
+
+	return true;
+}
+
+const char* MCommandReader::GetString(int i) const
+{
+	auto* pParam = GetParameterData(i, MPT_STR);
+	if (pParam == nullptr) return nullptr;
+
+	return pParam + sizeof(unsigned short);
+}
+
+const void* MCommandReader::GetBlob(int i, u32* pSize) const
+{
+	auto* pParam = GetParameterData(i, MPT_BLOB);
+	if (pParam == nullptr) return nullptr;
+
+	if (pSize)
+		memcpy(pSize, pParam, sizeof(*pSize));
+	return pParam + sizeof(u32);
+}
+
 #define DEFAULT_COMMAND_SNCHECKER_CAPICITY	50
 
 MCommandSNChecker::MCommandSNChecker() : m_nCapacity(DEFAULT_COMMAND_SNCHECKER_CAPICITY)
@@ -9,7 +9,9 @@ MCommandBuilder::MCommandBuilder(MUID uidSender, MUID uidReceiver, MCommandManag
 	m_uidReceiver = uidReceiver;
 	m_pCommandManager = pCmdMgr;
 
+	m_nBufferStart = 0;
 	m_nBufferNext = 0;
+	m_nCommandListPos = 0;
 	m_bCheckCommandSN = true;
 }
 
@@ -18,181 +20,154 @@ MCommandBuilder::~MCommandBuilder()
 	Clear();
 }
 
-bool MCommandBuilder::CheckBufferEmpty() 
+bool MCommandBuilder::AddBuffer(const char* pBuffer, int nLen) 
 {
-	if (m_nBufferNext == 0) return true;
-	else return false;
-}
+	if (nLen <= 0) return true;
 
-bool MCommandBuilder::EstimateBufferToCmd() 
-{
-	if (m_nBufferNext < sizeof(MPacketHeader))
-		return false;
-	MPacketHeader* pPacket = (MPacketHeader*)m_Buffer;
-	if (m_nBufferNext < _CalcPacketSize(pPacket))
+	// Anything more than this is a client that keeps sending before it can be read.
+	const int MaxBufferedSize = COMMAND_BUFFER_LEN * 4;
+	if (GetBufferedSize() + nLen > MaxBufferedSize)
 		return false;
+
+	if (m_nBufferNext + nLen > (int)m_Buffer.size())
+	{
+		// Only happens when more than one packet is buffered, since the buffer is
+		// reset whenever it's emptied.
+		if (m_nBufferStart > 0)
+		{
+			memmove(m_Buffer.data(), m_Buffer.data() + m_nBufferStart, GetBufferedSize());
+			m_nBufferNext -= m_nBufferStart;
+			m_nBufferStart = 0;
+		}
+		if (m_nBufferNext + nLen > (int)m_Buffer.size())
+			m_Buffer.resize((std::max)(m_nBufferNext + nLen, COMMAND_BUFFER_LEN));
+	}
+
+	memcpy(m_Buffer.data() + m_nBufferNext, pBuffer, nLen);
+	m_nBufferNext += nLen;
 	return true;
 }
 
-void MCommandBuilder::AddBuffer(char* pBuffer, int nLen) 
+int MCommandBuilder::_CalcPacketSize(MPacketHeader* pPacket)
 {
-	if (nLen <= 0) return;
-	if ((m_nBufferNext + nLen) >= COMMAND_BUFFER_LEN) {
-		_ASSERT(false);
-		return;
-	}
-	memcpy(m_Buffer+m_nBufferNext, pBuffer, nLen);
-	m_nBufferNext += nLen;
+	return pPacket->CalcPacketSize(m_pPacketCrypter);
 }
 
-bool MCommandBuilder::MoveBufferToFront(int nStart, int nLen) 
+int MCommandBuilder::GetPacketSize(MPacketHeader* pPacket)
 {
-	if (nStart+nLen > m_nBufferNext) 
-		return false;
-	memcpy(m_Buffer, m_Buffer+nStart, nLen);
-	m_nBufferNext = nLen;
-	return true;
+	// Encrypted packets can't be framed until the crypter is set up, so they wait in
+	// the buffer until then.
+	if (pPacket->IsEncrypted() && !m_pPacketCrypter)
+		return 0;
+
+	int nPacketSize = _CalcPacketSize(pPacket);
+	if (nPacketSize < (int)sizeof(MPacketHeader) || nPacketSize > MAX_PACKET_SIZE)
+		return -1;
+
+	return nPacketSize;
 }
 
-int MCommandBuilder::_CalcPacketSize(MPacketHeader* pPacket)
+int MCommandBuilder::PeekCommandID(MPacketHeader* pPacket, int nPacketSize)
 {
-	return pPacket->CalcPacketSize(m_pPacketCrypter);
+	// The command starts with its u16 size and u16 ID.
+	char Head[sizeof(u16) * 2];
+	const char* pBody = ((MCommandMsg*)pPacket)->Buffer;
+	if (nPacketSize - (int)sizeof(MPacketHeader) < (int)sizeof(Head))
+		return -1;
+
+	if (pPacket->nMsg == MSGID_RAWCOMMAND)
+		memcpy(Head, pBody, sizeof(Head));
+	else if (pPacket->nMsg == MSGID_COMMAND && m_pPacketCrypter)
+		m_pPacketCrypter->Decrypt(pBody, sizeof(Head), Head, sizeof(Head));
+	else
+		return -1;
+
+	u16 nCommandID;
+	memcpy(&nCommandID, Head + sizeof(u16), sizeof(nCommandID));
+	return nCommandID;
 }
 
-int MCommandBuilder::MakeCommand(char* pBuffer, int nBufferLen) 
+bool MCommandBuilder::MakeCommand(MPacketHeader* pPacket, int nPacketSize,
+	std::vector<MCommand*>& Commands)
 {
-	unsigned int nOffset = 0;
-	int nLen = nBufferLen;
-	MPacketHeader* pPacket = (MPacketHeader*)(pBuffer+nOffset);
-	int nCmdCount = 0;
-	int nPacketSize = 0;
+	// Checked before the rate limiter, since the command ID inside a compressed
+	// packet can't be peeked at.
+	if (pPacket->nMsg == MSGID_COMPRESSEDCOMMAND && !m_bAllowCompressed)
+		return false;
+
+	if (m_pRateLimiter)
+	{
+		auto Class = MPacketRateLimiter::Classify(pPacket->nMsg, PeekCommandID(pPacket, nPacketSize));
+		if (!m_pRateLimiter->Check(Class))
+			return !m_pRateLimiter->IsKicked();
+	}
 
-	while (nLen >= sizeof(MPacketHeader))
+	if (pPacket->nMsg == MSGID_RAWCOMMAND || pPacket->IsEncrypted())
 	{
-		int nPacketSize = _CalcPacketSize(pPacket);
-		if ((nPacketSize > nLen) || (nPacketSize <= 0)) break;
+		unsigned short nCheckSum = MBuildCheckSum(pPacket, nPacketSize);
+		if (pPacket->nCheckSum != nCheckSum)
+			return false;
 
-		if (pPacket->nMsg == MSGID_RAWCOMMAND)
+		char* pData = ((MCommandMsg*)pPacket)->Buffer;
+		int nCmdSize = nPacketSize - sizeof(MPacketHeader);
+		if (pPacket->IsEncrypted() && m_pPacketCrypter)
 		{
-			unsigned short nCheckSum = MBuildCheckSum(pPacket, nPacketSize);
-			if (pPacket->nCheckSum != nCheckSum) {
-				return -1;
-			} else if (nPacketSize > MAX_PACKET_SIZE)
-			{
-				return -1;
-			}
-			else 
-			{
-				MCommand* pCmd = new MCommand();
-				int nCmdSize = nPacketSize - sizeof(MPacketHeader);
-				if (pCmd->SetData(((MCommandMsg*)pPacket)->Buffer, m_pCommandManager,
-					(unsigned short)nCmdSize))
-				{
-					if (m_bCheckCommandSN)
-					{
-						if (!m_CommandSNChecker.CheckValidate(pCmd->m_nSerialNumber))
-						{
-							delete pCmd; pCmd = NULL;
-							return -1;
-						}
-					}
-
-					pCmd->m_Sender = m_uidSender;
-					pCmd->m_Receiver = m_uidReceiver;
-					m_CommandList.push_back(pCmd);
-				}
-				else
-				{
-					delete pCmd; pCmd = NULL;
-					return -1;
-				}
-			}
+			if (!m_pPacketCrypter->Decrypt(pData, nCmdSize))
+				return false;
 		}
-		else if (pPacket->nMsg == MSGID_COMMAND) 
+
+		if (pPacket->nMsg == MSGID_COMPRESSEDCOMMAND)
 		{
-			unsigned short nCheckSum = MBuildCheckSum(pPacket, nPacketSize);
-			if (pPacket->nCheckSum != nCheckSum) {
-				return -1;
-			} 
-			else if (nPacketSize > MAX_PACKET_SIZE)
-			{
-				return -1;
-			}
-			else 
-			{
-				MCommand* pCmd = new MCommand();
-
-				int nCmdSize = nPacketSize - sizeof(MPacketHeader);
-				if (m_pPacketCrypter)
-				{
-					if (!m_pPacketCrypter->Decrypt((char*)((MCommandMsg*)pPacket)->Buffer, nCmdSize))
-					{
-						delete pCmd; pCmd = NULL;
-						return -1;
-					}
-				}
-
-				if (pCmd->SetData((char*)((MCommandMsg*)pPacket)->Buffer,
-					m_pCommandManager, (unsigned short)nCmdSize))
-				{
-					if (m_bCheckCommandSN)
-					{
-						if (!m_CommandSNChecker.CheckValidate(pCmd->m_nSerialNumber))
-						{
-							delete pCmd; pCmd = NULL;
-							return -1;
-						}
-					}
-
-					pCmd->m_Sender = m_uidSender;
-					pCmd->m_Receiver = m_uidReceiver;
-					m_CommandList.push_back(pCmd);
-				}
-				else
-				{
-					delete pCmd; pCmd = NULL;
-					return -1;
-				}
-			}
-		} 
-		else if (pPacket->nMsg == MSGID_REPLYCONNECT) {
-			if (nPacketSize == sizeof(MReplyConnectMsg))
-			{
-				MPacketHeader* pNewPacket = (MPacketHeader*)malloc(nPacketSize);
-				memcpy(pNewPacket, pPacket, nPacketSize);
-				m_NetCmdList.push_back(pNewPacket);
-			}
-			else
-			{
-				return -1;
-			}
+			if (m_DecompressBuffer.empty())
+				m_DecompressBuffer.resize(USHRT_MAX);
+			nCmdSize = MDecompressCommand(pData, nCmdSize,
+				m_DecompressBuffer.data(), int(m_DecompressBuffer.size()));
+			if (nCmdSize == 0)
+				return false;
+			pData = m_DecompressBuffer.data();
 		}
-		else {
-			return -1;
+
+		MCommand* pCmd = new MCommand();
+		if (!pCmd->SetRawData(pData, m_pCommandManager, (unsigned short)nCmdSize))
+		{
+			delete pCmd;
+			return false;
 		}
 
-		nOffset += nPacketSize;
-		nLen -= nPacketSize;			
-		nCmdCount++;
+		if (m_bCheckCommandSN)
+		{
+			if (!m_CommandSNChecker.CheckValidate(pCmd->m_nSerialNumber))
+			{
+				delete pCmd;
+				return false;
+			}
+		}
 
-		pPacket = (MPacketHeader*)(pBuffer+nOffset);
+		pCmd->m_Sender = m_uidSender;
+		pCmd->m_Receiver = m_uidReceiver;
+		Commands.push_back(pCmd);
 	}
+	else if (pPacket->nMsg == MSGID_REPLYCONNECT) {
+		if (nPacketSize != sizeof(MReplyConnectMsg))
+			return false;
 
+		MPacketHeader* pNewPacket = (MPacketHeader*)malloc(nPacketSize);
+		memcpy(pNewPacket, pPacket, nPacketSize);
+		m_NetCmdList.push_back(pNewPacket);
+	}
+	else {
+		return false;
+	}
 
-	return nLen;
+	return true;
 }
 
 void MCommandBuilder::Clear()
 {
-	if (!m_CommandList.empty())
-	{
-		for (MCommandList::iterator itorCmd = m_CommandList.begin(); itorCmd != m_CommandList.end(); ++itorCmd)
-		{
-			MCommand* pCmd = (*itorCmd);
-			delete pCmd;
-		}
-		m_CommandList.clear();
-	}
+	for (size_t i = m_nCommandListPos; i < m_CommandList.size(); ++i)
+		delete m_CommandList[i];
+	m_CommandList.clear();
+	m_nCommandListPos = 0;
 
 	if (!m_NetCmdList.empty())
 	{
@@ -205,42 +180,83 @@ void MCommandBuilder::Clear()
 	}
 }
 
-bool MCommandBuilder::Read(char* pBuffer, int nBufferLen) 
+bool MCommandBuilder::Read(char* pBuffer, int nBufferLen, std::vector<MCommand*>& Commands)
 {
-	MPacketHeader* pPacket = (MPacketHeader*)pBuffer;
-
-	if (CheckBufferEmpty() == true)  {
-		if ( (nBufferLen < sizeof(MPacketHeader)) || (nBufferLen < _CalcPacketSize(pPacket)) ) {	
-			AddBuffer(pBuffer, nBufferLen);
-		} else {
-			int nSpareData = MakeCommand(pBuffer, nBufferLen);
-			if (nSpareData > 0) {
-				AddBuffer(pBuffer+(nBufferLen-nSpareData), nSpareData);
-			}
-			else if (nSpareData < 0) return false;
+	// Finish the packets in the buffer first, taking only as many bytes from pBuffer
+	// as the current packet needs.
+	while (GetBufferedSize() > 0)
+	{
+		int nNeeded = sizeof(MPacketHeader);
+		int nPacketSize = 0;
+		if (GetBufferedSize() >= nNeeded)
+		{
+			nPacketSize = GetPacketSize((MPacketHeader*)(m_Buffer.data() + m_nBufferStart));
+			if (nPacketSize < 0)
+				return false;
+			if (nPacketSize == 0)
+				return AddBuffer(pBuffer, nBufferLen);
+			nNeeded = nPacketSize;
 		}
-	} else {
-		AddBuffer(pBuffer, nBufferLen);
-		if (EstimateBufferToCmd() == true) {
-			int nSpareData = MakeCommand(m_Buffer, m_nBufferNext);	// m_nBufferNext == nBufferSize
-			if (nSpareData >= 0)
-				MoveBufferToFront(m_nBufferNext-nSpareData, nSpareData);
-			else return false;
+
+		if (GetBufferedSize() < nNeeded)
+		{
+			int nCopy = (std::min)(nNeeded - GetBufferedSize(), nBufferLen);
+			if (!AddBuffer(pBuffer, nCopy))
+				return false;
+			pBuffer += nCopy;
+			nBufferLen -= nCopy;
+
+			if (GetBufferedSize() < nNeeded)
+				return true;
+			if (nPacketSize == 0)
+				continue;
 		}
+
+		if (!MakeCommand((MPacketHeader*)(m_Buffer.data() + m_nBufferStart), nPacketSize, Commands))
+			return false;
+
+		m_nBufferStart += nPacketSize;
+		if (m_nBufferStart == m_nBufferNext)
+			m_nBufferStart = m_nBufferNext = 0;
 	}
-	return true;
+
+	// Then frame the rest straight out of pBuffer.
+	while (nBufferLen >= (int)sizeof(MPacketHeader))
+	{
+		MPacketHeader* pPacket = (MPacketHeader*)pBuffer;
+		int nPacketSize = GetPacketSize(pPacket);
+		if (nPacketSize < 0)
+			return false;
+		if (nPacketSize == 0 || nPacketSize > nBufferLen)
+			break;
+
+		if (!MakeCommand(pPacket, nPacketSize, Commands))
+			return false;
+
+		pBuffer += nPacketSize;
+		nBufferLen -= nPacketSize;
+	}
+
+	return AddBuffer(pBuffer, nBufferLen);
+}
+
+bool MCommandBuilder::Read(char* pBuffer, int nBufferLen) 
+{
+	if (m_nCommandListPos == m_CommandList.size())
+	{
+		m_CommandList.clear();
+		m_nCommandListPos = 0;
+	}
+
+	return Read(pBuffer, nBufferLen, m_CommandList);
 }
 
 MCommand* MCommandBuilder::GetCommand() 
 {
-	MCommandList::iterator itorCmd = m_CommandList.begin();
-	if (itorCmd != m_CommandList.end()) {
-		MCommand* pCmd = (*itorCmd);
-		m_CommandList.pop_front();
-		return (pCmd);
-	} else {
+	if (m_nCommandListPos == m_CommandList.size())
 		return NULL;
-	}
+
+	return m_CommandList[m_nCommandListPos++];
 }
 
 
@@ -51,6 +51,10 @@ void MCommandCommunicator::OnPrepareCommand(MCommand* pCommand)
 {
 }
 
+void MCommandCommunicator::OnRunFinished()
+{
+}
+
 void MCommandCommunicator::OnRun()
 {
 }
@@ -210,6 +214,8 @@ void MCommandCommunicator::Run()
 	}
 
 	OnRun();
+
+	OnRunFinished();
 }
 
 void MCommandCommunicator::LOG(unsigned int nLogLevel, const char *pFormat,...)
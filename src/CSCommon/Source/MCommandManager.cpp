@@ -30,10 +30,7 @@ MCommandManager::~MCommandManager()
 
 void MCommandManager::Initialize()
 {
-	for(MCommandList::iterator i=m_CommandQueue.begin(); i!=m_CommandQueue.end(); i++){
-		delete (*i);
-	}
-	m_CommandQueue.clear();
+	m_CommandQueue.Drain([&](MCommand* pCmd) { delete pCmd; });
 }
 
 int MCommandManager::GetCommandDescCount() const
@@ -43,7 +40,17 @@ int MCommandManager::GetCommandDescCount() const
 
 int MCommandManager::GetCommandQueueCount() const
 {
-	return (int)m_CommandQueue.size();
+	return (int)m_CommandQueue.Size();
+}
+
+int MCommandManager::GetCommandQueueHighWaterMark() const
+{
+	return (int)m_CommandQueue.GetHighWaterMark();
+}
+
+void MCommandManager::ResetCommandQueueHighWaterMark()
+{
+	m_CommandQueue.ResetHighWaterMark();
 }
 
 
@@ -103,29 +110,22 @@ bool MCommandManager::Post(MCommand* pCmd)
 	_ASSERT(bCheckRule==true);
 	if(bCheckRule==false) return false;
 
-	m_CommandQueue.push_back(pCmd);
-
+	m_CommandQueue.Push(pCmd);
 
 	return true;
 }
 
 MCommand* MCommandManager::GetCommand()
 {
-	if(m_CommandQueue.size()==0) return NULL;
-
-	MCommand* pCmd = *m_CommandQueue.begin();
-	
-	m_CommandQueue.erase(m_CommandQueue.begin());
-
+	MCommand* pCmd = NULL;
+	m_CommandQueue.Pop(pCmd);
 	return pCmd;
 }
 
 MCommand* MCommandManager::PeekCommand()
 {
-	if(m_CommandQueue.size()==0) return NULL;
-
-	MCommand* pCmd = *m_CommandQueue.begin();
-	return pCmd;
+	auto* ppCmd = m_CommandQueue.Peek();
+	return ppCmd ? *ppCmd : NULL;
 }
 
 void MCommandManager::GetSyntax(char* szSyntax, int maxlen, const MCommandDesc* pCD)
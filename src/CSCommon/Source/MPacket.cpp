@@ -1,12 +1,13 @@
 #include "stdafx.h"
 #include "MPacket.h"
 #include "MPacketCrypter.h"
+#include "zip/zlib.h"
 
 int MPacketHeader::CalcPacketSize(MPacketCrypter* pCrypter)
 {
 	unsigned short nPacketSize = 0;
 
-	if (nMsg == MSGID_COMMAND)
+	if (IsEncrypted())
 	{
 		if (pCrypter)
 		{
@@ -21,3 +22,39 @@ int MPacketHeader::CalcPacketSize(MPacketCrypter* pCrypter)
 
 	return (int)nPacketSize;
 }
+
+int MCompressCommand(const char* pSrc, int nSrcLen, char* pDst, int nDstLen)
+{
+	if (nSrcLen <= 0 || nSrcLen > USHRT_MAX || nDstLen <= (int)sizeof(u16))
+		return 0;
+
+	const u16 nCommandSize = u16(nSrcLen);
+	memcpy(pDst, &nCommandSize, sizeof(nCommandSize));
+
+	// Level 1. Most of the gain for a fraction of the time, and this runs on the main
+	// thread.
+	uLongf nCompressedSize = uLongf((std::min)(nDstLen, nSrcLen) - sizeof(u16));
+	if (compress2((Bytef*)pDst + sizeof(u16), &nCompressedSize,
+		(const Bytef*)pSrc, uLong(nSrcLen), Z_BEST_SPEED) != Z_OK)
+		return 0;
+
+	int nBodySize = int(sizeof(u16) + nCompressedSize);
+	return nBodySize < nSrcLen ? nBodySize : 0;
+}
+
+int MDecompressCommand(const char* pSrc, int nSrcLen, char* pDst, int nDstLen)
+{
+	u16 nCommandSize = 0;
+	if (nSrcLen <= (int)sizeof(nCommandSize))
+		return 0;
+	memcpy(&nCommandSize, pSrc, sizeof(nCommandSize));
+	if (nCommandSize == 0 || nCommandSize > nDstLen)
+		return 0;
+
+	uLongf nSize = nCommandSize;
+	if (uncompress((Bytef*)pDst, &nSize, (const Bytef*)pSrc + sizeof(u16),
+		uLong(nSrcLen - sizeof(u16))) != Z_OK || nSize != nCommandSize)
+		return 0;
+
+	return int(nSize);
+}
@@ -2,9 +2,23 @@
 #include "MPacketCrypter.h"
 #include "MPacket.h"
 #include "MSharedCommandTable.h"
+#include <cstring>
+#include <vector>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define PACKET_CRYPTER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 int MPacketCrypter::m_nSHL = (MCOMMAND_VERSION % 6) + 1;
-unsigned char MPacketCrypter::m_ShlMask = 0;
 
 bool MPacketCrypter::InitKey(MPacketCrypterKey* pKey)
 {
@@ -36,91 +50,333 @@ bool MPacketCrypter::Decrypt(char* pSource, int nSrcLen)
 	return true;
 }
 
-bool MPacketCrypter::Encrypt(const char* pSource, int nSrcLen, char* pTarget, int nTarLen, MPacketCrypterKey* pKey)
+// The transform is a byte-wise xor with the key, a rotate by m_nSHL and a xor with 0xF0.
+// The key index restarts at 0 for every call and wraps every 32 bytes, so a 32 byte
+// vector (or two 16 byte vectors) covers exactly one key period.
+//
+// All kernels support Src == Dst. The encrypt kernels return the byte sum of the
+// output, which is what MBuildCheckSum needs.
+namespace
 {
-	int nKeyIndex = 0;
-	for (int i = 0; i < nSrcLen; i++)
-	{
-		*pTarget = _Enc(*pSource, pKey->szKey[nKeyIndex]);
+using EncryptKernel = u32(*)(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL);
+using DecryptKernel = void(*)(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL);
+using SumKernel = u32(*)(const u8* Data, int Len);
 
-		nKeyIndex++;
-		if (nKeyIndex >= PACKET_CRYPTER_KEY_LEN) nKeyIndex = 0;
-		pTarget++;
-		pSource++;
+struct CrypterKernels
+{
+	const char* Name;
+	EncryptKernel Encrypt;
+	DecryptKernel Decrypt;
+	SumKernel Sum;
+};
+
+u8 RotateLeft(u8 b, int n) { return u8((b << n) | (b >> (8 - n))); }
+
+u32 EncryptScalar(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL, int i = 0)
+{
+	u32 Sum = 0;
+	for (; i < Len; i++)
+	{
+		Dst[i] = RotateLeft(Src[i] ^ Key[i % PACKET_CRYPTER_KEY_LEN], SHL) ^ 0xF0;
+		Sum += Dst[i];
 	}
+	return Sum;
+}
 
-	return true;
+void DecryptScalar(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL, int i = 0)
+{
+	for (; i < Len; i++)
+		Dst[i] = RotateLeft(Src[i] ^ 0xF0, 8 - SHL) ^ Key[i % PACKET_CRYPTER_KEY_LEN];
 }
 
-bool MPacketCrypter::Decrypt(const char* pSource, int nSrcLen, char* pTarget, int nTarLen, MPacketCrypterKey* pKey)
+u32 SumScalar(const u8* Data, int Len, int i = 0)
 {
-	int nKeyIndex = 0;
-	for (int i = 0; i < nSrcLen; i++)
+	u32 Sum = 0;
+	for (; i < Len; i++)
+		Sum += Data[i];
+	return Sum;
+}
+
+u32 EncryptScalarKernel(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL) {
+	return EncryptScalar(Src, Dst, Len, Key, SHL); }
+void DecryptScalarKernel(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL) {
+	DecryptScalar(Src, Dst, Len, Key, SHL); }
+u32 SumScalarKernel(const u8* Data, int Len) { return SumScalar(Data, Len); }
+
+#ifdef PACKET_CRYPTER_X86
+// There are no 8-bit shifts, so bytes are rotated with 16-bit shifts and masks that
+// drop the bits that crossed over from the neighbouring byte.
+struct RotateSSE2
+{
+	__m128i LeftCount, RightCount, LeftMask, RightMask;
+
+	TARGET_SSE2 explicit RotateSSE2(int n)
 	{
-		*pTarget = _Dec(*pSource, pKey->szKey[nKeyIndex]);
+		LeftCount = _mm_cvtsi32_si128(n);
+		RightCount = _mm_cvtsi32_si128(8 - n);
+		LeftMask = _mm_set1_epi8(char(0xFF << n));
+		RightMask = _mm_set1_epi8(char((1 << n) - 1));
+	}
 
-		nKeyIndex++;
-		if (nKeyIndex >= PACKET_CRYPTER_KEY_LEN) nKeyIndex = 0;
-		pTarget++;
-		pSource++;
+	TARGET_SSE2 __m128i operator()(__m128i x) const
+	{
+		return _mm_or_si128(
+			_mm_and_si128(_mm_sll_epi16(x, LeftCount), LeftMask),
+			_mm_and_si128(_mm_srl_epi16(x, RightCount), RightMask));
 	}
+};
 
-	return true;
+TARGET_SSE2 u32 HorizontalSum(__m128i Acc)
+{
+	return u32(_mm_cvtsi128_si32(Acc) + _mm_cvtsi128_si32(_mm_srli_si128(Acc, 8)));
 }
 
-
-char MPacketCrypter::_Enc(char s, char key)
+TARGET_SSE2 u32 EncryptSSE2(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL)
 {
-	u16 w;
-	u8 b, bh;
-	b = s ^ key;
-	w = b << m_nSHL;
-	bh = (w&0xFF00)>>8;
-	b = w&0xFF;
-	return u8(b | bh) ^ 0xF0;
+	const RotateSSE2 Rotate{SHL};
+	const __m128i Keys[2] = {
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(Key)),
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(Key + 16)),
+	};
+	const __m128i F0 = _mm_set1_epi8(char(0xF0));
+	const __m128i Zero = _mm_setzero_si128();
+	__m128i Acc = Zero;
+
+	int i = 0;
+	for (; i + 16 <= Len; i += 16)
+	{
+		auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i));
+		x = _mm_xor_si128(Rotate(_mm_xor_si128(x, Keys[(i / 16) & 1])), F0);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + i), x);
+		Acc = _mm_add_epi64(Acc, _mm_sad_epu8(x, Zero));
+	}
+
+	return HorizontalSum(Acc) + EncryptScalar(Src, Dst, Len, Key, SHL, i);
 }
 
-char MPacketCrypter::_Dec(char s, char key)
+TARGET_SSE2 void DecryptSSE2(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL)
 {
-	u8 b, bh, d;
+	const RotateSSE2 Rotate{8 - SHL};
+	const __m128i Keys[2] = {
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(Key)),
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(Key + 16)),
+	};
+	const __m128i F0 = _mm_set1_epi8(char(0xF0));
 
-	b = s^0xF0;
-	bh = b&m_ShlMask;
-	d = (bh<<(8-m_nSHL))|(b>>m_nSHL);
+	int i = 0;
+	for (; i + 16 <= Len; i += 16)
+	{
+		auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Src + i));
+		x = _mm_xor_si128(Rotate(_mm_xor_si128(x, F0)), Keys[(i / 16) & 1]);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(Dst + i), x);
+	}
 
-	return ( d ^ key );
+	DecryptScalar(Src, Dst, Len, Key, SHL, i);
 }
 
+TARGET_SSE2 u32 SumSSE2(const u8* Data, int Len)
+{
+	const __m128i Zero = _mm_setzero_si128();
+	__m128i Acc = Zero;
 
-bool MPacketCrypter::Encrypt(char* pSource, int nSrcLen, MPacketCrypterKey* pKey)
+	int i = 0;
+	for (; i + 16 <= Len; i += 16)
+	{
+		auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + i));
+		Acc = _mm_add_epi64(Acc, _mm_sad_epu8(x, Zero));
+	}
+
+	return HorizontalSum(Acc) + SumScalar(Data, Len, i);
+}
+
+struct RotateAVX2
 {
-	int nKeyIndex = 0;
-	for (int i = 0; i < nSrcLen; i++)
+	__m128i LeftCount, RightCount;
+	__m256i LeftMask, RightMask;
+
+	TARGET_AVX2 explicit RotateAVX2(int n)
 	{
-		*pSource = _Enc(*pSource, pKey->szKey[nKeyIndex]);
+		LeftCount = _mm_cvtsi32_si128(n);
+		RightCount = _mm_cvtsi32_si128(8 - n);
+		LeftMask = _mm256_set1_epi8(char(0xFF << n));
+		RightMask = _mm256_set1_epi8(char((1 << n) - 1));
+	}
 
-		nKeyIndex++;
-		if (nKeyIndex >= PACKET_CRYPTER_KEY_LEN) nKeyIndex = 0;
-		pSource++;
+	TARGET_AVX2 __m256i operator()(__m256i x) const
+	{
+		return _mm256_or_si256(
+			_mm256_and_si256(_mm256_sll_epi16(x, LeftCount), LeftMask),
+			_mm256_and_si256(_mm256_srl_epi16(x, RightCount), RightMask));
 	}
-	return true;
+};
+
+TARGET_AVX2 u32 HorizontalSum(__m256i Acc)
+{
+	auto x = _mm_add_epi64(_mm256_castsi256_si128(Acc), _mm256_extracti128_si256(Acc, 1));
+	return u32(_mm_cvtsi128_si32(x) + _mm_cvtsi128_si32(_mm_srli_si128(x, 8)));
 }
 
-bool MPacketCrypter::Decrypt(char* pSource, int nSrcLen, MPacketCrypterKey* pKey)
+TARGET_AVX2 u32 EncryptAVX2(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL)
 {
-	int nKeyIndex = 0;
-	for (int i = 0; i < nSrcLen; i++)
+	const RotateAVX2 Rotate{SHL};
+	const __m256i KeyVec = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Key));
+	const __m256i F0 = _mm256_set1_epi8(char(0xF0));
+	const __m256i Zero = _mm256_setzero_si256();
+	__m256i Acc = Zero;
+
+	int i = 0;
+	for (; i + 32 <= Len; i += 32)
 	{
-		*pSource = _Dec(*pSource, pKey->szKey[nKeyIndex]);
+		auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Src + i));
+		x = _mm256_xor_si256(Rotate(_mm256_xor_si256(x, KeyVec)), F0);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + i), x);
+		Acc = _mm256_add_epi64(Acc, _mm256_sad_epu8(x, Zero));
+	}
+
+	return HorizontalSum(Acc) + EncryptScalar(Src, Dst, Len, Key, SHL, i);
+}
+
+TARGET_AVX2 void DecryptAVX2(const u8* Src, u8* Dst, int Len, const u8* Key, int SHL)
+{
+	const RotateAVX2 Rotate{8 - SHL};
+	const __m256i KeyVec = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Key));
+	const __m256i F0 = _mm256_set1_epi8(char(0xF0));
+
+	int i = 0;
+	for (; i + 32 <= Len; i += 32)
+	{
+		auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Src + i));
+		x = _mm256_xor_si256(Rotate(_mm256_xor_si256(x, F0)), KeyVec);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(Dst + i), x);
+	}
+
+	DecryptScalar(Src, Dst, Len, Key, SHL, i);
+}
 
-		nKeyIndex++;
-		if (nKeyIndex >= PACKET_CRYPTER_KEY_LEN) nKeyIndex = 0;
-		pSource++;
+TARGET_AVX2 u32 SumAVX2(const u8* Data, int Len)
+{
+	const __m256i Zero = _mm256_setzero_si256();
+	__m256i Acc = Zero;
+
+	int i = 0;
+	for (; i + 32 <= Len; i += 32)
+	{
+		auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Data + i));
+		Acc = _mm256_add_epi64(Acc, _mm256_sad_epu8(x, Zero));
 	}
 
+	return HorizontalSum(Acc) + SumScalar(Data, Len, i);
+}
+
+bool CPUSupportsSSE2()
+{
+#ifdef _MSC_VER
+	int Info[4];
+	__cpuid(Info, 1);
+	return (Info[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+bool CPUSupportsAVX2()
+{
+#ifdef _MSC_VER
+	int Info[4];
+	__cpuid(Info, 0);
+	if (Info[0] < 7)
+		return false;
+
+	// AVX and OSXSAVE, and the OS has to save the ymm registers.
+	__cpuid(Info, 1);
+	const int AVXBits = (1 << 27) | (1 << 28);
+	if ((Info[2] & AVXBits) != AVXBits || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(Info, 7, 0);
+	return (Info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// Ordered from the fastest.
+std::vector<CrypterKernels> GetSupportedKernels()
+{
+	std::vector<CrypterKernels> Ret;
+#ifdef PACKET_CRYPTER_X86
+	if (CPUSupportsAVX2())
+		Ret.push_back({ "AVX2", EncryptAVX2, DecryptAVX2, SumAVX2 });
+	if (CPUSupportsSSE2())
+		Ret.push_back({ "SSE2", EncryptSSE2, DecryptSSE2, SumSSE2 });
+#endif
+	Ret.push_back({ "scalar", EncryptScalarKernel, DecryptScalarKernel, SumScalarKernel });
+	return Ret;
+}
+
+CrypterKernels& GetKernels()
+{
+	static CrypterKernels Kernels = GetSupportedKernels().front();
+	return Kernels;
+}
+}
+
+bool MPacketCrypter::Encrypt(const char* pSource, int nSrcLen, char* pTarget, int nTarLen, MPacketCrypterKey* pKey)
+{
+	EncryptAndSum(pSource, nSrcLen, pTarget, pKey);
+	return true;
+}
+
+bool MPacketCrypter::Decrypt(const char* pSource, int nSrcLen, char* pTarget, int nTarLen, MPacketCrypterKey* pKey)
+{
+	GetKernels().Decrypt(reinterpret_cast<const u8*>(pSource), reinterpret_cast<u8*>(pTarget),
+		nSrcLen, reinterpret_cast<const u8*>(pKey->szKey), m_nSHL);
 	return true;
 }
 
+bool MPacketCrypter::Encrypt(char* pSource, int nSrcLen, MPacketCrypterKey* pKey)
+{
+	EncryptAndSum(pSource, nSrcLen, pSource, pKey);
+	return true;
+}
+
+bool MPacketCrypter::Decrypt(char* pSource, int nSrcLen, MPacketCrypterKey* pKey)
+{
+	return Decrypt(pSource, nSrcLen, pSource, nSrcLen, pKey);
+}
+
+u32 MPacketCrypter::EncryptAndSum(const char* pSource, int nSrcLen, char* pTarget,
+	const MPacketCrypterKey* pKey)
+{
+	return GetKernels().Encrypt(reinterpret_cast<const u8*>(pSource), reinterpret_cast<u8*>(pTarget),
+		nSrcLen, reinterpret_cast<const u8*>(pKey->szKey), m_nSHL);
+}
+
+u32 MPacketCrypter::SumBytes(const void* pData, int nLen)
+{
+	return GetKernels().Sum(static_cast<const u8*>(pData), nLen);
+}
+
+const char* MPacketCrypter::GetKernelName()
+{
+	return GetKernels().Name;
+}
+
+bool MPacketCrypter::SetKernel(const char* Name)
+{
+	for (auto& Kernels : GetSupportedKernels())
+	{
+		if (strcmp(Kernels.Name, Name) == 0)
+		{
+			GetKernels() = Kernels;
+			return true;
+		}
+	}
+	return false;
+}
+
 MPacketCrypter::MPacketCrypter()
 {
 	InitConst();
@@ -130,10 +386,4 @@ MPacketCrypter::MPacketCrypter()
 void MPacketCrypter::InitConst()
 {
 	m_nSHL = (MCOMMAND_VERSION % 6) + 1;
-
-	m_ShlMask = 0;
-	for (int i = 0; i < m_nSHL; i++)
-	{
-		m_ShlMask += (1 << i);
-	}
 }
\ No newline at end of file
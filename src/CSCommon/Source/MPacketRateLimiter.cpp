@@ -0,0 +1,83 @@
+#include "stdafx.h"
+#include "MPacketRateLimiter.h"
+#include "MPacket.h"
+#include "MSharedCommandTable.h"
+#include "MTime.h"
+
+const char* MPacketRateLimits::GetClassName(MPacketClass Class)
+{
+	switch (Class)
+	{
+	case MPacketClass::Raw: return "raw";
+	case MPacketClass::Chat: return "chat";
+	case MPacketClass::Voice: return "voice";
+	case MPacketClass::PeerRelay: return "peer_relay";
+	case MPacketClass::Other: return "other";
+	default: return "unknown";
+	}
+}
+
+MPacketClass MPacketRateLimiter::Classify(u16 nMsg, int nCommandID)
+{
+	if (nMsg == MSGID_RAWCOMMAND)
+		return MPacketClass::Raw;
+
+	switch (nCommandID)
+	{
+	case MC_MATCH_CHANNEL_REQUEST_CHAT:
+	case MC_MATCH_STAGE_CHAT:
+	case MC_MATCH_GAME_CHAT:
+	case MC_MATCH_USER_WHISPER:
+	case MC_MATCH_CHATROOM_CHAT:
+	case MC_MATCH_CLAN_REQUEST_MSG:
+		return MPacketClass::Chat;
+	case MC_MATCH_SEND_VOICE_CHAT:
+		return MPacketClass::Voice;
+	case MC_MATCH_P2P_COMMAND:
+	case MC_MATCH_PEER_SNAPSHOT_ACK:
+		return MPacketClass::PeerRelay;
+	default:
+		return MPacketClass::Other;
+	}
+}
+
+bool MPacketRateLimiter::Check(MPacketClass Class)
+{
+	const auto Index = size_t(Class);
+	auto& Limit = Limits.Buckets[Index];
+	if (Limit.Rate <= 0)
+		return true;
+
+	auto& Bucket = Buckets[Index];
+	const auto Time = GetGlobalTimeMS();
+	if (!Bucket.Initialized)
+	{
+		Bucket.Tokens = Limit.Burst;
+		Bucket.LastTime = Time;
+		Bucket.Initialized = true;
+	}
+	else
+	{
+		Bucket.Tokens = (std::min)(Limit.Burst,
+			Bucket.Tokens + float(Time - Bucket.LastTime) * Limit.Rate / 1000.f);
+		Bucket.LastTime = Time;
+	}
+
+	if (Bucket.Tokens >= 1)
+	{
+		Bucket.Tokens -= 1;
+		return true;
+	}
+
+	if (Limit.Action == MPacketLimitAction::Kick)
+	{
+		KickedClass = Class;
+		Stats.Kicked[Index].fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+	{
+		Stats.Dropped[Index].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	return false;
+}
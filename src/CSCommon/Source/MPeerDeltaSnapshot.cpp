@@ -0,0 +1,259 @@
+#include "stdafx.h"
+#include "MPeerDeltaSnapshot.h"
+#include "MMatchUtil.h"
+#include <cmath>
+#include <cstring>
+
+static u32 ZigZag(i32 Value) { return (u32(Value) << 1) ^ u32(Value >> 31); }
+static i32 UnZigZag(u32 Value) { return i32(Value >> 1) ^ -i32(Value & 1); }
+
+// Deltas are written as a 2 bit size class followed by that many bits of the
+// zigzagged value. Most deltas between updates 33 ms apart fit in the 7 bit class.
+static constexpr int DeltaBits[] = { 0, 7, 12, 32 };
+
+static void WriteDelta(MBitWriter& Bits, i32 Delta)
+{
+	const auto Value = ZigZag(Delta);
+	u32 Class = 3;
+	for (u32 i = 0; i < 3; ++i)
+	{
+		if (u64(Value) < (u64(1) << DeltaBits[i]))
+		{
+			Class = i;
+			break;
+		}
+	}
+	Bits.Write(Class, 2);
+	Bits.Write(Value, DeltaBits[Class]);
+}
+
+static i32 ReadDelta(MBitReader& Bits)
+{
+	const auto Class = Bits.Read(2);
+	return UnZigZag(Bits.Read(DeltaBits[Class]));
+}
+
+static void WriteVarUInt(MBitWriter& Bits, u32 Value)
+{
+	do
+	{
+		Bits.Write(Value & 0x7F, 7);
+		Value >>= 7;
+		Bits.WriteBool(Value != 0);
+	} while (Value != 0);
+}
+
+static u32 ReadVarUInt(MBitReader& Bits)
+{
+	u32 Value = 0;
+	for (int Shift = 0; Shift < 35; Shift += 7)
+	{
+		Value |= Bits.Read(7) << Shift;
+		if (!Bits.ReadBool())
+			break;
+	}
+	return Value;
+}
+
+MPeerQuantizedState MQuantizePeerState(const NewBasicInfo& nbi,
+	ZC_STATE_LOWER LowerAni, ZC_STATE_UPPER UpperAni, MMatchCharItemParts Slot,
+	const MPeerDeltaPrecision& Precision)
+{
+	MPeerQuantizedState Ret{};
+	auto& bi = nbi.bi;
+	Ret.TimeMS = i32(std::lround(nbi.Time * 1000.0));
+	for (int i = 0; i < 3; ++i)
+	{
+		Ret.Pos[i] = i32(std::lround(bi.position[i] / Precision.PosStep));
+		Ret.Vel[i] = i32(std::lround(bi.velocity[i] / Precision.VelStep));
+	}
+	auto Dir = PackDirection(bi.direction);
+	Ret.Dir[0] = Dir.Yaw;
+	Ret.Dir[1] = Dir.Pitch;
+	Ret.HasCamDir = (nbi.Flags & BasicInfoFlags::CameraDir) != 0;
+	if (Ret.HasCamDir)
+	{
+		auto CamDir = PackDirection(bi.cameradir);
+		Ret.CamDir[0] = CamDir.Yaw;
+		Ret.CamDir[1] = CamDir.Pitch;
+	}
+	Ret.LowerAni = u8(LowerAni);
+	Ret.UpperAni = u8(UpperAni);
+	Ret.Slot = u8(Slot);
+	return Ret;
+}
+
+void MDequantizePeerState(const MPeerQuantizedState& State, const MPeerDeltaPrecision& Precision,
+	CharacterInfo& Out, float& OutTime)
+{
+	OutTime = State.TimeMS / 1000.f;
+	for (int i = 0; i < 3; ++i)
+	{
+		Out.Pos[i] = State.Pos[i] * Precision.PosStep;
+		Out.Vel[i] = State.Vel[i] * Precision.VelStep;
+	}
+	Out.Dir = UnpackDirection({ State.Dir[0], State.Dir[1] });
+	Out.HasCamDir = State.HasCamDir;
+	Out.CamDir = State.HasCamDir ? UnpackDirection({ State.CamDir[0], State.CamDir[1] }) : Out.Dir;
+	Out.LowerAni = ZC_STATE_LOWER(State.LowerAni);
+	Out.UpperAni = ZC_STATE_UPPER(State.UpperAni);
+	Out.Slot = MMatchCharItemParts(State.Slot);
+}
+
+static u16 StepToFixed(float Step) { return u16(std::lround((std::max)(1.f, (std::min)(65535.f, Step * 16)))); }
+static float FixedToStep(u16 Fixed) { return Fixed / 16.f; }
+
+float MRoundPeerDeltaStep(float Step)
+{
+	return FixedToStep(StepToFixed(Step));
+}
+
+MPeerDeltaSnapshotWriter::MPeerDeltaSnapshotWriter(std::vector<u8>& Out, u32 Epoch, u32 Seq,
+	const MPeerDeltaPrecision& Precision)
+	: Out(Out), Start(Out.size())
+{
+	auto Write = [&](auto Val) {
+		auto Offset = Out.size();
+		Out.resize(Offset + sizeof(Val));
+		memcpy(Out.data() + Offset, &Val, sizeof(Val));
+	};
+	Write(MPeerDeltaSnapshotFormat);
+	Write(Epoch);
+	Write(Seq);
+	Write(StepToFixed(Precision.PosStep));
+	Write(StepToFixed(Precision.VelStep));
+	Write(u8(0));
+}
+
+void MPeerDeltaSnapshotWriter::Add(const MUID& Sender, const MPeerQuantizedState& State,
+	const MPeerQuantizedState* Baseline, u32 BaselineAge)
+{
+	static const MPeerQuantizedState Zero{};
+	if (!Baseline || BaselineAge == 0 || BaselineAge > MPeerDeltaMaxBaselineAge)
+	{
+		Baseline = &Zero;
+		BaselineAge = 0;
+	}
+	auto& Base = *Baseline;
+
+	WriteVarUInt(Bits, Sender.High);
+	WriteVarUInt(Bits, Sender.Low);
+	Bits.Write(BaselineAge, 5);
+
+	WriteDelta(Bits, State.TimeMS - Base.TimeMS);
+	for (int i = 0; i < 3; ++i)
+		WriteDelta(Bits, State.Pos[i] - Base.Pos[i]);
+	for (int i = 0; i < 3; ++i)
+		WriteDelta(Bits, State.Vel[i] - Base.Vel[i]);
+	// The directions wrap around, so the deltas are taken in 8 bits.
+	for (int i = 0; i < 2; ++i)
+		WriteDelta(Bits, i8(State.Dir[i] - Base.Dir[i]));
+
+	Bits.WriteBool(State.HasCamDir);
+	if (State.HasCamDir)
+	{
+		auto& BaseCamDir = Base.HasCamDir ? Base.CamDir : State.Dir;
+		for (int i = 0; i < 2; ++i)
+			WriteDelta(Bits, i8(State.CamDir[i] - BaseCamDir[i]));
+	}
+
+	const bool bAniChanged = State.LowerAni != Base.LowerAni || State.UpperAni != Base.UpperAni;
+	Bits.WriteBool(bAniChanged);
+	if (bAniChanged)
+	{
+		Bits.Write(State.LowerAni, 8);
+		Bits.Write(State.UpperAni, 8);
+	}
+	const bool bSlotChanged = State.Slot != Base.Slot;
+	Bits.WriteBool(bSlotChanged);
+	if (bSlotChanged)
+		Bits.Write(State.Slot, 8);
+
+	++Count;
+	Out[Start + MPeerDeltaSnapshotHeaderSize - 1] = u8(Count);
+}
+
+bool MReadPeerDeltaSnapshotHeader(const u8* Data, size_t Size, MPeerDeltaSnapshotHeader& Out)
+{
+	if (Size < MPeerDeltaSnapshotHeaderSize || Data[0] != MPeerDeltaSnapshotFormat)
+		return false;
+
+	u16 PosStep, VelStep;
+	memcpy(&Out.Epoch, Data + 1, sizeof(Out.Epoch));
+	memcpy(&Out.Seq, Data + 5, sizeof(Out.Seq));
+	memcpy(&PosStep, Data + 9, sizeof(PosStep));
+	memcpy(&VelStep, Data + 11, sizeof(VelStep));
+	Out.Count = Data[13];
+	if (PosStep == 0 || VelStep == 0)
+		return false;
+	Out.Precision.PosStep = FixedToStep(PosStep);
+	Out.Precision.VelStep = FixedToStep(VelStep);
+	return true;
+}
+
+MPeerDeltaReadResult MReadPeerDeltaSnapshot(const u8* Data, size_t Size,
+	function_view<const MPeerQuantizedState*(const MUID&, u32)> GetBaseline,
+	function_view<void(const MUID&, const MPeerQuantizedState&)> OnEntry)
+{
+	MPeerDeltaSnapshotHeader Header;
+	if (!MReadPeerDeltaSnapshotHeader(Data, Size, Header))
+		return MPeerDeltaReadResult::Malformed;
+
+	auto Result = MPeerDeltaReadResult::Complete;
+	MBitReader Bits{ Data + MPeerDeltaSnapshotHeaderSize, Size - MPeerDeltaSnapshotHeaderSize };
+	static const MPeerQuantizedState Zero{};
+	for (u32 n = 0; n < Header.Count; ++n)
+	{
+		MUID Sender;
+		Sender.High = ReadVarUInt(Bits);
+		Sender.Low = ReadVarUInt(Bits);
+		const auto BaselineAge = Bits.Read(5);
+
+		const MPeerQuantizedState* pBase = &Zero;
+		if (BaselineAge != 0)
+			pBase = BaselineAge <= Header.Seq ? GetBaseline(Sender, Header.Seq - BaselineAge) : nullptr;
+		// Without the baseline, the entry is still read to get to the next one.
+		auto& Base = pBase ? *pBase : Zero;
+
+		MPeerQuantizedState State;
+		State.TimeMS = Base.TimeMS + ReadDelta(Bits);
+		for (int i = 0; i < 3; ++i)
+			State.Pos[i] = Base.Pos[i] + ReadDelta(Bits);
+		for (int i = 0; i < 3; ++i)
+			State.Vel[i] = Base.Vel[i] + ReadDelta(Bits);
+		for (int i = 0; i < 2; ++i)
+			State.Dir[i] = i8(Base.Dir[i] + ReadDelta(Bits));
+
+		State.HasCamDir = Bits.ReadBool();
+		if (State.HasCamDir)
+		{
+			auto& BaseCamDir = Base.HasCamDir ? Base.CamDir : State.Dir;
+			for (int i = 0; i < 2; ++i)
+				State.CamDir[i] = i8(BaseCamDir[i] + ReadDelta(Bits));
+		}
+		else
+		{
+			State.CamDir[0] = State.CamDir[1] = 0;
+		}
+
+		State.LowerAni = Base.LowerAni;
+		State.UpperAni = Base.UpperAni;
+		if (Bits.ReadBool())
+		{
+			State.LowerAni = u8(Bits.Read(8));
+			State.UpperAni = u8(Bits.Read(8));
+		}
+		State.Slot = Base.Slot;
+		if (Bits.ReadBool())
+			State.Slot = u8(Bits.Read(8));
+
+		if (!Bits.IsValid())
+			return MPeerDeltaReadResult::Malformed;
+
+		if (pBase)
+			OnEntry(Sender, State);
+		else
+			Result = MPeerDeltaReadResult::MissingBaselines;
+	}
+	return Result;
+}
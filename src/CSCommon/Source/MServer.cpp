@@ -2,6 +2,7 @@
 #include "MServer.h"
 #include "MSharedCommandTable.h"
 #include "MCommandBuilder.h"
+#include "MCommandWriter.h"
 #include <stdarg.h>
 #include "MErrorTable.h"
 #include "MCRC32.h"
@@ -65,24 +66,21 @@ void MServer::Destroy(void)
 
 	Net.Destroy();
 
-	LockCommList();
-		for(auto i=m_CommRefCache.begin(); i!=m_CommRefCache.end(); i++){
-			delete i->second;
-		}
-		m_CommRefCache.clear();
-	UnlockCommList();
+	LockAcceptWaitMap();
+		for (auto& Pair : m_AcceptWaitMap)
+			delete Pair.second;
+		m_AcceptWaitMap.clear();
+	UnlockAcceptWaitMap();
+
+	for (auto* pCommObj : m_CommRefCache.RemoveAll())
+		delete pCommObj;
 
 	MCommandCommunicator::Destroy();
 }
 
 int MServer::GetCommObjCount()	
 { 
-	int count = 0;
-	LockCommList();
-		count = (int)m_CommRefCache.size(); 
-	UnlockCommList();
-
-	return count;
+	return (int)m_CommRefCache.size();
 }
 
 void MServer::AddCommObject(const MUID& uid, MCommObject* pCommObj)
@@ -91,7 +89,7 @@ void MServer::AddCommObject(const MUID& uid, MCommObject* pCommObj)
 	MCommandBuilder* pCmdBuilder = pCommObj->GetCommandBuilder();
 	pCmdBuilder->SetUID(GetUID(), uid);
 
-	m_CommRefCache.emplace(uid, pCommObj);
+	m_CommRefCache.Insert(uid, pCommObj);
 	g_LogCommObjectCreated++;
 }
 
@@ -113,30 +111,81 @@ void MServer::InitCryptCommObject(MCommObject* pCommObj, unsigned int nTimeStamp
 
 void MServer::PostSafeQueue(MCommand* pNew)
 {
-	LockSafeCmdQueue();
-		m_SafeCmdQueue.push_back(pNew);
-	UnlockSafeCmdQueue();
+	m_SafeCmdQueue.Push(pNew);
+}
+
+void MServer::SetCompressionAllowed(const MUID& CommUID, bool bAllow)
+{
+	m_CommRefCache.Read(CommUID, [&](MCommObject& CommObj) {
+		CommObj.SetAllowCompression(bAllow);
+	});
+}
+
+void MServer::SetUDPRelayAllowed(const MUID& CommUID, bool bAllow)
+{
+	m_CommRefCache.Read(CommUID, [&](MCommObject& CommObj) {
+		CommObj.SetAllowUDPRelay(bAllow);
+	});
+}
+
+void MServer::SetPeerSnapshotAllowed(const MUID& CommUID, bool bAllow)
+{
+	m_CommRefCache.Read(CommUID, [&](MCommObject& CommObj) {
+		CommObj.SetAllowPeerSnapshot(bAllow);
+	});
+}
+
+void MServer::SetPeerDeltaSnapshotAllowed(const MUID& CommUID, bool bAllow)
+{
+	m_CommRefCache.Read(CommUID, [&](MCommObject& CommObj) {
+		CommObj.SetAllowPeerDeltaSnapshot(bAllow);
+	});
 }
 
 void MServer::SendCommand(MCommand* pCommand)
 {
+	if (!pCommand->m_Receivers.empty())
+	{
+		SendCommandToReceivers(pCommand);
+		return;
+	}
+
 	_ASSERT(pCommand->GetReceiverUID().High || pCommand->GetReceiverUID().Low);
 
-	uintptr_t nClientKey = 0;
-	bool bGetComm = false;
+	SendTarget Target;
+	bool bGetComm = m_CommRefCache.Read(pCommand->m_Receiver, [&](MCommObject& CommObj) {
+		Target.nClientKey = CommObj.GetUserContext();
+		memcpy(&Target.CrypterKey, CommObj.GetCrypter()->GetKey(), sizeof(MPacketCrypterKey));
+		Target.bCompression = CommObj.IsCompressionAllowed();
+	});
 
-	MPacketCrypterKey CrypterKey;
+	if (bGetComm == false) return;
 
-	LockCommList();
-		MCommObject* pCommObj = (MCommObject*)m_CommRefCache.GetRef(pCommand->m_Receiver);
-		if(pCommObj){
-			nClientKey = pCommObj->GetUserContext();
-			memcpy(&CrypterKey, pCommObj->GetCrypter()->GetKey(), sizeof(MPacketCrypterKey));
-			bGetComm = true;
-		}
-	UnlockCommList();
+	int nSize = pCommand->GetSize();
+	if ((nSize <= 0) || (nSize >= MAX_PACKET_SIZE)) return;
 
-	if (bGetComm == false) return;
+	char CmdData[MAX_PACKET_SIZE];
+	nSize = pCommand->GetData(CmdData, nSize);
+
+	SendCommandData(pCommand, CmdData, nSize, &Target, 1);
+}
+
+void MServer::SendCommandToReceivers(MCommand* pCommand)
+{
+	std::vector<SendTarget> Targets;
+	Targets.reserve(pCommand->m_Receivers.size());
+
+	for (auto& uid : pCommand->m_Receivers)
+	{
+		m_CommRefCache.Read(uid, [&](MCommObject& CommObj) {
+			Targets.emplace_back();
+			Targets.back().nClientKey = CommObj.GetUserContext();
+			memcpy(&Targets.back().CrypterKey, CommObj.GetCrypter()->GetKey(), sizeof(MPacketCrypterKey));
+			Targets.back().bCompression = CommObj.IsCompressionAllowed();
+		});
+	}
+
+	if (Targets.empty()) return;
 
 	int nSize = pCommand->GetSize();
 	if ((nSize <= 0) || (nSize >= MAX_PACKET_SIZE)) return;
@@ -144,26 +193,70 @@ void MServer::SendCommand(MCommand* pCommand)
 	char CmdData[MAX_PACKET_SIZE];
 	nSize = pCommand->GetData(CmdData, nSize);
 
-	if(pCommand->m_pCommandDesc->IsFlag(MCCT_NON_ENCRYPTED))
+	SendCommandData(pCommand, CmdData, nSize, Targets.data(), int(Targets.size()));
+}
+
+static NetIO::SendPriority GetSendPriority(const MCommandDesc& Desc)
+{
+	if (Desc.IsFlag(MCCT_PRIORITY_REALTIME))
+		return NetIO::SendPriority::Realtime;
+	if (Desc.IsFlag(MCCT_PRIORITY_BULK))
+		return NetIO::SendPriority::Bulk;
+	return NetIO::SendPriority::Interactive;
+}
+
+void MServer::SendCommandData(const MCommand* pCommand, char* pData, int nSize,
+	SendTarget* pTargets, int nTargets)
+{
+	const bool bEncrypted = !pCommand->m_pCommandDesc->IsFlag(MCCT_NON_ENCRYPTED);
+	const auto Priority = GetSendPriority(*pCommand->m_pCommandDesc);
+
+	// Compressed once for every receiver that supports it.
+	char Compressed[MAX_PACKET_SIZE];
+	int nCompressedSize = 0;
+	if (bEncrypted && nSize >= MPACKET_COMPRESS_THRESHOLD &&
+		std::any_of(pTargets, pTargets + nTargets, [](auto& Target) { return Target.bCompression; }))
 	{
-		SendMsgCommand(nClientKey, CmdData, nSize, MSGID_RAWCOMMAND, NULL);
+		nCompressedSize = MCompressCommand(pData, nSize, Compressed, sizeof(Compressed));
 	}
-	else 
+
+	for (int i = 0; i < nTargets; ++i)
 	{
-		SendMsgCommand(nClientKey, CmdData, nSize, MSGID_COMMAND, &CrypterKey);
+		auto& Target = pTargets[i];
+		if (!bEncrypted)
+		{
+			SendMsgCommand(Target.nClientKey, pData, nSize, MSGID_RAWCOMMAND, NULL,
+				pCommand->m_bDroppable, Priority);
+		}
+		else if (Target.bCompression && nCompressedSize > 0)
+		{
+			SendMsgCommand(Target.nClientKey, Compressed, nCompressedSize, MSGID_COMPRESSEDCOMMAND,
+				&Target.CrypterKey, pCommand->m_bDroppable, Priority);
+			++m_CompressionStats.Commands;
+			m_CompressionStats.RawBytes += nSize;
+			m_CompressionStats.CompressedBytes += nCompressedSize;
+		}
+		else
+		{
+			SendMsgCommand(Target.nClientKey, pData, nSize, MSGID_COMMAND,
+				&Target.CrypterKey, pCommand->m_bDroppable, Priority);
+		}
 	}
 }
 
 void MServer::OnPrepareRun(void)
 {
-	LockSafeCmdQueue();
-		MCommandList::iterator itorCmd;
-		while ( (itorCmd = m_SafeCmdQueue.begin()) != m_SafeCmdQueue.end()) {
-			MCommand* pCmd = (*itorCmd);
-			m_SafeCmdQueue.pop_front();
-			GetCommandManager()->Post(pCmd);
-		}
-	UnlockSafeCmdQueue();
+	auto* pCM = GetCommandManager();
+	m_SafeCmdQueue.Drain([&](MCommand* pCmd) {
+		if (!pCM->Post(pCmd))
+			delete pCmd;
+	});
+}
+
+void MServer::OnRunFinished()
+{
+	// End-of-tick flush point for deferred sends, after anything OnRun sent.
+	Net.Flush();
 }
 
 void MServer::OnRun(void)
@@ -214,8 +307,7 @@ bool MServer::OnCommand(MCommand* pCommand)
 		{
 			MUID uid;
 			if (pCommand->GetParameter(&uid, 0, MPT_UID)==false) break;
-			MCommand* pNew = new MCommand(m_CommandManager.GetCommandDescByID(MC_NET_PING), uid, m_This);
-			pNew->AddParameter(new MCommandParameterUInt(static_cast<u32>(GetGlobalTimeMS())));
+			MCommand* pNew = CreateCommand<MC_NET_PING>(uid, static_cast<u32>(GetGlobalTimeMS()));
 			Post(pNew);
 			return true;
 		}
@@ -224,9 +316,8 @@ bool MServer::OnCommand(MCommand* pCommand)
 	case MC_NET_PING:
 		{
 			unsigned int nTimeStamp;
-			if (pCommand->GetParameter(&nTimeStamp, 0, MPT_UINT)==false) break;
-			MCommand* pNew = new MCommand(m_CommandManager.GetCommandDescByID(MC_NET_PONG), pCommand->m_Sender, m_This);
-			pNew->AddParameter(new MCommandParameterUInt(nTimeStamp));
+			if (pCommand->GetReader().GetParameter(&nTimeStamp, 0, MPT_UINT)==false) break;
+			MCommand* pNew = CreateCommand<MC_NET_PONG>(pCommand->m_Sender, nTimeStamp);
 			Post(pNew);
 			return true;
 		}
@@ -247,9 +338,23 @@ bool MServer::OnCommand(MCommand* pCommand)
 
 void MServer::OnNetClear(const MUID& CommUID)
 {
-	LockCommList();
-		RemoveCommObject(CommUID);
-	UnlockCommList();
+	// The connection may have closed before its MC_LOCAL_LOGIN was processed.
+	MCommObject* pWaitingObj = nullptr;
+	LockAcceptWaitMap();
+	auto it = m_AcceptWaitMap.find(CommUID);
+	if (it != m_AcceptWaitMap.end()) {
+		pWaitingObj = it->second;
+		m_AcceptWaitMap.erase(it);
+	}
+	UnlockAcceptWaitMap();
+
+	if (pWaitingObj) {
+		delete pWaitingObj;
+		g_LogCommObjectDestroyed++;
+		return;
+	}
+
+	RemoveCommObject(CommUID);
 }
 
 void MServer::OnNetPong(const MUID& CommUID, unsigned int nTimeStamp)
@@ -261,10 +366,8 @@ int MServer::Connect(MCommObject* pCommObj)
 	auto Handle = Net.Connect(pCommObj->GetIP(), pCommObj->GetPort(), pCommObj);
 
 	// UID Caching
-	LockCommList();
-		AddCommObject(pCommObj->GetUID(), pCommObj);
-		pCommObj->SetUserContext(Handle);
-	UnlockCommList();
+	pCommObj->SetUserContext(Handle);
+	AddCommObject(pCommObj->GetUID(), pCommObj);
 
 	return MOK;
 }
@@ -287,9 +390,9 @@ int MServer::OnAccept(MCommObject* pCommObj)
 
 	pCommObj->SetUID(AllocUID);
 
-	LockAcceptWaitQueue();
-		m_AcceptWaitQueue.push_back(pCommObj);
-	UnlockAcceptWaitQueue();
+	LockAcceptWaitMap();
+		m_AcceptWaitMap.emplace(pCommObj->GetUID(), pCommObj);
+	UnlockAcceptWaitMap();
 
 	MCommand* pNew = new MCommand(m_CommandManager.GetCommandDescByID(MC_LOCAL_LOGIN), m_This, m_This);
 	pNew->AddParameter(new MCommandParameterUID(pCommObj->GetUID()));
@@ -303,26 +406,22 @@ void MServer::OnLocalLogin(MUID CommUID, MUID PlayerUID)
 {
 	MCommObject* pCommObj = NULL;
 
-	LockAcceptWaitQueue();
-	for (auto i = m_AcceptWaitQueue.begin(); i!= m_AcceptWaitQueue.end(); i++) {
-		MCommObject* pTmpObj = (*i);
-		if (pTmpObj->GetUID() == CommUID) {
-			pCommObj = pTmpObj;
-			m_AcceptWaitQueue.erase(i);
-			break;
-		}
+	LockAcceptWaitMap();
+	auto it = m_AcceptWaitMap.find(CommUID);
+	if (it != m_AcceptWaitMap.end()) {
+		pCommObj = it->second;
+		m_AcceptWaitMap.erase(it);
 	}
-	UnlockAcceptWaitQueue();
+	UnlockAcceptWaitMap();
 
 	if (pCommObj == NULL) 
 		return;
 
 	auto nTimeStamp = static_cast<unsigned int>((GetGlobalTimeMS() * 103) - 234723);
 
-	LockCommList();
-		AddCommObject(pCommObj->GetUID(), pCommObj);
-		InitCryptCommObject(pCommObj, nTimeStamp);
-	UnlockCommList();
+	// Initialized before it's added, so senders never see it without a key.
+	InitCryptCommObject(pCommObj, nTimeStamp);
+	AddCommObject(pCommObj->GetUID(), pCommObj);
 
 	int nResult = ReplyConnect(&m_This, &CommUID, nTimeStamp, pCommObj);
 }
@@ -330,15 +429,9 @@ void MServer::OnLocalLogin(MUID CommUID, MUID PlayerUID)
 void MServer::Disconnect(MUID uid)
 {
 	uintptr_t nClientKey = 0;
-	bool bGetComm = false;
-
-	LockCommList();
-		MCommObject* pCommObj = (MCommObject*)m_CommRefCache.GetRef(uid);
-		if(pCommObj){
-			nClientKey = pCommObj->GetUserContext();
-			bGetComm = true;
-		}
-	UnlockCommList();
+	bool bGetComm = m_CommRefCache.Read(uid, [&](MCommObject& CommObj) {
+		nClientKey = CommObj.GetUserContext();
+	});
 
 	if (bGetComm == false) 
 		return;
@@ -372,33 +465,45 @@ bool MServer::SendMsgReplyConnect(MUID* pHostUID, MUID* pAllocUID, unsigned int
 	return Net.Send(nKey, pMsg, pMsg->nSize);
 }
 
-bool MServer::SendMsgCommand(uintptr_t nClientKey, char* pBuf, int nSize, unsigned short nMsgHeaderID, MPacketCrypterKey* pCrypterKey)
+// Checksums and encryption are applied by these on the connection's I/O thread, so the
+// sending thread only serializes the command and copies it into the packet.
+static void EncodeRawCommandPacket(void* pPacket, int nPacketSize, const void*)
 {
-	int nBlockSize = nSize+sizeof(MPacketHeader);
-	MCommandMsg* pMsg = (MCommandMsg*)malloc(nBlockSize);
-	pMsg->Buffer[0] = 0;
-	pMsg->nCheckSum = 0;
-	pMsg->nMsg = nMsgHeaderID;;
-	pMsg->nSize = nBlockSize;
-	int nPacketSize = nBlockSize;
+	auto pMsg = static_cast<MCommandMsg*>(pPacket);
+	pMsg->nCheckSum = MBuildCheckSum(pMsg, nPacketSize);
+}
 
+static void EncodeCommandPacket(void* pPacket, int nPacketSize, const void* pData)
+{
+	auto pMsg = static_cast<MCommandMsg*>(pPacket);
+	auto pCrypterKey = static_cast<const MPacketCrypterKey*>(pData);
+
+	MPacketCrypter::EncryptAndSum((char*)&pMsg->nSize, sizeof(pMsg->nSize),
+		(char*)&pMsg->nSize, pCrypterKey);
+
+	// Encrypt in place and checksum in the same pass.
+	auto nBodySum = MPacketCrypter::EncryptAndSum(pMsg->Buffer, nPacketSize - sizeof(MPacketHeader),
+		pMsg->Buffer, pCrypterKey);
+	pMsg->nCheckSum = MFinishCheckSum(pMsg, nBodySum);
+}
+
+static_assert(sizeof(MPacketCrypterKey) <= NetIO::PacketEncoder::MaxDataSize,
+	"MPacketCrypterKey doesn't fit in NetIO::PacketEncoder");
+
+bool MServer::SendMsgCommand(uintptr_t nClientKey, char* pBuf, int nSize, unsigned short nMsgHeaderID, MPacketCrypterKey* pCrypterKey,
+	bool bDroppable, NetIO::SendPriority Priority)
+{
+	NetIO::PacketEncoder Encoder;
 	if (nMsgHeaderID == MSGID_RAWCOMMAND)
 	{
-		memcpy(pMsg->Buffer, pBuf, nSize);
+		Encoder.Function = EncodeRawCommandPacket;
 	}
-	else if (nMsgHeaderID == MSGID_COMMAND)
+	else if (nMsgHeaderID == MSGID_COMMAND || nMsgHeaderID == MSGID_COMPRESSEDCOMMAND)
 	{
 		if ((nSize > MAX_PACKET_SIZE) || (pCrypterKey == NULL)) return false;
-		
-		if (!MPacketCrypter::Encrypt((char*)&pMsg->nSize, sizeof(unsigned short), pCrypterKey))
-			return false;
-
-		char SendBuf[MAX_PACKET_SIZE];
-
-		if (!MPacketCrypter::Encrypt(pBuf, nSize, SendBuf, nSize, pCrypterKey))
-			return false;
 
-		memcpy(pMsg->Buffer, SendBuf, nSize);			
+		Encoder.Function = EncodeCommandPacket;
+		memcpy(Encoder.Data, pCrypterKey, sizeof(MPacketCrypterKey));
 	}
 	else
 	{
@@ -406,9 +511,14 @@ bool MServer::SendMsgCommand(uintptr_t nClientKey, char* pBuf, int nSize, unsign
 		return false;
 	}
 
-	pMsg->nCheckSum = MBuildCheckSum(pMsg, nPacketSize);
+	int nPacketSize = nSize + sizeof(MPacketHeader);
+	MCommandMsg* pMsg = (MCommandMsg*)malloc(nPacketSize);
+	pMsg->nCheckSum = 0;
+	pMsg->nMsg = nMsgHeaderID;
+	pMsg->nSize = nPacketSize;
+	memcpy(pMsg->Buffer, pBuf, nSize);
 
-	return Net.Send(nClientKey, pMsg, nPacketSize);
+	return Net.Send(nClientKey, pMsg, nPacketSize, bDroppable, &Encoder, Priority);
 }
 
 void MServer::RCPCallback(void* pCallbackContext, NetIO::IOOperation Op, NetIO::ConnectionHandle Handle,
@@ -428,12 +538,27 @@ void MServer::RCPCallback(void* pCallbackContext, NetIO::IOOperation Op, NetIO::
 		GetIPv4String(addr, IPString);
 		pCommObj->SetAddress(IPString, AData->Port);
 		pCommObj->SetUserContext(Handle);
+		pCommObj->GetCommandBuilder()->SetRateLimiter(std::make_unique<MPacketRateLimiter>(
+			pServer->m_PacketRateLimits, pServer->m_PacketRateLimitStats));
+		pCommObj->GetCommandBuilder()->SetAllowCompressed(false);
 
 		pServer->OnAccept(pCommObj);
 			
 		pServer->Net.SetContext(Handle, pCommObj);
 	}
 		break;
+	case NetIO::IOOperation::SendQueueFull:
+	{
+		auto SData = static_cast<const NetIO::SendQueueFullData*>(Data);
+		if (auto pCommObj = static_cast<MCommObject*>(pServer->Net.GetContext(Handle)))
+		{
+			pServer->LogF(LOG_PROG, "Disconnecting %s (%u:%u): send queue over limit "
+				"(%u bytes, %u packets)\n",
+				pCommObj->GetIPString(), pCommObj->GetUID().High, pCommObj->GetUID().Low,
+				SData->QueuedBytes, SData->QueuedPackets);
+		}
+	}
+		break;
 	case NetIO::IOOperation::Disconnect:
 	{
 		if (auto pCommObj = static_cast<MCommObject*>(pServer->Net.GetContext(Handle)))
@@ -453,17 +578,31 @@ void MServer::RCPCallback(void* pCallbackContext, NetIO::IOOperation Op, NetIO::
 
 			if (pCmdBuilder)
 			{
-				if (!pCmdBuilder->Read((char*)pPacket, dwPacketLen))
+				// Reused across reads on this I/O thread.
+				static thread_local std::vector<MCommand*> Commands;
+				Commands.clear();
+
+				if (!pCmdBuilder->Read((char*)pPacket, dwPacketLen, Commands))
 				{
+					for (auto* pCmd : Commands)
+						delete pCmd;
+
+					auto* pLimiter = pCmdBuilder->GetRateLimiter();
+					if (pLimiter && pLimiter->IsKicked())
+					{
+						pServer->LogF(LOG_PROG, "Disconnecting %s (%u:%u): flooding %s packets\n",
+							pCommObj->GetIPString(), pCommObj->GetUID().High, pCommObj->GetUID().Low,
+							MPacketRateLimits::GetClassName(pLimiter->GetKickedClass()));
+					}
+
 					// Ŷ  ȿ .
 					pCommObj->SetAllowed(false);
 					pServer->Net.Disconnect(pCommObj->GetUserContext());
 					return;
 				}
 
-				while (MCommand* pCmd = pCmdBuilder->GetCommand()) {
+				for (auto* pCmd : Commands)
 					pServer->PostSafeQueue(pCmd);
-				}
 
 				while (MPacketHeader* pNetCmd = pCmdBuilder->GetNetCommand()) {
 					if (pNetCmd->nMsg == MSGID_REPLYCONNECT) {
@@ -479,9 +618,7 @@ void MServer::RCPCallback(void* pCallbackContext, NetIO::IOOperation Op, NetIO::
 
 						free(pNetCmd);
 
-						pServer->LockCommList();
 						pServer->OnConnected(&HostUID, &AllocUID, nTimeStamp, pCommObj);
-						pServer->UnlockCommList();
 					}
 				}
 			}
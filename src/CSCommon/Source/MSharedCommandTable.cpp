@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "MCommandRegistration.h"
+#include "MCommandWriter.h"
 #include "MMatchGlobal.h"
 #include "MMatchItem.h"
 #include "MBlobArray.h"
@@ -48,7 +49,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 		P(MPT_STR, "Message");
 	C(MC_MATCH_SEND_VOICE_CHAT, "", "", MCDT_MACHINE2MACHINE);
 		P(MPT_BLOB, "Encoded microphone data");
-	C(MC_MATCH_RECEIVE_VOICE_CHAT, "", "", MCDT_MACHINE2MACHINE);
+	C(MC_MATCH_RECEIVE_VOICE_CHAT, "", "", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME);
 		P(MPT_UID, "Sender");
 		P(MPT_BLOB, "Encoded microphone data");
 	C(MC_PEER_SET_SWORD_COLOR, "", "", MCDT_PEER2PEER);
@@ -60,12 +61,12 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 		P(MPT_UCHAR, "DamageType");
 		P(MPT_UCHAR, "WeaponType");
 	C(MC_MATCH_P2P_COMMAND, "Match.P2PCommand", "Forwards Peer to Peer commands",
-		MCDT_MACHINE2MACHINE | MCCT_NON_ENCRYPTED);
+		MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME | MCCT_NON_ENCRYPTED);
 		// Client -> Server = Receiver
 		// Server -> Client = Sender
 		P(MPT_UID, "Sender/Receiver"); 
 		P(MPT_BLOB, "Data");
-	C(MC_MATCH_DAMAGE, "", "", MCDT_MACHINE2MACHINE);
+	C(MC_MATCH_DAMAGE, "", "", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME);
 		P(MPT_UID, "Attacker");
 		P(MPT_USHORT, "Damage");
 		P(MPT_FLOAT, "PiercingRatio");
@@ -73,7 +74,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 		P(MPT_UCHAR, "WeaponType");
 	C(MC_MATCH_UPDATE_CLIENT_SETTINGS, "", "", MCDT_MACHINE2MACHINE);
 		P(MPT_BLOB, "Settings", MCPCBlobSize{sizeof(MTD_ClientSettings)});
-	C(MC_MATCH_PING_LIST, "", "", MCDT_MACHINE2MACHINE);
+	C(MC_MATCH_PING_LIST, "", "", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME);
 		P(MPT_BLOB, "Ping list", MCPCBlobArraySize{ sizeof(MTD_PingInfo) });
 	C(MC_PEER_BASICINFO_RG, "", "", MCDT_PEER2PEER);
 		// NOTE: This is validated in the handler, by UnpackNewBasicInfo.
@@ -94,6 +95,20 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 	C(MC_MATCH_RESPONSE_SPEC, "", "", MCDT_MACHINE2MACHINE);
 		P(MPT_UID, "Target player");
 		P(MPT_UINT, "Team");
+	C(MC_MATCH_PEER_SNAPSHOT, "Match.PeerSnapshot", "Forwards several Peer to Peer commands at once",
+		MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME | MCCT_NON_ENCRYPTED);
+		// Server -> Client only. See MPeerSnapshot.h.
+		P(MPT_BLOB, "Data");
+	C(MC_MATCH_PEER_DELTA_SNAPSHOT, "Match.PeerDeltaSnapshot", "Forwards quantized basic infos as deltas",
+		MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME | MCCT_NON_ENCRYPTED);
+		// Server -> Client only. See MPeerDeltaSnapshot.h.
+		P(MPT_BLOB, "Data");
+	C(MC_MATCH_PEER_SNAPSHOT_ACK, "Match.PeerSnapshotAck", "Acknowledges delta snapshots",
+		MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME | MCCT_NON_ENCRYPTED);
+		P(MPT_UINT, "Epoch");
+		P(MPT_UINT, "Latest sequence number");
+		// Bit n is set if snapshot Latest - 1 - n was received too.
+		P(MPT_UINT, "Received mask");
 
 
 	// Freestyle Gunz commands
@@ -124,9 +139,9 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 		P(MPT_UID, "uid");
 	C(MC_NET_CHECKPING, "Net.CheckPing", "Check ping time", MCDT_LOCAL);
 		P(MPT_UID, "uid");
-	C(MC_NET_PING, "Net.Ping", "Ping", MCDT_MACHINE2MACHINE | MCCT_NON_ENCRYPTED);
+	C(MC_NET_PING, "Net.Ping", "Ping", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME | MCCT_NON_ENCRYPTED);
 		P(MPT_UINT, "TimeStamp");
-	C(MC_NET_PONG, "Net.Pong", "Pong", MCDT_MACHINE2MACHINE | MCCT_NON_ENCRYPTED);
+	C(MC_NET_PONG, "Net.Pong", "Pong", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME | MCCT_NON_ENCRYPTED);
 		P(MPT_UINT, "TimeStamp");
 
 	C(MC_NET_ONCONNECT, "Net.OnConnect", "On Connect", MCDT_LOCAL);
@@ -159,6 +174,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			P(MPT_UINT, "ClientVersionMinor");
 			P(MPT_UINT, "ClientVersionPatch");
 			P(MPT_UINT, "ClientVersionRevision");
+			P(MPT_UINT, "Capabilities");
 		C(MC_MATCH_RESPONSE_LOGIN_FAILED, "", "", MCDT_MACHINE2MACHINE);
 			P(MPT_STR, "Reason");
 		C(MC_MATCH_RESPONSE_LOGIN, "Match.ResponseLogin", "Response Login", MCDT_MACHINE2MACHINE);
@@ -233,7 +249,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			P(MPT_INT, "nChannelType", MCPCMinMax{ 0, MCHANNEL_TYPE_MAX - 1 });
 		C(MC_MATCH_CHANNEL_LIST_STOP, "Channel.ListStop", "Channel List transmit stop", MCDT_MACHINE2MACHINE);
 			P(MPT_UID, "uidPlayer");
-		C(MC_MATCH_CHANNEL_LIST, "Channel.List", "Channel List", MCDT_MACHINE2MACHINE);
+		C(MC_MATCH_CHANNEL_LIST, "Channel.List", "Channel List", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_BLOB, "ChannelList", MCPCBlobArraySize{ sizeof(MCHANNELLISTNODE) });
 
 		C(MC_MATCH_CHANNEL_REQUEST_CHAT, "Channel.Request.Chat",
@@ -264,7 +280,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			P(MPT_UINT, "PlaceFilter");
 			P(MPT_UINT, "Options");
 		C(MC_MATCH_CHANNEL_RESPONSE_ALL_PLAYER_LIST, "Channel.ResponseAllPlayerList",
-			"Response Channel All Player List", MCDT_MACHINE2MACHINE);
+			"Response Channel All Player List", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_UID, "uidChannel");
 			P(MPT_BLOB, "PlayerList", MCPCBlobArraySize{ sizeof(MTD_ChannelPlayerListNode) });
 
@@ -400,7 +416,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			"Stage List transmit start", MCDT_MACHINE2MACHINE); 
 		C(MC_MATCH_STAGE_LIST_STOP, "Stage.ListStop",
 			"Stage List transmit stop", MCDT_MACHINE2MACHINE); 
-		C(MC_MATCH_STAGE_LIST, "Stage.List", "Stage List", MCDT_MACHINE2MACHINE); 
+		C(MC_MATCH_STAGE_LIST, "Stage.List", "Stage List", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK); 
 			P(MPT_CHAR, "PrevStageListCount");
 			P(MPT_CHAR, "NextStageListCount");
 			P(MPT_BLOB, "StageList", MCPCBlobArraySize{ sizeof(MTD_StageListNode) });
@@ -416,7 +432,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			P(MPT_UID, "uidChannel");
 			P(MPT_INT, "PlayerListPage");
 		C(MC_MATCH_CHANNEL_RESPONSE_PLAYER_LIST, "Channel.ResponsePlayerList",
-			"Response Channel Player List", MCDT_MACHINE2MACHINE);
+			"Response Channel Player List", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_UCHAR, "TotalPlayerCount");
 			P(MPT_UCHAR, "PlayerListPage");
 			P(MPT_BLOB, "PlayerList", MCPCBlobArraySize{ sizeof(MTD_ChannelPlayerListNode) });
@@ -489,7 +505,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			"Request TimeSync for Game", MCDT_MACHINE2MACHINE);
 			P(MPT_UINT, "LocalTimeStamp");
 		C(MC_MATCH_GAME_RESPONSE_TIMESYNC, "Game.ResponseTimeSync",
-			"Response TimeSync for Game", MCDT_MACHINE2MACHINE);
+			"Response TimeSync for Game", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_REALTIME);
 			P(MPT_UINT, "LocalTimeStamp");
 			P(MPT_UINT, "GlobalTimeStamp");
 		C(MC_MATCH_GAME_REPORT_TIMESYNC, "Game.ReportTimeSync",
@@ -634,13 +650,13 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			P(MPT_UID, "uid");
 			P(MPT_INT, "FirstItemIndex");
 			P(MPT_INT, "ItemCount");
-		C(MC_MATCH_RESPONSE_SHOP_ITEMLIST, "Match.ResponseShopItemList", "Response Shop Item List", MCDT_MACHINE2MACHINE);
+		C(MC_MATCH_RESPONSE_SHOP_ITEMLIST, "Match.ResponseShopItemList", "Response Shop Item List", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_BLOB, "ItemList", MCPCBlobArraySize{ sizeof(u32) });
 
 		C(MC_MATCH_REQUEST_CHARACTER_ITEMLIST, "Match.RequestCharacterItemList", "Request Character Item List", MCDT_MACHINE2MACHINE);
 			P(MPT_UID, "uid");
 
-		C(MC_MATCH_RESPONSE_CHARACTER_ITEMLIST, "Match.ResponseCharacterItemList", "Response Character Item List", MCDT_MACHINE2MACHINE);
+		C(MC_MATCH_RESPONSE_CHARACTER_ITEMLIST, "Match.ResponseCharacterItemList", "Response Character Item List", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_INT, "Bounty");
 			P(MPT_BLOB, "EquipItemList", MCPCBlobArraySize{ sizeof(MUID) });
 			P(MPT_BLOB, "ItemList", MCPCBlobArraySize{ sizeof(MTD_ItemNode) });
@@ -658,7 +674,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			P(MPT_INT, "Result");
 		C(MC_MATCH_REQUEST_ACCOUNT_ITEMLIST, "Match.RequestAccountItemList", "Request Account Item List", MCDT_MACHINE2MACHINE);
 			P(MPT_UID, "uid");
-		C(MC_MATCH_RESPONSE_ACCOUNT_ITEMLIST, "Match.ResponseAccountItemList", "Response Account Item List" , MCDT_MACHINE2MACHINE);
+		C(MC_MATCH_RESPONSE_ACCOUNT_ITEMLIST, "Match.ResponseAccountItemList", "Response Account Item List" , MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_BLOB, "ItemList", MCPCBlobArraySize{ sizeof(MTD_AccountItemNode) });
 		C(MC_MATCH_REQUEST_BRING_ACCOUNTITEM, "Match.RequestBringAccountItem", "Request Bring Account Item", MCDT_MACHINE2MACHINE);
 			P(MPT_UID, "uidChar");
@@ -752,7 +768,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 		C(MC_MATCH_FRIEND_REMOVE, "Match.Friend.Remove", "Remove a Friend", MCDT_MACHINE2MACHINE);
 			P(MPT_STR, "Name");
 		C(MC_MATCH_FRIEND_LIST, "Match.Friend.List", "List Friend", MCDT_MACHINE2MACHINE);
-		C(MC_MATCH_RESPONSE_FRIENDLIST, "Match.Response.FriendList", "Response List Friend", MCDT_MACHINE2MACHINE);
+		C(MC_MATCH_RESPONSE_FRIENDLIST, "Match.Response.FriendList", "Response List Friend", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_BLOB, "FriendList", MCPCBlobArraySize{ sizeof(MFRIENDLISTNODE) });
 		C(MC_MATCH_FRIEND_MSG, "Match.Friend.Msg", "Message to Friends", MCDT_MACHINE2MACHINE);
 			P(MPT_STR, "Msg");
@@ -860,7 +876,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			"Request Clan Member List", MCDT_MACHINE2MACHINE);
 			P(MPT_UID, "uidChar");
 		C(MC_MATCH_CLAN_RESPONSE_MEMBER_LIST, "Match.Clan.Response.ClanMemberList",
-			"Response Clan Member List", MCDT_MACHINE2MACHINE);
+			"Response Clan Member List", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_BLOB, "ClanMemberList", MCPCBlobArraySize{ sizeof(MTD_ClanMemberListNode) });
 		C(MC_MATCH_CLAN_REQUEST_CLAN_INFO, "Match.Clan.Request.Clan.Info",
 			"Request Clan Info", MCDT_MACHINE2MACHINE);
@@ -870,7 +886,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 			"Response Clan Info", MCDT_MACHINE2MACHINE);
 			P(MPT_BLOB, "ClanInfo", MCPCBlobArraySize{ sizeof(MTD_ClanInfo), 1, 1 });
 		C(MC_MATCH_CLAN_STANDBY_CLAN_LIST, "Match.Clan.Standby.ClanList",
-			"Standby Clan List", MCDT_MACHINE2MACHINE);
+			"Standby Clan List", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK);
 			P(MPT_INT, "PrevClanListCount");
 			P(MPT_INT, "NextClanListCount");
 			P(MPT_BLOB, "ClanList", MCPCBlobArraySize{ sizeof(MTD_StandbyClanList) });
@@ -1443,7 +1459,7 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 
 	C( MC_MATCH_REQUEST_CHAR_QUEST_ITEM_LIST, "Quest item", "Request my quest item list", MCDT_MACHINE2MACHINE );
 		P( MPT_UID, "uid" );
-	C( MC_MATCH_RESPONSE_CHAR_QUEST_ITEM_LIST, "Quest item", "Response my quest item list", MCDT_MACHINE2MACHINE );
+	C( MC_MATCH_RESPONSE_CHAR_QUEST_ITEM_LIST, "Quest item", "Response my quest item list", MCDT_MACHINE2MACHINE | MCCT_PRIORITY_BULK );
 		P( MPT_BLOB, "My quest item list" );
 
     C( MC_MATCH_REQUEST_BUY_QUEST_ITEM, "Quest item", "Request buy quest item", MCDT_MACHINE2MACHINE );
@@ -1541,4 +1557,36 @@ void MAddSharedCommandTable(MCommandManager* CommandManager, MSharedCommandType:
 		P(MPT_UID, "user uid");
 		P(MPT_INT, "parts");
 		P(MPT_INT, "itemid");
+
+	MVerifyCommandSignatures(CommandManager);
+}
+
+bool MVerifyCommandSignatures(MCommandManager* pCM)
+{
+	bool bValid = true;
+
+	auto Verify = [&](int ID, std::initializer_list<MCommandParameterType> Types) {
+		auto* pDesc = pCM->GetCommandDescByID(ID);
+		if (!pDesc)
+			return;
+
+		bool bMatches = pDesc->GetParameterDescCount() == int(Types.size());
+		int i = 0;
+		for (auto Type : Types)
+			bMatches = bMatches && pDesc->GetParameterType(i++) == Type;
+
+		if (!bMatches)
+		{
+			mlog("MVerifyCommandSignatures -- Signature of command %d (%s) doesn't match its description\n",
+				ID, pDesc->GetName());
+			_ASSERT(false);
+			bValid = false;
+		}
+	};
+
+#define MVERIFY_COMMAND_SIGNATURE(ID, ...) Verify(ID, { __VA_ARGS__ });
+	MCOMMAND_SIGNATURES(MVERIFY_COMMAND_SIGNATURE)
+#undef MVERIFY_COMMAND_SIGNATURE
+
+	return bValid;
 }
@@ -1,4 +1,5 @@
 #include "NetIO.h"
+#include <algorithm>
 
 #ifdef _WIN32
 bool NetIO::Create(int Port, CallbackType Callback, bool Reuse)
@@ -59,6 +60,27 @@ void NetIO::Destroy()
 	RealCPNet.Destroy();
 }
 
+void NetIO::SetNumIOThreads(int) {}
+
+void NetIO::SetListenBacklog(int Backlog)
+{
+	RealCPNet.SetListenBacklog(Backlog);
+}
+
+void NetIO::SetDeferSendUntilFlush(bool) {}
+void NetIO::Flush() {}
+void NetIO::SetSendLimits(const SendLimits&) {}
+
+NetIO::SendQueueStats NetIO::GetSendQueueStats() const
+{
+	return{};
+}
+
+std::vector<NetIO::IOThreadStats> NetIO::GetIOThreadStats() const
+{
+	return{};
+}
+
 NetIO::ConnectionHandle NetIO::Connect(u32 Address, int Port, void* Context)
 {
 	ConnectionHandle Ret;
@@ -76,8 +98,11 @@ void NetIO::Disconnect(ConnectionHandle Handle)
 	RealCPNet.Disconnect(Handle);
 }
 
-bool NetIO::Send(ConnectionHandle Handle, void* Packet, int Size)
+bool NetIO::Send(ConnectionHandle Handle, void* Packet, int Size, bool,
+	const PacketEncoder* Encoder, SendPriority)
 {
+	if (Encoder)
+		Encoder->Function(Packet, Size, Encoder->Data);
 	return RealCPNet.Send(Handle, static_cast<MPacketHeader*>(Packet), Size);
 }
 
@@ -103,14 +128,75 @@ void NetIO::SetLogLevel(int i)
 #else
 using asio::ip::tcp;
 
-static auto& GetConn(NetIO::ConnectionHandle Handle)
+static_assert(sizeof(NetIO::ConnectionHandle) >= sizeof(u64),
+	"ConnectionHandle must fit a 32-bit index and a 32-bit generation");
+
+static auto GetHandle(const std::shared_ptr<NetIO::Connection>& Ptr)
 {
-	return *reinterpret_cast<NetIO::Connection*>(Handle);
+	return Ptr->Handle;
 }
 
-static auto GetHandle(const std::shared_ptr<NetIO::Connection>& Ptr)
+static u32 GetSlotIndex(NetIO::ConnectionHandle Handle) { return u32(Handle); }
+static u32 GetSlotGeneration(NetIO::ConnectionHandle Handle) { return u32(u64(Handle) >> 32); }
+
+NetIO::ConnectionHandle NetIO::AddConnection(std::shared_ptr<Connection> Conn)
 {
-	return reinterpret_cast<NetIO::ConnectionHandle>(Ptr.get());
+	std::lock_guard<std::mutex> lock(ConnectionsMutex);
+
+	u32 Index;
+	if (!FreeConnectionSlots.empty())
+	{
+		Index = FreeConnectionSlots.back();
+		FreeConnectionSlots.pop_back();
+	}
+	else
+	{
+		Index = u32(ConnectionSlots.size());
+		ConnectionSlots.emplace_back();
+	}
+
+	auto& Slot = ConnectionSlots[Index];
+	Conn->Handle = ConnectionHandle((u64(Slot.Generation) << 32) | Index);
+	Slot.Conn = std::move(Conn);
+	return Slot.Conn->Handle;
+}
+
+std::shared_ptr<NetIO::Connection> NetIO::GetConnection(ConnectionHandle Handle)
+{
+	std::lock_guard<std::mutex> lock(ConnectionsMutex);
+
+	const auto Index = GetSlotIndex(Handle);
+	if (Index >= ConnectionSlots.size())
+		return nullptr;
+
+	auto& Slot = ConnectionSlots[Index];
+	if (Slot.Generation != GetSlotGeneration(Handle))
+		return nullptr;
+
+	return Slot.Conn;
+}
+
+void NetIO::RemoveConnection(ConnectionHandle Handle)
+{
+	std::shared_ptr<Connection> Conn;
+	{
+		std::lock_guard<std::mutex> lock(ConnectionsMutex);
+
+		const auto Index = GetSlotIndex(Handle);
+		if (Index >= ConnectionSlots.size())
+			return;
+
+		auto& Slot = ConnectionSlots[Index];
+		if (Slot.Generation != GetSlotGeneration(Handle))
+			return;
+
+		Conn = std::move(Slot.Conn);
+		// Skip 0 on wraparound so that no handle is ever 0.
+		if (++Slot.Generation == 0)
+			Slot.Generation = 1;
+		FreeConnectionSlots.push_back(Index);
+	}
+	// Conn is released outside of the lock.
 }
 
 void NetIO::Read(std::shared_ptr<Connection> Conn)
@@ -123,6 +209,7 @@ void NetIO::Read(std::shared_ptr<Connection> Conn)
 				Disconnect(GetHandle(Conn));
 				return;
 			}
+			IOThreads[Conn->IOThreadIndex]->NumReads.fetch_add(1, std::memory_order_relaxed);
 			ReadData Data{{Conn->ReadBuffer.data(), size}};
 			Callback(IOOperation::Read, GetHandle(Conn), &Data);
 			Read(Conn);
@@ -130,47 +217,141 @@ void NetIO::Read(std::shared_ptr<Connection> Conn)
 	});
 }
 
+size_t NetIO::PickIOThread() const
+{
+	size_t Best = 0;
+	for (size_t i = 1; i < IOThreads.size(); ++i)
+	{
+		if (IOThreads[i]->NumConnections.load(std::memory_order_relaxed) <
+			IOThreads[Best]->NumConnections.load(std::memory_order_relaxed))
+			Best = i;
+	}
+	return Best;
+}
+
 void NetIO::Accept()
 {
-	Acceptor.async_accept(AcceptSocket, [this](std::error_code ec) {
+	// The peer socket is created on the io_context of the thread that will own the
+	// connection, rather than the acceptor's.
+	const auto Index = PickIOThread();
+	auto& Context = IOThreads[Index]->Context;
+	auto NewConn = std::make_shared<Connection>(Context, tcp::socket{Context});
+	NewConn->IOThreadIndex = Index;
+	NewConn->TotalQueuedBytes = &QueuedBytes;
+
+	Acceptor->async_accept(NewConn->Socket, [this, NewConn](std::error_code ec) {
+		if (Stopped.load(std::memory_order_relaxed))
+			return;
+
 		if (!ec)
 		{
-			auto Endpoint = AcceptSocket.remote_endpoint();
+			auto Endpoint = NewConn->Socket.remote_endpoint();
 			AcceptData Data{u32(Endpoint.address().to_v4().to_ulong()), Endpoint.port()};
-			{
-				std::lock_guard<std::mutex> lock(ConnectionsMutex);
-				Connections.push_back(std::make_shared<Connection>(IOContext, std::move(AcceptSocket)));;
-				auto& Conn = Connections.back();
-				Callback(IOOperation::Accept, GetHandle(Conn), &Data);
-				Read(Conn);
-			}
+			IOThreads[NewConn->IOThreadIndex]->NumConnections.fetch_add(1, std::memory_order_relaxed);
+			const auto Handle = AddConnection(NewConn);
+			Callback(IOOperation::Accept, Handle, &Data);
+			Read(NewConn);
 		}
 		Accept();
 	});
 }
 
+void NetIO::SetNumIOThreads(int Num)
+{
+	NumIOThreads = Num;
+}
+
+void NetIO::SetListenBacklog(int Backlog)
+{
+	ListenBacklog = Backlog;
+}
+
 bool NetIO::Create(int Port, CallbackType Callback, bool Reuse)
 {
 	Stopped = false;
 	this->Callback = Callback;
 
-	auto ThreadProc = [this] {
-		while (!Stopped.load(std::memory_order_relaxed))
-			IOContext.run();
-	};
-	for (size_t i = 0; i < 1; ++i)
-		std::thread{ThreadProc}.detach();
+	auto NumThreads = NumIOThreads > 0 ? size_t(NumIOThreads) :
+		size_t(std::max(1u, std::thread::hardware_concurrency()));
+
+	IOThreads.clear();
+	for (size_t i = 0; i < NumThreads; ++i)
+	{
+		IOThreads.push_back(std::make_unique<IOThread>());
+		// Keeps run() from returning while the thread has no connections.
+		IOThreads.back()->Work.emplace(IOThreads.back()->Context);
+	}
 
 	tcp::endpoint LocalEndpoint{tcp::v4(), u16(Port)};
-	Acceptor = tcp::acceptor(IOContext, LocalEndpoint, Reuse);
+	Acceptor.emplace(IOThreads[0]->Context);
+	asio::error_code ec;
+	Acceptor->open(LocalEndpoint.protocol(), ec);
+	if (!ec && Reuse)
+		Acceptor->set_option(tcp::acceptor::reuse_address(true), ec);
+	if (!ec)
+		Acceptor->bind(LocalEndpoint, ec);
+	if (!ec)
+		Acceptor->listen(ListenBacklog > 0 ? ListenBacklog : int(tcp::acceptor::max_connections), ec);
+	if (ec)
+	{
+		Acceptor.reset();
+		IOThreads.clear();
+		return false;
+	}
 	Accept();
+
+	for (auto& Thread : IOThreads)
+	{
+		Thread->Thread = std::thread{[this, &Context = Thread->Context] {
+			while (!Stopped.load(std::memory_order_relaxed))
+				Context.run();
+		}};
+	}
+
 	return true;
 }
 
 void NetIO::Destroy()
 {
+	if (IOThreads.empty())
+		return;
+
 	Stopped = true;
-	IOContext.stop();
+	for (auto& Thread : IOThreads)
+	{
+		Thread->Work.reset();
+		Thread->Context.stop();
+	}
+	for (auto& Thread : IOThreads)
+	{
+		if (Thread->Thread.joinable())
+			Thread->Thread.join();
+	}
+
+	// Sockets have to go before the io_contexts they're registered with.
+	Acceptor.reset();
+	{
+		std::lock_guard<std::mutex> lock(ConnectionsMutex);
+		ConnectionSlots.clear();
+		FreeConnectionSlots.clear();
+	}
+	IOThreads.clear();
+}
+
+std::vector<NetIO::IOThreadStats> NetIO::GetIOThreadStats() const
+{
+	std::vector<IOThreadStats> Ret;
+	Ret.reserve(IOThreads.size());
+	for (auto& Thread : IOThreads)
+	{
+		Ret.push_back({
+			Thread->NumConnections.load(std::memory_order_relaxed),
+			Thread->NumReads.load(std::memory_order_relaxed),
+			Thread->NumWrites.load(std::memory_order_relaxed),
+			Thread->NumPacketsWritten.load(std::memory_order_relaxed),
+		});
+	}
+	return Ret;
 }
 
 NetIO::ConnectionHandle NetIO::Connect(u32 Address, int Port, void* Context)
@@ -181,44 +362,228 @@ NetIO::ConnectionHandle NetIO::Connect(u32 Address, int Port, void* Context)
 
 void NetIO::Disconnect(ConnectionHandle Handle)
 {
-	std::lock_guard<std::mutex> lock(ConnectionsMutex);
-	auto it = std::find_if(Connections.begin(), Connections.end(), [Conn = &GetConn(Handle)](auto& x) {
-		return x.get() == Conn;
-	});
-	if (it == Connections.end())
+	auto Conn = GetConnection(Handle);
+	// Disconnect can race between an I/O thread and the main thread; only the
+	// first caller gets to tear the connection down.
+	if (!Conn || Conn->Disconnecting.exchange(true))
 		return;
-	auto Conn = *it;
+
+	asio::error_code ec;
 	if (Conn->Socket.is_open())
-		Conn->Socket.shutdown(tcp::socket::shutdown_both);
-	Conn->Socket.close();
-	Callback(IOOperation::Disconnect, GetHandle(Conn), nullptr);
-	Connections.erase(it);
+		Conn->Socket.shutdown(tcp::socket::shutdown_both, ec);
+	Conn->Socket.close(ec);
+	IOThreads[Conn->IOThreadIndex]->NumConnections.fetch_sub(1, std::memory_order_relaxed);
+	// The slot is only released after the callback, so that it can still call GetContext.
+	Callback(IOOperation::Disconnect, Handle, nullptr);
+	RemoveConnection(Handle);
 }
 
-bool NetIO::Send(ConnectionHandle Handle, void* Packet, int Size)
+bool NetIO::Send(ConnectionHandle Handle, void* Packet, int Size, bool Droppable,
+	const PacketEncoder* Encoder, SendPriority Priority)
 {
-	auto Conn = GetConn(Handle).shared_from_this();
-	Conn->Strand.dispatch([this, Conn, Packet, Size] {
-		asio::async_write(Conn->Socket, asio::buffer(Packet, Size), Conn->Strand.wrap(
-		[this, Conn, Packet](std::error_code ec, size_t) {
-			if (!ec)
-			{
-				Callback(IOOperation::Write, GetHandle(Conn), nullptr);
-			}
-			free(Packet);
-		}));
+	auto Conn = GetConnection(Handle);
+	if (!Conn || Conn->Evicted.load(std::memory_order_relaxed))
+	{
+		free(Packet);
+		return false;
+	}
+
+	// The counts only go down concurrently, so the checks can only be too strict by
+	// whatever was written in the meantime.
+	auto OverLimit = [&](u32 MaxBytes, u32 MaxPackets) {
+		return (MaxBytes && Conn->QueuedBytes.load(std::memory_order_relaxed) + Size > MaxBytes) ||
+			(MaxPackets && Conn->QueuedPackets.load(std::memory_order_relaxed) + 1 > MaxPackets);
+	};
+
+	if (Droppable && OverLimit(Limits.DropBytes, Limits.DropPackets))
+	{
+		free(Packet);
+		NumDroppedPackets.fetch_add(1, std::memory_order_relaxed);
 		return true;
+	}
+
+	if (OverLimit(Limits.MaxBytes, Limits.MaxPackets))
+	{
+		free(Packet);
+		Evict(Conn, Size);
+		return false;
+	}
+
+	Conn->QueuedBytes.fetch_add(Size, std::memory_order_relaxed);
+	Conn->QueuedPackets.fetch_add(1, std::memory_order_relaxed);
+	auto NewTotal = QueuedBytes.fetch_add(Size, std::memory_order_relaxed) + Size;
+	auto Peak = PeakQueuedBytes.load(std::memory_order_relaxed);
+	while (NewTotal > Peak &&
+		!PeakQueuedBytes.compare_exchange_weak(Peak, NewTotal, std::memory_order_relaxed));
+
+	Conn->Strand.dispatch([this, Conn, Packet, Size, Priority,
+		Encoder = Encoder ? *Encoder : PacketEncoder{}] {
+		if (Encoder.Function)
+			Encoder.Function(Packet, Size, Encoder.Data);
+		Conn->SendQueues[size_t(Priority)].push_back({Packet, Size});
+		if (!Conn->Writing && !DeferSendUntilFlush)
+			WriteQueued(Conn);
 	});
+
+	if (DeferSendUntilFlush && !Conn->QueuedForFlush.exchange(true))
+	{
+		std::lock_guard<std::mutex> lock(FlushMutex);
+		FlushList.push_back(std::move(Conn));
+	}
+
+	return true;
+}
+
+void NetIO::WriteQueued(const std::shared_ptr<Connection>& Conn)
+{
+	// Called from within Conn->Strand.
+	auto& Queues = Conn->SendQueues;
+	if (std::all_of(std::begin(Queues), std::end(Queues), [](auto& Queue) { return Queue.empty(); }))
+	{
+		Conn->Writing = false;
+		return;
+	}
+
+	Conn->Writing = true;
+	Conn->WritePackets.clear();
+	for (auto Priority : {SendPriority::Realtime, SendPriority::Interactive})
+	{
+		auto& Queue = Queues[size_t(Priority)];
+		Conn->WritePackets.insert(Conn->WritePackets.end(), Queue.begin(), Queue.end());
+		Queue.clear();
+	}
+
+	auto& BulkQueue = Queues[size_t(SendPriority::Bulk)];
+	size_t NumBulk = 0;
+	int BulkBytes = 0;
+	while (NumBulk < BulkQueue.size() &&
+		(NumBulk == 0 || BulkBytes + BulkQueue[NumBulk].Size <= MaxBulkBytesPerWrite))
+	{
+		BulkBytes += BulkQueue[NumBulk].Size;
+		++NumBulk;
+	}
+	Conn->WritePackets.insert(Conn->WritePackets.end(), BulkQueue.begin(), BulkQueue.begin() + NumBulk);
+	BulkQueue.erase(BulkQueue.begin(), BulkQueue.begin() + NumBulk);
+
+	Conn->WriteBuffers.clear();
+	for (auto& Packet : Conn->WritePackets)
+		Conn->WriteBuffers.push_back(asio::buffer(Packet.Data, Packet.Size));
+
+	asio::async_write(Conn->Socket, Conn->WriteBuffers, Conn->Strand.wrap(
+	[this, Conn](std::error_code ec, size_t) {
+		auto& Thread = *IOThreads[Conn->IOThreadIndex];
+		Thread.NumWrites.fetch_add(1, std::memory_order_relaxed);
+		Thread.NumPacketsWritten.fetch_add(Conn->WritePackets.size(), std::memory_order_relaxed);
+
+		OnPacketsWritten(*Conn, Conn->WritePackets);
+		for (auto& Packet : Conn->WritePackets)
+			free(Packet.Data);
+		Conn->WritePackets.clear();
+
+		if (ec)
+		{
+			Conn->Writing = false;
+			return;
+		}
+
+		Callback(IOOperation::Write, GetHandle(Conn), nullptr);
+
+		// Everything that was queued in the meantime goes out in the next write.
+		WriteQueued(Conn);
+	}));
+}
+
+void NetIO::OnPacketsWritten(Connection& Conn, const std::vector<Connection::OutboundPacket>& Packets)
+{
+	u32 Bytes = 0;
+	for (auto& Packet : Packets)
+		Bytes += Packet.Size;
+
+	Conn.QueuedBytes.fetch_sub(Bytes, std::memory_order_relaxed);
+	Conn.QueuedPackets.fetch_sub(u32(Packets.size()), std::memory_order_relaxed);
+	QueuedBytes.fetch_sub(Bytes, std::memory_order_relaxed);
+}
+
+void NetIO::Evict(const std::shared_ptr<Connection>& Conn, int Size)
+{
+	if (Conn->Evicted.exchange(true))
+		return;
+
+	NumEvictions.fetch_add(1, std::memory_order_relaxed);
+
+	// Disconnecting tears down the connection's context through the callback, which
+	// the caller of Send may still be using, so it's done on the I/O thread instead.
+	SendQueueFullData Data{
+		Conn->QueuedBytes.load(std::memory_order_relaxed) + u32(Size),
+		Conn->QueuedPackets.load(std::memory_order_relaxed) + 1,
+	};
+	Conn->Strand.post([this, Conn, Data] {
+		const auto Handle = GetHandle(Conn);
+		Callback(IOOperation::SendQueueFull, Handle, &Data);
+		Disconnect(Handle);
+	});
+}
+
+void NetIO::SetSendLimits(const SendLimits& Value)
+{
+	Limits = Value;
+}
+
+NetIO::SendQueueStats NetIO::GetSendQueueStats() const
+{
+	return{
+		QueuedBytes.load(std::memory_order_relaxed),
+		PeakQueuedBytes.load(std::memory_order_relaxed),
+		NumDroppedPackets.load(std::memory_order_relaxed),
+		NumEvictions.load(std::memory_order_relaxed),
+	};
+}
+
+void NetIO::SetDeferSendUntilFlush(bool Value)
+{
+	DeferSendUntilFlush = Value;
+}
+
+void NetIO::Flush()
+{
+	std::vector<std::shared_ptr<Connection>> Conns;
+	{
+		std::lock_guard<std::mutex> lock(FlushMutex);
+		Conns.swap(FlushList);
+	}
+
+	for (auto& Conn : Conns)
+	{
+		Conn->QueuedForFlush = false;
+		Conn->Strand.dispatch([this, Conn] {
+			if (!Conn->Writing)
+				WriteQueued(Conn);
+		});
+	}
+}
+
+NetIO::Connection::~Connection()
+{
+	if (TotalQueuedBytes)
+		TotalQueuedBytes->fetch_sub(QueuedBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+	for (auto& Packet : WritePackets)
+		free(Packet.Data);
+	for (auto& Queue : SendQueues)
+		for (auto& Packet : Queue)
+			free(Packet.Data);
 }
 
 void* NetIO::GetContext(ConnectionHandle Handle)
 {
-	return GetConn(Handle).Context;
+	auto Conn = GetConnection(Handle);
+	return Conn ? Conn->Context : nullptr;
 }
 
 void NetIO::SetContext(ConnectionHandle Handle, void* Context)
 {
-	GetConn(Handle).Context = Context;
+	if (auto Conn = GetConnection(Handle))
+		Conn->Context = Context;
 }
 
 void NetIO::SetLogCallback(LogCallbackType){}
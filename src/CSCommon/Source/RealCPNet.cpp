@@ -269,7 +269,7 @@ bool MRealCPNet::CreateListenSocket(bool bReuse)
 		return(FALSE);
 	}
 
-	nRet = listen(m_sdListen, 16);
+	nRet = listen(m_sdListen, m_nListenBacklog > 0 ? m_nListenBacklog : SOMAXCONN);
 	if (SOCKET_ERROR == nRet) {
 		RCPLOG("RealCPNet> listen: %d\n", WSAGetLastError());
 		return(FALSE);
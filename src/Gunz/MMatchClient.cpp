@@ -6,6 +6,7 @@
 #include "MBlobArray.h"
 #include "MMatchUtil.h"
 #include "MMatchNotify.h"
+#include "MPeerSnapshot.h"
 
 MMatchClient* g_pMatchClient = NULL;
 MMatchClient* GetMainMatchClient() { return g_pMatchClient; }
@@ -274,6 +275,30 @@ bool MMatchClient::OnCommand(MCommand* pCommand)
 		if (pCmd->GetID() != MC_PEER_BASICINFO_RG)
 			DMLog("Received tunnelled P2P command ID %x\n", pCmd->GetID());
 	}
+	break;
+	case MC_MATCH_PEER_SNAPSHOT:
+	{
+		MCommandParameter* pParam = pCommand->GetParameter(0);
+		if (!pParam || pParam->GetType() != MPT_BLOB) break;
+		auto* Data = static_cast<const char*>(pParam->GetPointer());
+		auto Size = ((MCmdParamBlob*)pParam)->GetPayloadSize();
+
+		LockRecv();
+		MForEachPeerSnapshotEntry(Data, Size, [&](const MUID& Sender, const char* Blob, u16 BlobSize) {
+			MCommand* pCmd = MakeCmdFromSaneTunnelingBlob(Sender, m_This, Blob, BlobSize);
+			if (pCmd)
+				m_CommandManager.Post(pCmd);
+		});
+		UnlockRecv();
+	}
+	break;
+	case MC_MATCH_PEER_DELTA_SNAPSHOT:
+	{
+		MCommandParameter* pParam = pCommand->GetParameter(0);
+		if (!pParam || pParam->GetType() != MPT_BLOB) break;
+		OnPeerDeltaSnapshot(static_cast<const u8*>(pParam->GetPointer()),
+			((MCmdParamBlob*)pParam)->GetPayloadSize());
+	}
 	break;
 		case MC_MATCH_RESPONSE_LOGIN:
 			{
@@ -474,6 +499,8 @@ int MMatchClient::OnResponseMatchLogin(const MUID& uidServer, int nResult, const
 	strcpy_safe(m_szServerName, szServerName);
 	m_nServerMode = nServerMode;
 
+	m_PeerDeltaStream = {};
+
 	return MOK;
 }
 
@@ -775,11 +802,17 @@ bool MMatchClient::SendCommandToAgent(MCommand* pCommand)
 }
 
 void MMatchClient::SendCommandByUDP(MCommand* pCommand, const char* szIP, int nPort)
+{
+	SendCommandByUDP(pCommand, szIP, nPort, &m_PeerPacketCrypter);
+}
+
+void MMatchClient::SendCommandByUDP(MCommand* pCommand, const char* szIP, int nPort,
+	MPacketCrypter* pPacketCrypter)
 {
 	int nPacketSize = CalcPacketSize(pCommand);
 	char* pSendBuf = new char[nPacketSize];
 
-	int nSize = MakeCmdPacket(pSendBuf, nPacketSize, &m_PeerPacketCrypter, pCommand);
+	int nSize = MakeCmdPacket(pSendBuf, nPacketSize, pPacketCrypter, pCommand);
 
 	_ASSERT(nPacketSize > 0 && nPacketSize == nSize);
 
@@ -870,6 +903,15 @@ void MMatchClient::SendCommandByMatchServerTunneling(MCommand * pCommand, const
 		delete pCmd; pCmd = NULL; return;
 	}
 
+	// Commands that can be lost go over UDP once the server has shown that it relays
+	// them that way. The UDP packets are encrypted with the same key as the TCP ones.
+	if (m_bServerUDPRelay && MIsLossTolerantPeerCommand(pCommand->GetID()))
+	{
+		SendCommandByUDP(pCmd, GetServerIP(), GetServerPeerPort(), &m_ServerPacketCrypter);
+		delete pCmd;
+		return;
+	}
+
 	Post(pCmd);
 }
 
@@ -878,20 +920,96 @@ void MMatchClient::SendCommandByMatchServerTunneling(MCommand* pCommand)
 	SendCommandByMatchServerTunneling(pCommand, pCommand->GetReceiverUID());
 }
 
+void MMatchClient::OnPeerDeltaSnapshot(const u8* Data, size_t Size)
+{
+	MPeerDeltaSnapshotHeader Header;
+	if (!MReadPeerDeltaSnapshotHeader(Data, Size, Header) || Header.Seq == 0)
+		return;
+
+	auto& Stream = m_PeerDeltaStream;
+	if (!Stream.bStarted || MIsNewerPeerDeltaEpoch(Header.Epoch, Stream.Epoch))
+	{
+		Stream = {};
+		Stream.bStarted = true;
+		Stream.Epoch = Header.Epoch;
+	}
+	else if (Header.Epoch != Stream.Epoch || Header.Seq <= Stream.LastReadSeq)
+	{
+		// Late or duplicated. Newer positions have already been posted.
+		return;
+	}
+
+	LockRecv();
+	const auto Result = MReadPeerDeltaSnapshot(Data, Size,
+		[&](const MUID& Sender, u32 Seq) -> const MPeerQuantizedState* {
+			auto it = Stream.Peers.find(Sender);
+			if (it == Stream.Peers.end())
+				return nullptr;
+			auto& Received = it->second.History[Seq % it->second.History.size()];
+			return Received.Seq == Seq ? &Received.State : nullptr;
+		},
+		[&](const MUID& Sender, const MPeerQuantizedState& State) {
+			auto& Peer = Stream.Peers[Sender];
+			Peer.History[Header.Seq % Peer.History.size()] = { Header.Seq, State };
+
+			CharacterInfo Info;
+			float Time;
+			MDequantizePeerState(State, Header.Precision, Info, Time);
+			MCommand* pCmd = CreateCommand(MC_PEER_BASICINFO_RG, m_This);
+			pCmd->AddParameter(PackNewBasicInfo(Info, Peer.NetState, Time));
+			pCmd->m_Sender = Sender;
+			m_CommandManager.Post(pCmd);
+		});
+	UnlockRecv();
+
+	if (Result == MPeerDeltaReadResult::Malformed)
+		return;
+	Stream.LastReadSeq = Header.Seq;
+
+	// Only acknowledge snapshots that were read in full. Otherwise the server would
+	// use the skipped entries as baselines, which this client doesn't have. Without
+	// the ack, it keeps using older baselines, and eventually sends full states.
+	if (Result != MPeerDeltaReadResult::Complete)
+		return;
+
+	const auto Shift = Header.Seq - Stream.LatestSeq;
+	if (Stream.LatestSeq == 0 || Shift > 32)
+		Stream.ReceivedMask = 0;
+	else
+		Stream.ReceivedMask = ((u64(Stream.ReceivedMask) << Shift) | (u64(1) << (Shift - 1))) & 0xFFFFFFFF;
+	Stream.LatestSeq = Header.Seq;
+
+	MCommand* pAck = CreateCommand(MC_MATCH_PEER_SNAPSHOT_ACK, GetServerUID());
+	pAck->AddParameter(new MCmdParamUInt(Stream.Epoch));
+	pAck->AddParameter(new MCmdParamUInt(Stream.LatestSeq));
+	pAck->AddParameter(new MCmdParamUInt(Stream.ReceivedMask));
+	if (m_bServerUDPRelay)
+	{
+		SendCommandByUDP(pAck, GetServerIP(), GetServerPeerPort(), &m_ServerPacketCrypter);
+		delete pAck;
+		return;
+	}
+	Post(pAck);
+}
+
 bool MMatchClient::UDPSocketRecvEvent(u32 dwIP, WORD wRawPort, char* pPacket, u32 dwSize)
 {
 	if (GetMainMatchClient() == NULL) return false;
 	if (dwSize < sizeof(MPacketHeader)) return false;
 
+	auto* pClient = GetMainMatchClient();
+	unsigned int nPort = ntohs(wRawPort);
+
 	MPacketHeader*	pPacketHeader;
 	pPacketHeader = (MPacketHeader*)pPacket;
-	int nPacketSize = pPacketHeader->CalcPacketSize(&GetMainMatchClient()->m_PeerPacketCrypter);
+	auto* pCrypter = pClient->IsServerPeerAddress(dwIP, nPort) ?
+		&pClient->m_ServerPacketCrypter : &pClient->m_PeerPacketCrypter;
+	int nPacketSize = pPacketHeader->CalcPacketSize(pCrypter);
 
 	if ((dwSize != nPacketSize) ||
 		((pPacketHeader->nMsg != MSGID_COMMAND) && (pPacketHeader->nMsg != MSGID_RAWCOMMAND)) ) return false;
 
-	unsigned int nPort = ntohs(wRawPort);
-	GetMainMatchClient()->ParseUDPPacket(&pPacket[sizeof(MPacketHeader)], pPacketHeader, dwIP, nPort);
+	pClient->ParseUDPPacket(&pPacket[sizeof(MPacketHeader)], pPacketHeader, dwIP, nPort);
 	return true;
 }
 
@@ -1060,7 +1178,10 @@ void MMatchClient::ParseUDPPacket(char* pData, MPacketHeader* pPacketHeader, u32
 		break;
 	case MSGID_COMMAND:
 		{
-			int nPacketSize = pPacketHeader->CalcPacketSize(&m_PeerPacketCrypter);
+			// Relayed peer commands from the server are encrypted with the server's key.
+			const bool bFromServer = IsServerPeerAddress(dwIP, nPort);
+			auto* pCrypter = bFromServer ? &m_ServerPacketCrypter : &m_PeerPacketCrypter;
+			int nPacketSize = pPacketHeader->CalcPacketSize(pCrypter);
 			unsigned short nCheckSum = MBuildCheckSum(pPacketHeader, nPacketSize);
 
 			if (pPacketHeader->nCheckSum != nCheckSum) {
@@ -1075,7 +1196,7 @@ void MMatchClient::ParseUDPPacket(char* pData, MPacketHeader* pPacketHeader, u32
 
 				int nCmdSize = nPacketSize - sizeof(MPacketHeader);
 
-				if (!m_PeerPacketCrypter.Decrypt(pData, nCmdSize))
+				if (!pCrypter->Decrypt(pData, nCmdSize))
 				{
 					mlog("MMatchClient::ParseUDPPacket() -> Decrypt Error\n");
 
@@ -1097,13 +1218,29 @@ void MMatchClient::ParseUDPPacket(char* pData, MPacketHeader* pPacketHeader, u32
 					return;
 				}
 
-				MUID uidPeer = FindPeerUID(dwIP, nPort);
-				if (uidPeer != MUID(0,0))
+				if (bFromServer)
 				{
-					pCmd->m_Sender = uidPeer;
-				} else {
-					delete pCmd;
-					return;
+					if (pCmd->GetID() != MC_MATCH_P2P_COMMAND &&
+						pCmd->GetID() != MC_MATCH_PEER_SNAPSHOT &&
+						pCmd->GetID() != MC_MATCH_PEER_DELTA_SNAPSHOT)
+					{
+						delete pCmd;
+						return;
+					}
+
+					pCmd->m_Sender = GetServerUID();
+					m_bServerUDPRelay = true;
+				}
+				else
+				{
+					MUID uidPeer = FindPeerUID(dwIP, nPort);
+					if (uidPeer != MUID(0,0))
+					{
+						pCmd->m_Sender = uidPeer;
+					} else {
+						delete pCmd;
+						return;
+					}
 				}
 
 				pCmd->m_Receiver = m_This;
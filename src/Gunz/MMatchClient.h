@@ -1,7 +1,10 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <list>
 #include <map>
+#include <unordered_map>
 #include "MMatchGlobal.h"
 #include "MCommandCommunicator.h"
 #include "MClient.h"
@@ -11,6 +14,7 @@
 #include "MMatchGlobal.h"
 #include "MPacketCrypter.h"
 #include "MTCPSocket.h"
+#include "MPeerDeltaSnapshot.h"
 
 #define MATCHCLIENT_DEFAULT_UDP_PORT	10000
 #define MAX_PING						999
@@ -124,6 +128,7 @@ protected:
 
 	char				m_szServerName[64];
 	char				m_szServerIP[32];
+	u32					m_dwServerIP = 0;
 	int					m_nServerPort;
 	int					m_nServerPeerPort;
 	MMatchServerMode	m_nServerMode;
@@ -133,6 +138,9 @@ protected:
 	MSafeUDP			m_SafeUDP;
 	MMatchPeerInfoList	m_Peers;
 	bool				m_bBridgePeerFlag;
+	// Set when a relayed peer command arrives from the server over UDP, which means
+	// it has our bridged address, so ours can go over UDP too.
+	std::atomic<bool>	m_bServerUDPRelay{ false };
 	bool				m_bUDPTestProcess;
 	MPacketCrypter		m_AgentPacketCrypter;
 	MPacketCrypter		m_PeerPacketCrypter;
@@ -153,6 +161,33 @@ protected:
 
 	bool PeerToPeer = true;
 
+	// What has been received of the server's MC_MATCH_PEER_DELTA_SNAPSHOT stream.
+	struct PeerDeltaStream
+	{
+		struct ReceivedState
+		{
+			u32 Seq = 0;
+			MPeerQuantizedState State;
+		};
+		struct Peer
+		{
+			// Indexed by sequence number modulo the ring size.
+			std::array<ReceivedState, MPeerDeltaMaxBaselineAge + 1> History;
+			// Used to turn the states back into MC_PEER_BASICINFO_RG blobs.
+			BasicInfoNetState NetState;
+		};
+
+		bool bStarted = false;
+		u32 Epoch = 0;
+		// The newest snapshot read, acknowledged or not.
+		u32 LastReadSeq = 0;
+		// The newest snapshot acknowledged. Bit n of ReceivedMask is set if snapshot
+		// LatestSeq - 1 - n was acknowledged too.
+		u32 LatestSeq = 0;
+		u32 ReceivedMask = 0;
+		std::unordered_map<MUID, Peer> Peers;
+	} m_PeerDeltaStream;
+
 public:
 	MCommand* MakeCmdFromTunnelingBlob(const MUID& uidSender, void* pBlob, int nBlobArrayCount);
 	bool MakeTunnelingCommandBlob(MCommand* pWrappingCmd, MCommand* pSrcCmd);
@@ -205,8 +240,14 @@ protected:
 	void SendCommandByMatchServerTunneling(MCommand* pCommand, const MUID& Receiver);
 	void SendCommandByMatchServerTunneling(MCommand* pCommand);
 	void ParseUDPPacket(char* pData,MPacketHeader* pPacketHeader,u32 dwIP,unsigned int nPort);
+	void OnPeerDeltaSnapshot(const u8* Data, size_t Size);
+	bool IsServerPeerAddress(u32 dwIP, unsigned int nPort) const {
+		return dwIP == m_dwServerIP && int(nPort) == m_nServerPeerPort;
+	}
 public:
 	void SendCommandByUDP(MCommand* pCommand, const char* szIP, int nPort);
+	void SendCommandByUDP(MCommand* pCommand, const char* szIP, int nPort,
+		MPacketCrypter* pPacketCrypter);
 
 public:
 	MMatchClient();
@@ -219,7 +260,11 @@ public:
 	CreationResult Create(u16 nUDPPort);
 	
 	bool GetBridgePeerFlag()			{ return m_bBridgePeerFlag; }
-	void SetBridgePeerFlag(bool bFlag)	{ m_bBridgePeerFlag = bFlag; }
+	void SetBridgePeerFlag(bool bFlag)	{
+		m_bBridgePeerFlag = bFlag;
+		if (!bFlag)
+			m_bServerUDPRelay = false;
+	}
 	void AddPeer(MMatchPeerInfo* pPeerInfo);
 	bool DeletePeer(const MUID uid);
 	MUID FindPeerUID(const u32 dwIP, const int nPort);
@@ -244,6 +289,7 @@ public:
 
 	void SetServerAddr(const char* szIP, int nPort)	{ 
 		strcpy_safe(m_szServerIP, szIP); m_nServerPort = nPort;
+		m_dwServerIP = GetIPv4Number(m_szServerIP);
 	}
 	const char* GetServerIP() const { return m_szServerIP; }
 	int GetServerPort() const { return m_nServerPort; }
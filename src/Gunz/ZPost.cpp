@@ -29,5 +29,7 @@ void ZPostLogin(const char* szUserID, const unsigned char *HashedPassword,
 	ZPostCmd(MC_MATCH_LOGIN, MCmdParamStr(szUserID), MCmdParamBlob(HashedPassword, HashLength),
 		MCmdParamInt(MCOMMAND_VERSION), MCmdParamUInt(ChecksumPack),
 		MCmdParamUInt(RGUNZ_VERSION_MAJOR), MCmdParamUInt(RGUNZ_VERSION_MINOR),
-		MCmdParamUInt(RGUNZ_VERSION_PATCH), MCmdParamUInt(RGUNZ_VERSION_REVISION));
+		MCmdParamUInt(RGUNZ_VERSION_PATCH), MCmdParamUInt(RGUNZ_VERSION_REVISION),
+		MCmdParamUInt(MLOGIN_CAPABILITY_COMPRESSION | MLOGIN_CAPABILITY_UDP_RELAY |
+			MLOGIN_CAPABILITY_PEER_SNAPSHOT | MLOGIN_CAPABILITY_PEER_DELTA_SNAPSHOT));
 }
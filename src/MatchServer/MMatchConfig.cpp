@@ -33,6 +33,17 @@ MMatchConfig::MMatchConfig()
 	Version.Revision = RGUNZ_VERSION_REVISION;
 }
 
+static void SetPeerDeltaStep(const IniParser& ini, float& Dest, const char* Name)
+{
+	auto Value = ini.GetFloat("NETWORK", Name, Dest);
+	if (!(Value > 0))
+	{
+		MLog("Invalid value for config option [NETWORK] %s = %f, using %f\n", Name, Value, Dest);
+		return;
+	}
+	Dest = MRoundPeerDeltaStep(Value);
+}
+
 template <typename T>
 static bool SetEnum(const IniParser& ini, T& Dest, const char* Section, const char* Name,
 	T Max = T::Max)
@@ -117,6 +128,63 @@ bool MMatchConfig::Create()
 	if (!SetEnum(ini, DBType, "DB", "database_type"))
 		return false;
 
+	NetIOThreads = ini.GetInt("NETWORK", "io_threads", 0);
+	NetDeferSend = ini.GetInt<bool>("NETWORK", "defer_send", false);
+	NetListenBacklog = ini.GetInt("NETWORK", "listen_backlog", 0);
+	NetUDPRelay = ini.GetInt<bool>("NETWORK", "udp_relay", true);
+	NetInterestFiltering = ini.GetInt<bool>("NETWORK", "interest_filtering", false);
+	InterestSettings.NearRange = float(ini.GetInt("NETWORK", "interest_near_range",
+		int(InterestSettings.NearRange)));
+	InterestSettings.FarIntervalMS = ini.GetInt("NETWORK", "interest_far_interval_ms",
+		InterestSettings.FarIntervalMS);
+	InterestSettings.HiddenIntervalMS = ini.GetInt("NETWORK", "interest_hidden_interval_ms",
+		InterestSettings.HiddenIntervalMS);
+	NetVoiceForwarding = ini.GetInt<bool>("NETWORK", "voice_forwarding", false);
+	VoiceSettings.MaxSpeakers = ini.GetInt("NETWORK", "voice_max_speakers", VoiceSettings.MaxSpeakers);
+	VoiceSettings.SpeakerTimeoutMS = ini.GetInt("NETWORK", "voice_speaker_timeout_ms",
+		VoiceSettings.SpeakerTimeoutMS);
+	VoiceSettings.NearRange = float(ini.GetInt("NETWORK", "voice_near_range",
+		int(VoiceSettings.NearRange)));
+	VoiceSettings.BytesPerSecond = ini.GetInt("NETWORK", "voice_bytes_per_sec",
+		VoiceSettings.BytesPerSecond);
+	NetPeerSnapshots = ini.GetInt<bool>("NETWORK", "peer_snapshots", false);
+	PeerSnapshotIntervalMS = ini.GetInt("NETWORK", "peer_snapshot_interval_ms", PeerSnapshotIntervalMS);
+	SetPeerDeltaStep(ini, PeerDeltaPrecision.PosStep, "peer_delta_pos_step");
+	SetPeerDeltaStep(ini, PeerDeltaPrecision.VelStep, "peer_delta_vel_step");
+	NetSendLimits.DropBytes = ini.GetInt("NETWORK", "send_drop_bytes", NetSendLimits.DropBytes);
+	NetSendLimits.DropPackets = ini.GetInt("NETWORK", "send_drop_packets", NetSendLimits.DropPackets);
+	NetSendLimits.MaxBytes = ini.GetInt("NETWORK", "send_max_bytes", NetSendLimits.MaxBytes);
+	NetSendLimits.MaxPackets = ini.GetInt("NETWORK", "send_max_packets", NetSendLimits.MaxPackets);
+
+	LoginQueueLimits.MaxPerTick = ini.GetInt("LOGIN", "max_logins_per_tick", LoginQueueLimits.MaxPerTick);
+	LoginQueueLimits.TickBudgetMS = ini.GetInt("LOGIN", "login_tick_budget_ms", LoginQueueLimits.TickBudgetMS);
+	LoginQueueLimits.MaxPending = ini.GetInt("LOGIN", "max_pending_logins", LoginQueueLimits.MaxPending);
+
+	for (size_t i = 0; i < size_t(MPacketClass::Count); ++i)
+	{
+		auto& Bucket = PacketRateLimits.Buckets[i];
+		auto ClassName = MPacketRateLimits::GetClassName(MPacketClass(i));
+		char Name[64];
+		sprintf_safe(Name, "%s_rate", ClassName);
+		Bucket.Rate = ini.GetFloat("FLOOD", Name, Bucket.Rate);
+		sprintf_safe(Name, "%s_burst", ClassName);
+		Bucket.Burst = ini.GetFloat("FLOOD", Name, Bucket.Burst);
+		sprintf_safe(Name, "%s_action", ClassName);
+		if (auto Action = ini.GetString("FLOOD", Name))
+		{
+			if (iequals(*Action, "drop"))
+				Bucket.Action = MPacketLimitAction::Drop;
+			else if (iequals(*Action, "kick"))
+				Bucket.Action = MPacketLimitAction::Kick;
+			else
+			{
+				MLog("Invalid value for config option [FLOOD] %s = %.*s\n",
+					Name, Action->size(), Action->data());
+				return false;
+			}
+		}
+	}
+
 	strcpy_safe(m_NJ_szDBAgentIP, ini.GetString("LOCALE", "DBAgentIP",
 		SERVER_CONFIG_DEFAULT_NJ_DBAGENT_IP));
 	m_NJ_nDBAgentPort = ini.GetInt("LOCALE", "DBAgentPort", SERVER_CONFIG_DEFAULT_NJ_DBAGENT_PORT);
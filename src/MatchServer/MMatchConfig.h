@@ -7,6 +7,13 @@
 #include "MMatchMap.h"
 #include "MMatchGlobal.h"
 #include "IDatabase.h"
+#include "MPacketRateLimiter.h"
+#include "NetIO.h"
+#include "MMatchLoginQueue.h"
+#include "MMatchInterestManager.h"
+#include "MMatchVoiceForwarder.h"
+#include "Config.h"
+#include "MPeerDeltaSnapshot.h"
 
 class MMatchConfig
 {
@@ -53,6 +60,20 @@ private:
 	std::string GameDirectory = "";
 	bool bIsMasterServer = true;
 	DatabaseType DBType = DatabaseType::SQLite;
+	int NetIOThreads = 0;
+	bool NetDeferSend = false;
+	int NetListenBacklog = 0;
+	bool NetUDPRelay = true;
+	bool NetInterestFiltering = false;
+	bool NetPeerSnapshots = false;
+	u32 PeerSnapshotIntervalMS = BASICINFO_INTERVAL;
+	MPeerDeltaPrecision PeerDeltaPrecision;
+	MMatchInterestManager::Settings InterestSettings;
+	bool NetVoiceForwarding = false;
+	MMatchVoiceForwarder::Settings VoiceSettings;
+	NetIO::SendLimits NetSendLimits;
+	MPacketRateLimits PacketRateLimits;
+	MMatchLoginQueue::Limits LoginQueueLimits;
 
 	bool				m_bIsComplete;
 
@@ -112,6 +133,20 @@ public:
 	bool IsMasterServer() const { return bIsMasterServer; }
 	auto GetPort() const { return 6000; }
 	auto GetDatabaseType() const { return DBType; }
+	int GetNetIOThreads() const { return NetIOThreads; }
+	bool GetNetDeferSend() const { return NetDeferSend; }
+	int GetNetListenBacklog() const { return NetListenBacklog; }
+	bool GetNetUDPRelay() const { return NetUDPRelay; }
+	bool GetNetInterestFiltering() const { return NetInterestFiltering; }
+	const auto& GetInterestSettings() const { return InterestSettings; }
+	bool GetNetVoiceForwarding() const { return NetVoiceForwarding; }
+	const auto& GetVoiceSettings() const { return VoiceSettings; }
+	bool GetNetPeerSnapshots() const { return NetPeerSnapshots; }
+	u32 GetPeerSnapshotIntervalMS() const { return PeerSnapshotIntervalMS; }
+	const auto& GetPeerDeltaPrecision() const { return PeerDeltaPrecision; }
+	const auto& GetLoginQueueLimits() const { return LoginQueueLimits; }
+	const auto& GetNetSendLimits() const { return NetSendLimits; }
+	const auto& GetPacketRateLimits() const { return PacketRateLimits; }
 
 	struct VersionType {
 		u32 Major, Minor, Patch, Revision;
@@ -0,0 +1,61 @@
+#include "stdafx.h"
+#include "MMatchInterestManager.h"
+#include "MMatchObject.h"
+#include "RBspObject.h"
+
+// Roughly eye level, so that low cover doesn't count as hiding a player.
+static constexpr float EyeHeight = 150.f;
+
+bool MMatchInterestManager::ShouldRelay(const MMatchObject& Sender, const MMatchObject& Receiver,
+	RealSpace2::RBspObject* Map, bool bTeamPlay, u64 Time)
+{
+	using namespace RealSpace2;
+
+	if (!bEnabled)
+		return true;
+
+	// Dead players may be spectating anyone, and without positions there's nothing
+	// to go by.
+	if (!Receiver.IsAlive() ||
+		Sender.BasicInfoHistory.empty() || Receiver.BasicInfoHistory.empty())
+		return true;
+
+	if (bTeamPlay && Sender.GetTeam() == Receiver.GetTeam())
+		return true;
+
+	const auto& From = Receiver.BasicInfoHistory.front().position;
+	const auto& To = Sender.BasicInfoHistory.front().position;
+	const auto Diff = To - From;
+	if (MagnitudeSq(Diff) < CurSettings.NearRange * CurSettings.NearRange)
+		return true;
+
+	auto& State = Pairs[PairKey{ Sender.GetUID(), Receiver.GetUID() }];
+
+	if (Map && Time - State.VisibilityCheckTime >= CurSettings.VisibilityCacheMS)
+	{
+		constexpr u32 PassFlag = RM_FLAG_ADDITIVE | RM_FLAG_HIDE | RM_FLAG_PASSROCKET |
+			RM_FLAG_PASSBULLET;
+		const v3 Eye{ 0, 0, EyeHeight };
+		RBSPPICKINFO bpi;
+		State.bVisible = !Map->PickTo(From + Eye, To + Eye, &bpi, PassFlag);
+		State.VisibilityCheckTime = Time;
+	}
+
+	const auto Interval = State.bVisible ? CurSettings.FarIntervalMS : CurSettings.HiddenIntervalMS;
+	if (State.LastRelayTime != 0 && Time - State.LastRelayTime < Interval)
+		return false;
+
+	State.LastRelayTime = Time;
+	return true;
+}
+
+void MMatchInterestManager::RemovePlayer(const MUID& uid)
+{
+	for (auto it = Pairs.begin(); it != Pairs.end();)
+	{
+		if (it->first.Sender == uid || it->first.Receiver == uid)
+			it = Pairs.erase(it);
+		else
+			++it;
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "GlobalTypes.h"
+#include "MUID.h"
+
+class MMatchObject;
+namespace RealSpace2
+{
+class RBspObject;
+}
+
+// Decides which players of a stage get a player's position updates, so that the
+// server doesn't relay every update to everyone in a big stage.
+//
+// Updates for players that are far away, and more so for players that are hidden
+// behind the map, are relayed at a lower rate instead of every time. They're never
+// dropped entirely, since the client needs them to keep the other player in the
+// right place. Positions come from each player's BasicInfoHistory, which is only
+// filled in with server-based netcode, so with other netcodes everything is
+// relayed.
+class MMatchInterestManager
+{
+public:
+	struct Settings
+	{
+		// Players closer than this always get every update.
+		float NearRange = 3000.f;
+		// Minimum time between updates relayed to a player that's further away, if
+		// they can see the sender.
+		u32 FarIntervalMS = 200;
+		// The same, if the map is between them.
+		u32 HiddenIntervalMS = 500;
+		// How long the result of a line of sight check is used for.
+		u32 VisibilityCacheMS = 250;
+	};
+
+	struct Stats
+	{
+		// Position updates considered for a receiver, and how many were relayed.
+		u64 Considered = 0;
+		u64 Relayed = 0;
+	};
+
+	void SetEnabled(bool bEnable) { bEnabled = bEnable; }
+	bool IsEnabled() const { return bEnabled; }
+	void SetSettings(const Settings& NewSettings) { CurSettings = NewSettings; }
+	auto& GetSettings() const { return CurSettings; }
+
+	// Returns whether a position update from Sender should be relayed to Receiver
+	// now. Map may be null, in which case only distance is used.
+	bool ShouldRelay(const MMatchObject& Sender, const MMatchObject& Receiver,
+		RealSpace2::RBspObject* Map, bool bTeamPlay, u64 Time);
+
+	void RemovePlayer(const MUID& uid);
+	void Clear() { Pairs.clear(); }
+
+private:
+	struct PairKey
+	{
+		MUID Sender;
+		MUID Receiver;
+		bool operator==(const PairKey& rhs) const {
+			return Sender == rhs.Sender && Receiver == rhs.Receiver; }
+	};
+
+	struct PairKeyHash
+	{
+		size_t operator()(const PairKey& Key) const {
+			return std::hash<MUID>{}(Key.Sender) * 31 + std::hash<MUID>{}(Key.Receiver); }
+	};
+
+	struct PairState
+	{
+		u64 LastRelayTime = 0;
+		u64 VisibilityCheckTime = 0;
+		bool bVisible = true;
+	};
+
+	bool bEnabled = false;
+	Settings CurSettings;
+	std::unordered_map<PairKey, PairState, PairKeyHash> Pairs;
+};
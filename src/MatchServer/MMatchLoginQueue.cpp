@@ -0,0 +1,67 @@
+#include "stdafx.h"
+#include "MMatchLoginQueue.h"
+#include "MTime.h"
+#include <algorithm>
+
+bool MMatchLoginQueue::Push(MMatchLoginRequest&& Request)
+{
+	if (int(Queue.size()) >= CurLimits.MaxPending)
+	{
+		++CurStats.Rejected;
+		return false;
+	}
+
+	Request.QueuedTime = GetTime();
+	QueuedUIDs.insert(Request.CommUID);
+	Queue.push_back(std::move(Request));
+
+	CurStats.Pending = Queue.size();
+	CurStats.PeakPending = (std::max)(CurStats.PeakPending, CurStats.Pending);
+	return true;
+}
+
+void MMatchLoginQueue::Remove(const MUID& CommUID)
+{
+	if (QueuedUIDs.erase(CommUID) == 0)
+		return;
+
+	Queue.erase(std::remove_if(Queue.begin(), Queue.end(),
+		[&](const MMatchLoginRequest& Request) { return Request.CommUID == CommUID; }), Queue.end());
+	CurStats.Pending = Queue.size();
+}
+
+int MMatchLoginQueue::GetRetryDelayMS() const
+{
+	// Assume ticks keep taking as long, and processing as many logins, as they have
+	// recently.
+	const auto TickMS = (std::max)(AverageTickMS, 1.f);
+	const auto BatchSize = AverageBatchSize > 0 ? AverageBatchSize : float((std::max)(CurLimits.MaxPerTick, 1));
+	const auto NumTicks = float(Queue.size() + 1) / BatchSize;
+	const auto DelayMS = int(NumTicks * TickMS);
+	return (std::min)((std::max)(DelayMS, 1000), 60 * 1000);
+}
+
+void MMatchLoginQueue::OnTick(u64 Time)
+{
+	if (LastTickTime != 0)
+	{
+		const auto TickMS = float(Time - LastTickTime);
+		AverageTickMS = AverageTickMS == 0 ? TickMS : AverageTickMS * 0.9f + TickMS * 0.1f;
+	}
+	LastTickTime = Time;
+}
+
+void MMatchLoginQueue::OnBatchProcessed(int NumProcessed, bool Exhausted)
+{
+	// A batch that emptied the queue says nothing about how many logins fit in a tick.
+	if (Exhausted && float(NumProcessed) < AverageBatchSize)
+		return;
+
+	AverageBatchSize = AverageBatchSize == 0 ? float(NumProcessed) :
+		AverageBatchSize * 0.9f + float(NumProcessed) * 0.1f;
+}
+
+u64 MMatchLoginQueue::GetTime()
+{
+	return GetGlobalTimeMS();
+}
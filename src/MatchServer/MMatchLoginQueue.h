@@ -0,0 +1,110 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "GlobalTypes.h"
+#include "MUID.h"
+
+struct MMatchLoginRequest
+{
+	MUID CommUID;
+	std::string UserID;
+	std::vector<unsigned char> HashedPassword;
+	int CommandVersion;
+	u32 ChecksumPack;
+	u32 Major, Minor, Patch, Revision;
+	u64 QueuedTime;
+};
+
+// Paces login processing on the main thread. Each login does a DB lookup and a
+// password hash verification synchronously, so when a lot of clients connect at
+// once (e.g. after a restart) they're queued and only a limited number are handled
+// per tick. When the queue is full, logins are rejected with a retry delay instead.
+class MMatchLoginQueue
+{
+public:
+	struct Limits
+	{
+		// Logins processed per tick at most. At least one is processed per tick
+		// regardless of the time budget.
+		int MaxPerTick = 32;
+		int TickBudgetMS = 20;
+		int MaxPending = 1024;
+	};
+
+	struct Stats
+	{
+		u64 Processed;
+		u64 Rejected;
+		size_t Pending;
+		size_t PeakPending;
+		u64 MaxWaitMS;
+	};
+
+	void SetLimits(const Limits& NewLimits) { CurLimits = NewLimits; }
+
+	// Returns false if the queue is full.
+	bool Push(MMatchLoginRequest&& Request);
+	bool IsQueued(const MUID& CommUID) const { return QueuedUIDs.find(CommUID) != QueuedUIDs.end(); }
+	// Drops the login queued by a connection that has closed, if any.
+	void Remove(const MUID& CommUID);
+
+	// Calls Fn(const MMatchLoginRequest&) on queued logins, oldest first, until the
+	// tick's count or time budget runs out.
+	template <typename FnType>
+	void Process(FnType&& Fn);
+
+	// Roughly how long until a login queued now would be processed.
+	int GetRetryDelayMS() const;
+
+	auto& GetStats() const { return CurStats; }
+	void ResetPeakStats() { CurStats.PeakPending = CurStats.Pending; CurStats.MaxWaitMS = 0; }
+
+private:
+	void OnTick(u64 Time);
+	void OnBatchProcessed(int NumProcessed, bool Exhausted);
+	static u64 GetTime();
+
+	Limits CurLimits;
+	Stats CurStats{};
+	std::deque<MMatchLoginRequest> Queue;
+	std::unordered_set<MUID> QueuedUIDs;
+	u64 LastTickTime = 0;
+	float AverageTickMS = 0;
+	// Logins per tick while there was a backlog.
+	float AverageBatchSize = 0;
+};
+
+template <typename FnType>
+void MMatchLoginQueue::Process(FnType&& Fn)
+{
+	const auto Time = GetTime();
+	OnTick(Time);
+
+	int NumProcessed = 0;
+	while (!Queue.empty() && NumProcessed < CurLimits.MaxPerTick)
+	{
+		if (NumProcessed > 0 && GetTime() - Time >= u64(CurLimits.TickBudgetMS))
+			break;
+
+		auto Request = std::move(Queue.front());
+		Queue.pop_front();
+		QueuedUIDs.erase(Request.CommUID);
+		CurStats.Pending = Queue.size();
+
+		const auto WaitMS = Time - Request.QueuedTime;
+		if (WaitMS > CurStats.MaxWaitMS)
+			CurStats.MaxWaitMS = WaitMS;
+
+		Fn(static_cast<const MMatchLoginRequest&>(Request));
+
+		++NumProcessed;
+		++CurStats.Processed;
+	}
+
+	if (NumProcessed > 0)
+		OnBatchProcessed(NumProcessed, Queue.empty());
+}
@@ -14,6 +14,7 @@
 #include "MMatchFormula.h"
 #include "MMatchConfig.h"
 #include "MCommandCommunicator.h"
+#include "MCommandWriter.h"
 #include "MMatchShop.h"
 #include "MDebug.h"
 #include "MMatchAuth.h"
@@ -493,6 +494,13 @@ bool MMatchServer::Create(int nPort)
 
 	m_Admin.Create(this);
 
+	Net.SetNumIOThreads(MGetServerConfig()->GetNetIOThreads());
+	Net.SetDeferSendUntilFlush(MGetServerConfig()->GetNetDeferSend());
+	Net.SetSendLimits(MGetServerConfig()->GetNetSendLimits());
+	SetPacketRateLimits(MGetServerConfig()->GetPacketRateLimits());
+	Net.SetListenBacklog(MGetServerConfig()->GetNetListenBacklog());
+	m_LoginQueue.SetLimits(MGetServerConfig()->GetLoginQueueLimits());
+	m_UDPRelay.SetEnabled(MGetServerConfig()->GetNetUDPRelay());
 	if (MServer::Create(nPort) == false) return false;
 
 	GetDBMgr()->UpdateServerInfo(MGetServerConfig()->GetServerID(), MGetServerConfig()->GetMaxUser(),
@@ -605,6 +613,8 @@ void MMatchServer::OnRun(void)
 
 	MPremiumIPCache()->Update();
 
+	ProcessLoginQueue();
+
 	MGetServerStatusSingleton()->SetRunStatus(101);
 
 	// Update Objects
@@ -710,14 +720,14 @@ void MMatchServer::OnRun(void)
 				}
 
 				Command->AddParameter(Param);
+				Command->m_bDroppable = true;
 
 				RouteToBattle(Stage->GetUID(), Command);
 			}
 		}
 
 		// Ping all in-game clients
-		MCommand* pNew = CreateCommand(MC_NET_PING, MUID(0, 0));
-		pNew->AddParameter(new MCmdParamUInt(static_cast<u32>(GetGlobalClockCount())));
+		MCommand* pNew = CreateCommand<MC_NET_PING>(MUID(0, 0), static_cast<u32>(GetGlobalClockCount()));
 		RouteToAllClientIf(pNew, [](MMatchObject& Obj) {
 			return Obj.GetPlace() == MMP_BATTLE; });
 		LastPingTime = nGlobalClock;
@@ -731,8 +741,7 @@ void MMatchServer::OnRun(void)
 
 		LOG(LOG_ALL, "ClientCount=%d, SessionCount=%d, AgentCount=%d",
 			GetClientCount(), GetCommObjCount(), GetAgentCount());
-		MCommand* pNew = CreateCommand(MC_NET_PING, MUID(0, 0));
-		pNew->AddParameter(new MCmdParamUInt(static_cast<u32>(GetGlobalClockCount())));
+		MCommand* pNew = CreateCommand<MC_NET_PING>(MUID(0, 0), static_cast<u32>(GetGlobalClockCount()));
 		RouteToAllConnection(pNew);
 	}
 
@@ -891,13 +900,32 @@ void MMatchServer::OnVoiceChat(const MUID & Player, unsigned char* EncodedFrame,
 	if (!Obj)
 		return;
 
-	auto Stage = Obj->GetStageUID();
+	auto Stage = FindStage(Obj->GetStageUID());
+	if (!Stage)
+		return;
+
+	std::vector<MUID> Receivers;
+	if (Stage->VoiceForwarder.IsEnabled())
+	{
+		const bool bTeamPlay = Stage->GetStageSetting()->IsTeamPlay();
+		const auto Time = GetGlobalClockCount();
+		Receivers = GetBattleReceivers(Stage, Player, [&](MMatchObject& ReceiverObj) {
+			return Stage->VoiceForwarder.ShouldForward(*Obj, ReceiverObj, size_t(Length),
+				bTeamPlay, Time, m_VoiceStats);
+		});
+	}
+	else
+		Receivers = GetBattleReceivers(Stage, Player);
+
+	if (Receivers.empty())
+		return;
 
+	// Posted once for all receivers, so the frame is only serialized once.
 	auto Command = CreateCommand(MC_MATCH_RECEIVE_VOICE_CHAT, MUID(0, 0));
 	Command->AddParameter(new MCommandParameterUID(Player));
 	Command->AddParameter(new MCommandParameterBlob(EncodedFrame, Length));
 
-	RouteToBattleExcept(Stage, Command, Player);
+	RouteToReceivers(Command, std::move(Receivers));
 }
 
 void MMatchServer::OnRequestCreateBot(const MUID& OwnerUID)
@@ -1052,6 +1080,18 @@ static int GetBlobCmdID(const char* Data)
 	return *(u16*)(Data + 2);
 }
 
+// MC_PEER_BASICINFO_RG only carries the animations and the selected weapon when they
+// change, so an update that does can't be thinned out or superseded like the rest.
+static bool CarriesStateChange(int CommandID, const char* Blob, size_t BlobSize)
+{
+	constexpr size_t FlagsOffset = 2 + 2 + 1 + 4;
+	if (CommandID != MC_PEER_BASICINFO_RG || BlobSize <= FlagsOffset)
+		return false;
+
+	const auto Flags = u8(Blob[FlagsOffset]);
+	return (Flags & (BasicInfoFlags::Animations | BasicInfoFlags::SelItem)) != 0;
+}
+
 void MMatchServer::OnTunnelledP2PCommand(const MUID & Sender, const MUID & Receiver, const char * Blob, size_t BlobSize)
 {
 	auto SenderObj = GetObject(Sender);
@@ -1174,19 +1214,154 @@ void MMatchServer::OnTunnelledP2PCommand(const MUID & Sender, const MUID & Recei
 		};
 	}
 
-	MCommand* pCmd = CreateCommand(MC_MATCH_P2P_COMMAND, MUID(0, 0));
-	pCmd->AddParameter(new MCmdParamUID(Sender));
-	pCmd->AddParameter(new MCmdParamBlob(Blob, BlobSize));
+	MCommand* pCmd = CreateCommand<MC_MATCH_P2P_COMMAND>(MUID(0, 0),
+		Sender, MCommandBlob{ Blob, u32(BlobSize) });
+	if (!pCmd)
+		return;
+	const bool bStateChange = CarriesStateChange(CommandID, Blob, BlobSize);
+	const bool bPositionUpdate = (CommandID == MC_PEER_BASICINFO || CommandID == MC_PEER_BASICINFO_RG) &&
+		!bStateChange;
+	// Position updates are superseded by the next one.
+	pCmd->m_bDroppable = bPositionUpdate;
+	// A lost state change wouldn't be repeated by the next update.
+	const bool bUnreliable = MIsLossTolerantPeerCommand(CommandID) && !bStateChange;
 	if (Receiver == MUID{ 0, 0 })
-		RouteToBattleExcept(uidStage, pCmd, Sender);
+	{
+		std::vector<MUID> Receivers;
+		if (bPositionUpdate && Stage->InterestMgr.IsEnabled())
+		{
+			const bool bTeamPlay = Stage->GetStageSetting()->IsTeamPlay();
+			const auto Time = GetGlobalClockCount();
+			auto Filter = [&](MMatchObject& ReceiverObj) {
+				++m_InterestStats.Considered;
+				if (!Stage->InterestMgr.ShouldRelay(*SenderObj, ReceiverObj,
+					Stage->BspObject, bTeamPlay, Time))
+					return false;
+				++m_InterestStats.Relayed;
+				return true;
+			};
+			Receivers = GetBattleReceivers(Stage, Sender, Filter);
+		}
+		else
+			Receivers = GetBattleReceivers(Stage, Sender);
+
+		if (Stage->SnapshotAggregator.IsEnabled())
+			QueuePeerSnapshot(*Stage, Sender, CommandID, Blob, BlobSize, bPositionUpdate, Receivers);
+
+		if (bUnreliable)
+			RouteToReceiversUnreliable(pCmd, std::move(Receivers));
+		else
+			RouteToReceivers(pCmd, std::move(Receivers));
+	}
 	else
 	{
 		auto* ReceiverObj = GetObject(Receiver);
-		if (ReceiverObj)
+		if (!ReceiverObj)
+			delete pCmd;
+		else if (bUnreliable)
+			RouteToReceiversUnreliable(pCmd, std::vector<MUID>(ReceiverObj->m_CommListener.begin(),
+				ReceiverObj->m_CommListener.end()));
+		else
 			RouteToListener(ReceiverObj, pCmd);
 	}
 }
 
+void MMatchServer::QueuePeerSnapshot(MMatchStage& Stage, const MUID& Sender, int CommandID,
+	const char* Blob, size_t BlobSize, bool bPositionUpdate, std::vector<MUID>& Receivers)
+{
+	auto& Snapshots = Stage.SnapshotAggregator;
+
+	// Moves the receivers whose connection passes Pred to the end of Receivers.
+	auto Partition = [&](auto&& Pred) {
+		return std::partition(Receivers.begin(), Receivers.end(), [&](const MUID& uid) {
+			bool bAllowed = false;
+			m_CommRefCache.Read(uid, [&](MCommObject& CommObj) {
+				bAllowed = Pred(CommObj);
+			});
+			return !bAllowed;
+		});
+	};
+
+	if (CommandID == MC_PEER_BASICINFO_RG)
+	{
+		constexpr size_t HeaderSize = 2 + 2 + 1 + 4;
+		NewBasicInfo nbi;
+		if (BlobSize > HeaderSize && UnpackNewBasicInfo(nbi,
+			reinterpret_cast<const u8*>(Blob + HeaderSize), BlobSize - HeaderSize))
+		{
+			if (bPositionUpdate)
+			{
+				auto it = Partition([](MCommObject& CommObj) { return CommObj.IsPeerDeltaSnapshotAllowed(); });
+				std::vector<MUID> DeltaReceivers(it, Receivers.end());
+				Receivers.erase(it, Receivers.end());
+				Snapshots.AddBasicInfo(Sender, nbi, DeltaReceivers);
+				m_SnapshotStats.DeltaEntries += DeltaReceivers.size();
+			}
+			else
+			{
+				// Updates that change the animations or the slot are routed right away
+				// to everyone, but the aggregator still needs to see them.
+				Snapshots.AddBasicInfo(Sender, nbi, {});
+			}
+		}
+	}
+
+	if (!bPositionUpdate)
+	{
+		if (CommandID == MC_PEER_BASICINFO_RG)
+			// This one goes out right away and carries the position as well, so a
+			// queued one is out of date, and would undo the change if sent after it.
+			Snapshots.Discard(Sender);
+		return;
+	}
+
+	auto it = Partition([](MCommObject& CommObj) { return CommObj.IsPeerSnapshotAllowed(); });
+	if (it == Receivers.end())
+		return;
+
+	std::vector<MUID> SnapshotReceivers(it, Receivers.end());
+	if (!Snapshots.Add(Sender, Blob, BlobSize, SnapshotReceivers))
+		return;
+
+	m_SnapshotStats.Entries += SnapshotReceivers.size();
+	Receivers.erase(it, Receivers.end());
+}
+
+void MMatchServer::FlushPeerSnapshots(MMatchStage& Stage, u64 Time)
+{
+	Stage.SnapshotAggregator.Flush(Time, [&](const MUID& Receiver, const char* Data, size_t Size, bool bDelta) {
+		MCommand* pCmd;
+		if (bDelta)
+		{
+			pCmd = CreateCommand<MC_MATCH_PEER_DELTA_SNAPSHOT>(Receiver, MCommandBlob{ Data, u32(Size) });
+			++m_SnapshotStats.DeltaSnapshots;
+			m_SnapshotStats.DeltaBytes += Size;
+		}
+		else
+		{
+			pCmd = CreateCommand<MC_MATCH_PEER_SNAPSHOT>(Receiver, MCommandBlob{ Data, u32(Size) });
+			++m_SnapshotStats.Snapshots;
+			m_SnapshotStats.Bytes += Size;
+		}
+		if (!pCmd)
+			return;
+		pCmd->m_bDroppable = true;
+		RouteToReceiversUnreliable(pCmd, { Receiver });
+	});
+}
+
+void MMatchServer::OnPeerSnapshotAck(const MUID& CommUID, u32 Epoch, u32 Latest, u32 Mask)
+{
+	auto* Obj = GetObject(CommUID);
+	if (!Obj)
+		return;
+	auto* Stage = FindStage(Obj->GetStageUID());
+	if (!Stage)
+		return;
+
+	Stage->SnapshotAggregator.OnAck(CommUID, Epoch, Latest, Mask);
+}
+
 void MMatchServer::OnPeerShot(MMatchObject& SenderObj, MMatchStage& Stage, const ZPACKEDSHOTINFO& psi)
 {
 	if (!SenderObj.IsAlive())
@@ -1331,88 +1506,109 @@ void MMatchServer::OnPeerShot(MMatchObject& SenderObj, MMatchStage& Stage, const
 	}
 }
 
-struct stRouteListenerNode
-{
-	uintptr_t			nUserContext;
-	MPacketCrypterKey	CryptKey;
-};
-
 void MMatchServer::RouteToAllConnection(MCommand* pCommand)
 {
-	queue<stRouteListenerNode*>	ListenerList;
+	std::vector<SendTarget> Targets;
 
-	// Queueing for SafeSend
-	LockCommList();
-	for (auto i = m_CommRefCache.begin(); i != m_CommRefCache.end(); i++) {
-		MCommObject* pCommObj = i->second;
-		if (pCommObj->GetUID() < MUID(0, 3)) continue;
+	m_CommRefCache.ForEach([&](MCommObject& CommObj) {
+		if (CommObj.GetUID() < MUID(0, 3)) return;
 
-		stRouteListenerNode* pNewNode = new stRouteListenerNode;
-		pNewNode->nUserContext = pCommObj->GetUserContext();
-		memcpy(&pNewNode->CryptKey, pCommObj->GetCrypter()->GetKey(), sizeof(MPacketCrypterKey));
-		ListenerList.push(pNewNode);
-	}
-	UnlockCommList();
+		Targets.emplace_back();
+		Targets.back().nClientKey = CommObj.GetUserContext();
+		memcpy(&Targets.back().CrypterKey, CommObj.GetCrypter()->GetKey(), sizeof(MPacketCrypterKey));
+		Targets.back().bCompression = CommObj.IsCompressionAllowed();
+	});
 
-	// Send the queue (each all session)
 	int nCmdSize = pCommand->GetSize();
+	if (nCmdSize > 0 && nCmdSize < MAX_PACKET_SIZE && !Targets.empty())
+	{
+		char CmdData[MAX_PACKET_SIZE];
+		int nSize = pCommand->GetData(CmdData, nCmdSize);
+		SendCommandData(pCommand, CmdData, nSize, Targets.data(), int(Targets.size()));
+	}
+
+	delete pCommand;
+}
+
+static void AddListeners(std::vector<MUID>& Receivers, MObject* pObj)
+{
+	for (auto& uid : pObj->m_CommListener)
+		Receivers.push_back(uid);
+}
 
-	if (nCmdSize <= 0)
+void MMatchServer::RouteToReceivers(MCommand* pCommand, std::vector<MUID>&& Receivers)
+{
+	if (Receivers.empty())
 	{
-		while (!ListenerList.empty())
-		{
-			stRouteListenerNode* pNode = ListenerList.front();
-			ListenerList.pop();
-			delete pNode;
-		}
+		delete pCommand;
 		return;
 	}
 
-	char* pCmdData = new char[nCmdSize];
-	int nSize = pCommand->GetData(pCmdData, nCmdSize);
-	_ASSERT(nSize < MAX_PACKET_SIZE && nSize == nCmdSize);
+	pCommand->m_Receiver = Receivers.front();
+	if (Receivers.size() > 1)
+		pCommand->m_Receivers = std::move(Receivers);
+	Post(pCommand);
+}
 
+void MMatchServer::RouteToReceiversUnreliable(MCommand* pCommand, std::vector<MUID>&& Receivers)
+{
+	// Keeps the datagrams under a 1500 byte MTU with room for the IP and UDP headers.
+	constexpr int MaxUDPPacketSize = 1400;
 
-	if (pCommand->m_pCommandDesc->IsFlag(MCCT_NON_ENCRYPTED))
+	const int nCmdSize = pCommand->GetSize();
+	const int nPacketSize = int(sizeof(MPacketHeader)) + nCmdSize;
+	if (!m_UDPRelay.IsEnabled() || nCmdSize <= 0 || nPacketSize > MaxUDPPacketSize)
 	{
-		while (!ListenerList.empty())
-		{
-			stRouteListenerNode* pNode = ListenerList.front();
-			ListenerList.pop();
-
-			SendMsgCommand(pNode->nUserContext, pCmdData, nSize, MSGID_RAWCOMMAND, NULL);
+		RouteToReceivers(pCommand, std::move(Receivers));
+		return;
+	}
 
-			delete pNode;
-		}
+	char CmdData[MaxUDPPacketSize];
+	if (pCommand->GetData(CmdData, nCmdSize) != nCmdSize)
+	{
+		RouteToReceivers(pCommand, std::move(Receivers));
+		return;
 	}
-	else
+
+	auto& Stats = m_UDPRelay.GetStats();
+	std::vector<MUID> TCPReceivers;
+	for (auto& uid : Receivers)
 	{
-		while (!ListenerList.empty())
+		MMatchUDPRelay::Target Target;
+		auto* pCommObj = m_CommRefCache.GetRef(uid);
+		if (pCommObj && m_UDPRelay.GetTarget(uid, Target))
 		{
-			stRouteListenerNode* pNode = ListenerList.front();
-			ListenerList.pop();
-
-			SendMsgCommand(pNode->nUserContext, pCmdData, nSize, MSGID_COMMAND, &pNode->CryptKey);
-
-			delete pNode;
+			auto* pPacket = new char[nPacketSize];
+			MMatchUDPRelay::EncodePacket(pPacket, CmdData, nCmdSize, pCommObj->GetCrypter()->GetKey());
+			if (m_SafeUDP.Send(Target.IP, MSocket::ntohs(Target.RawPort), pPacket, nPacketSize))
+			{
+				Stats.SentUDP.fetch_add(1, std::memory_order_relaxed);
+				if (Target.bConfirmed)
+					continue;
+			}
+			else
+			{
+				delete[] pPacket;
+			}
 		}
+
+		TCPReceivers.push_back(uid);
 	}
 
-	delete[] pCmdData;
-	delete pCommand;
+	Stats.SentTCP.fetch_add(TCPReceivers.size(), std::memory_order_relaxed);
+	RouteToReceivers(pCommand, std::move(TCPReceivers));
 }
 
 void MMatchServer::RouteToAllClient(MCommand* pCommand)
 {
+	std::vector<MUID> Receivers;
 	for (MMatchObjectList::iterator i = m_Objects.begin(); i != m_Objects.end(); i++) {
 		MMatchObject* pObj = (MMatchObject*)((*i).second);
 		if (pObj->GetUID() < MUID(0, 3)) continue;
 
-		MCommand* pSendCmd = pCommand->Clone();
-		pSendCmd->m_Receiver = pObj->GetUID();
-		Post(pSendCmd);
+		Receivers.push_back(pObj->GetUID());
 	}
-	delete pCommand;
+	RouteToReceivers(pCommand, std::move(Receivers));
 }
 
 // sends an admin message to all users
@@ -1434,13 +1630,13 @@ void MMatchServer::RouteToChannel(const MUID& uidChannel, MCommand* pCommand)
 		return;
 	}
 
+	std::vector<MUID> Receivers;
 	for (auto i = pChannel->GetObjBegin(); i != pChannel->GetObjEnd(); i++) {
 		MObject* pObj = i->second;
 
-		MCommand* pSendCmd = pCommand->Clone();
-		RouteToListener(pObj, pSendCmd);
+		AddListeners(Receivers, pObj);
 	}
-	delete pCommand;
+	RouteToReceivers(pCommand, std::move(Receivers));
 }
 
 void MMatchServer::RouteToChannelLobby(const MUID& uidChannel, MCommand* pCommand)
@@ -1452,14 +1648,14 @@ void MMatchServer::RouteToChannelLobby(const MUID& uidChannel, MCommand* pComman
 		return;
 	}
 
+	std::vector<MUID> Receivers;
 	for (auto i = pChannel->GetLobbyObjBegin(); i != pChannel->GetLobbyObjEnd(); i++)
 	{
 		MObject* pObj = i->second;
 
-		MCommand* pSendCmd = pCommand->Clone();
-		RouteToListener(pObj, pSendCmd);
+		AddListeners(Receivers, pObj);
 	}
-	delete pCommand;
+	RouteToReceivers(pCommand, std::move(Receivers));
 }
 
 void MMatchServer::RouteToStage(const MUID& uidStage, MCommand* pCommand)
@@ -1471,19 +1667,19 @@ void MMatchServer::RouteToStage(const MUID& uidStage, MCommand* pCommand)
 		return;
 	}
 
+	std::vector<MUID> Receivers;
 	for (auto i = pStage->GetObjBegin(); i != pStage->GetObjEnd(); i++) {
 		MUID uidObj = i->first;
 		MObject* pObj = (MObject*)GetObject(uidObj);
 		if (pObj) {
-			MCommand* pSendCmd = pCommand->Clone();
-			RouteToListener(pObj, pSendCmd);
+			AddListeners(Receivers, pObj);
 		}
 		else {
 			LOG(LOG_ALL, "WARNING(RouteToStage) : Not Existing Obj(%u:%u)\n", uidObj.High, uidObj.Low);
 			i = pStage->RemoveObject(uidObj);
 		}
 	}
-	delete pCommand;
+	RouteToReceivers(pCommand, std::move(Receivers));
 }
 
 void MMatchServer::RouteToStageWaitRoom(const MUID& uidStage, MCommand* pCommand)
@@ -1495,6 +1691,7 @@ void MMatchServer::RouteToStageWaitRoom(const MUID& uidStage, MCommand* pCommand
 		return;
 	}
 
+	std::vector<MUID> Receivers;
 	for (auto i = pStage->GetObjBegin(); i != pStage->GetObjEnd(); i++) {
 
 		MUID uidObj = i->first;
@@ -1502,12 +1699,11 @@ void MMatchServer::RouteToStageWaitRoom(const MUID& uidStage, MCommand* pCommand
 		if (pObj) {
 			if (!pObj->GetEnterBattle())
 			{
-				MCommand* pSendCmd = pCommand->Clone();
-				RouteToListener(pObj, pSendCmd);
+				AddListeners(Receivers, pObj);
 			}
 		}
 	}
-	delete pCommand;
+	RouteToReceivers(pCommand, std::move(Receivers));
 }
 
 void MMatchServer::RouteToBattle(const MUID& uidStage, MCommand* pCommand)
@@ -1519,6 +1715,7 @@ void MMatchServer::RouteToBattle(const MUID& uidStage, MCommand* pCommand)
 		return;
 	}
 
+	std::vector<MUID> Receivers;
 	for (auto i = pStage->GetObjBegin(); i != pStage->GetObjEnd(); i++) {
 		//MMatchObject* pObj = (MMatchObject*)(*i).second;
 
@@ -1527,8 +1724,7 @@ void MMatchServer::RouteToBattle(const MUID& uidStage, MCommand* pCommand)
 		if (pObj) {
 			if (pObj->GetEnterBattle())
 			{
-				MCommand* pSendCmd = pCommand->Clone();
-				RouteToListener(pObj, pSendCmd);
+				AddListeners(Receivers, pObj);
 			}
 		}
 		else {
@@ -1536,18 +1732,13 @@ void MMatchServer::RouteToBattle(const MUID& uidStage, MCommand* pCommand)
 			i = pStage->RemoveObject(uidObj);	// RAONHAJE : 濡 UID ° ߽߰ α&û
 		}
 	}
-	delete pCommand;
+	RouteToReceivers(pCommand, std::move(Receivers));
 }
 
-void MMatchServer::RouteToBattleExcept(const MUID& uidStage, MCommand* pCommand, const MUID& uidExceptedPlayer)
+std::vector<MUID> MMatchServer::GetBattleReceivers(MMatchStage* pStage, const MUID& uidExceptedPlayer,
+	function_view<bool(MMatchObject&)> Filter)
 {
-	MMatchStage* pStage = FindStage(uidStage);
-	if (pStage == nullptr)
-	{
-		delete pCommand;
-		return;
-	}
-
+	std::vector<MUID> Receivers;
 	for (auto i = pStage->GetObjBegin(); i != pStage->GetObjEnd(); i++) {
 		MUID uidObj = i->first;
 
@@ -1556,10 +1747,9 @@ void MMatchServer::RouteToBattleExcept(const MUID& uidStage, MCommand* pCommand,
 
 		MMatchObject* pObj = (MMatchObject*)GetObject(uidObj);
 		if (pObj) {
-			if (pObj->GetEnterBattle())
+			if (pObj->GetEnterBattle() && (!Filter || Filter(*pObj)))
 			{
-				MCommand* pSendCmd = pCommand->Clone();
-				RouteToListener(pObj, pSendCmd);
+				AddListeners(Receivers, pObj);
 			}
 		}
 		else {
@@ -1567,7 +1757,24 @@ void MMatchServer::RouteToBattleExcept(const MUID& uidStage, MCommand* pCommand,
 			i = pStage->RemoveObject(uidObj);	// RAONHAJE : 濡 UID ° ߽߰ α&û
 		}
 	}
-	delete pCommand;
+	return Receivers;
+}
+
+void MMatchServer::RouteToBattleExcept(const MUID& uidStage, MCommand* pCommand, const MUID& uidExceptedPlayer,
+	bool bUnreliable)
+{
+	MMatchStage* pStage = FindStage(uidStage);
+	if (pStage == nullptr)
+	{
+		delete pCommand;
+		return;
+	}
+
+	auto Receivers = GetBattleReceivers(pStage, uidExceptedPlayer);
+	if (bUnreliable)
+		RouteToReceiversUnreliable(pCommand, std::move(Receivers));
+	else
+		RouteToReceivers(pCommand, std::move(Receivers));
 }
 
 void MMatchServer::RouteToClan(const int nCLID, MCommand* pCommand)
@@ -1579,13 +1786,13 @@ void MMatchServer::RouteToClan(const int nCLID, MCommand* pCommand)
 		return;
 	}
 
+	std::vector<MUID> Receivers;
 	for (auto i = pClan->GetMemberBegin(); i != pClan->GetMemberEnd(); i++) {
 		MObject* pObj = i->second;
 
-		MCommand* pSendCmd = pCommand->Clone();
-		RouteToListener(pObj, pSendCmd);
+		AddListeners(Receivers, pObj);
 	}
-	delete pCommand;
+	RouteToReceivers(pCommand, std::move(Receivers));
 }
 
 void MMatchServer::ResponseRoundState(const MUID& uidStage)
@@ -1672,6 +1879,8 @@ int MMatchServer::ObjectRemove(const MUID& uid, MMatchObjectList::iterator* pNex
 	// m_ClanMap 
 	m_ClanMap.RemoveObject(pObj->GetUID(), pObj);
 
+	m_UDPRelay.Unregister(pObj->GetUID());
+
 	delete pObj;
 	pObj = NULL;
 
@@ -1786,6 +1995,13 @@ void MMatchServer::OnBridgePeer(const MUID& uidChar, u32 dwIP, u32 nPort)
 	pObj->SetBridgePeer(true);
 	pObj->SetPlayerFlag(MTD_PlayerFlags_BridgePeer, true);
 
+	bool bUDPRelay = false;
+	m_CommRefCache.Read(uidChar, [&](MCommObject& CommObj) {
+		bUDPRelay = CommObj.IsUDPRelayAllowed();
+	});
+	if (bUDPRelay)
+		m_UDPRelay.Register(uidChar, dwIP, MSocket::htons(static_cast<u16>(nPort)));
+
 	ResponseBridgePeer(uidChar, 0);
 }
 
@@ -1851,10 +2067,18 @@ bool MMatchServer::UDPSocketRecvEvent(u32 dwIP, u16 wRawPort, char* pPacket, u32
 	MPacketHeader*	pPacketHeader;
 	pPacketHeader = (MPacketHeader*)pPacket;
 
+	MMatchServer* pServer = MMatchServer::GetInstance();
+
+	// The size of encrypted packets can only be read with the sender's key.
+	if (pPacketHeader->nMsg == MSGID_COMMAND)
+	{
+		pServer->ParseUDPRelayPacket(pPacket, dwSize, dwIP, wRawPort);
+		return true;
+	}
+
 	if ((dwSize < pPacketHeader->nSize) ||
-		((pPacketHeader->nMsg != MSGID_COMMAND) && (pPacketHeader->nMsg != MSGID_RAWCOMMAND))) return false;
+		(pPacketHeader->nMsg != MSGID_RAWCOMMAND)) return false;
 
-	MMatchServer* pServer = MMatchServer::GetInstance();
 	pServer->ParseUDPPacket(&pPacket[sizeof(MPacketHeader)], pPacketHeader, dwIP, wRawPort);
 	return true;
 }
@@ -1908,21 +2132,53 @@ void MMatchServer::ParseUDPPacket(char* pData, MPacketHeader* pPacketHeader, u32
 		}
 	}
 	break;
-	case MSGID_COMMAND:
+	default:
 	{
 		_ASSERT(0);
-		//  ȣȭ UDP  
 		Log(LOG_DEBUG, "MMatchServer::ParseUDPPacket: Parse Packet Error");
 	}
+
 	break;
-	default:
+	}
+}
+
+void MMatchServer::ParseUDPRelayPacket(char* pPacket, u32 dwSize, u32 dwIP, u16 wRawPort)
+{
+	MUID CommUID;
+	if (!m_UDPRelay.CheckSender(dwIP, wRawPort, CommUID))
+		return;
+
+	MPacketCrypterKey Key;
+	if (!m_CommRefCache.Read(CommUID, [&](MCommObject& CommObj) {
+		Key = *CommObj.GetCrypter()->GetKey();
+	}))
+		return;
+
+	auto& Stats = m_UDPRelay.GetStats();
+	const int nCmdSize = MMatchUDPRelay::DecodePacket(pPacket, dwSize, &Key);
+	if (nCmdSize == 0)
 	{
-		_ASSERT(0);
-		Log(LOG_DEBUG, "MMatchServer::ParseUDPPacket: Parse Packet Error");
+		Stats.Rejected.fetch_add(1, std::memory_order_relaxed);
+		return;
 	}
 
-	break;
+	// Only relayed peer commands and snapshot acks are taken over UDP. They're still
+	// handled on the main thread, like the ones that come over TCP.
+	MCommand* pCmd = new MCommand();
+	if (!pCmd->SetRawData(pPacket + sizeof(MPacketHeader), &m_CommandManager,
+		static_cast<unsigned short>(nCmdSize)) ||
+		(pCmd->GetID() != MC_MATCH_P2P_COMMAND && pCmd->GetID() != MC_MATCH_PEER_SNAPSHOT_ACK))
+	{
+		Stats.Rejected.fetch_add(1, std::memory_order_relaxed);
+		delete pCmd;
+		return;
 	}
+
+	m_UDPRelay.OnReceived(dwIP, wRawPort);
+
+	pCmd->m_Sender = CommUID;
+	pCmd->m_Receiver = m_This;
+	PostSafeQueue(pCmd);
 }
 
 void MMatchServer::ResponseBridgePeer(const MUID& uidChar, int nCode)
@@ -2478,6 +2734,8 @@ int MMatchServer::ValidateEquipItem(MMatchObject* pObj, MMatchItem* pItem, const
 
 void MMatchServer::OnNetClear(const MUID& CommUID)
 {
+	m_LoginQueue.Remove(CommUID);
+
 	MMatchObject* pObj = GetObject(CommUID);
 	if (pObj)
 		OnCharClear(pObj->GetUID());
@@ -2989,33 +3247,32 @@ void MMatchServer::CustomCheckEventObj(const u32 dwEventID, MMatchObject* pObj,
 
 void MMatchServer::PostDeath(const MMatchObject & Victim, const MMatchObject & Attacker)
 {
-	auto DeathCmd = MCommand(m_CommandManager.GetCommandDescByID(MC_PEER_DIE), MUID(0, 0), m_This);
-	DeathCmd.AddParameter(new MCmdParamUID(Attacker.GetUID()));
-	auto P2PCmd = CreateCommand(MC_MATCH_P2P_COMMAND, MUID(0, 0));
-	P2PCmd->AddParameter(new MCmdParamUID(Victim.GetUID()));
-	P2PCmd->AddParameter(CommandToBlob(DeathCmd));
+	char DeathCmd[64];
+	auto DeathCmdSize = MWriteCommand<MC_PEER_DIE>(DeathCmd, sizeof(DeathCmd), Attacker.GetUID());
+	auto P2PCmd = CreateCommand<MC_MATCH_P2P_COMMAND>(MUID(0, 0),
+		Victim.GetUID(), MCommandBlob{ DeathCmd, u32(DeathCmdSize) });
+	if (!P2PCmd)
+		return;
 	RouteToBattle(Victim.GetStageUID(), P2PCmd);
 }
 
 void MMatchServer::PostDamage(const MUID& Target, const MUID& Attacker, ZDAMAGETYPE DamageType, MMatchWeaponType WeaponType,
 	int Damage, float PiercingRatio)
 {
-	MCommand* pCmd = CreateCommand(MC_MATCH_DAMAGE, Target);
-	pCmd->AddParameter(new MCmdParamUID(Attacker));
-	pCmd->AddParameter(new MCmdParamUShort(Damage));
-	pCmd->AddParameter(new MCmdParamFloat(PiercingRatio));
-	pCmd->AddParameter(new MCmdParamUChar(DamageType));
-	pCmd->AddParameter(new MCmdParamUChar(WeaponType));
+	MCommand* pCmd = CreateCommand<MC_MATCH_DAMAGE>(Target,
+		Attacker, static_cast<u16>(Damage), PiercingRatio,
+		static_cast<u8>(DamageType), static_cast<u8>(WeaponType));
 	Post(pCmd);
 }
 
 void MMatchServer::PostHPAPInfo(const MMatchObject& Object, int HP, int AP)
 {
-	auto DeathCmd = MCommand(m_CommandManager.GetCommandDescByID(MC_PEER_HPAPINFO), MUID(0, 0), m_This);
-	DeathCmd.AddParameter(new MCmdParamFloat(static_cast<float>(HP)));
-	DeathCmd.AddParameter(new MCmdParamFloat(static_cast<float>(AP)));
-	auto P2PCmd = CreateCommand(MC_MATCH_P2P_COMMAND, MUID(0, 0));
-	P2PCmd->AddParameter(new MCmdParamUID(Object.GetUID()));
-	P2PCmd->AddParameter(CommandToBlob(DeathCmd));
+	char HPAPCmd[64];
+	auto HPAPCmdSize = MWriteCommand<MC_PEER_HPAPINFO>(HPAPCmd, sizeof(HPAPCmd),
+		static_cast<float>(HP), static_cast<float>(AP));
+	auto P2PCmd = CreateCommand<MC_MATCH_P2P_COMMAND>(MUID(0, 0),
+		Object.GetUID(), MCommandBlob{ HPAPCmd, u32(HPAPCmdSize) });
+	if (!P2PCmd)
+		return;
 	RouteToBattle(Object.GetStageUID(), P2PCmd);
 }
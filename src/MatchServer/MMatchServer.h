@@ -20,6 +20,9 @@
 #include "MStringRes.h"
 #include "MMatchStringResManager.h"
 #include "MMatchEventManager.h"
+#include "MMatchLoginQueue.h"
+#include "MMatchUDPRelay.h"
+#include "function_view.h"
 #include "GlobalTypes.h"
 #include <queue>
 #include <unordered_map>
@@ -76,6 +79,12 @@ public:
 	void CustomCheckEventObj(const u32 dwEventID, MMatchObject* pObj, void* pContext);
 
 	MLadderMgr*	GetLadderMgr() { return &m_LadderMgr; }
+	auto& GetLoginQueueStats() const { return m_LoginQueue.GetStats(); }
+	void ResetLoginQueuePeakStats() { m_LoginQueue.ResetPeakStats(); }
+	auto& GetUDPRelayStats() const { return m_UDPRelay.GetStats(); }
+	auto& GetInterestStats() const { return m_InterestStats; }
+	auto& GetVoiceStats() const { return m_VoiceStats; }
+	auto& GetSnapshotStats() const { return m_SnapshotStats; }
 	MMatchObjectList*	GetObjects() { return &m_Objects; }
 	MMatchStageMap*		GetStageMap() { return &m_StageMap; }
 	MMatchChannelMap*	GetChannelMap() { return &m_ChannelMap; }
@@ -154,24 +163,36 @@ public:
 	template <typename T>
 	void RouteToAllClientIf(MCommand* pCommand, T&& pred)
 	{
+		std::vector<MUID> Receivers;
 		for (MMatchObjectList::iterator i = m_Objects.begin(); i != m_Objects.end(); i++) {
 			MMatchObject* pObj = (MMatchObject*)((*i).second);
 			if (pObj->GetUID() < MUID(0, 3)) continue;
 			if (!pred(*pObj))
 				continue;
 
-			MCommand* pSendCmd = pCommand->Clone();
-			pSendCmd->m_Receiver = pObj->GetUID();
-			Post(pSendCmd);
+			Receivers.push_back(pObj->GetUID());
 		}
-		delete pCommand;
+		RouteToReceivers(pCommand, std::move(Receivers));
 	}
+	// Posts pCommand once for all receivers instead of once per receiver. Takes
+	// ownership of pCommand.
+	void RouteToReceivers(MCommand* pCommand, std::vector<MUID>&& Receivers);
+	// Like RouteToReceivers, but sends the command over UDP to receivers registered
+	// in m_UDPRelay, and over TCP to the rest. Only for commands that can be lost.
+	void RouteToReceiversUnreliable(MCommand* pCommand, std::vector<MUID>&& Receivers);
 	void RouteToChannel(const MUID& uidChannel, MCommand* pCommand);
 	void RouteToChannelLobby(const MUID& uidChannel, MCommand* pCommand);
 	void RouteToStage(const MUID& uidStage, MCommand* pCommand);
 	void RouteToStageWaitRoom(const MUID& uidStage, MCommand* pCommand);
 	void RouteToBattle(const MUID& uidStage, MCommand* pCommand);
-	void RouteToBattleExcept(const MUID& uidStage, MCommand* pCommand, const MUID& uidExceptedPlayer);
+	void RouteToBattleExcept(const MUID& uidStage, MCommand* pCommand, const MUID& uidExceptedPlayer,
+		bool bUnreliable = false);
+	// Returns the comm UIDs of the players in the battle, except uidExceptedPlayer. If
+	// Filter is set, only players for which it returns true are included.
+	std::vector<MUID> GetBattleReceivers(MMatchStage* pStage, const MUID& uidExceptedPlayer,
+		function_view<bool(MMatchObject&)> Filter = nullptr);
+	// Sends the position updates queued in the stage's snapshot aggregator.
+	void FlushPeerSnapshots(MMatchStage& Stage, u64 Time);
 	void RouteToClan(const int nCLID, MCommand* pCommand);
 	void RouteResponseToListener(MObject* pObject, const int nCmdID, int nResult);
 
@@ -239,6 +260,8 @@ protected:
 	void OnMatchLoginFromDBAgent(const MUID& CommUID, const char* szLoginID,
 		const char* szName, int nSex, bool bFreeLoginIP, u32 nChecksumPack);
 	void OnMatchLoginFailedFromDBAgent(const MUID& CommUID, int nResult);
+	void QueueMatchLogin(MMatchLoginRequest&& Request);
+	void ProcessLoginQueue();
 	void OnBridgePeer(const MUID& uidChar, u32 dwIP, u32 nPort);
 	bool AddObjectOnMatchLogin(const MUID& uidComm,
 		MMatchAccountInfo* pSrcAccountInfo,
@@ -265,6 +288,8 @@ protected:
 	void ParsePacket(char* pData, MPacketHeader* pPacketHeader, u32 dwIP, u16 wRawPort);
 	static bool UDPSocketRecvEvent(u32 dwIP, u16 wRawPort, char* pPacket, u32 dwSize);
 	void ParseUDPPacket(char* pData, MPacketHeader* pPacketHeader, u32 dwIP, u16 wRawPort);
+	// Handles a MSGID_COMMAND datagram from a client registered in m_UDPRelay.
+	void ParseUDPRelayPacket(char* pPacket, u32 dwSize, u32 dwIP, u16 wRawPort);
 
 	// Async DB
 	void ProcessAsyncJob();
@@ -616,6 +641,11 @@ protected:
 
 	void OnTunnelledP2PCommand(const MUID& Sender, const MUID& Receiver,
 		const char* Blob, size_t BlobSize);
+	// Queues a broadcast peer command for the receivers that can take it in a
+	// snapshot, and removes them from Receivers.
+	void QueuePeerSnapshot(MMatchStage& Stage, const MUID& Sender, int CommandID,
+		const char* Blob, size_t BlobSize, bool bPositionUpdate, std::vector<MUID>& Receivers);
+	void OnPeerSnapshotAck(const MUID& CommUID, u32 Epoch, u32 Latest, u32 Mask);
 
 	void OnPeerShot(MMatchObject& SenderObj, MMatchStage& Stage, const struct ZPACKEDSHOTINFO& psi);
 
@@ -693,6 +723,12 @@ protected:
 
 	MMatchEventManager		m_CustomEventManager;
 
+	MMatchLoginQueue		m_LoginQueue;
+	MMatchUDPRelay			m_UDPRelay{ m_PacketRateLimits, m_PacketRateLimitStats };
+	MMatchInterestManager::Stats m_InterestStats;
+	MMatchVoiceForwarder::Stats m_VoiceStats;
+	MMatchSnapshotAggregator::Stats m_SnapshotStats;
+
 	u64 LastPingTime{};
 };
 
@@ -14,6 +14,7 @@
 #include "MMatchFormula.h"
 #include "MMatchConfig.h"
 #include "MCommandCommunicator.h"
+#include "MCommandWriter.h"
 #include "MMatchShop.h"
 #include "MMatchTransDataType.h"
 #include "MDebug.h"
@@ -151,8 +152,7 @@ void MMatchServer::OnAdminPingToAll(const MUID& uidAdmin)
 		return;
 	}
 
-	MCommand* pNew = CreateCommand(MC_NET_PING, MUID(0,0));
-	pNew->AddParameter(new MCmdParamUInt(static_cast<u32>(GetGlobalClockCount())));
+	MCommand* pNew = CreateCommand<MC_NET_PING>(MUID(0,0), static_cast<u32>(GetGlobalClockCount()));
 	RouteToAllConnection(pNew);
 }
 
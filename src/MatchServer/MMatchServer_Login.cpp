@@ -144,6 +144,38 @@ void MMatchServer::OnMatchLogin(const MUID& CommUID, const char* UserID, const u
 	AddObjectOnMatchLogin(CommUID, &accountInfo, bFreeLoginIP, strCountryCode3, ChecksumPack);
 }
 
+void MMatchServer::QueueMatchLogin(MMatchLoginRequest&& Request)
+{
+	// Ignore repeated requests from a connection that's already waiting.
+	if (m_LoginQueue.IsQueued(Request.CommUID))
+		return;
+
+	const auto CommUID = Request.CommUID;
+	if (!m_LoginQueue.Push(std::move(Request)))
+	{
+		char buf[128];
+		sprintf_safe(buf, "The server is busy. Please try again in %d seconds.",
+			(m_LoginQueue.GetRetryDelayMS() + 999) / 1000);
+		NotifyFailedLogin(CommUID, buf);
+	}
+}
+
+void MMatchServer::ProcessLoginQueue()
+{
+	m_LoginQueue.Process([&](const MMatchLoginRequest& Request) {
+		// The connection may have closed before its MC_NET_CLEAR got here. Its login
+		// would only cost a DB lookup and a hash verification, and could disconnect
+		// the account's live session before failing.
+		if (!m_CommRefCache.GetRef(Request.CommUID))
+			return;
+
+		OnMatchLogin(Request.CommUID, Request.UserID.c_str(),
+			Request.HashedPassword.data(), int(Request.HashedPassword.size()),
+			Request.CommandVersion, Request.ChecksumPack,
+			Request.Major, Request.Minor, Request.Patch, Request.Revision);
+	});
+}
+
 void MMatchServer::NotifyFailedLogin(const MUID& uidComm, const char *szReason)
 {
 	MCommand* pCmd = CreateCommand(MC_MATCH_RESPONSE_LOGIN_FAILED, uidComm);
@@ -54,11 +54,29 @@ _STATUS_CMD_START;
 				if (pCommand->GetParameter(&Minor, 5, MPT_UINT) == false) break;
 				if (pCommand->GetParameter(&Patch, 6, MPT_UINT) == false) break;
 				if (pCommand->GetParameter(&Revision, 7, MPT_UINT) == false) break;
-
-				OnMatchLogin(pCommand->GetSenderUID(),
-					szUserID, HashedPassword, HashLength,
-					nCommandVersion, nChecksumPack,
-					Major, Minor, Patch, Revision);
+				u32 Capabilities;
+				if (pCommand->GetParameter(&Capabilities, 8, MPT_UINT) == false) break;
+
+				SetCompressionAllowed(pCommand->GetSenderUID(),
+					(Capabilities & MLOGIN_CAPABILITY_COMPRESSION) != 0);
+				SetUDPRelayAllowed(pCommand->GetSenderUID(),
+					(Capabilities & MLOGIN_CAPABILITY_UDP_RELAY) != 0);
+				SetPeerSnapshotAllowed(pCommand->GetSenderUID(),
+					(Capabilities & MLOGIN_CAPABILITY_PEER_SNAPSHOT) != 0);
+				SetPeerDeltaSnapshotAllowed(pCommand->GetSenderUID(),
+					(Capabilities & MLOGIN_CAPABILITY_PEER_DELTA_SNAPSHOT) != 0);
+
+				MMatchLoginRequest Request;
+				Request.CommUID = pCommand->GetSenderUID();
+				Request.UserID = szUserID;
+				Request.HashedPassword.assign(HashedPassword, HashedPassword + HashLength);
+				Request.CommandVersion = nCommandVersion;
+				Request.ChecksumPack = nChecksumPack;
+				Request.Major = Major;
+				Request.Minor = Minor;
+				Request.Patch = Patch;
+				Request.Revision = Revision;
+				QueueMatchLogin(std::move(Request));
 			}
 			break;
 		case MC_MATCH_REQUEST_CREATE_ACCOUNT:
@@ -81,27 +99,36 @@ _STATUS_CMD_START;
 		break;
 		case MC_MATCH_SEND_VOICE_CHAT:
 		{
-			auto Param = pCommand->GetParameter(0);
-			if (!Param || Param->GetType() != MPT_BLOB)
+			auto& Reader = pCommand->GetReader();
+			u32 Length = 0;
+			auto Data = (unsigned char*)Reader.GetBlob(0, &Length);
+			if (!Data)
 				break;
 
-			unsigned char *Data = (unsigned char *)Param->GetPointer();
-			auto Length = Param->GetSize() - sizeof(int);
-
 			OnVoiceChat(pCommand->GetSenderUID(), Data, Length);
 		}
 		break;
 		case MC_MATCH_P2P_COMMAND:
 		{
+			auto& Reader = pCommand->GetReader();
 			auto Sender = pCommand->GetSenderUID();
 			MUID Receiver;
-			if (!pCommand->GetParameter(&Receiver, 0, MPT_UID)) break;
-			auto Param = pCommand->GetParameter(1);
-			if (Param->GetType() != MPT_BLOB) break;
-			auto Blob = (MCmdParamBlob*)Param;
-			auto BlobPtr = Blob->GetPointer();
+			if (!Reader.GetParameter(&Receiver, 0, MPT_UID)) break;
+			u32 BlobSize = 0;
+			auto BlobPtr = Reader.GetBlob(1, &BlobSize);
+			if (!BlobPtr) break;
 
-			OnTunnelledP2PCommand(Sender, Receiver, (char*)BlobPtr, Blob->GetPayloadSize());
+			OnTunnelledP2PCommand(Sender, Receiver, (char*)BlobPtr, BlobSize);
+		}
+		break;
+		case MC_MATCH_PEER_SNAPSHOT_ACK:
+		{
+			u32 Epoch, Latest, Mask;
+			if (!pCommand->GetParameter(&Epoch, 0, MPT_UINT)) break;
+			if (!pCommand->GetParameter(&Latest, 1, MPT_UINT)) break;
+			if (!pCommand->GetParameter(&Mask, 2, MPT_UINT)) break;
+
+			OnPeerSnapshotAck(pCommand->GetSenderUID(), Epoch, Latest, Mask);
 		}
 		break;
 		case MC_MATCH_UPDATE_CLIENT_SETTINGS:
@@ -224,8 +251,9 @@ _STATUS_CMD_START;
 				static char szChat[1024];
 				uidPlayer = pCommand->GetSenderUID();
 
-				pCommand->GetParameter(&uidChannel, 1, MPT_UID);
-				pCommand->GetParameter(szChat, 2, MPT_STR, sizeof(szChat) );
+				auto& Reader = pCommand->GetReader();
+				Reader.GetParameter(&uidChannel, 1, MPT_UID);
+				Reader.GetParameter(szChat, 2, MPT_STR, sizeof(szChat) );
 
 				OnChannelChat(uidPlayer, uidChannel, szChat);
 			}
@@ -365,7 +393,7 @@ _STATUS_CMD_START;
 		case MC_MATCH_GAME_KILL:
 			{
 				MUID uidAttacker, uidVictim;
-				pCommand->GetParameter(&uidAttacker, 0, MPT_UID);
+				pCommand->GetReader().GetParameter(&uidAttacker, 0, MPT_UID);
 				uidVictim = pCommand->GetSenderUID();
 
 				OnGameKill(uidAttacker, uidVictim);
@@ -376,9 +404,10 @@ _STATUS_CMD_START;
 				MUID uidChar;
 				MVector pos, dir;
 
-				pCommand->GetParameter(&uidChar, 0, MPT_UID);
-				pCommand->GetParameter(&pos, 1, MPT_POS);
-				pCommand->GetParameter(&dir, 2, MPT_DIR);
+				auto& Reader = pCommand->GetReader();
+				Reader.GetParameter(&uidChar, 0, MPT_UID);
+				Reader.GetParameter(&pos, 1, MPT_POS);
+				Reader.GetParameter(&dir, 2, MPT_DIR);
 
 				OnRequestSpawn(pCommand->GetSenderUID(), pos, dir);
 			}
@@ -386,7 +415,7 @@ _STATUS_CMD_START;
 		case MC_MATCH_GAME_REQUEST_TIMESYNC:
 			{
 				unsigned int nLocalTimeStamp;
-				pCommand->GetParameter(&nLocalTimeStamp, 0, MPT_UINT);
+				pCommand->GetReader().GetParameter(&nLocalTimeStamp, 0, MPT_UINT);
 
 				OnGameRequestTimeSync(pCommand->GetSenderUID(), nLocalTimeStamp);
 			}
@@ -394,8 +423,9 @@ _STATUS_CMD_START;
 		case MC_MATCH_GAME_REPORT_TIMESYNC:
 			{
 				unsigned int nLocalTimeStamp, nDataChecksum;
-				pCommand->GetParameter(&nLocalTimeStamp, 0, MPT_UINT);
-				pCommand->GetParameter(&nDataChecksum, 1, MPT_UINT);
+				auto& Reader = pCommand->GetReader();
+				Reader.GetParameter(&nLocalTimeStamp, 0, MPT_UINT);
+				Reader.GetParameter(&nDataChecksum, 1, MPT_UINT);
 
 				OnGameReportTimeSync(pCommand->GetSenderUID(), nLocalTimeStamp, nDataChecksum);
 			}
@@ -406,8 +436,9 @@ _STATUS_CMD_START;
 				static char szChat[1024];
 				uidPlayer = pCommand->GetSenderUID();
 
-				pCommand->GetParameter(&uidStage, 1, MPT_UID);
-				pCommand->GetParameter(szChat, 2, MPT_STR, sizeof(szChat) );
+				auto& Reader = pCommand->GetReader();
+				Reader.GetParameter(&uidStage, 1, MPT_UID);
+				Reader.GetParameter(szChat, 2, MPT_STR, sizeof(szChat) );
 
 				OnStageChat(uidPlayer, uidStage, szChat);
 			}
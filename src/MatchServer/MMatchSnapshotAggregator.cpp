@@ -0,0 +1,226 @@
+#include "stdafx.h"
+#include "MMatchSnapshotAggregator.h"
+#include "MPeerSnapshot.h"
+#include <algorithm>
+
+// New streams get a new epoch so that a client doesn't take states from an older
+// stream with the same sequence numbers as baselines.
+static u32 NextEpoch = 0;
+
+static void AddReceivers(std::vector<MUID>& To, const std::vector<MUID>& Receivers)
+{
+	// Receivers that were due to get the old update get this one instead, so only
+	// add the ones that weren't already there.
+	for (auto& uid : Receivers)
+	{
+		if (std::find(To.begin(), To.end(), uid) == To.end())
+			To.push_back(uid);
+	}
+}
+
+MMatchSnapshotAggregator::Update& MMatchSnapshotAggregator::GetUpdate(const MUID& Sender)
+{
+	auto it = std::find_if(Updates.begin(), Updates.end(),
+		[&](auto& Update) { return Update.Sender == Sender; });
+	if (it != Updates.end())
+		return *it;
+
+	Updates.emplace_back();
+	Updates.back().Sender = Sender;
+	return Updates.back();
+}
+
+bool MMatchSnapshotAggregator::Add(const MUID& Sender, const void* Blob, size_t BlobSize,
+	const std::vector<MUID>& Receivers)
+{
+	if (BlobSize == 0 || MPeerSnapshotEntrySize(BlobSize) > MaxSnapshotSize)
+		return false;
+
+	auto& Update = GetUpdate(Sender);
+	AddReceivers(Update.Receivers, Receivers);
+
+	auto* p = static_cast<const char*>(Blob);
+	Update.Blob.assign(p, p + BlobSize);
+
+	return true;
+}
+
+void MMatchSnapshotAggregator::AddBasicInfo(const MUID& Sender, const NewBasicInfo& nbi,
+	const std::vector<MUID>& Receivers)
+{
+	auto& Last = Senders[Sender];
+	if (nbi.Flags & BasicInfoFlags::Animations)
+	{
+		Last.LowerAni = nbi.bi.lowerstate;
+		Last.UpperAni = nbi.bi.upperstate;
+	}
+	if (nbi.Flags & BasicInfoFlags::SelItem)
+		Last.Slot = nbi.bi.SelectedSlot;
+
+	if (Receivers.empty())
+		return;
+
+	auto& Update = GetUpdate(Sender);
+	AddReceivers(Update.DeltaReceivers, Receivers);
+	Update.bHasState = true;
+	Update.State = MQuantizePeerState(nbi, Last.LowerAni, Last.UpperAni, Last.Slot, Precision);
+}
+
+bool MMatchSnapshotAggregator::DeltaReceiver::IsAcked(u32 Seq) const
+{
+	if (Seq == 0 || Seq > AckedSeq)
+		return false;
+	if (Seq == AckedSeq)
+		return true;
+	const auto Age = AckedSeq - Seq;
+	return Age <= 32 && (AckedMask >> (Age - 1)) & 1;
+}
+
+void MMatchSnapshotAggregator::OnAck(const MUID& Receiver, u32 Epoch, u32 Latest, u32 Mask)
+{
+	auto it = DeltaReceivers.find(Receiver);
+	if (it == DeltaReceivers.end())
+		return;
+
+	auto& Stream = it->second;
+	// Acks for snapshots that weren't sent yet are bogus.
+	if (Epoch != Stream.Epoch || Latest == 0 || Latest >= Stream.NextSeq)
+		return;
+
+	if (Latest > Stream.AckedSeq)
+	{
+		Stream.AckedSeq = Latest;
+		Stream.AckedMask = Mask;
+	}
+	else if (Latest == Stream.AckedSeq)
+	{
+		// Acks can arrive out of order, so keep what the other ones said too.
+		Stream.AckedMask |= Mask;
+	}
+}
+
+void MMatchSnapshotAggregator::Discard(const MUID& Sender)
+{
+	auto it = std::find_if(Updates.begin(), Updates.end(),
+		[&](auto& Update) { return Update.Sender == Sender; });
+	if (it != Updates.end())
+		Updates.erase(it);
+}
+
+void MMatchSnapshotAggregator::RemovePlayer(const MUID& uid)
+{
+	Discard(uid);
+	Senders.erase(uid);
+	DeltaReceivers.erase(uid);
+	for (auto& Pair : DeltaReceivers)
+		Pair.second.History.erase(uid);
+}
+
+void MMatchSnapshotAggregator::Clear()
+{
+	Updates.clear();
+	Senders.clear();
+	DeltaReceivers.clear();
+}
+
+void MMatchSnapshotAggregator::FlushDelta(const MUID& Receiver, DeltaReceiver& Stream,
+	function_view<void(const MUID&, const char*, size_t, bool)> Fn)
+{
+	// A full entry with every field in the 32 bit class, with a 64 bit UID.
+	constexpr size_t MaxEntrySize = 64;
+
+	size_t Index = 0;
+	while (Index < Stream.Pending.size())
+	{
+		const auto Seq = Stream.NextSeq++;
+		DeltaBuffer.clear();
+		MPeerDeltaSnapshotWriter Writer{ DeltaBuffer, Stream.Epoch, Seq, Precision };
+
+		for (; Index < Stream.Pending.size(); ++Index)
+		{
+			if (Writer.GetCount() == 0xFF || Writer.GetSize() + MaxEntrySize > MaxSnapshotSize)
+				break;
+
+			auto& Update = Updates[Stream.Pending[Index]];
+			auto& History = Stream.History[Update.Sender];
+
+			// Use the newest state the receiver has acknowledged that is still in range.
+			const MPeerQuantizedState* Baseline = nullptr;
+			u32 BaselineAge = 0;
+			for (auto& Sent : History)
+			{
+				const auto Age = Seq - Sent.Seq;
+				if (Age <= MPeerDeltaMaxBaselineAge && Stream.IsAcked(Sent.Seq) &&
+					(!Baseline || Age < BaselineAge))
+				{
+					Baseline = &Sent.State;
+					BaselineAge = Age;
+				}
+			}
+
+			Writer.Add(Update.Sender, Update.State, Baseline, BaselineAge);
+			History[Seq % History.size()] = { Seq, Update.State };
+		}
+
+		Fn(Receiver, reinterpret_cast<const char*>(DeltaBuffer.data()), DeltaBuffer.size(), true);
+	}
+	Stream.Pending.clear();
+}
+
+void MMatchSnapshotAggregator::Flush(u64 Time,
+	function_view<void(const MUID&, const char*, size_t, bool)> Fn)
+{
+	LastFlushTime = Time;
+
+	for (size_t i = 0; i < Updates.size(); ++i)
+	{
+		auto& Update = Updates[i];
+
+		for (auto& Receiver : Update.Receivers)
+		{
+			auto& Buffer = Buffers[Receiver];
+			if (Buffer.size() + MPeerSnapshotEntrySize(Update.Blob.size()) > MaxSnapshotSize)
+			{
+				Fn(Receiver, Buffer.data(), Buffer.size(), false);
+				Buffer.clear();
+			}
+			MAppendPeerSnapshotEntry(Buffer, Update.Sender, Update.Blob.data(), u16(Update.Blob.size()));
+		}
+
+		if (!Update.bHasState)
+			continue;
+
+		for (auto& Receiver : Update.DeltaReceivers)
+		{
+			auto it = DeltaReceivers.find(Receiver);
+			if (it == DeltaReceivers.end())
+			{
+				it = DeltaReceivers.emplace(Receiver, DeltaReceiver{}).first;
+				it->second.Epoch = ++NextEpoch;
+			}
+			it->second.Pending.push_back(i);
+		}
+	}
+
+	for (auto it = Buffers.begin(); it != Buffers.end();)
+	{
+		if (it->second.empty())
+		{
+			// Nothing for this receiver this time, which happens when they've left.
+			it = Buffers.erase(it);
+			continue;
+		}
+
+		Fn(it->first, it->second.data(), it->second.size(), false);
+		it->second.clear();
+		++it;
+	}
+
+	for (auto& Pair : DeltaReceivers)
+	{
+		if (!Pair.second.Pending.empty())
+			FlushDelta(Pair.first, Pair.second, Fn);
+	}
+
+	Updates.clear();
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <array>
+#include <unordered_map>
+#include <vector>
+
+#include "GlobalTypes.h"
+#include "MUID.h"
+#include "function_view.h"
+#include "MPeerDeltaSnapshot.h"
+
+// Collects the position updates that a stage's players send during a tick, and
+// hands them out as one MC_MATCH_PEER_SNAPSHOT per receiver instead of one
+// MC_MATCH_P2P_COMMAND per update and receiver. With N players, each receiver then
+// gets one packet per tick instead of N - 1, each of which would have been wrapped,
+// encrypted and sent on its own.
+//
+// Only used for receivers that said at login that they understand snapshots.
+//
+// Receivers that also understand MC_MATCH_PEER_DELTA_SNAPSHOT get MC_PEER_BASICINFO_RG
+// updates quantized and sent as deltas against the last state they acknowledged
+// for that sender instead. See MPeerDeltaSnapshot.h.
+class MMatchSnapshotAggregator
+{
+public:
+	// Keeps a snapshot in one UDP datagram along with the packet and command headers.
+	static constexpr size_t MaxSnapshotSize = 1200;
+
+	struct Stats
+	{
+		// Updates queued for a receiver, and the snapshots they were sent in.
+		u64 Entries = 0;
+		u64 Snapshots = 0;
+		// The same for delta snapshots.
+		u64 DeltaEntries = 0;
+		u64 DeltaSnapshots = 0;
+		// Snapshot payload bytes, to compare the two formats.
+		u64 Bytes = 0;
+		u64 DeltaBytes = 0;
+	};
+
+	void SetEnabled(bool bEnable) { bEnabled = bEnable; }
+	bool IsEnabled() const { return bEnabled; }
+	void SetInterval(u32 IntervalMS) { Interval = IntervalMS; }
+	void SetPrecision(const MPeerDeltaPrecision& Value) {
+		Precision = { MRoundPeerDeltaStep(Value.PosStep), MRoundPeerDeltaStep(Value.VelStep) }; }
+
+	// Queues a tunnelled command blob from Sender for the comm UIDs in Receivers.
+	// A queued update from the same sender is superseded by this one. Returns false
+	// if the blob is too big to go into a snapshot, in which case nothing is queued.
+	bool Add(const MUID& Sender, const void* Blob, size_t BlobSize, const std::vector<MUID>& Receivers);
+	// Queues a MC_PEER_BASICINFO_RG update from Sender for delta receivers. This has
+	// to be called for every update Sender broadcasts, even with no receivers, since
+	// the animations and slot are only in the ones where they changed.
+	void AddBasicInfo(const MUID& Sender, const NewBasicInfo& nbi, const std::vector<MUID>& Receivers);
+	// Handles a MC_MATCH_PEER_SNAPSHOT_ACK from Receiver.
+	void OnAck(const MUID& Receiver, u32 Epoch, u32 Latest, u32 Mask);
+
+	bool IsDue(u64 Time) const { return !Updates.empty() && Time - LastFlushTime >= Interval; }
+
+	// Calls Fn(Receiver, Data, Size, bDelta) with the snapshot data for each receiver,
+	// split into several snapshots if it doesn't fit in one, and empties the queue.
+	void Flush(u64 Time, function_view<void(const MUID&, const char*, size_t, bool)> Fn);
+	// Drops the update queued from Sender, if any.
+	void Discard(const MUID& Sender);
+	void RemovePlayer(const MUID& uid);
+	void Clear();
+
+private:
+	struct Update
+	{
+		MUID Sender;
+		std::vector<char> Blob;
+		std::vector<MUID> Receivers;
+		bool bHasState = false;
+		MPeerQuantizedState State;
+		std::vector<MUID> DeltaReceivers;
+	};
+
+	// What the last MC_PEER_BASICINFO_RG from a sender said about the fields that
+	// are only sent when they change.
+	struct SenderState
+	{
+		ZC_STATE_LOWER LowerAni = ZC_STATE_LOWER_IDLE1;
+		ZC_STATE_UPPER UpperAni = ZC_STATE_UPPER_NONE;
+		MMatchCharItemParts Slot = MMCIP_PRIMARY;
+	};
+
+	struct SentState
+	{
+		u32 Seq = 0;
+		MPeerQuantizedState State;
+	};
+
+	struct DeltaReceiver
+	{
+		u32 Epoch;
+		u32 NextSeq = 1;
+		u32 AckedSeq = 0;
+		u32 AckedMask = 0;
+		// What was sent for each sender in the last snapshots, indexed by sequence
+		// number modulo the ring size.
+		std::unordered_map<MUID, std::array<SentState, MPeerDeltaMaxBaselineAge + 1>> History;
+		// Indices into Updates, filled during a flush.
+		std::vector<size_t> Pending;
+
+		bool IsAcked(u32 Seq) const;
+	};
+
+	Update& GetUpdate(const MUID& Sender);
+	void FlushDelta(const MUID& Receiver, DeltaReceiver& Stream,
+		function_view<void(const MUID&, const char*, size_t, bool)> Fn);
+
+	bool bEnabled = false;
+	u32 Interval = 0;
+	u64 LastFlushTime = 0;
+	MPeerDeltaPrecision Precision;
+	std::vector<Update> Updates;
+	std::unordered_map<MUID, SenderState> Senders;
+	std::unordered_map<MUID, DeltaReceiver> DeltaReceivers;
+	// Kept between flushes so their memory is reused.
+	std::unordered_map<MUID, std::vector<char>> Buffers;
+	std::vector<u8> DeltaBuffer;
+};
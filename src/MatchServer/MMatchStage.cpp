@@ -135,6 +135,9 @@ void MMatchStage::AddObject(const MUID& uid, MMatchObject* pObj)
 
 MMatchObjectMap::iterator MMatchStage::RemoveObject(const MUID& uid)
 {
+	InterestMgr.RemovePlayer(uid);
+	VoiceForwarder.RemovePlayer(uid);
+	SnapshotAggregator.RemovePlayer(uid);
 	m_VoteMgr.RemoveVoter(uid);
 	if( CheckUserWasVoted(uid) )
 	{
@@ -330,6 +333,9 @@ void MMatchStage::Tick(u64 nClock)
 		UpdateWorldItems();
 	}
 
+	if (SnapshotAggregator.IsDue(nClock))
+		MMatchServer::GetInstance()->FlushPeerSnapshots(*this, nClock);
+
 	m_VoteMgr.Tick(nClock);
 
 	if (IsChecksumUpdateTime(nClock))
@@ -714,6 +720,19 @@ void MMatchStage::OnStartGame()
 
 	m_WorldItemManager.OnStageBegin(&m_StageSetting);
 
+	InterestMgr.Clear();
+	InterestMgr.SetEnabled(MGetServerConfig()->GetNetInterestFiltering());
+	InterestMgr.SetSettings(MGetServerConfig()->GetInterestSettings());
+
+	VoiceForwarder.Clear();
+	VoiceForwarder.SetEnabled(MGetServerConfig()->GetNetVoiceForwarding());
+	VoiceForwarder.SetSettings(MGetServerConfig()->GetVoiceSettings());
+
+	SnapshotAggregator.Clear();
+	SnapshotAggregator.SetEnabled(MGetServerConfig()->GetNetPeerSnapshots());
+	SnapshotAggregator.SetInterval(MGetServerConfig()->GetPeerSnapshotIntervalMS());
+	SnapshotAggregator.SetPrecision(MGetServerConfig()->GetPeerDeltaPrecision());
+
 	if (GetStageType() == MST_NORMAL)
 		MMatchServer::GetInstance()->StageLaunch(GetUID());
 }
@@ -721,6 +740,7 @@ void MMatchStage::OnStartGame()
 void MMatchStage::OnFinishGame()
 {
 	m_WorldItemManager.OnStageEnd();
+	SnapshotAggregator.Clear();
 
 	if (m_pRule)
 	{
@@ -11,6 +11,9 @@
 #include "MMatchGlobal.h"
 #include "MUtil.h"
 #include "MovingWeaponManager.h"
+#include "MMatchInterestManager.h"
+#include "MMatchVoiceForwarder.h"
+#include "MMatchSnapshotAggregator.h"
 
 #define MTICK_STAGE			100
 
@@ -109,6 +112,9 @@ protected:
 public:
 	RealSpace2::RBspObject* BspObject = nullptr;
 	MovingWeaponManager MovingWeaponMgr;
+	MMatchInterestManager InterestMgr;
+	MMatchVoiceForwarder VoiceForwarder;
+	MMatchSnapshotAggregator SnapshotAggregator;
 	MMatchWorldItemManager	m_WorldItemManager;
 
 	struct Bot
@@ -98,8 +98,76 @@ void MMatchStatus::SaveToLogFile()
 		}
 	}
 	mlog(szBuf);
-	
 
+	mlog("Packet crypter kernel: %s\n", MPacketCrypter::GetKernelName());
+
+	auto* pServer = MMatchServer::GetInstance();
+	mlog("Command queues: safe queue high water = %d, command queue = %d (high water = %d)\n",
+		pServer->GetSafeCmdQueueHighWaterMark(),
+		pServer->GetCommandManager()->GetCommandQueueCount(),
+		pServer->GetCommandManager()->GetCommandQueueHighWaterMark());
+
+	auto PoolStats = MCommand::GetStats();
+	mlog("Command pool: allocs = %llu, frees = %llu, heap allocs = %llu, "
+		"refills = %llu, flushes = %llu, contentions = %llu\n",
+		PoolStats.Allocs, PoolStats.Frees, PoolStats.HeapAllocs,
+		PoolStats.Refills, PoolStats.Flushes, PoolStats.Contentions);
+
+	auto CommStats = pServer->GetCommRefCacheStats();
+	mlog("Comm object table: locks = %llu, contentions = %llu\n",
+		CommStats.Locks, CommStats.Contentions);
+
+	auto SendStats = pServer->GetNetSendQueueStats();
+	mlog("Send queues: queued = %llu bytes (peak %llu), dropped packets = %llu, evictions = %llu\n",
+		SendStats.QueuedBytes, SendStats.PeakQueuedBytes,
+		SendStats.DroppedPackets, SendStats.Evictions);
+
+	auto& Compression = pServer->GetCompressionStats();
+	mlog("Compressed commands: %llu, %llu bytes -> %llu bytes\n",
+		Compression.Commands, Compression.RawBytes, Compression.CompressedBytes);
+
+	auto& LoginStats = pServer->GetLoginQueueStats();
+	mlog("Login queue: pending = %d (peak %d), processed = %llu, rejected = %llu, max wait = %llu ms\n",
+		int(LoginStats.Pending), int(LoginStats.PeakPending),
+		LoginStats.Processed, LoginStats.Rejected, LoginStats.MaxWaitMS);
+
+	auto& RateLimitStats = pServer->GetPacketRateLimitStats();
+	for (size_t i = 0; i < size_t(MPacketClass::Count); ++i)
+	{
+		mlog("Flood protection (%s): dropped = %llu, kicked = %llu\n",
+			MPacketRateLimits::GetClassName(MPacketClass(i)),
+			u64(RateLimitStats.Dropped[i]), u64(RateLimitStats.Kicked[i]));
+	}
+
+	auto& RelayStats = pServer->GetUDPRelayStats();
+	mlog("UDP relay: received = %llu, rejected = %llu, sent over UDP = %llu, sent over TCP = %llu\n",
+		u64(RelayStats.Received), u64(RelayStats.Rejected),
+		u64(RelayStats.SentUDP), u64(RelayStats.SentTCP));
+
+	auto& InterestStats = pServer->GetInterestStats();
+	mlog("Interest filtering: position updates considered = %llu, relayed = %llu\n",
+		InterestStats.Considered, InterestStats.Relayed);
+
+	auto& VoiceStats = pServer->GetVoiceStats();
+	mlog("Voice forwarding: frames considered = %llu, forwarded = %llu, "
+		"suppressed for speaker limit = %llu, suppressed for byte budget = %llu\n",
+		VoiceStats.Considered, VoiceStats.Forwarded,
+		VoiceStats.SuppressedSpeakers, VoiceStats.SuppressedBudget);
+
+	auto& SnapshotStats = pServer->GetSnapshotStats();
+	mlog("Peer snapshots: updates = %llu, snapshots = %llu, bytes = %llu\n",
+		SnapshotStats.Entries, SnapshotStats.Snapshots, SnapshotStats.Bytes);
+	mlog("Peer delta snapshots: updates = %llu, snapshots = %llu, bytes = %llu\n",
+		SnapshotStats.DeltaEntries, SnapshotStats.DeltaSnapshots, SnapshotStats.DeltaBytes);
+
+	auto IOStats = pServer->GetNetIOThreadStats();
+	for (size_t i = 0; i < IOStats.size(); ++i)
+	{
+		auto& Stats = IOStats[i];
+		mlog("IO thread %d: connections = %u, reads = %llu, writes = %llu, packets/write = %.2f\n",
+			int(i), Stats.Connections, Stats.Reads, Stats.Writes,
+			Stats.Writes ? double(Stats.PacketsWritten) / Stats.Writes : 0.0);
+	}
 }
 
 void MMatchStatus::AddCmdHistory(u32 nCmdID)
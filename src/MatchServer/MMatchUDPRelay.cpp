@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include "MMatchUDPRelay.h"
+#include "MPacket.h"
+#include "MTime.h"
+
+void MMatchUDPRelay::Register(const MUID& CommUID, u32 IP, u16 RawPort)
+{
+	if (!bEnabled)
+		return;
+
+	const auto Key = MakeKey(IP, RawPort);
+
+	std::lock_guard<std::mutex> Lock{ Mutex };
+	auto it = ByUID.find(CommUID);
+	if (it != ByUID.end())
+	{
+		if (it->second == Key)
+			return;
+		ByAddress.erase(it->second);
+		ByUID.erase(it);
+	}
+
+	// Another client may have had this address, e.g. if it reconnected from behind
+	// the same NAT mapping.
+	auto Existing = ByAddress.find(Key);
+	if (Existing != ByAddress.end())
+	{
+		ByUID.erase(Existing->second.CommUID);
+		ByAddress.erase(Existing);
+	}
+
+	ByAddress.emplace(Key, Entry{ CommUID, MPacketRateLimiter{ Limits, LimitStats }, 0 });
+	ByUID.emplace(CommUID, Key);
+}
+
+void MMatchUDPRelay::Unregister(const MUID& CommUID)
+{
+	std::lock_guard<std::mutex> Lock{ Mutex };
+	auto it = ByUID.find(CommUID);
+	if (it == ByUID.end())
+		return;
+	ByAddress.erase(it->second);
+	ByUID.erase(it);
+}
+
+void MMatchUDPRelay::Clear()
+{
+	std::lock_guard<std::mutex> Lock{ Mutex };
+	ByAddress.clear();
+	ByUID.clear();
+}
+
+bool MMatchUDPRelay::GetTarget(const MUID& CommUID, Target& Out)
+{
+	std::lock_guard<std::mutex> Lock{ Mutex };
+	auto it = ByUID.find(CommUID);
+	if (it == ByUID.end())
+		return false;
+
+	auto& Entry = ByAddress.find(it->second)->second;
+	Out.IP = u32(it->second);
+	Out.RawPort = u16(it->second >> 32);
+	Out.bConfirmed = Entry.LastRecvTime != 0 &&
+		GetGlobalTimeMS() - Entry.LastRecvTime < ConfirmTimeoutMS;
+	return true;
+}
+
+bool MMatchUDPRelay::CheckSender(u32 IP, u16 RawPort, MUID& OutCommUID)
+{
+	std::lock_guard<std::mutex> Lock{ Mutex };
+	auto it = ByAddress.find(MakeKey(IP, RawPort));
+	if (it == ByAddress.end())
+	{
+		CurStats.Rejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// There's no connection to kick from here, so the limit always drops.
+	if (!it->second.Limiter.Check(MPacketClass::PeerRelay))
+		return false;
+
+	OutCommUID = it->second.CommUID;
+	return true;
+}
+
+void MMatchUDPRelay::OnReceived(u32 IP, u16 RawPort)
+{
+	CurStats.Received.fetch_add(1, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> Lock{ Mutex };
+	auto it = ByAddress.find(MakeKey(IP, RawPort));
+	if (it != ByAddress.end())
+		it->second.LastRecvTime = GetGlobalTimeMS();
+}
+
+int MMatchUDPRelay::EncodePacket(char* pOut, const char* pCmdData, int nCmdSize,
+	const MPacketCrypterKey* pKey)
+{
+	auto pMsg = reinterpret_cast<MCommandMsg*>(pOut);
+	const int nPacketSize = int(sizeof(MPacketHeader)) + nCmdSize;
+
+	pMsg->nMsg = MSGID_COMMAND;
+	pMsg->nSize = static_cast<unsigned short>(nPacketSize);
+	MPacketCrypter::EncryptAndSum((char*)&pMsg->nSize, sizeof(pMsg->nSize),
+		(char*)&pMsg->nSize, pKey);
+
+	auto nBodySum = MPacketCrypter::EncryptAndSum(pCmdData, nCmdSize, pMsg->Buffer, pKey);
+	pMsg->nCheckSum = MFinishCheckSum(pMsg, nBodySum);
+
+	return nPacketSize;
+}
+
+int MMatchUDPRelay::DecodePacket(char* pPacket, u32 dwSize, const MPacketCrypterKey* pKey)
+{
+	if (dwSize <= sizeof(MPacketHeader) || dwSize > MAX_PACKET_SIZE)
+		return 0;
+
+	auto pMsg = reinterpret_cast<MCommandMsg*>(pPacket);
+	if (pMsg->nMsg != MSGID_COMMAND)
+		return 0;
+
+	auto Key = *pKey;
+	unsigned short nPacketSize = 0;
+	if (!MPacketCrypter::Decrypt((const char*)&pMsg->nSize, sizeof(nPacketSize),
+		(char*)&nPacketSize, sizeof(nPacketSize), &Key))
+		return 0;
+
+	// Each datagram carries exactly one packet.
+	if (nPacketSize != dwSize)
+		return 0;
+
+	if (pMsg->nCheckSum != MBuildCheckSum(pMsg, nPacketSize))
+		return 0;
+
+	const int nCmdSize = nPacketSize - int(sizeof(MPacketHeader));
+	if (!MPacketCrypter::Decrypt(pMsg->Buffer, nCmdSize, &Key))
+		return 0;
+
+	return nCmdSize;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include "GlobalTypes.h"
+#include "MUID.h"
+#include "MPacketCrypter.h"
+#include "MPacketRateLimiter.h"
+
+// Addresses of clients that can exchange MC_MATCH_P2P_COMMAND with the server over
+// MSafeUDP instead of TCP. Tunnelled peer commands that can be lost (see
+// MIsLossTolerantPeerCommand) are relayed this way, since a lost position update is
+// better than one that waits behind a retransmission.
+//
+// Clients are registered by comm UID when they bridge their UDP address to the
+// server, if they said at login that they can take relayed commands over UDP.
+// Register, Unregister and GetTarget are called on the main thread, and CheckSender
+// on the MSafeUDP socket thread, so the tables are guarded by a mutex.
+class MMatchUDPRelay
+{
+public:
+	struct Target
+	{
+		u32 IP;
+		u16 RawPort;
+		// Set if a relayed packet from this address arrived recently, which shows
+		// that the client has seen ours and switched to UDP itself. Until then,
+		// commands are also sent over TCP in case ours don't get through.
+		bool bConfirmed;
+	};
+
+	struct Stats
+	{
+		std::atomic<u64> Received{ 0 };
+		// Unknown sender, bad checksum or not a MC_MATCH_P2P_COMMAND.
+		std::atomic<u64> Rejected{ 0 };
+		std::atomic<u64> SentUDP{ 0 };
+		std::atomic<u64> SentTCP{ 0 };
+	};
+
+	// How long a client stays confirmed after its last relayed packet.
+	static constexpr u64 ConfirmTimeoutMS = 3000;
+
+	MMatchUDPRelay(const MPacketRateLimits& Limits, MPacketRateLimitStats& LimitStats)
+		: Limits(Limits), LimitStats(LimitStats) {}
+
+	void SetEnabled(bool bEnable) { bEnabled = bEnable; }
+	bool IsEnabled() const { return bEnabled; }
+
+	// Replaces any address the client had before.
+	void Register(const MUID& CommUID, u32 IP, u16 RawPort);
+	void Unregister(const MUID& CommUID);
+	void Clear();
+
+	// Returns false if the client isn't registered.
+	bool GetTarget(const MUID& CommUID, Target& Out);
+	// Finds the client that sent a datagram and checks it against their PeerRelay
+	// rate limit. Returns false if the datagram should be dropped.
+	bool CheckSender(u32 IP, u16 RawPort, MUID& OutCommUID);
+	void OnReceived(u32 IP, u16 RawPort);
+
+	auto& GetStats() { return CurStats; }
+	auto& GetStats() const { return CurStats; }
+
+	// Writes a MSGID_COMMAND packet with the command data encrypted with pKey. pOut
+	// must have room for sizeof(MPacketHeader) + nCmdSize bytes. Returns the size of
+	// the packet.
+	static int EncodePacket(char* pOut, const char* pCmdData, int nCmdSize,
+		const MPacketCrypterKey* pKey);
+	// Checks and decrypts a MSGID_COMMAND datagram in place. Returns the size of the
+	// command data after the header, or 0 if the datagram isn't a valid packet.
+	static int DecodePacket(char* pPacket, u32 dwSize, const MPacketCrypterKey* pKey);
+
+private:
+	struct Entry
+	{
+		MUID CommUID;
+		MPacketRateLimiter Limiter;
+		u64 LastRecvTime;
+	};
+
+	static u64 MakeKey(u32 IP, u16 RawPort) { return (u64(RawPort) << 32) | IP; }
+
+	const MPacketRateLimits& Limits;
+	MPacketRateLimitStats& LimitStats;
+	bool bEnabled = true;
+
+	std::mutex Mutex;
+	std::unordered_map<u64, Entry> ByAddress;
+	std::unordered_map<MUID, u64> ByUID;
+	Stats CurStats;
+};
@@ -0,0 +1,118 @@
+#include "stdafx.h"
+#include "MMatchVoiceForwarder.h"
+#include "MMatchObject.h"
+#include <algorithm>
+
+bool MMatchVoiceForwarder::ShouldForward(const MMatchObject& Speaker, const MMatchObject& Receiver,
+	size_t FrameSize, bool bTeamPlay, u64 Time, Stats& Stats)
+{
+	++Stats.Considered;
+
+	if (!bEnabled)
+	{
+		++Stats.Forwarded;
+		return true;
+	}
+
+	auto& State = Receivers[Receiver.GetUID()];
+
+	if (!TakeSlot(State, Speaker.GetUID(), GetPriority(Speaker, Receiver, bTeamPlay), Time))
+	{
+		++Stats.SuppressedSpeakers;
+		return false;
+	}
+
+	if (!SpendBudget(State, FrameSize, Time))
+	{
+		++Stats.SuppressedBudget;
+		return false;
+	}
+
+	++Stats.Forwarded;
+	return true;
+}
+
+MMatchVoiceForwarder::Priority MMatchVoiceForwarder::GetPriority(const MMatchObject& Speaker,
+	const MMatchObject& Receiver, bool bTeamPlay) const
+{
+	using namespace RealSpace2;
+
+	if (bTeamPlay && Speaker.GetTeam() == Receiver.GetTeam())
+		return Priority::Teammate;
+
+	if (Speaker.BasicInfoHistory.empty() || Receiver.BasicInfoHistory.empty())
+		return Priority::Far;
+
+	const auto Diff = Speaker.BasicInfoHistory.front().position -
+		Receiver.BasicInfoHistory.front().position;
+	if (MagnitudeSq(Diff) < CurSettings.NearRange * CurSettings.NearRange)
+		return Priority::Near;
+
+	return Priority::Far;
+}
+
+bool MMatchVoiceForwarder::TakeSlot(ReceiverState& State, const MUID& Speaker, Priority Prio, u64 Time)
+{
+	auto& Slots = State.Slots;
+
+	// Speakers that have gone quiet give up their slots.
+	Slots.erase(std::remove_if(Slots.begin(), Slots.end(), [&](const Slot& s) {
+		return s.Speaker != Speaker && Time - s.LastFrameTime >= CurSettings.SpeakerTimeoutMS;
+	}), Slots.end());
+
+	auto it = std::find_if(Slots.begin(), Slots.end(),
+		[&](const Slot& s) { return s.Speaker == Speaker; });
+	if (it != Slots.end())
+	{
+		it->LastFrameTime = Time;
+		it->Prio = Prio;
+		return true;
+	}
+
+	if (Slots.size() < CurSettings.MaxSpeakers)
+	{
+		Slots.push_back({ Speaker, Time, Prio });
+		return true;
+	}
+
+	// Take the slot of the lowest priority speaker, and of those the one that has
+	// been quiet the longest, but only from a strictly lower priority so that
+	// speakers of the same priority don't cut each other off.
+	auto Lowest = std::min_element(Slots.begin(), Slots.end(), [](const Slot& a, const Slot& b) {
+		return a.Prio != b.Prio ? a.Prio < b.Prio : a.LastFrameTime < b.LastFrameTime;
+	});
+	if (Lowest == Slots.end() || Lowest->Prio >= Prio)
+		return false;
+
+	*Lowest = { Speaker, Time, Prio };
+	return true;
+}
+
+bool MMatchVoiceForwarder::SpendBudget(ReceiverState& State, size_t FrameSize, u64 Time)
+{
+	// A token bucket that holds up to a second's worth of bytes.
+	const auto Max = float(CurSettings.BytesPerSecond);
+	if (State.LastBudgetTime == 0)
+		State.Budget = Max;
+	else
+		State.Budget = std::min(Max,
+			State.Budget + (Time - State.LastBudgetTime) * CurSettings.BytesPerSecond / 1000.f);
+	State.LastBudgetTime = Time;
+
+	if (State.Budget < FrameSize)
+		return false;
+
+	State.Budget -= FrameSize;
+	return true;
+}
+
+void MMatchVoiceForwarder::RemovePlayer(const MUID& uid)
+{
+	Receivers.erase(uid);
+	for (auto& Pair : Receivers)
+	{
+		auto& Slots = Pair.second.Slots;
+		Slots.erase(std::remove_if(Slots.begin(), Slots.end(),
+			[&](const Slot& s) { return s.Speaker == uid; }), Slots.end());
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "GlobalTypes.h"
+#include "MUID.h"
+
+class MMatchObject;
+
+// Decides which players of a stage get a player's voice chat frames, so that a
+// full room of people talking at once doesn't mean every client gets every stream.
+//
+// Each receiver hears at most MaxSpeakers players at a time. A speaker keeps their
+// slot while they keep talking, and loses it after SpeakerTimeoutMS of silence. When
+// all slots are taken, a new speaker only gets one by taking it from a speaker of a
+// lower priority: teammates come first, then players within NearRange, then the
+// rest. On top of that, each receiver has a byte budget, and frames that don't fit
+// in it are dropped.
+//
+// Distances come from each player's BasicInfoHistory, which is only filled in with
+// server-based netcode, so with other netcodes only teams are used.
+class MMatchVoiceForwarder
+{
+public:
+	struct Settings
+	{
+		u32 MaxSpeakers = 4;
+		u32 SpeakerTimeoutMS = 500;
+		float NearRange = 3000.f;
+		// How many bytes of voice a receiver can get per second. Frames are 60 ms of
+		// Opus, usually around 150 bytes, so this fits MaxSpeakers with room to spare.
+		u32 BytesPerSecond = 16000;
+	};
+
+	struct Stats
+	{
+		// Frames considered for a receiver, and how many were forwarded. The rest were
+		// suppressed for lack of a speaker slot or for going over the byte budget.
+		u64 Considered = 0;
+		u64 Forwarded = 0;
+		u64 SuppressedSpeakers = 0;
+		u64 SuppressedBudget = 0;
+	};
+
+	void SetEnabled(bool bEnable) { bEnabled = bEnable; }
+	bool IsEnabled() const { return bEnabled; }
+	void SetSettings(const Settings& NewSettings) { CurSettings = NewSettings; }
+	auto& GetSettings() const { return CurSettings; }
+
+	// Returns whether a voice frame of FrameSize bytes from Speaker should be
+	// forwarded to Receiver, and updates Stats.
+	bool ShouldForward(const MMatchObject& Speaker, const MMatchObject& Receiver,
+		size_t FrameSize, bool bTeamPlay, u64 Time, Stats& Stats);
+
+	void RemovePlayer(const MUID& uid);
+	void Clear() { Receivers.clear(); }
+
+private:
+	enum class Priority
+	{
+		Far,
+		Near,
+		Teammate,
+	};
+
+	struct Slot
+	{
+		MUID Speaker;
+		u64 LastFrameTime;
+		Priority Prio;
+	};
+
+	struct ReceiverState
+	{
+		std::vector<Slot> Slots;
+		float Budget = 0;
+		u64 LastBudgetTime = 0;
+	};
+
+	Priority GetPriority(const MMatchObject& Speaker, const MMatchObject& Receiver,
+		bool bTeamPlay) const;
+	bool TakeSlot(ReceiverState& State, const MUID& Speaker, Priority Prio, u64 Time);
+	bool SpendBudget(ReceiverState& State, size_t FrameSize, u64 Time);
+
+	bool bEnabled = false;
+	Settings CurSettings;
+	std::unordered_map<MUID, ReceiverState> Receivers;
+};
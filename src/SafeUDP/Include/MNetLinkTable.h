@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include "GlobalTypes.h"
+
+class MNetLink;
+
+// Map key (see MNetLink::GetMapKey) -> MNetLink* table. Every received datagram looks up
+// its link, so this uses open addressing with linear probing, which usually finds the
+// link in the first slot it checks instead of walking a tree of heap nodes.
+class MNetLinkTable
+{
+public:
+	MNetLink* Find(i64 Key) const;
+	// Returns false if Key is already in the table.
+	bool Insert(i64 Key, MNetLink* pNetLink);
+	// Returns the link that was removed, or nullptr if Key wasn't in the table.
+	MNetLink* Erase(i64 Key);
+	void clear();
+
+	size_t size() const { return Size; }
+	bool empty() const { return Size == 0; }
+
+	// Calls Fn(MNetLink*) on every link. Fn must not insert or erase links.
+	template <typename FnType>
+	void ForEach(FnType&& Fn) const
+	{
+		for (auto& Slot : Slots)
+			if (Slot.pNetLink)
+				Fn(Slot.pNetLink);
+	}
+
+private:
+	struct Slot
+	{
+		i64 Key;
+		MNetLink* pNetLink;
+	};
+
+	size_t GetHomeIndex(i64 Key) const;
+	// Returns the index of Key's slot, or of the empty slot where it would go.
+	size_t FindIndex(i64 Key) const;
+	void Grow();
+
+	std::vector<Slot> Slots;
+	size_t Size = 0;
+	int Shift = 64;
+};
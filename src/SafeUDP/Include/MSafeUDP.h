@@ -6,8 +6,9 @@
 //								    LastUpdate : 2000/07/25
 /////////////////////////////////////////////////////////////
 
-#include <map>
+#include <atomic>
 #include <list>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -17,6 +18,8 @@
 #include "MBasePacket.h"
 #include "MTrafficLog.h"
 #include "MInetUtil.h"
+#include "MNetLinkTable.h"
+#include "MTimerWheel.h"
 #include <memory>
 
 #ifdef WIN32
@@ -24,13 +27,18 @@
 #endif
 
 class MSafeUDP;
+class MNetLink;
 
 // INNER CLASS //////////////////////////////////////////////////////////////////////////
+struct MACKWaitItem;
+
 struct MSendQueueItem {
 	u32 dwIP;
 	u16 wRawPort;
 	MBasePacket* pPacket;
 	u32 dwPacketSize;
+	// For a safe packet, the ACK wait item to add to the link before it's sent.
+	MACKWaitItem* pACKWaitItem;
 };
 
 struct MACKQueueItem {
@@ -39,11 +47,14 @@ struct MACKQueueItem {
 	u8 nSafeIndex;
 };
 
-struct MACKWaitItem {
+// Scheduled in MSafeUDP::m_RetransmitTimers to expire when the packet should be resent.
+struct MACKWaitItem : MTimerWheelNode {
+	MNetLink* pNetLink;
 	std::unique_ptr<MSafePacket> pPacket;
 	u32 dwPacketSize;
-	MTime::timeval tvFirstSent;
-	MTime::timeval tvLastSent;
+	u64 FirstSentTime;
+	// Retransmission timeout in milliseconds. Doubled on every retransmission.
+	u32 RTO;
 	u8 nSendCount;
 };
 
@@ -59,9 +70,6 @@ public:
 		LINKSTATE_FIN_RCVD
 	};
 
-	typedef std::list<MACKWaitItem*>		ACKWaitList;
-	typedef ACKWaitList::iterator	ACKWaitListItor;
-
 private:
 	MSafeUDP*		m_pSafeUDP{};
 	bool			m_bConnected{};
@@ -73,13 +81,21 @@ private:
 	u32				m_dwAuthKey{};
 	void*			m_pUserData{};
 
+	// Safe packets waiting for an ACK, indexed by their nSafeIndex. Guarded by
+	// MSafeUDP::m_csNetLink, like the retransmission timers they're scheduled in.
+	MACKWaitItem*	m_ACKWaitItems[256]{};
+	// Also read under the send lock by MakeACKWait.
+	std::atomic<int> m_nACKWaitCount{};
+
+	// Round trip time estimates in milliseconds, as in RFC 6298.
+	u32				m_nSRTT{};
+	u32				m_nRTTVar{};
+	u32				m_nRTO{};
+
 public:
 	MTime::timeval			m_tvConnectedTime{};
 	MTime::timeval			m_tvLastPacketRecvTime{};
 
-public:
-	ACKWaitList		m_ACKWaitQueue;	// Safe Sent queue, Wait for ACK
-
 private:
 	void Setconnected(bool bConnected)	{ m_bConnected = bConnected; }
 	void CreateAuthKey() { 	
@@ -87,6 +103,7 @@ private:
 	}
 	u8 GetNextReadIndex() { return m_nNextReadIndex++; }
 	u8 GetNextWriteIndex() { return m_nNextWriteIndex++; }
+	void UpdateRTO(u32 nRTT);
 
 public:
 	MNetLink();
@@ -95,8 +112,17 @@ public:
 	bool SendControl(MControlPacket::CONTROL nControl);
 	bool OnRecvControl(MControlPacket* pPacket);
 
-	bool SetACKWait(MSafePacket* pPacket, u32 dwPacketSize);
+	// Gives pPacket the next safe index and makes an ACK wait item that owns it, or
+	// returns null if too many packets are waiting. Called under the send lock, so it
+	// doesn't touch the ACK wait items or the timers; SetACKWait adds the item later.
+	MACKWaitItem* MakeACKWait(MSafePacket* pPacket, u32 dwPacketSize);
+	// Adds an item from MakeACKWait and starts its retransmission timer. Must be
+	// called under MSafeUDP::m_csNetLink.
+	void SetACKWait(MACKWaitItem* pACKWaitItem);
 	bool ClearACKWait(u8 nSafeIndex);
+	void ClearAllACKWaits();
+	int GetACKWaitCount() const			{ return m_nACKWaitCount; }
+	u32 GetRTO() const					{ return m_nRTO; }
 
 	void SetSafeUDP(MSafeUDP* pSafeUDP)	{ m_pSafeUDP = pSafeUDP; }
 	MSafeUDP* GetSafeUDP()				{ return m_pSafeUDP; }
@@ -120,10 +146,6 @@ public:
 	void* GetUserData() const			{ return m_pUserData; }
 };
 
-typedef std::map<i64, MNetLink*>	NetLinkMap;
-typedef NetLinkMap::value_type	NetLinkType;
-typedef NetLinkMap::iterator	NetLinkItor;
-
 
 // INNER CLASS //////////////////////////////////////////////////////////////////////////
 typedef void(MNETLINKSTATECALLBACK)(MNetLink* pNetLink, MNetLink::LINKSTATE nState);
@@ -135,10 +157,10 @@ class MSafeUDP;
 class MSocketThread : public MThread
 {
 public:
-	typedef std::list<MACKQueueItem*>	ACKSendList;
-	typedef ACKSendList::iterator	ACKSendListItor;
-	typedef std::list<MSendQueueItem*>	SendList;
-	typedef SendList::iterator		SendListItor;
+	// Held by value and swapped between the push and flush sides, so their storage is
+	// reused instead of allocating a node per packet.
+	typedef std::vector<MACKQueueItem>	ACKSendList;
+	typedef std::vector<MSendQueueItem>	SendList;
 
 	MCUSTOMRECVCALLBACK*	m_fnCustomRecvCallback{};
 	MLIGHTRECVCALLBACK*		m_fnLightRecvCallback{};
@@ -173,16 +195,21 @@ private:
 	bool FlushSend();
 
 	bool SafeSendManage();
+	// Resends safe packets whose retransmission timers have expired, and runs
+	// SafeSendManage when it's due. Returns how long to wait for events until the next call.
+	u32 ManageTimers();
+	void OnRetransmitTimer(MACKWaitItem& Item, u64 Now);
 
 	bool Recv();
+	void OnRecv(u32 dwIP, u16 wRawPort, char* pPacket, u32 dwSize);
 	bool OnCustomRecv(u32 dwIP, u16 wRawPort, char* pPacket, u32 dwSize);
 	bool OnControlRecv(u32 dwIP, u16 wRawPort, MBasePacket* pPacket, u32 dwSize);
 	bool OnLightRecv(u32 dwIP, u16 wRawPort, MLightPacket* pPacket, u32 dwSize);
 	bool OnACKRecv(u32 dwIP, u16 wRawPort, MACKPacket* pPacket);
 	bool OnGenericRecv(u32 dwIP, u16 wRawPort, MBasePacket* pPacket, u32 dwSize);
 
-	template <typename T>
-	bool SendPacket(const T& DestAddr, const void* Data, size_t DataSize);
+	// Sends m_SendDatagrams with as few system calls as possible.
+	void SendDatagrams();
 
 	MSafeUDP*				m_pSafeUDP{};
 	MSignalEvent			m_ACKEvent;
@@ -197,6 +224,17 @@ private:
 	SendList				m_TempSendList;		// Temporary Send List for Sync
 	MCriticalSection		m_csSendLock;
 
+	// Receive buffers for one batch of datagrams. They're allocated once when the thread
+	// starts, and reused for every batch.
+	std::vector<char>				m_RecvBuffer;
+	std::vector<MSocket::Datagram>	m_RecvDatagrams;
+
+	std::vector<MSocket::Datagram>	m_SendDatagrams;
+	std::vector<MACKPacket>			m_ACKPackets;
+	std::vector<MNetLink*>			m_ClosedLinks;
+
+	u64						m_LastSafeSendManageTime{};
+
 	u32						m_nTotalSend{};
 	u32						m_nTotalRecv{};
 	MTrafficLog				m_SendTrafficLog;
@@ -244,8 +282,10 @@ public:
 
 	MCriticalSection			m_csNetLink;
 
-	NetLinkMap					m_NetLinkMap;
-	MNETLINKSTATECALLBACK*		m_fnNetLinkStateCallback;
+	MNetLinkTable				m_NetLinkTable;
+	// Retransmission timers of every link's MACKWaitItems. Guarded by m_csNetLink, like the links.
+	MTimerWheel					m_RetransmitTimers;
+	MNETLINKSTATECALLBACK*		m_fnNetLinkStateCallback{};
 
 private:
 	bool OpenSocket(int nPort, bool bReuse = true);
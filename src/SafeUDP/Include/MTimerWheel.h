@@ -0,0 +1,106 @@
+#pragma once
+
+#include "GlobalTypes.h"
+
+class MTimerWheel;
+
+// Intrusive hook for MTimerWheel. Embed it in (or derive from it) the object that a timer
+// is for. A node that's destroyed while scheduled removes itself from its wheel.
+class MTimerWheelNode
+{
+public:
+	MTimerWheelNode() = default;
+	MTimerWheelNode(const MTimerWheelNode&) = delete;
+	MTimerWheelNode& operator=(const MTimerWheelNode&) = delete;
+	~MTimerWheelNode() { Cancel(); }
+
+	bool IsScheduled() const { return pWheel != nullptr; }
+	u64 GetExpiryTick() const { return ExpiryTick; }
+
+	// O(1). Does nothing if the node isn't scheduled.
+	void Cancel();
+
+private:
+	friend class MTimerWheel;
+
+	void Link(MTimerWheelNode& Head);
+	void Unlink();
+
+	MTimerWheelNode* pPrev{};
+	MTimerWheelNode* pNext{};
+	MTimerWheel* pWheel{};
+	u64 ExpiryTick{};
+};
+
+// Hierarchical timing wheel (Varghese & Lauck). Scheduling and cancelling timers is O(1),
+// and advancing a tick only touches the timers that expire in it, plus every 64^n ticks,
+// the ones that are moved down from level n.
+//
+// Level 0 has a slot per tick for the next 64 ticks, level 1 a slot per 64 ticks for the
+// next 64 * 64 ticks, and so on. Timers further out than the top level can reach are
+// clamped to its range.
+class MTimerWheel
+{
+public:
+	MTimerWheel();
+	MTimerWheel(const MTimerWheel&) = delete;
+	MTimerWheel& operator=(const MTimerWheel&) = delete;
+	~MTimerWheel();
+
+	// Sets the current tick. Only valid while no timers are scheduled.
+	void Reset(u64 Tick);
+
+	// Schedules Node to expire when the wheel advances to ExpiryTick, or on the next tick
+	// if ExpiryTick isn't in the future. Reschedules it if it was already scheduled.
+	void Schedule(MTimerWheelNode& Node, u64 ExpiryTick);
+
+	// Advances the wheel to Tick, calling Fn(MTimerWheelNode&) on each node that expires,
+	// in expiry order. The node is unscheduled before Fn is called, and Fn may reschedule
+	// it, destroy it, or schedule and cancel other nodes.
+	template <typename FnType>
+	void Advance(u64 Tick, FnType&& Fn);
+
+	u64 GetCurrentTick() const { return CurrentTick; }
+	size_t size() const { return Size; }
+	bool empty() const { return Size == 0; }
+
+private:
+	friend class MTimerWheelNode;
+
+	static constexpr int LevelBits = 6;
+	static constexpr int SlotsPerLevel = 1 << LevelBits;
+	static constexpr int NumLevels = 4;
+
+	static u64 GetLevelSpan(int Level) { return u64(1) << (LevelBits * Level); }
+	void Insert(MTimerWheelNode& Node);
+	// Moves the nodes in a slot of level Level > 0 down into the lower levels.
+	void Cascade(int Level, int Slot);
+
+	MTimerWheelNode Slots[NumLevels][SlotsPerLevel];
+	u64 CurrentTick = 0;
+	size_t Size = 0;
+};
+
+template <typename FnType>
+void MTimerWheel::Advance(u64 Tick, FnType&& Fn)
+{
+	while (CurrentTick < Tick)
+	{
+		++CurrentTick;
+
+		for (int Level = 1; Level < NumLevels; ++Level)
+		{
+			if ((CurrentTick & (GetLevelSpan(Level) - 1)) != 0)
+				break;
+			Cascade(Level, int((CurrentTick >> (LevelBits * Level)) & (SlotsPerLevel - 1)));
+		}
+
+		auto& Head = Slots[0][CurrentTick & (SlotsPerLevel - 1)];
+		while (Head.pNext != &Head)
+		{
+			auto& Node = *Head.pNext;
+			Node.Cancel();
+			Fn(Node);
+		}
+	}
+}
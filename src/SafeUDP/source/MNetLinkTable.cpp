@@ -0,0 +1,100 @@
+#include "stdafx.h"
+#include "MNetLinkTable.h"
+
+static constexpr size_t MinCapacity = 64;
+
+size_t MNetLinkTable::GetHomeIndex(i64 Key) const
+{
+	// Keys of clients on the same network only differ in a few bits, so they're spread out
+	// with a multiplicative hash, taking the top bits.
+	return size_t((u64(Key) * 0x9E3779B97F4A7C15ull) >> Shift);
+}
+
+size_t MNetLinkTable::FindIndex(i64 Key) const
+{
+	const auto Mask = Slots.size() - 1;
+	auto Index = GetHomeIndex(Key);
+	while (Slots[Index].pNetLink && Slots[Index].Key != Key)
+		Index = (Index + 1) & Mask;
+	return Index;
+}
+
+MNetLink* MNetLinkTable::Find(i64 Key) const
+{
+	if (Size == 0)
+		return nullptr;
+
+	return Slots[FindIndex(Key)].pNetLink;
+}
+
+bool MNetLinkTable::Insert(i64 Key, MNetLink* pNetLink)
+{
+	// Keeps the table at most half full, so probe sequences stay short.
+	if ((Size + 1) * 2 > Slots.size())
+		Grow();
+
+	auto& Slot = Slots[FindIndex(Key)];
+	if (Slot.pNetLink)
+		return false;
+
+	Slot.Key = Key;
+	Slot.pNetLink = pNetLink;
+	++Size;
+	return true;
+}
+
+MNetLink* MNetLinkTable::Erase(i64 Key)
+{
+	if (Size == 0)
+		return nullptr;
+
+	auto Index = FindIndex(Key);
+	auto pNetLink = Slots[Index].pNetLink;
+	if (!pNetLink)
+		return nullptr;
+
+	// Shift the following entries of the probe sequence back into the hole, so that lookups
+	// never have to skip over deleted slots.
+	const auto Mask = Slots.size() - 1;
+	auto Next = Index;
+	while (true)
+	{
+		Next = (Next + 1) & Mask;
+		if (!Slots[Next].pNetLink)
+			break;
+
+		const auto Home = GetHomeIndex(Slots[Next].Key);
+		// The entry can only move back if the hole is between its home slot and its current one.
+		if (((Next - Home) & Mask) >= ((Next - Index) & Mask))
+		{
+			Slots[Index] = Slots[Next];
+			Index = Next;
+		}
+	}
+
+	Slots[Index] = {};
+	--Size;
+	return pNetLink;
+}
+
+void MNetLinkTable::clear()
+{
+	for (auto& Slot : Slots)
+		Slot = {};
+	Size = 0;
+}
+
+void MNetLinkTable::Grow()
+{
+	const auto NewCapacity = Slots.empty() ? MinCapacity : Slots.size() * 2;
+
+	std::vector<Slot> OldSlots(NewCapacity);
+	OldSlots.swap(Slots);
+	Shift = 64;
+	for (auto Capacity = NewCapacity; Capacity > 1; Capacity >>= 1)
+		--Shift;
+
+	for (auto& Slot : OldSlots)
+		if (Slot.pNetLink)
+			Slots[FindIndex(Slot.Key)] = Slot;
+}
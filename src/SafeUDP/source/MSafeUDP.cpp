@@ -6,16 +6,27 @@
 #include "MUtil.h"
 #include "MFile.h"
 #include "MSync.h"
+#include <algorithm>
 
 #define MAX_RECVBUF_LEN		65535
+#define SAFEUDP_RECV_BATCH_SIZE		16
 
 #define SAFEUDP_MAX_SENDQUEUE_LENGTH		5120
 #define SAFEUDP_MAX_ACKQUEUE_LENGTH			5120
 #define SAFEUDP_MAX_ACKWAITQUEUE_LENGTH		64
 
 #define SAFEUDP_SAFE_MANAGE_TIME			100		// WSA_INFINITE for debug
-#define SAFEUDP_SAFE_RETRANS_TIME			500
+#define SAFEUDP_SAFE_RETRANS_TIME			500		// RTO until the link's RTT has been measured
 #define SAFEUDP_MAX_SAFE_RETRANS_TIME		5000
+#define SAFEUDP_MIN_RTO						100
+#define SAFEUDP_MAX_RTO						2000
+#define SAFEUDP_TIMER_TICK_TIME				10
+
+// Rounds up, so that timers never expire early.
+static u64 GetTimerTick(u64 Time)
+{
+	return (Time + SAFEUDP_TIMER_TICK_TIME - 1) / SAFEUDP_TIMER_TICK_TIME;
+}
 
 
 #define LINKSTATE_LOG
@@ -36,6 +47,7 @@ MNetLink::MNetLink()
 	m_nNextWriteIndex = 0;
 	m_dwAuthKey = 0;
 	m_pUserData = NULL;
+	m_nRTO = SAFEUDP_SAFE_RETRANS_TIME;
 
 	MTime::GetTime(&m_tvConnectedTime);
 	MTime::GetTime(&m_tvLastPacketRecvTime);
@@ -43,10 +55,7 @@ MNetLink::MNetLink()
 
 MNetLink::~MNetLink()
 {
-	for (ACKWaitListItor itor = m_ACKWaitQueue.begin(); itor != m_ACKWaitQueue.end(); ) {
-		delete (*itor);
-		itor = m_ACKWaitQueue.erase(itor);
-	}
+	ClearAllACKWaits();
 }
 
 void MNetLink::SetLinkState(MNetLink::LINKSTATE nState) 
@@ -213,36 +222,79 @@ bool MNetLink::OnRecvControl(MControlPacket* pPacket)
 	return m_pSafeUDP->Send(this, pReply, sizeof(MControlPacket));
 }
 
-bool MNetLink::SetACKWait(MSafePacket* pPacket, u32 dwPacketSize)
+MACKWaitItem* MNetLink::MakeACKWait(MSafePacket* pPacket, u32 dwPacketSize)
 {
-	if (m_ACKWaitQueue.size() > SAFEUDP_MAX_ACKWAITQUEUE_LENGTH)
-		return false;
+	if (m_nACKWaitCount > SAFEUDP_MAX_ACKWAITQUEUE_LENGTH)
+		return nullptr;
 
 	pPacket->nSafeIndex = GetNextWriteIndex();
-	MACKWaitItem* pACKWaitItem = new MACKWaitItem;
+
+	auto* pACKWaitItem = new MACKWaitItem;
+	pACKWaitItem->pNetLink = this;
 	pACKWaitItem->pPacket = std::unique_ptr<MSafePacket>{ pPacket };
 	pACKWaitItem->dwPacketSize = dwPacketSize;
 	pACKWaitItem->nSendCount = 1;		// SendQueue
-	MTime::GetTime(&pACKWaitItem->tvFirstSent);
-	MTime::GetTime(&pACKWaitItem->tvLastSent);
-	m_ACKWaitQueue.push_back(pACKWaitItem);
+	return pACKWaitItem;
+}
 
-	return true;
+void MNetLink::SetACKWait(MACKWaitItem* pNewItem)
+{
+	// The index has wrapped around to a packet that's still waiting, which means that one
+	// has been lost for good.
+	auto*& pACKWaitItem = m_ACKWaitItems[pNewItem->pPacket->nSafeIndex];
+	if (pACKWaitItem) {
+		delete pACKWaitItem;
+		--m_nACKWaitCount;
+	}
+
+	pACKWaitItem = pNewItem;
+	pACKWaitItem->FirstSentTime = GetGlobalTimeMS();
+	pACKWaitItem->RTO = m_nRTO;
+	++m_nACKWaitCount;
+
+	m_pSafeUDP->m_RetransmitTimers.Schedule(*pACKWaitItem,
+		GetTimerTick(pACKWaitItem->FirstSentTime + pACKWaitItem->RTO));
 }
 
 bool MNetLink::ClearACKWait(u8 nSafeIndex)
 {
-	for (ACKWaitListItor itor = m_ACKWaitQueue.begin(); itor != m_ACKWaitQueue.end(); ) {
-		MACKWaitItem* pACKWaitItem = *itor;
-		if (pACKWaitItem->pPacket->nSafeIndex == nSafeIndex) {
-			delete pACKWaitItem;	// pACKWaitItem->pPacket will Delete too
-			itor = m_ACKWaitQueue.erase(itor);
-			return true;
-		} else {
-			++itor;
-		}
+	auto*& pACKWaitItem = m_ACKWaitItems[nSafeIndex];
+	if (pACKWaitItem == NULL)
+		return false;
+
+	// Karn's algorithm: The ACK for a retransmitted packet could be for any of the copies,
+	// so only packets that were sent once are used to measure the RTT.
+	if (pACKWaitItem->nSendCount == 1)
+		UpdateRTO(u32(GetGlobalTimeMS() - pACKWaitItem->FirstSentTime));
+
+	delete pACKWaitItem;	// Cancels the timer, and pACKWaitItem->pPacket will Delete too
+	pACKWaitItem = NULL;
+	--m_nACKWaitCount;
+	return true;
+}
+
+void MNetLink::ClearAllACKWaits()
+{
+	for (auto*& pACKWaitItem : m_ACKWaitItems) {
+		delete pACKWaitItem;
+		pACKWaitItem = NULL;
 	}
-	return false;
+	m_nACKWaitCount = 0;
+}
+
+void MNetLink::UpdateRTO(u32 nRTT)
+{
+	if (m_nSRTT == 0) {
+		m_nSRTT = (std::max)(nRTT, 1u);
+		m_nRTTVar = nRTT / 2;
+	} else {
+		const auto nDiff = nRTT > m_nSRTT ? nRTT - m_nSRTT : m_nSRTT - nRTT;
+		m_nRTTVar = (3 * m_nRTTVar + nDiff) / 4;
+		m_nSRTT = (7 * m_nSRTT + nRTT) / 8;
+	}
+
+	const auto nRTO = m_nSRTT + (std::max)(u32(SAFEUDP_TIMER_TICK_TIME), 4 * m_nRTTVar);
+	m_nRTO = (std::min)((std::max)(nRTO, u32(SAFEUDP_MIN_RTO)), u32(SAFEUDP_MAX_RTO));
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -279,7 +331,16 @@ void MSocketThread::Run()
 			break;
 	}
 
+	m_RecvBuffer.resize(SAFEUDP_RECV_BATCH_SIZE * MAX_RECVBUF_LEN);
+	m_RecvDatagrams.resize(SAFEUDP_RECV_BATCH_SIZE);
+	for (size_t i = 0; i < m_RecvDatagrams.size(); ++i)
+	{
+		m_RecvDatagrams[i].Buffer = &m_RecvBuffer[i * MAX_RECVBUF_LEN];
+		m_RecvDatagrams[i].Size = MAX_RECVBUF_LEN;
+	}
+
 	bool bSendable = false;
+	u32 nWaitTime = SAFEUDP_SAFE_MANAGE_TIME;
 	auto SocketEvent = MSocket::CreateEvent();
 	MSignalEvent* EventArray[]{
 		&SocketEvent,
@@ -296,7 +357,7 @@ void MSocketThread::Run()
 
 	while (true)
 	{
-		auto WaitResult = WaitForMultipleEvents(EventArray, SAFEUDP_SAFE_MANAGE_TIME);
+		auto WaitResult = WaitForMultipleEvents(EventArray, nWaitTime);
 
 		if (WaitResult == MSync::WaitFailed)
 		{
@@ -323,17 +384,18 @@ void MSocketThread::Run()
 		}
 			break;
 
-			// ACK Send Event
+			// ACK Send Event. The events are reset before flushing, so a push that
+			// happens during the flush sets them again instead of waiting for a timeout.
 		case 1:
-			FlushACK();
 			m_ACKEvent.ResetEvent();
+			FlushACK();
 			break;
 
 			// Packet Send Event
 		case 2:
+			m_SendEvent.ResetEvent();
 			if (bSendable == true)
 				FlushSend();
-			m_SendEvent.ResetEvent();
 			break;
 
 			// Kill event
@@ -342,59 +404,43 @@ void MSocketThread::Run()
 			goto end_thread; // Stop Thread
 
 		default:
-			m_pSafeUDP->LockNetLink();
-			SafeSendManage();
-			m_pSafeUDP->UnlockNetLink();
 			break;
 		}
+
+		// Timers are checked after every event, since a busy socket may never let the
+		// wait time out.
+		nWaitTime = ManageTimers();
 	}
 
 end_thread:
 
 	// Clear Queues
 	LockSend();
-	{
-		for (SendListItor itor = m_SendList.begin(); itor != m_SendList.end(); ) {
-			delete (*itor);
-			itor = m_SendList.erase(itor);
-		}
-	}
-	{
-		for (SendListItor itor = m_TempSendList.begin(); itor != m_TempSendList.end(); ) {
-			delete (*itor);
-			itor = m_TempSendList.erase(itor);
-		}
-	}
+	for (auto& SendItem : m_TempSendList)
+		delete SendItem.pACKWaitItem;
+	m_SendList.clear();
+	m_TempSendList.clear();
 	UnlockSend();
 
 	LockACK();
-	{
-		for (ACKSendListItor itor = m_ACKSendList.begin(); itor != m_ACKSendList.end(); ) {
-			delete (*itor);
-			itor = m_ACKSendList.erase(itor);
-		}
-	}
-	{
-		for (ACKSendListItor itor = m_TempACKSendList.begin(); itor != m_TempACKSendList.end(); ) {
-			delete (*itor);
-			itor = m_TempACKSendList.erase(itor);
-		}
-	}
+	m_ACKSendList.clear();
+	m_TempACKSendList.clear();
 	UnlockACK();
 }
 
 bool MSocketThread::PushACK(MNetLink* pNetLink, MSafePacket* pPacket)
 {
-	if (m_ACKSendList.size() > SAFEUDP_MAX_ACKQUEUE_LENGTH)
-		return false;
-
-	MACKQueueItem* pACKItem = new MACKQueueItem;
-	pACKItem->dwIP = pNetLink->GetIP();
-	pACKItem->wRawPort = pNetLink->GetRawPort();
-	pACKItem->nSafeIndex = pPacket->nSafeIndex;
+	MACKQueueItem ACKItem;
+	ACKItem.dwIP = pNetLink->GetIP();
+	ACKItem.wRawPort = pNetLink->GetRawPort();
+	ACKItem.nSafeIndex = pPacket->nSafeIndex;
 
 	LockACK();
-	m_TempACKSendList.push_back(pACKItem);
+	if (m_TempACKSendList.size() > SAFEUDP_MAX_ACKQUEUE_LENGTH) {
+		UnlockACK();
+		return false;
+	}
+	m_TempACKSendList.push_back(ACKItem);
 	UnlockACK();
 
 	m_ACKEvent.SetEvent();
@@ -404,21 +450,34 @@ bool MSocketThread::PushACK(MNetLink* pNetLink, MSafePacket* pPacket)
 
 bool MSocketThread::PushSend(MNetLink* pNetLink, MBasePacket* pPacket, u32 dwPacketSize, bool bRetransmit)
 {
-	if (!pNetLink || m_SendList.size() > SAFEUDP_MAX_SENDQUEUE_LENGTH)
+	if (!pNetLink)
 		return false;
 
-	MSendQueueItem* pSendItem = new MSendQueueItem;
-	pSendItem->dwIP = pNetLink->GetIP();
-	pSendItem->wRawPort = pNetLink->GetRawPort();
-	pSendItem->pPacket = pPacket;
-	pSendItem->dwPacketSize = dwPacketSize;
-
-	if (pPacket->GetFlag(SAFEUDP_FLAG_SAFE_PACKET) != false && bRetransmit == false) {
-		pNetLink->SetACKWait((MSafePacket*)pPacket, dwPacketSize);
-	}
+	MSendQueueItem SendItem;
+	SendItem.dwIP = pNetLink->GetIP();
+	SendItem.wRawPort = pNetLink->GetRawPort();
+	SendItem.pPacket = pPacket;
+	SendItem.dwPacketSize = dwPacketSize;
+	SendItem.pACKWaitItem = nullptr;
 
 	LockSend();
-	m_TempSendList.push_back(pSendItem);
+	if (m_TempSendList.size() > SAFEUDP_MAX_SENDQUEUE_LENGTH) {
+		UnlockSend();
+		return false;
+	}
+	if (pPacket->GetFlag(SAFEUDP_FLAG_SAFE_PACKET) != false) {
+		// The ACK wait item keeps the packet for retransmission, and may delete it when
+		// it's ACKed while this is still queued, so the send queue gets its own copy.
+		// Only the send lock is held here, so FlushSend adds the item to the link.
+		if (!bRetransmit)
+			SendItem.pACKWaitItem = pNetLink->MakeACKWait((MSafePacket*)pPacket, dwPacketSize);
+		if (bRetransmit || SendItem.pACKWaitItem) {
+			auto* pCopy = new char[dwPacketSize];
+			memcpy(pCopy, pPacket, dwPacketSize);
+			SendItem.pPacket = (MBasePacket*)pCopy;
+		}
+	}
+	m_TempSendList.push_back(SendItem);
 	UnlockSend();
 
 	m_SendEvent.SetEvent();
@@ -428,21 +487,23 @@ bool MSocketThread::PushSend(MNetLink* pNetLink, MBasePacket* pPacket, u32 dwPac
 
 bool MSocketThread::PushSend(const char* pszIP, int nPort, char* pPacket, u32 dwPacketSize)
 {
-	if (m_SendList.size() > SAFEUDP_MAX_SENDQUEUE_LENGTH)
-		return false;
-
 	MSocket::sockaddr_in Addr;
 	if (MNetLink::MakeSockAddr(pszIP, nPort, &Addr) == false)
 		return false;
 
-	MSendQueueItem* pSendItem = new MSendQueueItem;
-	pSendItem->dwIP = Addr.sin_addr.S_un.S_addr;
-	pSendItem->wRawPort = Addr.sin_port;
-	pSendItem->pPacket = (MBasePacket*)pPacket;
-	pSendItem->dwPacketSize = dwPacketSize;
+	MSendQueueItem SendItem;
+	SendItem.dwIP = Addr.sin_addr.S_un.S_addr;
+	SendItem.wRawPort = Addr.sin_port;
+	SendItem.pPacket = (MBasePacket*)pPacket;
+	SendItem.dwPacketSize = dwPacketSize;
+	SendItem.pACKWaitItem = nullptr;
 
 	LockSend();
-	m_TempSendList.push_back(pSendItem);
+	if (m_TempSendList.size() > SAFEUDP_MAX_SENDQUEUE_LENGTH) {
+		UnlockSend();
+		return false;
+	}
+	m_TempSendList.push_back(SendItem);
 	UnlockSend();
 
 	m_SendEvent.SetEvent();
@@ -452,91 +513,94 @@ bool MSocketThread::PushSend(const char* pszIP, int nPort, char* pPacket, u32 dw
 
 bool MSocketThread::PushSend(u32 dwIP, int nPort, char* pPacket, u32 dwPacketSize)
 {
-	if (SAFEUDP_MAX_SENDQUEUE_LENGTH < m_SendList.size() ||
-		MSocket::in_addr::None == dwIP)
+	if (MSocket::in_addr::None == dwIP)
 	 	return false;
 
-	MSocket::sockaddr_in Addr{};
-
-	//	Set Dest IP and Port 
-	Addr.sin_family = MSocket::AF::INET;
-	Addr.sin_port = MSocket::htons(nPort);
-	memcpy(&(Addr.sin_addr), &dwIP, 4);
-
-	MSendQueueItem* pSendItem = new MSendQueueItem;
-	if( 0 != pSendItem )
-	{
-		pSendItem->dwIP = dwIP;
-		pSendItem->wRawPort = Addr.sin_port;
-		pSendItem->pPacket = (MBasePacket*)pPacket;
-		pSendItem->dwPacketSize = dwPacketSize;
+	MSendQueueItem SendItem;
+	SendItem.dwIP = dwIP;
+	SendItem.wRawPort = MSocket::htons(nPort);
+	SendItem.pPacket = (MBasePacket*)pPacket;
+	SendItem.dwPacketSize = dwPacketSize;
+	SendItem.pACKWaitItem = nullptr;
 
-		LockSend();
-		m_TempSendList.push_back( pSendItem );
+	LockSend();
+	if (m_TempSendList.size() > SAFEUDP_MAX_SENDQUEUE_LENGTH) {
 		UnlockSend();
+		return false;
+	}
+	m_TempSendList.push_back( SendItem );
+	UnlockSend();
 
-		m_SendEvent.SetEvent();
+	m_SendEvent.SetEvent();
 
-		return true;
-	}
+	return true;
+}
 
-	return false;
+static MSocket::Datagram MakeDatagram(u32 dwIP, u16 wRawPort, const void* Data, u32 dwSize)
+{
+	MSocket::Datagram Datagram{};
+	Datagram.Buffer = static_cast<char*>(const_cast<void*>(Data));
+	Datagram.Size = int(dwSize);
+	Datagram.Addr.sin_family = MSocket::AF::INET;
+	Datagram.Addr.sin_addr.S_un.S_addr = dwIP;
+	Datagram.Addr.sin_port = wRawPort;
+	return Datagram;
 }
 
-template <typename T>
-bool MSocketThread::SendPacket(const T& DestAddr, const void* Data, size_t DataSize)
+void MSocketThread::SendDatagrams()
 {
-	auto SendToResult = MSocket::sendto(m_pSafeUDP->GetLocalSocket(),
-		static_cast<const char*>(Data),
-		DataSize,
-		0,
-		reinterpret_cast<const MSocket::sockaddr*>(&DestAddr),
-		sizeof(DestAddr));
+	const auto* Datagrams = m_SendDatagrams.data();
+	const auto Count = int(m_SendDatagrams.size());
 
-	if (SendToResult == MSocket::SocketError)
+	int nSent = 0;
+	while (nSent < Count)
 	{
-		LOG_SOCKET_ERROR("sendto", SendToResult);
-		return false;
+		const auto SendResult = MSocket::SendToBatch(m_pSafeUDP->GetLocalSocket(),
+			Datagrams + nSent, Count - nSent, 0);
+
+		if (SendResult == MSocket::SocketError)
+		{
+			// Drop the datagram that failed, and carry on with the rest.
+			LOG_SOCKET_ERROR("SendToBatch", SendResult);
+			++nSent;
+			continue;
+		}
+
+		for (int i = nSent; i < nSent + SendResult; ++i)
+			m_nTotalSend += Datagrams[i].Size;
+		nSent += SendResult;
 	}
-	else
-	{
-		m_nTotalSend += SendToResult;
+
+	if (Count > 0)
 		m_SendTrafficLog.Record(m_nTotalSend);
-	}
 
-	return true;
+	m_SendDatagrams.clear();
 }
 
 bool MSocketThread::FlushACK()
 {
 	{
+		// m_ACKSendList is empty here, so this takes the queued ACKs and gives the
+		// pushing side back the storage.
 		std::lock_guard<MCriticalSection> lock{ m_csACKLock };
-		while (m_TempACKSendList.size() > 0) {
-			ACKSendListItor itor = m_TempACKSendList.begin();
-			m_ACKSendList.push_back(*itor);
-			m_TempACKSendList.erase(itor);
-		}
+		m_ACKSendList.swap(m_TempACKSendList);
 	}
 
-	while (m_ACKSendList.size() > 0)
+	// The datagrams point into m_ACKPackets, so it can't reallocate while they're built.
+	m_ACKPackets.resize(m_ACKSendList.size());
+	for (size_t i = 0; i < m_ACKSendList.size(); ++i)
 	{
-		auto itor = m_ACKSendList.begin();
-		auto* pACKItem = *itor;
-
-		MACKPacket ACKPacket{};
-		ACKPacket.nSafeIndex = pACKItem->nSafeIndex;
-
-		MSocket::sockaddr_in DestAddr{};
-		DestAddr.sin_family = MSocket::AF::INET;
-		DestAddr.sin_addr.S_un.S_addr = pACKItem->dwIP;
-		DestAddr.sin_port = pACKItem->wRawPort;
-
-		SendPacket(DestAddr, &ACKPacket, sizeof(ACKPacket));
-
-		delete pACKItem;
-		m_ACKSendList.erase(itor);
+		auto& ACKItem = m_ACKSendList[i];
+		auto& ACKPacket = m_ACKPackets[i];
+		ACKPacket = MACKPacket{};
+		ACKPacket.nSafeIndex = ACKItem.nSafeIndex;
+		m_SendDatagrams.push_back(MakeDatagram(ACKItem.dwIP, ACKItem.wRawPort,
+			&ACKPacket, sizeof(ACKPacket)));
 	}
 
+	SendDatagrams();
+	m_ACKSendList.clear();
+
 	return true;
 }
 
@@ -544,56 +608,50 @@ bool MSocketThread::FlushSend()
 {
 	{
 		std::lock_guard<MCriticalSection> lock{ m_csSendLock };
-		while (m_TempSendList.size() > 0) {
-			auto itor = m_TempSendList.begin();
-			m_SendList.push_back(*itor);
-			m_TempSendList.erase(itor);
+		m_SendList.swap(m_TempSendList);
+	}
+
+	// The ACK wait items go in before the packets are sent, since this thread handles
+	// the ACKs as well. The link may have been closed since the packet was pushed.
+	bool bLocked = false;
+	for (auto& SendItem : m_SendList)
+	{
+		auto* pACKWaitItem = SendItem.pACKWaitItem;
+		if (!pACKWaitItem)
+			continue;
+		if (!bLocked) {
+			m_pSafeUDP->LockNetLink();
+			bLocked = true;
 		}
+		if (m_pSafeUDP->FindNetLink(SendItem.dwIP, SendItem.wRawPort) == pACKWaitItem->pNetLink)
+			pACKWaitItem->pNetLink->SetACKWait(pACKWaitItem);
+		else
+			delete pACKWaitItem;
+		SendItem.pACKWaitItem = nullptr;
 	}
+	if (bLocked)
+		m_pSafeUDP->UnlockNetLink();
 
-	MSendQueueItem* pSendItem{};
-	MSocket::sockaddr_in DestAddr{};
+	for (auto& SendItem : m_SendList)
+		m_SendDatagrams.push_back(MakeDatagram(SendItem.dwIP, SendItem.wRawPort,
+			SendItem.pPacket, SendItem.dwPacketSize));
 
-	while(m_SendList.size() > 0)
-	{
-		auto itor = m_SendList.begin();
-		pSendItem = *itor;
-
-		DestAddr.sin_family = MSocket::AF::INET;
-		DestAddr.sin_addr.S_un.S_addr = pSendItem->dwIP;
-		DestAddr.sin_port = pSendItem->wRawPort;
-
-		SendPacket(DestAddr, pSendItem->pPacket, pSendItem->dwPacketSize);
-		
-		#ifdef _OLD_SAFEUDP
-			if (pSendItem->pPacket->GetFlag(SAFEUDP_FLAG_SAFE_PACKET) != false) {
-				// Don't Delete SafePacket (pSendItem->pPacket)
-				delete pSendItem;
-				m_SendList.erase(itor);
-			} else {	// Means Normal Packet
-				delete pSendItem->pPacket;
-				delete pSendItem;
-				m_SendList.erase(itor);
-			}
-		#else
-			delete pSendItem->pPacket;
-			delete pSendItem;
-			m_SendList.erase(itor);
-		#endif
+	SendDatagrams();
+
+	for (auto& SendItem : m_SendList)
+		delete SendItem.pPacket;
+	m_SendList.clear();
 
-	}
 	return true;
 }
 
 bool MSocketThread::SafeSendManage()
 {
-	int nCnt = m_pSafeUDP->m_NetLinkMap.size();
-	for (NetLinkItor itorLink = m_pSafeUDP->m_NetLinkMap.begin(); itorLink != m_pSafeUDP->m_NetLinkMap.end(); ) {
-		MNetLink* pNetLink = (*itorLink).second;
-
-		MTime::timeval tvNow;
-		MTime::GetTime(&tvNow);
+	MTime::timeval tvNow;
+	MTime::GetTime(&tvNow);
 
+	m_pSafeUDP->m_NetLinkTable.ForEach([&](MNetLink* pNetLink)
+	{
 		// Closed Idle time check
 		auto tvIdleDiff = MTime::TimeSub(tvNow, pNetLink->m_tvLastPacketRecvTime);
 		if ( (pNetLink->GetLinkState() != MNetLink::LINKSTATE_ESTABLISHED) &&
@@ -601,78 +659,118 @@ bool MSocketThread::SafeSendManage()
 			MTRACE("SUDP> Idle Control Timeout \n");
 			pNetLink->SetLinkState(MNetLink::LINKSTATE_CLOSED);
 
-			delete (*itorLink).second;
-			m_pSafeUDP->m_NetLinkMap.erase(itorLink++);
-			continue;
-		} else {
-			++itorLink;
+			// The table can't be modified while it's being iterated.
+			m_ClosedLinks.push_back(pNetLink);
 		}
+	});
 
-		for (MNetLink::ACKWaitListItor itorACK = pNetLink->m_ACKWaitQueue.begin(); itorACK != pNetLink->m_ACKWaitQueue.end(); ++itorACK) {
-			MACKWaitItem* pACKWaitItem = *itorACK;
+	for (auto* pNetLink : m_ClosedLinks)
+	{
+		m_pSafeUDP->m_NetLinkTable.Erase(pNetLink->GetMapKey());
+		delete pNetLink;
+	}
+	m_ClosedLinks.clear();
 
-			auto tvDiff = MTime::TimeSub(tvNow, pACKWaitItem->tvFirstSent);
-			if ((tvDiff.tv_sec*1000 + tvDiff.tv_usec) > SAFEUDP_MAX_SAFE_RETRANS_TIME) {
-				// Disconnect....
-				MTRACE("SUDP> Retransmit Timeout \n");
-				pNetLink->SetLinkState(MNetLink::LINKSTATE_CLOSED);
-				break;
-			}
+	return true;
+}
 
-			tvDiff = MTime::TimeSub(tvNow, pACKWaitItem->tvLastSent);
-			if ((tvDiff.tv_sec*1000 + tvDiff.tv_usec) > SAFEUDP_SAFE_RETRANS_TIME) {
-				PushSend(pNetLink, pACKWaitItem->pPacket.get(), pACKWaitItem->dwPacketSize, true);
-				pACKWaitItem->tvLastSent = tvNow;
-				pACKWaitItem->nSendCount++;
-			}
-		}
+u32 MSocketThread::ManageTimers()
+{
+	const auto Now = GetGlobalTimeMS();
+
+	m_pSafeUDP->LockNetLink();
+
+	auto& Timers = m_pSafeUDP->m_RetransmitTimers;
+	Timers.Advance(Now / SAFEUDP_TIMER_TICK_TIME, [&](MTimerWheelNode& Node) {
+		OnRetransmitTimer(static_cast<MACKWaitItem&>(Node), Now);
+	});
+
+	if (Now - m_LastSafeSendManageTime >= SAFEUDP_SAFE_MANAGE_TIME) {
+		SafeSendManage();
+		m_LastSafeSendManageTime = Now;
 	}
-	return true;
+
+	// Only wake up every tick while there are packets waiting for ACKs.
+	auto nWaitTime = u32(SAFEUDP_SAFE_MANAGE_TIME - (Now - m_LastSafeSendManageTime));
+	if (!Timers.empty())
+		nWaitTime = (std::min)(nWaitTime, u32(SAFEUDP_TIMER_TICK_TIME));
+
+	m_pSafeUDP->UnlockNetLink();
+
+	return nWaitTime;
+}
+
+void MSocketThread::OnRetransmitTimer(MACKWaitItem& Item, u64 Now)
+{
+	auto* pNetLink = Item.pNetLink;
+
+	if (Now - Item.FirstSentTime > SAFEUDP_MAX_SAFE_RETRANS_TIME) {
+		// Disconnect....
+		MTRACE("SUDP> Retransmit Timeout \n");
+		// Stop retransmitting everything else to the link as well. This deletes Item.
+		pNetLink->ClearAllACKWaits();
+		pNetLink->SetLinkState(MNetLink::LINKSTATE_CLOSED);
+		return;
+	}
+
+	PushSend(pNetLink, Item.pPacket.get(), Item.dwPacketSize, true);
+	Item.nSendCount++;
+
+	// Back off exponentially while the link isn't answering.
+	Item.RTO = (std::min)(Item.RTO * 2, u32(SAFEUDP_MAX_RTO));
+	m_pSafeUDP->m_RetransmitTimers.Schedule(Item, GetTimerTick(Now + Item.RTO));
 }
 
 bool MSocketThread::Recv()
 {
-	MSocket::sockaddr_in AddrFrom{};
-	int	nAddrFromLen = sizeof(MSocket::sockaddr);
-	char RecvBuf[MAX_RECVBUF_LEN];
+	const auto BatchSize = int(m_RecvDatagrams.size());
 
 	while (true)
 	{
-		const auto nRecv = MSocket::recvfrom(m_pSafeUDP->GetLocalSocket(),
-			RecvBuf,
-			MAX_RECVBUF_LEN,
-			0, 
-			reinterpret_cast<MSocket::sockaddr*>(&AddrFrom),
-			&nAddrFromLen);
-
-		if (nRecv != MSocket::SocketError) {
-			m_nTotalRecv += nRecv;
-			m_RecvTrafficLog.Record(m_nTotalRecv);
-		}
+		const auto nRecv = MSocket::RecvFromBatch(m_pSafeUDP->GetLocalSocket(),
+			m_RecvDatagrams.data(),
+			BatchSize,
+			0);
 
-		if (nRecv <= 0) break;
+		if (nRecv == MSocket::SocketError || nRecv <= 0) break;
 
-		if (m_fnCustomRecvCallback &&
-			OnCustomRecv(AddrFrom.sin_addr.S_un.S_addr, AddrFrom.sin_port, RecvBuf, nRecv) == true) {
-			continue;
-		} else if (((MBasePacket*)RecvBuf)->GetFlag(SAFEUDP_FLAG_CONTROL_PACKET) != false) {
-			OnControlRecv(AddrFrom.sin_addr.S_un.S_addr, AddrFrom.sin_port, (MBasePacket*)RecvBuf, nRecv);
-			continue;
-		} else if (((MBasePacket*)RecvBuf)->GetFlag(SAFEUDP_FLAG_LIGHT_PACKET) != false) {
-			OnLightRecv(AddrFrom.sin_addr.S_un.S_addr, AddrFrom.sin_port, (MLightPacket*)RecvBuf, nRecv);
-			continue;
-		} else if (((MBasePacket*)RecvBuf)->GetFlag(SAFEUDP_FLAG_ACK_PACKET) != false) {
-			OnACKRecv(AddrFrom.sin_addr.S_un.S_addr, AddrFrom.sin_port, (MACKPacket*)RecvBuf);
-			continue;
-		} else {
-			OnGenericRecv(AddrFrom.sin_addr.S_un.S_addr, AddrFrom.sin_port, (MBasePacket*)RecvBuf, nRecv);
-			continue;
+		for (int i = 0; i < nRecv; ++i)
+		{
+			auto& Datagram = m_RecvDatagrams[i];
+			if (Datagram.Received <= 0)
+				continue;
+
+			m_nTotalRecv += Datagram.Received;
+			OnRecv(Datagram.Addr.sin_addr.S_un.S_addr, Datagram.Addr.sin_port,
+				Datagram.Buffer, Datagram.Received);
 		}
+		m_RecvTrafficLog.Record(m_nTotalRecv);
+
+		// A short batch means the socket has been drained.
+		if (nRecv < BatchSize) break;
 	}
 
 	return true;
 }
 
+void MSocketThread::OnRecv(u32 dwIP, u16 wRawPort, char* pPacket, u32 dwSize)
+{
+	auto* pBasePacket = (MBasePacket*)pPacket;
+
+	if (m_fnCustomRecvCallback &&
+		OnCustomRecv(dwIP, wRawPort, pPacket, dwSize) == true) {
+		return;
+	} else if (pBasePacket->GetFlag(SAFEUDP_FLAG_CONTROL_PACKET) != false) {
+		OnControlRecv(dwIP, wRawPort, pBasePacket, dwSize);
+	} else if (pBasePacket->GetFlag(SAFEUDP_FLAG_LIGHT_PACKET) != false) {
+		OnLightRecv(dwIP, wRawPort, (MLightPacket*)pPacket, dwSize);
+	} else if (pBasePacket->GetFlag(SAFEUDP_FLAG_ACK_PACKET) != false) {
+		OnACKRecv(dwIP, wRawPort, (MACKPacket*)pPacket);
+	} else {
+		OnGenericRecv(dwIP, wRawPort, pBasePacket, dwSize);
+	}
+}
+
 bool MSocketThread::OnCustomRecv(u32 dwIP, u16 wRawPort, char* pPacket, u32 dwSize)
 {
 	if (m_fnCustomRecvCallback)
@@ -759,6 +857,8 @@ bool MSafeUDP::Create(bool BindWinsockDLL, int Port, bool ReusePort)
 		return false;
 	}
 
+	m_RetransmitTimers.Reset(GetGlobalTimeMS() / SAFEUDP_TIMER_TICK_TIME);
+
 	m_SocketThread.SetSafeUDP(this);
 	m_SocketThread.Create();
 	return true;
@@ -842,19 +942,12 @@ MNetLink* MSafeUDP::FindNetLink(u32 dwIP, u16 wRawPort)
 	nKey = nKey << 32;
 	nKey += dwIP;
 
-	NetLinkItor pos = m_NetLinkMap.find(nKey);
-	if (pos != m_NetLinkMap.end())
-		return (*pos).second;
-
-	return NULL;
+	return m_NetLinkTable.Find(nKey);
 }
 
 MNetLink* MSafeUDP::FindNetLink(i64 nMapKey)
 {
-	NetLinkItor pos = m_NetLinkMap.find(nMapKey);
-	if (pos != m_NetLinkMap.end())
-		return (*pos).second;
-	return NULL;
+	return m_NetLinkTable.Find(nMapKey);
 }
 
 MNetLink* MSafeUDP::OpenNetLink(char* szIP, int nPort)
@@ -865,13 +958,13 @@ MNetLink* MSafeUDP::OpenNetLink(char* szIP, int nPort)
 	
 	auto nKey = pNetLink->GetMapKey();
 	
-	auto pos = m_NetLinkMap.find(nKey);
-	if (pos != m_NetLinkMap.end()) {
-		Reconnect((*pos).second);
+	auto* pExisting = m_NetLinkTable.Find(nKey);
+	if (pExisting) {
+		Reconnect(pExisting);
 		delete pNetLink;
-		pNetLink = (*pos).second;
+		pNetLink = pExisting;
 	} else {
-		m_NetLinkMap.insert(NetLinkType(nKey, pNetLink));
+		m_NetLinkTable.Insert(nKey, pNetLink);
 	}
 
 	return pNetLink;
@@ -879,14 +972,11 @@ MNetLink* MSafeUDP::OpenNetLink(char* szIP, int nPort)
 
 bool MSafeUDP::CloseNetLink(MNetLink* pNetLink)
 {
-	auto nKey = pNetLink->GetMapKey();
-
-	auto pos = m_NetLinkMap.find(nKey);
-	if (pos == m_NetLinkMap.end())
+	auto* pRemoved = m_NetLinkTable.Erase(pNetLink->GetMapKey());
+	if (pRemoved == NULL)
 		return false;
 
-	delete (*pos).second;
-	m_NetLinkMap.erase(pos);
+	delete pRemoved;
 
 	return true;
 }
@@ -914,12 +1004,9 @@ bool MSafeUDP::Disconnect(MNetLink* pNetLink)
 int MSafeUDP::DisconnectAll()
 {
 	LockNetLink();
-	int nCount = 0;
-	for (NetLinkItor itor = m_NetLinkMap.begin(); itor != m_NetLinkMap.end(); ) {
-		delete (*itor).second;
-		m_NetLinkMap.erase(itor++);
-		++nCount;
-	}
+	int nCount = int(m_NetLinkTable.size());
+	m_NetLinkTable.ForEach([](MNetLink* pNetLink) { delete pNetLink; });
+	m_NetLinkTable.clear();
 	UnlockNetLink();
 	return nCount;
 }
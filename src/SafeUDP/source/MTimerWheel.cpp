@@ -0,0 +1,100 @@
+#include "stdafx.h"
+#include "MTimerWheel.h"
+
+void MTimerWheelNode::Link(MTimerWheelNode& Head)
+{
+	pPrev = Head.pPrev;
+	pNext = &Head;
+	Head.pPrev->pNext = this;
+	Head.pPrev = this;
+}
+
+void MTimerWheelNode::Unlink()
+{
+	pPrev->pNext = pNext;
+	pNext->pPrev = pPrev;
+	pPrev = pNext = nullptr;
+}
+
+void MTimerWheelNode::Cancel()
+{
+	if (!pWheel)
+		return;
+
+	Unlink();
+	--pWheel->Size;
+	pWheel = nullptr;
+}
+
+MTimerWheel::MTimerWheel()
+{
+	// The slots are the heads of circular lists, so empty ones point at themselves.
+	for (auto& Level : Slots)
+	{
+		for (auto& Head : Level)
+		{
+			Head.pPrev = &Head;
+			Head.pNext = &Head;
+		}
+	}
+}
+
+MTimerWheel::~MTimerWheel()
+{
+	for (auto& Level : Slots)
+	{
+		for (auto& Head : Level)
+		{
+			while (Head.pNext != &Head)
+				Head.pNext->Cancel();
+		}
+	}
+}
+
+void MTimerWheel::Reset(u64 Tick)
+{
+	CurrentTick = Tick;
+}
+
+void MTimerWheel::Schedule(MTimerWheelNode& Node, u64 ExpiryTick)
+{
+	Node.Cancel();
+
+	const auto MaxDelta = GetLevelSpan(NumLevels) - 1;
+	if (ExpiryTick <= CurrentTick)
+		ExpiryTick = CurrentTick + 1;
+	else if (ExpiryTick - CurrentTick > MaxDelta)
+		ExpiryTick = CurrentTick + MaxDelta;
+
+	Node.ExpiryTick = ExpiryTick;
+	Node.pWheel = this;
+	++Size;
+	Insert(Node);
+}
+
+void MTimerWheel::Insert(MTimerWheelNode& Node)
+{
+	// A node that's cascaded can be due on the current tick, which is handled after
+	// cascading, so a delta of 0 is fine here.
+	const auto Delta = Node.ExpiryTick - CurrentTick;
+
+	int Level = 0;
+	while (Level < NumLevels - 1 && Delta >= GetLevelSpan(Level + 1))
+		++Level;
+
+	const auto Slot = (Node.ExpiryTick >> (LevelBits * Level)) & (SlotsPerLevel - 1);
+	Node.Link(Slots[Level][Slot]);
+}
+
+void MTimerWheel::Cascade(int Level, int Slot)
+{
+	// The nodes are all due within the next GetLevelSpan(Level) ticks, so they always move
+	// to a lower level, never back into this slot.
+	auto& Head = Slots[Level][Slot];
+	while (Head.pNext != &Head)
+	{
+		auto& Node = *Head.pNext;
+		Node.Unlink();
+		Insert(Node);
+	}
+}
@@ -0,0 +1,196 @@
+#include "stdafx.h"
+#include "MMatchObject.h"
+#include "MMatchInterestManager.h"
+#include "TestCommon.h"
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+using namespace RealSpace2;
+
+// Replays movement traces through MMatchInterestManager and reports how many of the
+// position updates that used to be relayed to everyone still are.
+//
+// A trace is a text file with one position update per line, ordered by time:
+//
+//   <time in ms> <player index> <x> <y> <z>
+//
+// Pass trace files on the command line to replay them. Without any, traces are
+// generated for a few arena sizes and player counts, with players walking between
+// random points at running speed.
+
+struct TraceSample
+{
+	u64 Time;
+	int Player;
+	v3 Pos;
+};
+
+struct MovementTrace
+{
+	std::string Name;
+	int Players = 0;
+	bool bTeamPlay = false;
+	std::vector<TraceSample> Samples;
+};
+
+static bool LoadTrace(MovementTrace& Out, const char* Path)
+{
+	std::ifstream File{ Path };
+	if (!File)
+	{
+		std::printf("Couldn't open %s\n", Path);
+		return false;
+	}
+
+	Out.Name = Path;
+	std::string Line;
+	while (std::getline(File, Line))
+	{
+		if (Line.empty() || Line[0] == '#')
+			continue;
+
+		std::istringstream Stream{ Line };
+		TraceSample Sample;
+		if (!(Stream >> Sample.Time >> Sample.Player >> Sample.Pos.x >> Sample.Pos.y >> Sample.Pos.z) ||
+			Sample.Player < 0 || Sample.Player >= 64)
+		{
+			std::printf("%s: bad line \"%s\"\n", Path, Line.c_str());
+			return false;
+		}
+		Out.Players = std::max(Out.Players, Sample.Player + 1);
+		Out.Samples.push_back(Sample);
+	}
+	return true;
+}
+
+static MovementTrace MakeTrace(const char* Name, int Players, float ArenaSize, bool bTeamPlay)
+{
+	constexpr u64 UpdateIntervalMS = 50;
+	constexpr u64 Duration = 120 * 1000;
+
+	MovementTrace Ret;
+	Ret.Name = Name;
+	Ret.Players = Players;
+	Ret.bTeamPlay = bTeamPlay;
+
+	std::mt19937 Rng{ 1234 };
+	std::uniform_real_distribution<float> Dist{ 0, ArenaSize };
+	auto RandomPos = [&] { return v3{ Dist(Rng), Dist(Rng), 0 }; };
+
+	struct Walker { v3 Pos, Target; };
+	std::vector<Walker> Walkers(Players);
+	for (auto& Walker : Walkers)
+		Walker = { RandomPos(), RandomPos() };
+
+	constexpr float Speed = 500.f * UpdateIntervalMS / 1000;
+	for (u64 Time = UpdateIntervalMS; Time <= Duration; Time += UpdateIntervalMS)
+	{
+		for (int i = 0; i < Players; ++i)
+		{
+			auto& Walker = Walkers[i];
+			const auto Dir = Walker.Target - Walker.Pos;
+			const auto Distance = Magnitude(Dir);
+			if (Distance <= Speed)
+			{
+				Walker.Pos = Walker.Target;
+				Walker.Target = RandomPos();
+			}
+			else
+				Walker.Pos += Dir / Distance * Speed;
+
+			Ret.Samples.push_back({ Time, i, Walker.Pos });
+		}
+	}
+	return Ret;
+}
+
+static void Replay(const MovementTrace& Trace)
+{
+	std::vector<std::unique_ptr<MMatchObject>> Objects;
+	for (int i = 0; i < Trace.Players; ++i)
+	{
+		Objects.emplace_back(std::make_unique<MMatchObject>(MUID(0, 1000 + i)));
+		Objects.back()->SetAlive(true);
+		Objects.back()->SetTeam(i % 2 ? MMT_RED : MMT_BLUE);
+	}
+
+	MMatchInterestManager Mgr;
+	Mgr.SetEnabled(true);
+	const auto& Settings = Mgr.GetSettings();
+
+	u64 Considered = 0;
+	u64 Relayed = 0;
+	u64 MaxGap = 0;
+	u64 MaxSampleInterval = 0;
+	std::vector<u64> LastRelay(Trace.Players * Trace.Players);
+	std::vector<u64> LastSample(Trace.Players);
+
+	for (auto& Sample : Trace.Samples)
+	{
+		auto& Sender = *Objects[Sample.Player];
+
+		BasicInfoItem bi{};
+		bi.position = Sample.Pos;
+		bi.SentTime = bi.RecvTime = Sample.Time / 1000.0;
+		bi.lowerstate = ZC_STATE_LOWER(-1);
+		bi.SelectedSlot = MMatchCharItemParts(-1);
+		Sender.BasicInfoHistory.AddBasicInfo(bi);
+
+		auto& Last = LastSample[Sample.Player];
+		if (Last != 0)
+			MaxSampleInterval = std::max(MaxSampleInterval, Sample.Time - Last);
+		Last = Sample.Time;
+
+		for (int i = 0; i < Trace.Players; ++i)
+		{
+			if (i == Sample.Player)
+				continue;
+
+			++Considered;
+			if (!Mgr.ShouldRelay(Sender, *Objects[i], nullptr, Trace.bTeamPlay, Sample.Time))
+				continue;
+
+			++Relayed;
+			auto& LastTime = LastRelay[Sample.Player * Trace.Players + i];
+			if (LastTime != 0)
+				MaxGap = std::max(MaxGap, Sample.Time - LastTime);
+			LastTime = Sample.Time;
+		}
+	}
+
+	std::printf("%-24s %2d players: %llu of %llu updates relayed (%.1f%% less), longest gap %llu ms\n",
+		Trace.Name.c_str(), Trace.Players,
+		static_cast<unsigned long long>(Relayed), static_cast<unsigned long long>(Considered),
+		Considered ? 100.0 * (Considered - Relayed) / Considered : 0.0,
+		static_cast<unsigned long long>(MaxGap));
+
+	TEST_CHECK(Relayed <= Considered);
+	// Distant players still get updates, just fewer of them.
+	TEST_CHECK(MaxGap <= std::max<u64>(Settings.FarIntervalMS, Settings.HiddenIntervalMS) + MaxSampleInterval);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			MovementTrace Trace;
+			TEST_CHECK(LoadTrace(Trace, argv[i]));
+			if (!Trace.Samples.empty())
+				Replay(Trace);
+		}
+		return TestResult();
+	}
+
+	Replay(MakeTrace("FFA, 8000 unit arena", 16, 8000, false));
+	Replay(MakeTrace("FFA, 4000 unit arena", 16, 4000, false));
+	Replay(MakeTrace("Team, 8000 unit arena", 16, 8000, true));
+	Replay(MakeTrace("FFA, 8000 unit arena", 8, 8000, false));
+
+	return TestResult();
+}
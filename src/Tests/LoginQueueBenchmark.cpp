@@ -0,0 +1,141 @@
+#include "stdafx.h"
+#include "MMatchLoginQueue.h"
+#include "MTime.h"
+#include "TestCommon.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+
+// Drives MMatchLoginQueue with a synthetic reconnect storm: a few thousand clients
+// connect within a second or so, and each login keeps the main thread busy as long
+// as the DB lookup and password hash would. Clients that get the busy response
+// retry after the delay they were given. Reports how long the longest tick was and
+// how long clients waited, against processing every login in the tick it arrived.
+
+static void BusyWait(std::chrono::microseconds Duration)
+{
+	const auto End = std::chrono::steady_clock::now() + Duration;
+	while (std::chrono::steady_clock::now() < End);
+}
+
+static MMatchLoginRequest MakeRequest(int Client)
+{
+	MMatchLoginRequest Request{};
+	Request.CommUID = MUID(0, 1000 + Client);
+	Request.UserID = "user" + std::to_string(Client);
+	return Request;
+}
+
+static void TestRemove()
+{
+	MMatchLoginQueue Queue;
+	for (int i = 0; i < 4; ++i)
+		TEST_CHECK(Queue.Push(MakeRequest(i)));
+
+	Queue.Remove(MUID(0, 1001));
+	Queue.Remove(MUID(0, 1001));
+	TEST_CHECK(!Queue.IsQueued(MUID(0, 1001)));
+	TEST_CHECK(Queue.GetStats().Pending == 3);
+
+	std::vector<MUID> Processed;
+	Queue.Process([&](const MMatchLoginRequest& Request) { Processed.push_back(Request.CommUID); });
+	TEST_CHECK((Processed == std::vector<MUID>{ MUID(0, 1000), MUID(0, 1002), MUID(0, 1003) }));
+	TEST_CHECK(Queue.GetStats().Pending == 0);
+}
+
+static void TestLimits()
+{
+	MMatchLoginQueue Queue;
+	MMatchLoginQueue::Limits Limits;
+	Limits.MaxPerTick = 3;
+	Limits.MaxPending = 5;
+	Queue.SetLimits(Limits);
+
+	for (int i = 0; i < 5; ++i)
+		TEST_CHECK(Queue.Push(MakeRequest(i)));
+	TEST_CHECK(!Queue.Push(MakeRequest(5)));
+	TEST_CHECK(Queue.GetStats().Rejected == 1);
+	TEST_CHECK(Queue.GetRetryDelayMS() > 0);
+
+	int Processed = 0;
+	Queue.Process([&](const MMatchLoginRequest&) { ++Processed; });
+	TEST_CHECK(Processed == 3);
+	TEST_CHECK(Queue.GetStats().Pending == 2);
+}
+
+static void Storm(int Clients, int ArrivalMS, std::chrono::microseconds LoginCost)
+{
+	constexpr int TickMS = 10;
+	const MMatchLoginQueue::Limits Limits;
+
+	MMatchLoginQueue Queue;
+	Queue.SetLimits(Limits);
+
+	// When each client connects next, and when it first did.
+	std::multimap<u64, int> Arrivals;
+	std::vector<u64> FirstArrival(Clients);
+	const auto Start = GetGlobalTimeMS();
+	for (int i = 0; i < Clients; ++i)
+	{
+		FirstArrival[i] = Start + u64(i) * ArrivalMS / Clients;
+		Arrivals.emplace(FirstArrival[i], i);
+	}
+
+	int LoggedIn = 0;
+	u64 Busy = 0, MaxLoginMS = 0;
+	double MaxTickMS = 0;
+	while (LoggedIn < Clients)
+	{
+		const auto TickStart = std::chrono::steady_clock::now();
+		const auto Time = GetGlobalTimeMS();
+
+		while (!Arrivals.empty() && Arrivals.begin()->first <= Time)
+		{
+			const auto Client = Arrivals.begin()->second;
+			Arrivals.erase(Arrivals.begin());
+			if (!Queue.Push(MakeRequest(Client)))
+			{
+				++Busy;
+				Arrivals.emplace(Time + Queue.GetRetryDelayMS(), Client);
+			}
+		}
+
+		Queue.Process([&](const MMatchLoginRequest& Request) {
+			BusyWait(LoginCost);
+			MaxLoginMS = std::max(MaxLoginMS, GetGlobalTimeMS() - FirstArrival[Request.CommUID.Low - 1000]);
+			++LoggedIn;
+		});
+
+		const std::chrono::duration<double, std::milli> Elapsed = std::chrono::steady_clock::now() - TickStart;
+		MaxTickMS = std::max(MaxTickMS, Elapsed.count());
+		if (Elapsed.count() < TickMS)
+			std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(TickMS - Elapsed.count()));
+	}
+
+	// Without the queue, a tick handles every login that arrived during the last one.
+	const auto UnpacedTickMS = double(Clients) / ArrivalMS * TickMS * LoginCost.count() / 1000;
+
+	std::printf("%d clients in %d ms, %lld us per login: longest tick %.1f ms (%.1f ms unpaced), "
+		"%llu busy responses, longest wait %llu ms, peak queue %zu\n",
+		Clients, ArrivalMS, static_cast<long long>(LoginCost.count()), MaxTickMS, UnpacedTickMS,
+		static_cast<unsigned long long>(Busy), static_cast<unsigned long long>(MaxLoginMS),
+		Queue.GetStats().PeakPending);
+
+	TEST_CHECK(Queue.GetStats().Processed == u64(Clients));
+	TEST_CHECK(Queue.GetStats().PeakPending <= size_t(Limits.MaxPending));
+	// A tick can go over the budget by the login that was running when it ran out,
+	// plus some slack for the scheduler.
+	TEST_CHECK(MaxTickMS <= Limits.TickBudgetMS + LoginCost.count() / 1000.0 + 15);
+}
+
+int main()
+{
+	TestRemove();
+	TestLimits();
+
+	Storm(5000, 200, std::chrono::microseconds{ 300 });
+	Storm(2000, 100, std::chrono::microseconds{ 1000 });
+
+	return TestResult();
+}
@@ -0,0 +1,97 @@
+#include "MPSCQueue.h"
+#include "TestCommon.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Pushes from several threads at once into a queue small enough to spill into its
+// overflow list, while the consumer checks that every value comes out once and in
+// order per producer, and that Size and the high-water mark never count more values
+// than have been pushed.
+
+constexpr int Producers = 8;
+constexpr int PerProducer = 200000;
+
+// The producer in the high bits, the sequence number in the low ones.
+static unsigned MakeValue(int Producer, int Seq) { return unsigned(Producer) << 24 | unsigned(Seq); }
+
+static void Run()
+{
+	MPSCQueue<unsigned, 64> Queue;
+	// Incremented before each Push starts, so it's never behind what Size can count.
+	std::atomic<size_t> Started{ 0 };
+
+	std::vector<std::thread> Threads;
+	for (int p = 0; p < Producers; ++p)
+	{
+		Threads.emplace_back([&, p] {
+			for (int i = 0; i < PerProducer; ++i)
+			{
+				Started.fetch_add(1, std::memory_order_relaxed);
+				Queue.Push(MakeValue(p, i));
+			}
+		});
+	}
+
+	std::vector<int> Next(Producers, 0);
+	size_t Popped = 0;
+	int BadSize = 0, BadOrder = 0;
+	auto CheckSize = [&] {
+		// Read Size before Started, so that every Push it counts has started.
+		const auto Size = Queue.Size();
+		const auto HighWater = Queue.GetHighWaterMark();
+		const auto Pushed = Started.load(std::memory_order_relaxed);
+		if (Size > Pushed - Popped || HighWater > Pushed)
+			++BadSize;
+	};
+	auto Check = [&](unsigned Value) {
+		const auto Producer = Value >> 24;
+		const auto Seq = int(Value & 0xFFFFFF);
+		if (Producer >= unsigned(Producers) || Seq != Next[Producer])
+			++BadOrder;
+		else
+			++Next[Producer];
+		++Popped;
+		// Right after a pop is when a Push that counts its value late would be seen.
+		CheckSize();
+	};
+
+	const size_t Total = size_t(Producers) * PerProducer;
+	int Iteration = 0;
+	while (Popped < Total)
+	{
+		CheckSize();
+		if (++Iteration % 2 == 0)
+		{
+			Queue.Drain(Check);
+		}
+		else
+		{
+			unsigned Value;
+			while (Queue.Pop(Value))
+				Check(Value);
+		}
+		CheckSize();
+		if (Iteration % 100 == 0)
+			Queue.ResetHighWaterMark();
+	}
+
+	for (auto& Thread : Threads)
+		Thread.join();
+
+	TEST_CHECK(BadSize == 0);
+	TEST_CHECK(BadOrder == 0);
+	TEST_CHECK(Popped == Total);
+	TEST_CHECK(Queue.Size() == 0);
+	unsigned Value;
+	TEST_CHECK(!Queue.Pop(Value));
+	Queue.ResetHighWaterMark();
+	TEST_CHECK(Queue.GetHighWaterMark() == 0);
+}
+
+int main()
+{
+	Run();
+
+	return TestResult();
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "NetIO.h"
+#include "MPacket.h"
+#include "MPacketCrypter.h"
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// What the loopback benchmarks share: a NetIO server on a loopback port, and
+// MServer's encryption of MSGID_COMMAND packets along with its inverse.
+
+// The same as MServer's encoder for MSGID_COMMAND packets.
+inline void EncodeCommandPacket(void* pPacket, int nPacketSize, const void* pData)
+{
+	auto pMsg = static_cast<MCommandMsg*>(pPacket);
+	auto pCrypterKey = static_cast<const MPacketCrypterKey*>(pData);
+
+	MPacketCrypter::EncryptAndSum((char*)&pMsg->nSize, sizeof(pMsg->nSize),
+		(char*)&pMsg->nSize, pCrypterKey);
+	auto nBodySum = MPacketCrypter::EncryptAndSum(pMsg->Buffer, nPacketSize - sizeof(MPacketHeader),
+		pMsg->Buffer, pCrypterKey);
+	pMsg->nCheckSum = MFinishCheckSum(pMsg, nBodySum);
+}
+
+// Reads one MSGID_COMMAND packet into Packet and decrypts it. Returns false if the
+// read fails, or if the checksum or size is wrong.
+inline bool ReadCommandPacket(asio::ip::tcp::socket& Socket, std::vector<char>& Packet,
+	const MPacketCrypterKey& Key)
+{
+	auto* pKey = const_cast<MPacketCrypterKey*>(&Key);
+
+	MPacketHeader Header;
+	asio::error_code ec;
+	asio::read(Socket, asio::buffer(&Header, sizeof(Header)), ec);
+	if (ec || Header.nMsg != MSGID_COMMAND)
+		return false;
+
+	auto Size = Header.nSize;
+	MPacketCrypter::Decrypt(reinterpret_cast<char*>(&Size), sizeof(Size), pKey);
+	if (Size < sizeof(MPacketHeader))
+		return false;
+
+	Packet.resize(Size);
+	memcpy(Packet.data(), &Header, sizeof(Header));
+	asio::read(Socket, asio::buffer(Packet.data() + sizeof(Header), Size - sizeof(Header)), ec);
+	if (ec)
+		return false;
+
+	auto pMsg = reinterpret_cast<MCommandMsg*>(Packet.data());
+	if (pMsg->nCheckSum != MBuildCheckSum(pMsg, Size))
+		return false;
+
+	MPacketCrypter::Decrypt(pMsg->Buffer, Size - int(sizeof(MPacketHeader)), pKey);
+	return true;
+}
+
+struct LoopbackServer
+{
+	std::mutex Mutex;
+	std::condition_variable Accepted;
+	// In the order they connected.
+	std::vector<NetIO::ConnectionHandle> Clients;
+	int Port = 0;
+	std::function<void(NetIO::IOOperation, NetIO::ConnectionHandle, const void*)> OnEvent{
+		[this](NetIO::IOOperation Op, NetIO::ConnectionHandle Handle, const void*) {
+			if (Op != NetIO::IOOperation::Accept)
+				return;
+			std::lock_guard<std::mutex> Lock{ Mutex };
+			Clients.push_back(Handle);
+			Accepted.notify_all();
+		} };
+	// Declared last, so that it's destroyed before what the callback uses.
+	NetIO Net;
+
+	bool Create()
+	{
+		NetIO::SendLimits Limits;
+		Limits.DropBytes = Limits.DropPackets = Limits.MaxBytes = Limits.MaxPackets = 0;
+		Net.SetSendLimits(Limits);
+		Net.SetNumIOThreads(1);
+
+		for (int TryPort = 47300; TryPort < 47400; ++TryPort)
+		{
+			if (Net.Create(TryPort, OnEvent))
+			{
+				Port = TryPort;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Returns the Index'th client to connect, or 0 if it hasn't within five seconds.
+	NetIO::ConnectionHandle WaitForClient(size_t Index = 0)
+	{
+		std::unique_lock<std::mutex> Lock{ Mutex };
+		Accepted.wait_for(Lock, std::chrono::seconds{ 5 }, [&] { return Clients.size() > Index; });
+		return Clients.size() > Index ? Clients[Index] : 0;
+	}
+
+	// Connects Socket and returns the server's handle for it, or 0 on failure. Clients
+	// have to be connected one at a time for the handles to match up.
+	NetIO::ConnectionHandle Connect(asio::ip::tcp::socket& Socket)
+	{
+		size_t Index;
+		{
+			std::lock_guard<std::mutex> Lock{ Mutex };
+			Index = Clients.size();
+		}
+		asio::error_code ec;
+		Socket.connect(asio::ip::tcp::endpoint{ asio::ip::address_v4::loopback(), u16(Port) }, ec);
+		if (ec)
+			return 0;
+		return WaitForClient(Index);
+	}
+};
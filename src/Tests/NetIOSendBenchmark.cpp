@@ -0,0 +1,121 @@
+#include "stdafx.h"
+#include "NetIO.h"
+#include "MPacket.h"
+#include "MPacketCrypter.h"
+#include "NetIOLoopback.h"
+#include "TestCommon.h"
+#include <chrono>
+#include <random>
+
+// Sends encrypted command packets through NetIO to a loopback client, and times how
+// long the sending thread spends per 1000 sends when it encrypts and checksums them
+// itself, against leaving that to a NetIO::PacketEncoder on the I/O thread, which is
+// what MServer::SendMsgCommand does. The client decrypts everything it gets and checks
+// it against what was sent.
+
+using asio::ip::tcp;
+
+static std::atomic<std::thread::id> EncoderThread;
+
+static void EncodeAndRecordThread(void* pPacket, int nPacketSize, const void* pData)
+{
+	EncoderThread = std::this_thread::get_id();
+	EncodeCommandPacket(pPacket, nPacketSize, pData);
+}
+
+// Reads Count packets and checks that they decrypt to Body with a valid checksum.
+static bool ReadPackets(tcp::socket& Socket, int Count, const std::vector<char>& Body,
+	const MPacketCrypterKey& Key)
+{
+	std::vector<char> Packet;
+	for (int i = 0; i < Count; ++i)
+	{
+		if (!ReadCommandPacket(Socket, Packet, Key) || Packet.size() != sizeof(MPacketHeader) + Body.size())
+			return false;
+		if (!std::equal(Body.begin(), Body.end(), Packet.begin() + sizeof(MPacketHeader)))
+			return false;
+	}
+	return true;
+}
+
+static double TimeSends(LoopbackServer& Srv, NetIO::ConnectionHandle Handle, tcp::socket& Socket,
+	const std::vector<char>& Body, const MPacketCrypterKey& Key, bool bOnIOThread)
+{
+	constexpr int Count = 1000;
+
+	bool bReadOK = false;
+	std::thread Reader{ [&] { bReadOK = ReadPackets(Socket, Count, Body, Key); } };
+
+	NetIO::PacketEncoder Encoder;
+	Encoder.Function = EncodeAndRecordThread;
+	memcpy(Encoder.Data, &Key, sizeof(Key));
+
+	EncoderThread = std::thread::id{};
+	const int PacketSize = int(sizeof(MPacketHeader) + Body.size());
+	const auto Start = std::chrono::steady_clock::now();
+	for (int i = 0; i < Count; ++i)
+	{
+		auto pMsg = static_cast<MCommandMsg*>(malloc(PacketSize));
+		pMsg->nCheckSum = 0;
+		pMsg->nMsg = MSGID_COMMAND;
+		pMsg->nSize = PacketSize;
+		memcpy(pMsg->Buffer, Body.data(), Body.size());
+
+		if (bOnIOThread)
+		{
+			Srv.Net.Send(Handle, pMsg, PacketSize, false, &Encoder);
+		}
+		else
+		{
+			EncodeAndRecordThread(pMsg, PacketSize, &Key);
+			Srv.Net.Send(Handle, pMsg, PacketSize);
+		}
+	}
+	const std::chrono::duration<double, std::micro> Elapsed = std::chrono::steady_clock::now() - Start;
+
+	Reader.join();
+	TEST_CHECK(bReadOK);
+	TEST_CHECK((EncoderThread.load() == std::this_thread::get_id()) == !bOnIOThread);
+
+	return Elapsed.count();
+}
+
+int main()
+{
+	LoopbackServer Srv;
+	if (!Srv.Create())
+	{
+		std::printf("Couldn't listen on a loopback port\n");
+		return 1;
+	}
+
+	asio::io_context Context;
+	tcp::socket Socket{ Context };
+	const auto Handle = Srv.Connect(Socket);
+	TEST_CHECK(Handle != 0);
+	if (Handle == 0)
+		return TestResult();
+
+	std::mt19937 Rng{ 1 };
+	MPacketCrypterKey Key;
+	for (auto& c : Key.szKey)
+		c = char(Rng());
+
+	for (int Size : { 64, 256, 2048 })
+	{
+		std::vector<char> Body(Size);
+		for (auto& c : Body)
+			c = char(Rng());
+
+		const auto Inline = TimeSends(Srv, Handle, Socket, Body, Key, false);
+		const auto Deferred = TimeSends(Srv, Handle, Socket, Body, Key, true);
+		std::printf("%4d byte commands: %6.0f us per 1000 sends encrypting on the sending thread, "
+			"%6.0f us on the I/O thread\n", Size, Inline, Deferred);
+	}
+
+	asio::error_code ec;
+	Socket.close(ec);
+	Srv.Net.Destroy();
+
+	return TestResult();
+}
@@ -0,0 +1,124 @@
+#include "stdafx.h"
+#include "MPacketCrypter.h"
+#include "MSharedCommandTable.h"
+#include "TestCommon.h"
+#include <chrono>
+#include <random>
+#include <vector>
+
+// Checks that every MPacketCrypter kernel this CPU supports gives the same bytes and
+// checksum sums as a byte at a time reference, over odd lengths and unaligned
+// buffers, then times each kernel on a few packet sizes.
+
+static const char* const KernelNames[] = { "scalar", "SSE2", "AVX2" };
+
+static u8 RotateLeft(u8 b, int n) { return u8((b << n) | (b >> (8 - n))); }
+
+static u32 EncryptReference(const u8* Src, u8* Dst, int Len, const MPacketCrypterKey& Key)
+{
+	const int SHL = (MCOMMAND_VERSION % 6) + 1;
+	u32 Sum = 0;
+	for (int i = 0; i < Len; ++i)
+	{
+		Dst[i] = RotateLeft(Src[i] ^ u8(Key.szKey[i % PACKET_CRYPTER_KEY_LEN]), SHL) ^ 0xF0;
+		Sum += Dst[i];
+	}
+	return Sum;
+}
+
+static void TestKernel(const char* Name)
+{
+	std::mt19937 Rng{ 1 };
+	std::uniform_int_distribution<int> Byte{ 0, 255 };
+
+	MPacketCrypterKey Key;
+	for (auto& c : Key.szKey)
+		c = char(Byte(Rng));
+
+	// Room for the longest packet at every offset on both sides.
+	constexpr int MaxLen = 300;
+	constexpr int MaxOffset = 64;
+	std::vector<u8> Src(MaxLen + MaxOffset), Expected(MaxLen), Dst(MaxLen + MaxOffset);
+
+	for (int Len = 0; Len <= MaxLen; ++Len)
+	{
+		for (int SrcOffset = 0; SrcOffset < MaxOffset; SrcOffset += 1 + Len % 7)
+		{
+			const int DstOffset = (SrcOffset * 3 + Len) % MaxOffset;
+			auto* pSrc = Src.data() + SrcOffset;
+			auto* pDst = Dst.data() + DstOffset;
+			for (int i = 0; i < Len; ++i)
+				pSrc[i] = u8(Byte(Rng));
+
+			const auto ExpectedSum = EncryptReference(pSrc, Expected.data(), Len, Key);
+
+			const auto Sum = MPacketCrypter::EncryptAndSum(reinterpret_cast<const char*>(pSrc), Len,
+				reinterpret_cast<char*>(pDst), &Key);
+			TEST_CHECK(Sum == ExpectedSum);
+			TEST_CHECK(std::equal(pDst, pDst + Len, Expected.begin()));
+			TEST_CHECK(MPacketCrypter::SumBytes(pDst, Len) == ExpectedSum);
+
+			MPacketCrypter::Decrypt(reinterpret_cast<const char*>(pDst), Len,
+				reinterpret_cast<char*>(pDst), Len, &Key);
+			TEST_CHECK(std::equal(pDst, pDst + Len, pSrc));
+
+			// In place.
+			std::copy(pSrc, pSrc + Len, pDst);
+			MPacketCrypter::Encrypt(reinterpret_cast<char*>(pDst), Len, &Key);
+			TEST_CHECK(std::equal(pDst, pDst + Len, Expected.begin()));
+			MPacketCrypter::Decrypt(reinterpret_cast<char*>(pDst), Len, &Key);
+			TEST_CHECK(std::equal(pDst, pDst + Len, pSrc));
+
+			if (TestFailures() != 0)
+			{
+				std::printf("%s: failed with length %d, source offset %d, target offset %d\n",
+					Name, Len, SrcOffset, DstOffset);
+				return;
+			}
+		}
+	}
+}
+
+static void Benchmark(const char* Name)
+{
+	MPacketCrypterKey Key{};
+	for (int Size : { 64, 512, 4096 })
+	{
+		std::vector<char> Buffer(Size, 'x');
+		const int Iterations = (64 << 20) / Size;
+
+		u32 Sum = 0;
+		const auto Start = std::chrono::steady_clock::now();
+		for (int i = 0; i < Iterations; ++i)
+		{
+			Sum += MPacketCrypter::EncryptAndSum(Buffer.data(), Size, Buffer.data(), &Key);
+			MPacketCrypter::Decrypt(Buffer.data(), Size, &Key);
+		}
+		const std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+
+		// Sum is printed so that the loop isn't optimized out.
+		std::printf("%-6s %4d byte packets: %7.0f MB/s encrypt + decrypt (%08X)\n",
+			Name, Size, 2.0 * Iterations * Size / Elapsed.count() / (1 << 20), Sum);
+	}
+}
+
+int main()
+{
+	for (auto* Name : KernelNames)
+	{
+		if (!MPacketCrypter::SetKernel(Name))
+		{
+			std::printf("%s isn't supported on this CPU, skipping it\n", Name);
+			continue;
+		}
+		TestKernel(Name);
+	}
+
+	for (auto* Name : KernelNames)
+	{
+		if (MPacketCrypter::SetKernel(Name))
+			Benchmark(Name);
+	}
+
+	return TestResult();
+}
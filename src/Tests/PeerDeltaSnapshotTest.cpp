@@ -0,0 +1,424 @@
+#include "stdafx.h"
+#include "MMatchSnapshotAggregator.h"
+#include "MPeerDeltaSnapshot.h"
+#include "MPeerSnapshot.h"
+#include "MCommandParameter.h"
+#include "TestCommon.h"
+#include <array>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <vector>
+
+// Round-trip tests for the MC_MATCH_PEER_DELTA_SNAPSHOT format, and a benchmark that
+// replays battle traces through MMatchSnapshotAggregator with packet loss, comparing
+// the bytes sent against relaying each MC_PEER_BASICINFO_RG in a plain snapshot.
+//
+// A trace is a text file with one update per line, ordered by time:
+//
+//   <time in ms> <player index> <pos x y z> <vel x y z> <dir x y z> <lower> <upper> <slot>
+//
+// Pass trace files on the command line to replay them. Without any, a battle is
+// generated with players running around and changing animations and weapons.
+
+static NewBasicInfo MakeBasicInfo(const CharacterInfo& Info, BasicInfoNetState& NetState, float Time)
+{
+	std::unique_ptr<MCommandParameterBlob> Blob{ PackNewBasicInfo(Info, NetState, Time) };
+	NewBasicInfo nbi;
+	TEST_CHECK(UnpackNewBasicInfo(nbi, static_cast<const u8*>(Blob->GetPointer()), Blob->GetPayloadSize()));
+	return nbi;
+}
+
+static CharacterInfo MakeCharacterInfo(const v3& Pos, const v3& Vel, const v3& Dir,
+	int LowerAni = ZC_STATE_LOWER_IDLE1, int UpperAni = ZC_STATE_UPPER_NONE, int Slot = MMCIP_PRIMARY)
+{
+	return CharacterInfo{ Pos, Dir, Vel, Dir, ZC_STATE_LOWER(LowerAni), ZC_STATE_UPPER(UpperAni),
+		MMatchCharItemParts(Slot), false };
+}
+
+static MPeerQuantizedState Quantize(const CharacterInfo& Info, float Time,
+	const MPeerDeltaPrecision& Precision = {})
+{
+	BasicInfoNetState NetState;
+	auto nbi = MakeBasicInfo(Info, NetState, Time);
+	return MQuantizePeerState(nbi, Info.LowerAni, Info.UpperAni, Info.Slot, Precision);
+}
+
+static bool operator==(const MPeerQuantizedState& a, const MPeerQuantizedState& b)
+{
+	return a.TimeMS == b.TimeMS &&
+		std::equal(std::begin(a.Pos), std::end(a.Pos), std::begin(b.Pos)) &&
+		std::equal(std::begin(a.Vel), std::end(a.Vel), std::begin(b.Vel)) &&
+		a.Dir[0] == b.Dir[0] && a.Dir[1] == b.Dir[1] &&
+		a.HasCamDir == b.HasCamDir &&
+		(!a.HasCamDir || (a.CamDir[0] == b.CamDir[0] && a.CamDir[1] == b.CamDir[1])) &&
+		a.LowerAni == b.LowerAni && a.UpperAni == b.UpperAni && a.Slot == b.Slot;
+}
+
+static void TestQuantization()
+{
+	const MPeerDeltaPrecision Precisions[] = { { 1, 1 }, { 4, 2 }, { 0.5f, 8 } };
+	for (auto& Precision : Precisions)
+	{
+		const auto Info = MakeCharacterInfo({ 1234, -5678, 90 }, { 300, -20, -400 }, { 0, 1, 0 });
+		const auto State = Quantize(Info, 12.5f, Precision);
+
+		CharacterInfo Out;
+		float Time;
+		MDequantizePeerState(State, Precision, Out, Time);
+
+		TEST_CHECK(std::abs(Time - 12.5f) < 0.001f);
+		for (int i = 0; i < 3; ++i)
+		{
+			TEST_CHECK(std::abs(Out.Pos[i] - Info.Pos[i]) <= Precision.PosStep / 2 + 1);
+			TEST_CHECK(std::abs(Out.Vel[i] - Info.Vel[i]) <= Precision.VelStep / 2 + 1);
+		}
+		TEST_CHECK(Out.LowerAni == Info.LowerAni);
+		TEST_CHECK(Out.UpperAni == Info.UpperAni);
+		TEST_CHECK(Out.Slot == Info.Slot);
+	}
+
+	TEST_CHECK(MRoundPeerDeltaStep(1.f) == 1.f);
+	TEST_CHECK(MRoundPeerDeltaStep(0.3f) == 5 / 16.f);
+	// Steps too small for the header still quantize to something it can carry.
+	TEST_CHECK(MRoundPeerDeltaStep(0.001f) == 1 / 16.f);
+}
+
+static void TestRoundTrip()
+{
+	const MUID Senders[] = { { 0, 1 }, { 0, 2 }, { 0, 3 } };
+	const MPeerDeltaPrecision Precision{ 2, 4 };
+
+	MPeerQuantizedState First[3], Second[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		First[i] = Quantize(MakeCharacterInfo({ 100.f * i, 200, 300 }, { 10, 0, 0 }, { 1, 0, 0 }), 1);
+		Second[i] = Quantize(MakeCharacterInfo({ 100.f * i + 17, 190, 300 }, { 12, -4, 0 }, { 0, 1, 0 },
+			ZC_STATE_LOWER_RUN_FORWARD), 1.05f);
+	}
+
+	std::vector<u8> Full, Delta;
+	{
+		MPeerDeltaSnapshotWriter Writer{ Full, 0xFFFFFFFF, 7, Precision };
+		for (int i = 0; i < 3; ++i)
+			Writer.Add(Senders[i], First[i], nullptr, 0);
+		TEST_CHECK(Writer.GetCount() == 3);
+		TEST_CHECK(Writer.GetSize() == Full.size());
+	}
+	{
+		MPeerDeltaSnapshotWriter Writer{ Delta, 0xFFFFFFFF, 9, Precision };
+		// The last one has no baseline.
+		for (int i = 0; i < 2; ++i)
+			Writer.Add(Senders[i], Second[i], &First[i], 2);
+		Writer.Add(Senders[2], Second[2], nullptr, 0);
+	}
+	TEST_CHECK(Delta.size() < Full.size());
+
+	MPeerDeltaSnapshotHeader Header;
+	TEST_CHECK(MReadPeerDeltaSnapshotHeader(Delta.data(), Delta.size(), Header));
+	TEST_CHECK(Header.Epoch == 0xFFFFFFFF);
+	TEST_CHECK(Header.Seq == 9);
+	TEST_CHECK(Header.Count == 3);
+	TEST_CHECK(Header.Precision.PosStep == Precision.PosStep);
+	TEST_CHECK(Header.Precision.VelStep == Precision.VelStep);
+
+	std::map<MUID, MPeerQuantizedState> Read;
+	auto OnEntry = [&](const MUID& Sender, const MPeerQuantizedState& State) { Read[Sender] = State; };
+
+	auto Result = MReadPeerDeltaSnapshot(Full.data(), Full.size(),
+		[&](const MUID&, u32) -> const MPeerQuantizedState* { return nullptr; }, OnEntry);
+	TEST_CHECK(Result == MPeerDeltaReadResult::Complete);
+	TEST_CHECK(Read.size() == 3);
+	for (int i = 0; i < 3; ++i)
+		TEST_CHECK(Read[Senders[i]] == First[i]);
+
+	auto GetBaseline = [&](const MUID& Sender, u32 Seq) -> const MPeerQuantizedState* {
+		auto it = Read.find(Sender);
+		return Seq == 7 && it != Read.end() ? &it->second : nullptr;
+	};
+	std::map<MUID, MPeerQuantizedState> ReadDelta;
+	Result = MReadPeerDeltaSnapshot(Delta.data(), Delta.size(), GetBaseline,
+		[&](const MUID& Sender, const MPeerQuantizedState& State) { ReadDelta[Sender] = State; });
+	TEST_CHECK(Result == MPeerDeltaReadResult::Complete);
+	TEST_CHECK(ReadDelta.size() == 3);
+	for (int i = 0; i < 3; ++i)
+		TEST_CHECK(ReadDelta[Senders[i]] == Second[i]);
+
+	// Without the baselines, only the full entry can be read.
+	ReadDelta.clear();
+	Result = MReadPeerDeltaSnapshot(Delta.data(), Delta.size(),
+		[&](const MUID&, u32) -> const MPeerQuantizedState* { return nullptr; },
+		[&](const MUID& Sender, const MPeerQuantizedState& State) { ReadDelta[Sender] = State; });
+	TEST_CHECK(Result == MPeerDeltaReadResult::MissingBaselines);
+	TEST_CHECK(ReadDelta.size() == 1 && ReadDelta[Senders[2]] == Second[2]);
+
+	// Truncated snapshots are rejected.
+	for (size_t Size = 0; Size < Delta.size(); ++Size)
+	{
+		Result = MReadPeerDeltaSnapshot(Delta.data(), Size, GetBaseline,
+			[&](const MUID&, const MPeerQuantizedState&) {});
+		TEST_CHECK(Result == MPeerDeltaReadResult::Malformed);
+	}
+
+	TEST_CHECK(MIsNewerPeerDeltaEpoch(1, 0xFFFFFFFF));
+	TEST_CHECK(!MIsNewerPeerDeltaEpoch(0xFFFFFFFF, 1));
+	TEST_CHECK(!MIsNewerPeerDeltaEpoch(5, 5));
+}
+
+struct BattleSample
+{
+	u64 Time;
+	int Player;
+	CharacterInfo Info;
+};
+
+struct BattleTrace
+{
+	std::string Name;
+	int Players = 0;
+	std::vector<BattleSample> Samples;
+};
+
+static bool LoadTrace(BattleTrace& Out, const char* Path)
+{
+	std::ifstream File{ Path };
+	if (!File)
+	{
+		std::printf("Couldn't open %s\n", Path);
+		return false;
+	}
+
+	Out.Name = Path;
+	std::string Line;
+	while (std::getline(File, Line))
+	{
+		if (Line.empty() || Line[0] == '#')
+			continue;
+
+		std::istringstream Stream{ Line };
+		BattleSample Sample;
+		v3 Pos, Vel, Dir;
+		int Lower, Upper, Slot;
+		if (!(Stream >> Sample.Time >> Sample.Player >> Pos.x >> Pos.y >> Pos.z >>
+			Vel.x >> Vel.y >> Vel.z >> Dir.x >> Dir.y >> Dir.z >> Lower >> Upper >> Slot) ||
+			Sample.Player < 0 || Sample.Player >= 64)
+		{
+			std::printf("%s: bad line \"%s\"\n", Path, Line.c_str());
+			return false;
+		}
+		Sample.Info = MakeCharacterInfo(Pos, Vel, Dir, Lower, Upper, Slot);
+		Out.Players = std::max(Out.Players, Sample.Player + 1);
+		Out.Samples.push_back(Sample);
+	}
+	return true;
+}
+
+static BattleTrace MakeTrace(int Players, u64 UpdateIntervalMS)
+{
+	constexpr u64 Duration = 100 * 1000;
+
+	BattleTrace Ret;
+	Ret.Name = "Generated battle";
+	Ret.Players = Players;
+
+	std::mt19937 Rng{ 1 };
+	std::uniform_real_distribution<float> Dist{ -1, 1 };
+	std::uniform_real_distribution<float> Chance{ 0, 1 };
+
+	std::vector<CharacterInfo> Infos(Players);
+	for (auto& Info : Infos)
+		Info = MakeCharacterInfo({ Dist(Rng) * 3000, Dist(Rng) * 3000, 0 }, {}, { 1, 0, 0 });
+
+	const float Seconds = UpdateIntervalMS / 1000.f;
+	for (u64 Time = UpdateIntervalMS; Time <= Duration; Time += UpdateIntervalMS)
+	{
+		for (int i = 0; i < Players; ++i)
+		{
+			auto& Info = Infos[i];
+			Info.Vel = Info.Vel * 0.9f + v3{ Dist(Rng), Dist(Rng), 0 } * 60.f;
+			Info.Pos += Info.Vel * Seconds;
+			const auto Angle = 0.05f * Dist(Rng);
+			Info.Dir = { Info.Dir.x * cos(Angle) - Info.Dir.y * sin(Angle),
+				Info.Dir.x * sin(Angle) + Info.Dir.y * cos(Angle), 0 };
+			Info.CamDir = Info.Dir;
+			if (Chance(Rng) < 0.03f)
+			{
+				Info.LowerAni = ZC_STATE_LOWER(1 + Rng() % 30);
+				Info.UpperAni = ZC_STATE_UPPER(Rng() % 10);
+			}
+			if (Chance(Rng) < 0.005f)
+				Info.Slot = MMatchCharItemParts(MMCIP_PRIMARY + Rng() % 3);
+
+			Ret.Samples.push_back({ Time, i, Info });
+		}
+	}
+	return Ret;
+}
+
+// What a client keeps of the stream, as MMatchClient does.
+struct ClientStream
+{
+	bool bStarted = false;
+	u32 Epoch = 0;
+	u32 LatestSeq = 0;
+	u32 ReceivedMask = 0;
+	std::map<MUID, std::array<std::pair<u32, MPeerQuantizedState>, MPeerDeltaMaxBaselineAge + 1>> History;
+};
+
+static void Replay(const BattleTrace& Trace, double Loss, u64 FlushIntervalMS)
+{
+	std::vector<MUID> Players;
+	for (int i = 0; i < Trace.Players; ++i)
+		Players.emplace_back(0, 1000 + i);
+
+	MMatchSnapshotAggregator Aggregator;
+	Aggregator.SetEnabled(true);
+	Aggregator.SetInterval(u32(FlushIntervalMS));
+
+	std::vector<BasicInfoNetState> NetStates(Trace.Players);
+	std::map<MUID, MPeerQuantizedState> Expected;
+	std::vector<CharacterInfo> LastInfo(Trace.Players);
+	std::map<MUID, ClientStream> Clients;
+	std::mt19937 Rng{ 2 };
+	std::uniform_real_distribution<double> Chance{ 0, 1 };
+
+	u64 PlainBytes = 0, DeltaBytes = 0, Snapshots = 0;
+	u64 Decoded = 0, Mismatched = 0, Incomplete = 0;
+
+	auto Flush = [&](u64 Time) {
+		std::vector<std::tuple<MUID, u32, u32, u32>> Acks;
+		Aggregator.Flush(Time, [&](const MUID& Receiver, const char* Data, size_t Size, bool bDelta) {
+			TEST_CHECK(bDelta);
+			DeltaBytes += Size;
+			++Snapshots;
+			if (Chance(Rng) < Loss)
+				return;
+
+			auto* p = reinterpret_cast<const u8*>(Data);
+			MPeerDeltaSnapshotHeader Header;
+			TEST_CHECK(MReadPeerDeltaSnapshotHeader(p, Size, Header));
+
+			auto& Client = Clients[Receiver];
+			if (!Client.bStarted || MIsNewerPeerDeltaEpoch(Header.Epoch, Client.Epoch))
+			{
+				Client = {};
+				Client.bStarted = true;
+				Client.Epoch = Header.Epoch;
+			}
+
+			const auto Result = MReadPeerDeltaSnapshot(p, Size,
+				[&](const MUID& Sender, u32 Seq) -> const MPeerQuantizedState* {
+					auto it = Client.History.find(Sender);
+					if (it == Client.History.end())
+						return nullptr;
+					auto& Received = it->second[Seq % it->second.size()];
+					return Received.first == Seq ? &Received.second : nullptr;
+				},
+				[&](const MUID& Sender, const MPeerQuantizedState& State) {
+					auto& History = Client.History[Sender];
+					History[Header.Seq % History.size()] = { Header.Seq, State };
+					++Decoded;
+					if (!(State == Expected[Sender]))
+						++Mismatched;
+				});
+			if (Result != MPeerDeltaReadResult::Complete)
+			{
+				++Incomplete;
+				return;
+			}
+
+			const auto Shift = Header.Seq - Client.LatestSeq;
+			if (Client.LatestSeq == 0 || Shift > 32)
+				Client.ReceivedMask = 0;
+			else
+				Client.ReceivedMask = ((u64(Client.ReceivedMask) << Shift) | (u64(1) << (Shift - 1))) & 0xFFFFFFFF;
+			Client.LatestSeq = Header.Seq;
+
+			if (Chance(Rng) >= Loss)
+				Acks.emplace_back(Receiver, Client.Epoch, Client.LatestSeq, Client.ReceivedMask);
+		});
+		// The acks arrive after the next updates have been queued.
+		return Acks;
+	};
+
+	std::vector<std::tuple<MUID, u32, u32, u32>> PendingAcks;
+	u64 NextFlush = FlushIntervalMS;
+	for (auto& Sample : Trace.Samples)
+	{
+		while (Sample.Time >= NextFlush)
+		{
+			for (auto& Ack : PendingAcks)
+				Aggregator.OnAck(std::get<0>(Ack), std::get<1>(Ack), std::get<2>(Ack), std::get<3>(Ack));
+			PendingAcks = Flush(NextFlush);
+			NextFlush += FlushIntervalMS;
+		}
+
+		const auto i = Sample.Player;
+		std::unique_ptr<MCommandParameterBlob> Blob{
+			PackNewBasicInfo(Sample.Info, NetStates[i], Sample.Time / 1000.f) };
+		NewBasicInfo nbi;
+		if (!UnpackNewBasicInfo(nbi, static_cast<const u8*>(Blob->GetPointer()), Blob->GetPayloadSize()))
+		{
+			// The server would drop it too, e.g. for an invalid slot in a trace.
+			std::printf("%s: invalid update from player %d at %llu ms\n", Trace.Name.c_str(), i,
+				static_cast<unsigned long long>(Sample.Time));
+			++TestFailures();
+			continue;
+		}
+
+		// The P2P command blob has a 9 byte header before the basic info.
+		PlainBytes += MPeerSnapshotEntrySize(9 + Blob->GetPayloadSize()) * (Trace.Players - 1);
+
+		Expected[Players[i]] = MQuantizePeerState(nbi, Sample.Info.LowerAni, Sample.Info.UpperAni, Sample.Info.Slot,
+			MPeerDeltaPrecision{});
+
+		std::vector<MUID> Receivers;
+		for (int j = 0; j < Trace.Players; ++j)
+			if (j != i)
+				Receivers.push_back(Players[j]);
+		Aggregator.AddBasicInfo(Players[i], nbi, Receivers);
+	}
+	Flush(NextFlush);
+
+	std::printf("%s, %d players, %d%% loss: %llu plain bytes, %llu delta bytes (%.1f%%) in %llu snapshots, "
+		"%llu entries decoded\n",
+		Trace.Name.c_str(), Trace.Players, int(Loss * 100 + 0.5),
+		static_cast<unsigned long long>(PlainBytes), static_cast<unsigned long long>(DeltaBytes),
+		PlainBytes ? 100.0 * DeltaBytes / PlainBytes : 0.0,
+		static_cast<unsigned long long>(Snapshots), static_cast<unsigned long long>(Decoded));
+
+	// Entries are only encoded against acknowledged baselines, so every snapshot that
+	// arrives can be read in full, and has the newest state of each sender in it.
+	TEST_CHECK(Incomplete == 0);
+	TEST_CHECK(Mismatched == 0);
+	TEST_CHECK(DeltaBytes < PlainBytes);
+}
+
+int main(int argc, char** argv)
+{
+	TestQuantization();
+	TestRoundTrip();
+
+	std::vector<BattleTrace> Traces;
+	if (argc > 1)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			BattleTrace Trace;
+			TEST_CHECK(LoadTrace(Trace, argv[i]));
+			if (!Trace.Samples.empty())
+				Traces.push_back(std::move(Trace));
+		}
+	}
+	else
+		Traces.push_back(MakeTrace(16, 33));
+
+	for (auto& Trace : Traces)
+		for (auto Loss : { 0.0, 0.1, 0.3 })
+			Replay(Trace, Loss, 33);
+
+	return TestResult();
+}
@@ -0,0 +1,287 @@
+#include "stdafx.h"
+#include "MMatchSnapshotAggregator.h"
+#include "MCommandWriter.h"
+#include "MPeerSnapshot.h"
+#include "MSharedCommandTable.h"
+#include "NetIOLoopback.h"
+#include "TestCommon.h"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <random>
+#include <thread>
+
+// Tests MMatchSnapshotAggregator's queueing, then sends a stage's worth of position
+// updates through NetIO to loopback clients, once as one MC_MATCH_P2P_COMMAND per
+// update and receiver and once as one MC_MATCH_PEER_SNAPSHOT per receiver and tick,
+// the way MMatchServer does. Each client decrypts and unpacks what it gets and checks
+// that every update arrived. Reports packets, bytes and the time the sending thread
+// spent in both cases.
+
+using asio::ip::tcp;
+
+constexpr int Players = 16;
+constexpr int Ticks = 500;
+// Roughly the size of a tunnelled MC_PEER_BASICINFO_RG.
+constexpr int BlobSize = 40;
+
+static MUID GetPlayerUID(int Player) { return MUID(0, 1 + Player); }
+
+// The blob says who sent it and when, so the clients can check it.
+static void MakeBlob(char* Blob, int Player, int Tick)
+{
+	memset(Blob, Player + Tick, BlobSize);
+	memcpy(Blob, &Player, sizeof(Player));
+	memcpy(Blob + sizeof(Player), &Tick, sizeof(Tick));
+}
+
+static void TestQueue()
+{
+	MMatchSnapshotAggregator Aggregator;
+	const MUID A = GetPlayerUID(0), B = GetPlayerUID(1), C = GetPlayerUID(2);
+
+	char Blob[BlobSize];
+	MakeBlob(Blob, 0, 1);
+	TEST_CHECK(Aggregator.Add(A, Blob, sizeof(Blob), { B }));
+	// Supersedes the first one, and adds C.
+	MakeBlob(Blob, 0, 2);
+	TEST_CHECK(Aggregator.Add(A, Blob, sizeof(Blob), { B, C }));
+	MakeBlob(Blob, 1, 2);
+	TEST_CHECK(Aggregator.Add(B, Blob, sizeof(Blob), { A, C }));
+	TEST_CHECK(!Aggregator.Add(C, Blob, 0, { A }));
+	std::vector<char> Big(MMatchSnapshotAggregator::MaxSnapshotSize);
+	TEST_CHECK(!Aggregator.Add(C, Big.data(), Big.size(), { A }));
+	TEST_CHECK(Aggregator.IsDue(0));
+
+	std::map<MUID, std::vector<std::pair<MUID, int>>> Received;
+	Aggregator.Flush(0, [&](const MUID& Receiver, const char* Data, size_t Size, bool bDelta) {
+		TEST_CHECK(!bDelta);
+		TEST_CHECK(MForEachPeerSnapshotEntry(Data, Size, [&](const MUID& Sender, const char* Blob, u16 Size) {
+			int Tick;
+			memcpy(&Tick, Blob + sizeof(int), sizeof(Tick));
+			TEST_CHECK(Size == BlobSize);
+			Received[Receiver].emplace_back(Sender, Tick);
+		}));
+	});
+	TEST_CHECK((Received[A] == std::vector<std::pair<MUID, int>>{ { B, 2 } }));
+	TEST_CHECK((Received[B] == std::vector<std::pair<MUID, int>>{ { A, 2 } }));
+	TEST_CHECK((Received[C] == std::vector<std::pair<MUID, int>>{ { A, 2 }, { B, 2 } }));
+	TEST_CHECK(!Aggregator.IsDue(0));
+
+	// A discarded update isn't sent.
+	Aggregator.Add(A, Blob, sizeof(Blob), { B });
+	Aggregator.Discard(A);
+	TEST_CHECK(!Aggregator.IsDue(0));
+
+	// What doesn't fit in one snapshot is split over several.
+	const int Senders = 2 * int(MMatchSnapshotAggregator::MaxSnapshotSize / MPeerSnapshotEntrySize(BlobSize));
+	for (int i = 0; i < Senders; ++i)
+	{
+		MakeBlob(Blob, i, 3);
+		Aggregator.Add(GetPlayerUID(100 + i), Blob, sizeof(Blob), { A });
+	}
+	int Snapshots = 0, Entries = 0;
+	Aggregator.Flush(1, [&](const MUID&, const char* Data, size_t Size, bool) {
+		++Snapshots;
+		TEST_CHECK(Size <= MMatchSnapshotAggregator::MaxSnapshotSize);
+		MForEachPeerSnapshotEntry(Data, Size, [&](const MUID&, const char*, u16) { ++Entries; });
+	});
+	TEST_CHECK(Snapshots >= 2 && Snapshots <= 3);
+	TEST_CHECK(Entries == Senders);
+}
+
+struct ClientStats
+{
+	int Packets = 0;
+	int Entries = 0;
+	u64 Bytes = 0;
+	bool bOK = true;
+};
+
+// Reads until every other player's update for every tick has arrived, checking that
+// they come from who they should and in order.
+static void ReadUpdates(tcp::socket& Socket, int Self, const MPacketCrypterKey& Key, ClientStats& Stats)
+{
+	std::vector<int> LastTick(Players, -1);
+	auto OnEntry = [&](const MUID& Sender, const char* Blob, u32 Size) {
+		int Player, Tick;
+		memcpy(&Player, Blob, sizeof(Player));
+		memcpy(&Tick, Blob + sizeof(Player), sizeof(Tick));
+		if (Size != BlobSize || Player == Self || Player < 0 || Player >= Players ||
+			Sender != GetPlayerUID(Player) || Tick <= LastTick[Player])
+		{
+			Stats.bOK = false;
+			return;
+		}
+		LastTick[Player] = Tick;
+		++Stats.Entries;
+	};
+
+	std::vector<char> Packet;
+	while (Stats.bOK && Stats.Entries < Ticks * (Players - 1))
+	{
+		if (!ReadCommandPacket(Socket, Packet, Key))
+		{
+			Stats.bOK = false;
+			break;
+		}
+		++Stats.Packets;
+		Stats.Bytes += Packet.size();
+
+		// The command header is the size, the ID and the serial number.
+		const char* p = Packet.data() + sizeof(MPacketHeader);
+		u16 ID;
+		memcpy(&ID, p + sizeof(u16), sizeof(ID));
+		p += detail::MCommandHeaderSize;
+
+		if (ID == MC_MATCH_P2P_COMMAND)
+		{
+			MUID Sender;
+			u32 Size;
+			memcpy(&Sender, p, sizeof(Sender));
+			memcpy(&Size, p + sizeof(Sender), sizeof(Size));
+			OnEntry(Sender, p + sizeof(Sender) + sizeof(Size), Size);
+		}
+		else if (ID == MC_MATCH_PEER_SNAPSHOT)
+		{
+			u32 Size;
+			memcpy(&Size, p, sizeof(Size));
+			if (!MForEachPeerSnapshotEntry(p + sizeof(Size), Size, OnEntry))
+				Stats.bOK = false;
+		}
+		else
+		{
+			Stats.bOK = false;
+		}
+	}
+}
+
+template <int ID, typename... ArgTypes>
+static void SendCommand(LoopbackServer& Srv, NetIO::ConnectionHandle Handle,
+	NetIO::PacketEncoder& Encoder, u64& Bytes, const ArgTypes&... Args)
+{
+	const int PacketSize = int(sizeof(MPacketHeader)) + MGetCommandSize<ID>(Args...);
+	auto pMsg = static_cast<MCommandMsg*>(malloc(PacketSize));
+	pMsg->nCheckSum = 0;
+	pMsg->nMsg = MSGID_COMMAND;
+	pMsg->nSize = PacketSize;
+	MWriteCommand<ID>(pMsg->Buffer, PacketSize - int(sizeof(MPacketHeader)), Args...);
+	Srv.Net.Send(Handle, pMsg, PacketSize, false, &Encoder);
+	Bytes += PacketSize;
+}
+
+static void Benchmark(bool bAggregate)
+{
+	LoopbackServer Srv;
+	if (!Srv.Create())
+	{
+		std::printf("Couldn't listen on a loopback port\n");
+		TEST_CHECK(false);
+		return;
+	}
+
+	asio::io_context Context;
+	std::vector<std::unique_ptr<tcp::socket>> Sockets;
+	std::vector<NetIO::ConnectionHandle> Handles;
+	for (int i = 0; i < Players; ++i)
+	{
+		Sockets.push_back(std::make_unique<tcp::socket>(Context));
+		Handles.push_back(Srv.Connect(*Sockets.back()));
+		TEST_CHECK(Handles.back() != 0);
+		if (Handles.back() == 0)
+			return;
+	}
+
+	// Everyone has the same key, since it doesn't matter here.
+	std::mt19937 Rng{ 1 };
+	MPacketCrypterKey Key;
+	for (auto& c : Key.szKey)
+		c = char(Rng());
+	NetIO::PacketEncoder Encoder;
+	Encoder.Function = EncodeCommandPacket;
+	memcpy(Encoder.Data, &Key, sizeof(Key));
+
+	std::vector<ClientStats> Stats(Players);
+	std::vector<std::thread> Readers;
+	for (int i = 0; i < Players; ++i)
+		Readers.emplace_back([&, i] { ReadUpdates(*Sockets[i], i, Key, Stats[i]); });
+
+	std::vector<std::vector<MUID>> Receivers(Players);
+	for (int i = 0; i < Players; ++i)
+		for (int j = 0; j < Players; ++j)
+			if (j != i)
+				Receivers[i].push_back(GetPlayerUID(j));
+
+	MMatchSnapshotAggregator Aggregator;
+	u64 SentPackets = 0, SentBytes = 0;
+	const auto Start = std::chrono::steady_clock::now();
+	for (int Tick = 0; Tick < Ticks; ++Tick)
+	{
+		for (int i = 0; i < Players; ++i)
+		{
+			char Blob[BlobSize];
+			MakeBlob(Blob, i, Tick);
+			if (bAggregate)
+			{
+				Aggregator.Add(GetPlayerUID(i), Blob, sizeof(Blob), Receivers[i]);
+				continue;
+			}
+
+			for (auto& Receiver : Receivers[i])
+			{
+				SendCommand<MC_MATCH_P2P_COMMAND>(Srv, Handles[Receiver.Low - 1], Encoder, SentBytes,
+					GetPlayerUID(i), MCommandBlob{ Blob, u32(sizeof(Blob)) });
+				++SentPackets;
+			}
+		}
+
+		if (bAggregate)
+		{
+			Aggregator.Flush(Tick, [&](const MUID& Receiver, const char* Data, size_t Size, bool) {
+				SendCommand<MC_MATCH_PEER_SNAPSHOT>(Srv, Handles[Receiver.Low - 1], Encoder, SentBytes,
+					MCommandBlob{ Data, u32(Size) });
+				++SentPackets;
+			});
+		}
+	}
+	const std::chrono::duration<double, std::milli> SendTime = std::chrono::steady_clock::now() - Start;
+
+	for (auto& Reader : Readers)
+		Reader.join();
+	const std::chrono::duration<double, std::milli> DeliveryTime = std::chrono::steady_clock::now() - Start;
+
+	u64 ReceivedPackets = 0, ReceivedBytes = 0;
+	for (auto& Client : Stats)
+	{
+		TEST_CHECK(Client.bOK);
+		TEST_CHECK(Client.Entries == Ticks * (Players - 1));
+		ReceivedPackets += Client.Packets;
+		ReceivedBytes += Client.Bytes;
+	}
+	TEST_CHECK(ReceivedPackets == SentPackets);
+	TEST_CHECK(ReceivedBytes == SentBytes);
+	if (bAggregate)
+		// One snapshot per receiver and tick, since a tick's updates fit in one.
+		TEST_CHECK(SentPackets == u64(Players) * Ticks);
+
+	std::printf("%-9s %7llu packets, %8llu bytes, %6.1f ms on the sending thread, "
+		"%6.1f ms until delivered\n", bAggregate ? "Snapshot:" : "Direct:",
+		static_cast<unsigned long long>(SentPackets), static_cast<unsigned long long>(SentBytes),
+		SendTime.count(), DeliveryTime.count());
+
+	asio::error_code ec;
+	for (auto& Socket : Sockets)
+		Socket->close(ec);
+	Srv.Net.Destroy();
+}
+
+int main()
+{
+	TestQueue();
+
+	std::printf("%d players, %d ticks, %d byte updates:\n", Players, Ticks, BlobSize);
+	Benchmark(false);
+	Benchmark(true);
+
+	return TestResult();
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+
+// Minimal checks for the test programs run by ctest. A failed check prints where it
+// failed and makes TestResult() return nonzero, so that main can return it.
+
+inline int& TestFailures()
+{
+	static int Failures = 0;
+	return Failures;
+}
+
+#define TEST_CHECK(expr) \
+	do { \
+		if (!(expr)) { \
+			std::printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #expr); \
+			++TestFailures(); \
+		} \
+	} while (false)
+
+inline int TestResult()
+{
+	if (TestFailures() != 0)
+		std::printf("%d check(s) failed\n", TestFailures());
+	return TestFailures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,275 @@
+#include "stdafx.h"
+#include "MMatchUDPRelay.h"
+#include "MPacket.h"
+#include "MTime.h"
+#include "TestCommon.h"
+#include "asio.hpp"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <thread>
+
+// Tests MMatchUDPRelay's packet encoding and client table, then relays packets
+// between two loopback UDP clients the way MMatchServer does: check the sender,
+// decode with their key, encode with the receiver's key and send it on. Reports the
+// one-way latency through the relay and the throughput with a window of packets in
+// flight.
+
+using asio::ip::udp;
+using Clock = std::chrono::steady_clock;
+
+static MPacketCrypterKey MakeKey(std::mt19937& Rng)
+{
+	MPacketCrypterKey Key;
+	for (auto& c : Key.szKey)
+		c = char(Rng());
+	return Key;
+}
+
+static void TestEncoding()
+{
+	std::mt19937 Rng{ 1 };
+	const auto Key = MakeKey(Rng);
+	const auto OtherKey = MakeKey(Rng);
+
+	for (int Size = 1; Size < 600; Size += 7)
+	{
+		std::vector<char> Cmd(Size);
+		for (auto& c : Cmd)
+			c = char(Rng());
+
+		std::vector<char> Packet(sizeof(MPacketHeader) + Size);
+		const auto PacketSize = MMatchUDPRelay::EncodePacket(Packet.data(), Cmd.data(), Size, &Key);
+		TEST_CHECK(PacketSize == int(Packet.size()));
+
+		auto Copy = Packet;
+		TEST_CHECK(MMatchUDPRelay::DecodePacket(Copy.data(), PacketSize, &Key) == Size);
+		TEST_CHECK(std::equal(Cmd.begin(), Cmd.end(), Copy.begin() + sizeof(MPacketHeader)));
+
+		// Wrong key, wrong size, and a flipped bit.
+		Copy = Packet;
+		TEST_CHECK(MMatchUDPRelay::DecodePacket(Copy.data(), PacketSize, &OtherKey) == 0);
+		Copy = Packet;
+		TEST_CHECK(MMatchUDPRelay::DecodePacket(Copy.data(), PacketSize - 1, &Key) == 0);
+		Copy = Packet;
+		Copy[sizeof(MPacketHeader) + Rng() % Size] ^= 1 << (Rng() % 8);
+		TEST_CHECK(MMatchUDPRelay::DecodePacket(Copy.data(), PacketSize, &Key) == 0);
+	}
+}
+
+static void TestClients()
+{
+	MPacketRateLimits Limits;
+	MPacketRateLimitStats LimitStats;
+	MMatchUDPRelay Relay{ Limits, LimitStats };
+
+	const MUID A{ 0, 1 }, B{ 0, 2 };
+	Relay.Register(A, 0x0100007F, 1000);
+	Relay.Register(B, 0x0100007F, 1001);
+
+	MMatchUDPRelay::Target Target;
+	TEST_CHECK(Relay.GetTarget(A, Target));
+	TEST_CHECK(Target.IP == 0x0100007F && Target.RawPort == 1000 && !Target.bConfirmed);
+	Relay.OnReceived(0x0100007F, 1000);
+	TEST_CHECK(Relay.GetTarget(A, Target) && Target.bConfirmed);
+
+	MUID Sender;
+	TEST_CHECK(Relay.CheckSender(0x0100007F, 1001, Sender) && Sender == B);
+	TEST_CHECK(!Relay.CheckSender(0x0100007F, 1002, Sender));
+
+	// B reconnects from A's address.
+	Relay.Register(B, 0x0100007F, 1000);
+	TEST_CHECK(!Relay.GetTarget(A, Target));
+	TEST_CHECK(Relay.CheckSender(0x0100007F, 1000, Sender) && Sender == B);
+	TEST_CHECK(!Relay.CheckSender(0x0100007F, 1001, Sender));
+
+	Relay.Unregister(B);
+	TEST_CHECK(!Relay.GetTarget(B, Target));
+
+	// The PeerRelay rate limit drops what goes over the burst.
+	Relay.Register(A, 0x0100007F, 1000);
+	const auto& Bucket = Limits.Buckets[size_t(MPacketClass::PeerRelay)];
+	int Passed = 0;
+	for (int i = 0; i < int(Bucket.Burst) * 2; ++i)
+		Passed += Relay.CheckSender(0x0100007F, 1000, Sender);
+	TEST_CHECK(Passed >= int(Bucket.Burst) && Passed < int(Bucket.Burst) * 2);
+}
+
+static std::pair<u32, u16> GetAddress(const udp::endpoint& Endpoint)
+{
+	return{ u32(Endpoint.address().to_v4().to_ulong()), Endpoint.port() };
+}
+
+// Returns 0 if nothing arrived before Deadline.
+static size_t Receive(udp::socket& Socket, std::vector<char>& Buffer, udp::endpoint& From,
+	Clock::time_point Deadline)
+{
+	while (Clock::now() < Deadline)
+	{
+		asio::error_code ec;
+		const auto Size = Socket.receive_from(asio::buffer(Buffer), From, 0, ec);
+		if (!ec)
+			return Size;
+		if (ec != asio::error::would_block && ec != asio::error::try_again)
+			return 0;
+		std::this_thread::yield();
+	}
+	return 0;
+}
+
+struct RelayServer
+{
+	MPacketRateLimits Limits;
+	MPacketRateLimitStats LimitStats;
+	MMatchUDPRelay Relay{ Limits, LimitStats };
+	std::map<MUID, MPacketCrypterKey> Keys;
+	// Who gets what each client sends.
+	std::map<MUID, MUID> Routes;
+	std::atomic<bool> bStop{ false };
+
+	void Run(udp::socket& Socket)
+	{
+		std::vector<char> Buffer(MAX_PACKET_SIZE), Out(MAX_PACKET_SIZE);
+		udp::endpoint From;
+		while (!bStop)
+		{
+			const auto Size = Receive(Socket, Buffer, From, Clock::now() + std::chrono::milliseconds{ 10 });
+			if (Size == 0)
+				continue;
+
+			const auto Address = GetAddress(From);
+			MUID Sender;
+			if (!Relay.CheckSender(Address.first, Address.second, Sender))
+				continue;
+			const auto CmdSize = MMatchUDPRelay::DecodePacket(Buffer.data(), u32(Size), &Keys[Sender]);
+			if (CmdSize == 0)
+				continue;
+			Relay.OnReceived(Address.first, Address.second);
+
+			const auto& Receiver = Routes[Sender];
+			MMatchUDPRelay::Target Target;
+			if (!Relay.GetTarget(Receiver, Target))
+				continue;
+			const auto OutSize = MMatchUDPRelay::EncodePacket(Out.data(),
+				Buffer.data() + sizeof(MPacketHeader), CmdSize, &Keys[Receiver]);
+			asio::error_code ec;
+			Socket.send_to(asio::buffer(Out.data(), OutSize),
+				udp::endpoint{ asio::ip::address_v4{ Target.IP }, Target.RawPort }, 0, ec);
+		}
+	}
+};
+
+struct Payload
+{
+	u32 Seq;
+	i64 SentTimeNS;
+	// Roughly the size of a tunnelled MC_PEER_BASICINFO_RG.
+	char Padding[40];
+};
+
+static void Benchmark()
+{
+	asio::io_context Context;
+	const auto Loopback = asio::ip::address_v4::loopback();
+	udp::socket ServerSocket{ Context, udp::endpoint{ Loopback, 0 } };
+	udp::socket SenderSocket{ Context, udp::endpoint{ Loopback, 0 } };
+	udp::socket ReceiverSocket{ Context, udp::endpoint{ Loopback, 0 } };
+	ServerSocket.non_blocking(true);
+	ReceiverSocket.non_blocking(true);
+
+	std::mt19937 Rng{ 2 };
+	const MUID SenderUID{ 0, 1 }, ReceiverUID{ 0, 2 };
+
+	RelayServer Server;
+	// Measure the relay itself rather than the rate limit.
+	Server.Limits.Buckets[size_t(MPacketClass::PeerRelay)].Rate = 0;
+	Server.Keys[SenderUID] = MakeKey(Rng);
+	Server.Keys[ReceiverUID] = MakeKey(Rng);
+	Server.Routes[SenderUID] = ReceiverUID;
+	const auto SenderAddress = GetAddress(SenderSocket.local_endpoint());
+	const auto ReceiverAddress = GetAddress(ReceiverSocket.local_endpoint());
+	Server.Relay.Register(SenderUID, SenderAddress.first, SenderAddress.second);
+	Server.Relay.Register(ReceiverUID, ReceiverAddress.first, ReceiverAddress.second);
+
+	std::thread ServerThread{ [&] { Server.Run(ServerSocket); } };
+	const auto ServerEndpoint = ServerSocket.local_endpoint();
+
+	auto Send = [&](u32 Seq) {
+		Payload Data{};
+		Data.Seq = Seq;
+		Data.SentTimeNS = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			Clock::now().time_since_epoch()).count();
+		char Packet[sizeof(MPacketHeader) + sizeof(Payload)];
+		MMatchUDPRelay::EncodePacket(Packet, reinterpret_cast<const char*>(&Data), sizeof(Data),
+			&Server.Keys[SenderUID]);
+		SenderSocket.send_to(asio::buffer(Packet), ServerEndpoint);
+	};
+
+	std::vector<char> Buffer(MAX_PACKET_SIZE);
+	auto Receive = [&](Payload& Out) {
+		udp::endpoint From;
+		const auto Size = ::Receive(ReceiverSocket, Buffer, From, Clock::now() + std::chrono::seconds{ 1 });
+		if (Size == 0)
+			return false;
+		if (MMatchUDPRelay::DecodePacket(Buffer.data(), u32(Size), &Server.Keys[ReceiverUID]) != sizeof(Payload))
+			return false;
+		memcpy(&Out, Buffer.data() + sizeof(MPacketHeader), sizeof(Out));
+		return true;
+	};
+
+	// Latency, one packet at a time.
+	constexpr int LatencyCount = 2000;
+	std::vector<double> Latencies;
+	for (int i = 0; i < LatencyCount; ++i)
+	{
+		Send(i);
+		Payload Data;
+		if (!Receive(Data) || Data.Seq != u32(i))
+			break;
+		const auto Now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			Clock::now().time_since_epoch()).count();
+		Latencies.push_back((Now - Data.SentTimeNS) / 1000.0);
+	}
+	TEST_CHECK(Latencies.size() == LatencyCount);
+
+	// Throughput, with a window of packets in flight.
+	constexpr int ThroughputCount = 50000;
+	constexpr int Window = 64;
+	int Sent = 0, Received = 0;
+	const auto Start = Clock::now();
+	while (Received < ThroughputCount)
+	{
+		while (Sent < ThroughputCount && Sent - Received < Window)
+			Send(Sent++);
+		Payload Data;
+		if (!Receive(Data))
+			break;
+		++Received;
+	}
+	const std::chrono::duration<double> Elapsed = Clock::now() - Start;
+
+	Server.bStop = true;
+	ServerThread.join();
+
+	if (!Latencies.empty())
+	{
+		std::sort(Latencies.begin(), Latencies.end());
+		std::printf("Relay latency over %zu packets: median %.1f us, 99th percentile %.1f us\n",
+			Latencies.size(), Latencies[Latencies.size() / 2], Latencies[Latencies.size() * 99 / 100]);
+	}
+	std::printf("Relay throughput: %d of %d packets in %.2f s, %.0f packets/s\n",
+		Received, ThroughputCount, Elapsed.count(), Received / Elapsed.count());
+
+	// Loopback doesn't lose anything with this few in flight.
+	TEST_CHECK(Received == ThroughputCount);
+}
+
+int main()
+{
+	TestEncoding();
+	TestClients();
+	Benchmark();
+
+	return TestResult();
+}
@@ -0,0 +1,249 @@
+#include "stdafx.h"
+#include "MMatchVoiceForwarder.h"
+#include "MMatchObject.h"
+#include "TestCommon.h"
+#include <memory>
+#include <random>
+#include <set>
+
+// Tests MMatchVoiceForwarder's speaker slots, priorities and byte budget, then
+// simulates a full room where everyone talks at once and reports how many frames
+// were forwarded and suppressed, against forwarding every frame to everyone.
+
+using namespace RealSpace2;
+
+using Forwarder = MMatchVoiceForwarder;
+
+// Frames are 60 ms of Opus.
+constexpr u64 FrameMS = 60;
+constexpr size_t FrameSize = 150;
+
+static std::vector<std::unique_ptr<MMatchObject>> MakePlayers(int Count)
+{
+	std::vector<std::unique_ptr<MMatchObject>> Players;
+	for (int i = 0; i < Count; ++i)
+	{
+		Players.push_back(std::make_unique<MMatchObject>(MUID(0, 1000 + i)));
+		Players.back()->SetTeam(i % 2 ? MMT_RED : MMT_BLUE);
+	}
+	return Players;
+}
+
+static void SetPosition(MMatchObject& Player, const v3& Pos)
+{
+	BasicInfoItem Item{};
+	Item.position = Pos;
+	Player.BasicInfoHistory.AddBasicInfo(Item);
+}
+
+static void TestDisabled()
+{
+	auto Players = MakePlayers(2);
+	Forwarder Voice;
+	Forwarder::Stats Stats;
+	for (int i = 0; i < 100; ++i)
+		TEST_CHECK(Voice.ShouldForward(*Players[0], *Players[1], 10000, false, 1000, Stats));
+	TEST_CHECK(Stats.Considered == 100 && Stats.Forwarded == 100);
+}
+
+static void TestSpeakerLimit()
+{
+	auto Players = MakePlayers(7);
+	auto& Receiver = *Players[0];
+	Forwarder Voice;
+	Voice.SetEnabled(true);
+	Forwarder::Stats Stats;
+	const auto MaxSpeakers = Voice.GetSettings().MaxSpeakers;
+
+	// The first MaxSpeakers get through, the rest don't, as long as they keep talking.
+	u64 Time = 1000;
+	for (int Frame = 0; Frame < 5; ++Frame, Time += FrameMS)
+	{
+		for (u32 i = 1; i <= 6; ++i)
+			TEST_CHECK(Voice.ShouldForward(*Players[i], Receiver, FrameSize, false, Time, Stats) ==
+				(i <= MaxSpeakers));
+	}
+	TEST_CHECK(Stats.Considered == 30);
+	TEST_CHECK(Stats.Forwarded == 5 * MaxSpeakers);
+	TEST_CHECK(Stats.SuppressedSpeakers == 30 - 5 * MaxSpeakers);
+
+	// Once one goes quiet, a waiting speaker gets the slot.
+	Time += Voice.GetSettings().SpeakerTimeoutMS;
+	for (u32 i = 2; i <= MaxSpeakers; ++i)
+		TEST_CHECK(Voice.ShouldForward(*Players[i], Receiver, FrameSize, false, Time, Stats));
+	TEST_CHECK(Voice.ShouldForward(*Players[6], Receiver, FrameSize, false, Time, Stats));
+	TEST_CHECK(!Voice.ShouldForward(*Players[1], Receiver, FrameSize, false, Time, Stats));
+
+	// A player that leaves frees their slot right away.
+	Voice.RemovePlayer(Players[2]->GetUID());
+	TEST_CHECK(Voice.ShouldForward(*Players[1], Receiver, FrameSize, false, Time, Stats));
+}
+
+static void TestPriority()
+{
+	// Even players are on the receiver's team.
+	auto Players = MakePlayers(12);
+	auto& Receiver = *Players[0];
+	Forwarder Voice;
+	Voice.SetEnabled(true);
+	Forwarder::Stats Stats;
+	const u64 Time = 1000;
+
+	// Enemies fill the slots, and teammates take them.
+	for (int i : { 1, 3, 5, 7 })
+		TEST_CHECK(Voice.ShouldForward(*Players[i], Receiver, FrameSize, true, Time, Stats));
+	for (int i : { 2, 4, 6, 8 })
+		TEST_CHECK(Voice.ShouldForward(*Players[i], Receiver, FrameSize, true, Time, Stats));
+	for (int i : { 1, 3, 5, 7 })
+		TEST_CHECK(!Voice.ShouldForward(*Players[i], Receiver, FrameSize, true, Time, Stats));
+	// But teammates don't take each other's.
+	TEST_CHECK(!Voice.ShouldForward(*Players[10], Receiver, FrameSize, true, Time, Stats));
+
+	// Without teams, near players take slots from far ones.
+	Forwarder FFA;
+	FFA.SetEnabled(true);
+	SetPosition(Receiver, { 0, 0, 0 });
+	for (int i = 1; i < 12; ++i)
+		SetPosition(*Players[i], { i <= 4 ? 10000.f : 100.f * i, 0, 0 });
+	for (int i = 1; i <= 4; ++i)
+		TEST_CHECK(FFA.ShouldForward(*Players[i], Receiver, FrameSize, false, Time, Stats));
+	for (int i = 5; i <= 8; ++i)
+		TEST_CHECK(FFA.ShouldForward(*Players[i], Receiver, FrameSize, false, Time, Stats));
+	for (int i = 1; i <= 4; ++i)
+		TEST_CHECK(!FFA.ShouldForward(*Players[i], Receiver, FrameSize, false, Time, Stats));
+}
+
+static void TestBudget()
+{
+	auto Players = MakePlayers(2);
+	Forwarder Voice;
+	Voice.SetEnabled(true);
+	Forwarder::Settings Settings;
+	Settings.BytesPerSecond = 1000;
+	Voice.SetSettings(Settings);
+	Forwarder::Stats Stats;
+
+	// A second's worth goes through at once, then nothing until it refills.
+	u64 Time = 1000;
+	for (int i = 0; i < 10; ++i)
+		TEST_CHECK(Voice.ShouldForward(*Players[1], *Players[0], 100, false, Time, Stats));
+	TEST_CHECK(!Voice.ShouldForward(*Players[1], *Players[0], 100, false, Time, Stats));
+	TEST_CHECK(Stats.SuppressedBudget == 1);
+
+	Time += 100;
+	TEST_CHECK(Voice.ShouldForward(*Players[1], *Players[0], 100, false, Time, Stats));
+	TEST_CHECK(!Voice.ShouldForward(*Players[1], *Players[0], 100, false, Time, Stats));
+}
+
+// Everyone in a room of 16 talks at once for ten seconds.
+static void Simulate(bool bTeamPlay)
+{
+	constexpr int Count = 16;
+	constexpr int Frames = 10000 / FrameMS;
+
+	std::mt19937 Rng{ 7 };
+	std::uniform_real_distribution<float> Coord{ 0, 8000 };
+	auto Players = MakePlayers(Count);
+	for (auto& Player : Players)
+		SetPosition(*Player, { Coord(Rng), Coord(Rng), 0 });
+
+	Forwarder Voice;
+	Voice.SetEnabled(true);
+	Forwarder::Stats Stats;
+	const auto& Settings = Voice.GetSettings();
+
+	u64 Bytes = 0;
+	size_t MaxBytesPerSecond = 0;
+	std::vector<std::set<int>> Heard(Count);
+	std::vector<size_t> ReceiverBytes(Count);
+	// Who each receiver heard in the last frame.
+	std::vector<std::set<int>> HeardNow(Count);
+	for (int Frame = 0; Frame < Frames; ++Frame)
+	{
+		const u64 Time = 1000 + Frame * FrameMS;
+		for (auto& Speakers : HeardNow)
+			Speakers.clear();
+		for (int s = 0; s < Count; ++s)
+		{
+			for (int r = 0; r < Count; ++r)
+			{
+				if (r == s)
+					continue;
+				const size_t Size = FrameSize - 30 + Rng() % 60;
+				if (!Voice.ShouldForward(*Players[s], *Players[r], Size, bTeamPlay, Time, Stats))
+					continue;
+				Bytes += Size;
+				ReceiverBytes[r] += Size;
+				Heard[r].insert(s);
+				HeardNow[r].insert(s);
+			}
+		}
+
+		// In the first frame, higher priority speakers take slots from the ones that came
+		// before them, so more than MaxSpeakers get a frame through.
+		if (Frame > 0)
+		{
+			for (auto& Speakers : HeardNow)
+				TEST_CHECK(Speakers.size() <= Settings.MaxSpeakers);
+		}
+		if ((Frame + 1) % (1000 / FrameMS) == 0)
+		{
+			for (auto& Received : ReceiverBytes)
+			{
+				MaxBytesPerSecond = std::max(MaxBytesPerSecond, Received);
+				Received = 0;
+			}
+		}
+	}
+
+	int Pairs = 0, Teammates = 0;
+	for (int r = 0; r < Count; ++r)
+	{
+		for (int s : Heard[r])
+		{
+			++Pairs;
+			Teammates += (s % 2) == (r % 2);
+		}
+	}
+	int Speaking = 0, TeammatesSpeaking = 0;
+	for (int r = 0; r < Count; ++r)
+	{
+		for (int s : HeardNow[r])
+		{
+			++Speaking;
+			TeammatesSpeaking += (s % 2) == (r % 2);
+		}
+	}
+
+	std::printf("%s: %llu frames considered, %llu forwarded, %llu suppressed for speaker slots, "
+		"%llu for the byte budget; %.1f KB/s per receiver against %.1f KB/s unfiltered, "
+		"busiest receiver %.1f KB/s; %d of %d speaker/receiver pairs heard, %d of them teammates\n",
+		bTeamPlay ? "Team play" : "Free for all",
+		static_cast<unsigned long long>(Stats.Considered), static_cast<unsigned long long>(Stats.Forwarded),
+		static_cast<unsigned long long>(Stats.SuppressedSpeakers),
+		static_cast<unsigned long long>(Stats.SuppressedBudget),
+		Bytes / 10.0 / Count / 1024, (Count - 1) * FrameSize * 1000.0 / FrameMS / 1024,
+		MaxBytesPerSecond / 1024.0, Pairs, Count * (Count - 1), Teammates);
+
+	TEST_CHECK(Stats.Considered == u64(Frames) * Count * (Count - 1));
+	TEST_CHECK(Stats.Forwarded + Stats.SuppressedSpeakers + Stats.SuppressedBudget == Stats.Considered);
+	// A second's budget plus what refills during it.
+	TEST_CHECK(MaxBytesPerSecond <= 2 * Settings.BytesPerSecond);
+	// In team play, teammates end up with all the slots, since there are more of them
+	// than slots.
+	if (bTeamPlay)
+		TEST_CHECK(Speaking > 0 && TeammatesSpeaking == Speaking);
+}
+
+int main()
+{
+	TestDisabled();
+	TestSpeakerLimit();
+	TestPriority();
+	TestBudget();
+
+	Simulate(false);
+	Simulate(true);
+
+	return TestResult();
+}
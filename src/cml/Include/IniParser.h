@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdlib>
 #include <string>
 #include <unordered_map>
 #include "ini.h"
@@ -66,4 +67,22 @@ struct IniParser
 	{
 		return GetInt(arg_section, arg_name).value_or(default_value);
 	};
+
+	optional<float> GetFloat(const char* arg_section, const char* arg_name) const
+	{
+		auto Str = GetString(arg_section, arg_name);
+		if (!Str)
+			return nullopt;
+		auto String = Str->str();
+		char* End;
+		auto Value = strtof(String.c_str(), &End);
+		if (End == String.c_str() || *End != 0)
+			return nullopt;
+		return Value;
+	}
+
+	float GetFloat(const char* arg_section, const char* arg_name, float default_value) const
+	{
+		return GetFloat(arg_section, arg_name).value_or(default_value);
+	}
 };
\ No newline at end of file
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Bounded multi-producer, single-consumer FIFO queue.
+//
+// Push can be called from any thread, everything else only from the consumer
+// thread (except Size and GetHighWaterMark, which are approximate: a value is
+// counted from the start of its Push, so Size can include values that Pop doesn't
+// see yet, but never more than have been pushed).
+//
+// The fast path is a lock-free ring of N slots, based on Dmitry Vyukov's bounded
+// MPMC queue. If the ring is full, values spill into a locked overflow list
+// instead of being dropped or blocking the producer. Once anything has spilled,
+// producers keep spilling until the consumer has taken the overflow list, so the
+// values from any one producer are always popped in the order they were pushed.
+template <typename T, size_t N>
+class MPSCQueue
+{
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+public:
+	MPSCQueue() : Cells{ new Cell[N] }
+	{
+		for (size_t i = 0; i < N; ++i)
+			Cells[i].Sequence.store(i, std::memory_order_relaxed);
+	}
+
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+	void Push(T Value)
+	{
+		// Counted before the value is published, so that the consumer's decrement
+		// can't come first and wrap Count around. The release that publishes the
+		// value orders this before it.
+		auto NewCount = Count.fetch_add(1, std::memory_order_relaxed) + 1;
+		auto HighWater = HighWaterMark.load(std::memory_order_relaxed);
+		while (NewCount > HighWater &&
+			!HighWaterMark.compare_exchange_weak(HighWater, NewCount, std::memory_order_relaxed));
+
+		if (Overflowed.load(std::memory_order_acquire) || !TryPushRing(Value))
+		{
+			std::lock_guard<std::mutex> Lock{ OverflowMutex };
+			Overflow.push_back(std::move(Value));
+			Overflowed.store(true, std::memory_order_release);
+		}
+	}
+
+	bool Pop(T& Value)
+	{
+		if (!Front())
+			return false;
+
+		Value = std::move(*Front());
+		PopFront();
+		return true;
+	}
+
+	// Returns the next value without removing it, or nullptr if the queue is empty.
+	T* Peek() { return Front(); }
+
+	// Pops everything that's in the queue right now, in order, and calls Fn on each
+	// value. Returns the number of values.
+	template <typename FnType>
+	size_t Drain(FnType&& Fn)
+	{
+		size_t NumValues = 0;
+		const auto MaxValues = Size();
+		T Value;
+		while (NumValues < MaxValues && Pop(Value))
+		{
+			Fn(std::move(Value));
+			++NumValues;
+		}
+		return NumValues;
+	}
+
+	size_t Size() const { return Count.load(std::memory_order_relaxed); }
+	size_t GetHighWaterMark() const { return HighWaterMark.load(std::memory_order_relaxed); }
+	void ResetHighWaterMark() { HighWaterMark.store(Size(), std::memory_order_relaxed); }
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> Sequence;
+		T Value;
+	};
+
+	bool TryPushRing(T& Value)
+	{
+		auto Pos = EnqueuePos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			auto& Slot = Cells[Pos & (N - 1)];
+			auto Seq = Slot.Sequence.load(std::memory_order_acquire);
+			auto Diff = intptr_t(Seq) - intptr_t(Pos);
+			if (Diff == 0)
+			{
+				if (EnqueuePos.compare_exchange_weak(Pos, Pos + 1, std::memory_order_relaxed))
+				{
+					Slot.Value = std::move(Value);
+					Slot.Sequence.store(Pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (Diff < 0)
+			{
+				// Full.
+				return false;
+			}
+			else
+			{
+				Pos = EnqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Values taken from the overflow list are older than anything in the ring that
+	// came from the same producer, so they go first. The ring goes before the
+	// overflow list for the same reason.
+	T* Front()
+	{
+		if (SpillPos < Spill.size())
+			return &Spill[SpillPos];
+
+		auto& Slot = Cells[DequeuePos & (N - 1)];
+		if (Slot.Sequence.load(std::memory_order_acquire) == DequeuePos + 1)
+			return &Slot.Value;
+
+		// Only take the overflow list once the ring is really empty. A producer might
+		// have claimed a slot and not written it yet, and that value could be older
+		// than the ones in the overflow list.
+		if (Overflowed.load(std::memory_order_acquire) &&
+			EnqueuePos.load(std::memory_order_acquire) == DequeuePos)
+		{
+			Spill.clear();
+			SpillPos = 0;
+			{
+				std::lock_guard<std::mutex> Lock{ OverflowMutex };
+				Spill.swap(Overflow);
+				Overflowed.store(false, std::memory_order_release);
+			}
+			if (!Spill.empty())
+				return &Spill[0];
+		}
+
+		return nullptr;
+	}
+
+	// Must follow a Front() that returned a value.
+	void PopFront()
+	{
+		if (SpillPos < Spill.size())
+		{
+			++SpillPos;
+		}
+		else
+		{
+			auto& Slot = Cells[DequeuePos & (N - 1)];
+			Slot.Sequence.store(DequeuePos + N, std::memory_order_release);
+			++DequeuePos;
+		}
+
+		Count.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	static constexpr size_t CacheLineSize = 64;
+
+	std::unique_ptr<Cell[]> Cells;
+	char Pad0[CacheLineSize];
+	std::atomic<size_t> EnqueuePos{ 0 };
+	char Pad1[CacheLineSize];
+	std::atomic<size_t> Count{ 0 };
+	std::atomic<size_t> HighWaterMark{ 0 };
+	char Pad2[CacheLineSize];
+	std::atomic<bool> Overflowed{ false };
+	std::mutex OverflowMutex;
+	std::vector<T> Overflow;
+	char Pad3[CacheLineSize];
+
+	// Consumer only.
+	size_t DequeuePos = 0;
+	std::vector<T> Spill;
+	size_t SpillPos = 0;
+};
@@ -582,4 +582,23 @@ MSocket::protoent * MSOCKET_CALL getprotobynumber(int proto);
 
 MSocket::protoent * MSOCKET_CALL getprotobyname(const char * name);
 
+// Batched datagram I/O
+
+struct Datagram
+{
+	char* Buffer;
+	// The capacity of Buffer when receiving, and the number of bytes to send when sending.
+	int Size;
+	// Set to the number of bytes received.
+	int Received;
+	// The source address when receiving, and the destination address when sending.
+	sockaddr_in Addr;
+};
+
+// Receives or sends up to Count datagrams with as few system calls as possible, i.e. with
+// recvmmsg/sendmmsg where they're available, and recvfrom/sendto otherwise.
+// Returns the number of datagrams received or sent, or SocketError if the first one failed.
+int RecvFromBatch(SOCKET s, Datagram* Datagrams, int Count, int flags);
+int SendToBatch(SOCKET s, const Datagram* Datagrams, int Count, int flags);
+
 }
\ No newline at end of file
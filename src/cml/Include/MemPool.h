@@ -2,17 +2,38 @@
 
 #include "MDebug.h"
 #include "assert.h"
+#include <atomic>
 #include <mutex>
+#include "GlobalTypes.h"
 
 #define InitMemPool(T)
 #define UninitMemPool(T)
 #define ReleaseMemPool(T)	CMemPool<T>::Release();
 
+struct CMemPoolStats
+{
+	// Objects handed out, and objects given back.
+	u64 Allocs;
+	u64 Frees;
+	// Objects allocated with ::operator new, because every free list was empty.
+	u64 HeapAllocs;
+	// Batches moved between thread caches and the shared free list.
+	u64 Refills;
+	u64 Flushes;
+	// Times a thread had to wait for the shared free list's lock.
+	u64 Contentions;
+};
+
+// Free-list pool for objects of type T, used by deriving from CMemPool<T>.
+//
+// Each thread has a small cache of free objects in front of the shared free list,
+// so most allocations and frees don't take a lock. When a thread's cache runs out
+// it takes a batch from the shared list, and when it fills up it gives back half
+// of it in one go. This matters for objects that are created on one thread and
+// destroyed on another, like commands from the I/O threads.
 template< typename T >
 class CMemPool
 {
-protected:
-
 protected:
 	static T*	m_list;
 	T*			m_next;
@@ -22,67 +43,217 @@ protected:
 public:
 	static void	Release();
 
+	// The per-thread counts are added in whenever a thread touches the shared list,
+	// so the numbers can lag behind by up to a batch per thread.
+	static CMemPoolStats GetStats();
+
 public:
 	static void* operator new( size_t size_ );
 	static void  operator delete( void* deadObject_, size_t size_ );
-public:
+
+private:
+	static constexpr int CacheSize = 64;
+	static constexpr int BatchSize = CacheSize / 2;
+
+	// Trivially destructible, so it's still usable when objects are deleted after the
+	// thread's destructors have run (like from static destructors). Once Exited is
+	// set, everything goes straight to the shared list.
+	struct ThreadCache
+	{
+		T* Items[CacheSize];
+		int Count;
+		bool Initialized;
+		bool Exited;
+		u64 Allocs;
+		u64 Frees;
+	};
+
+	struct ThreadCacheFlusher
+	{
+		~ThreadCacheFlusher();
+	};
+
+	static ThreadCache& GetThreadCache();
+	static std::unique_lock<std::mutex> LockList();
+	// Must hold the lock.
+	static void FlushThreadCache(ThreadCache& Cache, int Count);
+
+	static std::atomic<u64> Allocs;
+	static std::atomic<u64> Frees;
+	static std::atomic<u64> HeapAllocs;
+	static std::atomic<u64> Refills;
+	static std::atomic<u64> Flushes;
+	static std::atomic<u64> Contentions;
 };
 
-// new
 template<typename T>
-void* CMemPool<T>::operator new( size_t size_ )
+typename CMemPool<T>::ThreadCache& CMemPool<T>::GetThreadCache()
 {
-	T* instance;
+	static thread_local ThreadCache Cache;
+	if (!Cache.Initialized)
+	{
+		Cache.Initialized = true;
+		static thread_local ThreadCacheFlusher Flusher;
+		(void)Flusher;
+	}
+	return Cache;
+}
 
-	std::lock_guard<std::mutex> lock(Mutex);
+template<typename T>
+CMemPool<T>::ThreadCacheFlusher::~ThreadCacheFlusher()
+{
+	auto& Cache = GetThreadCache();
+	auto Lock = LockList();
+	FlushThreadCache(Cache, Cache.Count);
+	Cache.Exited = true;
+}
 
-	if( m_list != NULL )
+template<typename T>
+std::unique_lock<std::mutex> CMemPool<T>::LockList()
+{
+	std::unique_lock<std::mutex> Lock(Mutex, std::try_to_lock);
+	if (!Lock.owns_lock())
 	{
-		instance	= m_list;
-		m_list	= m_list->m_next;
+		Contentions.fetch_add(1, std::memory_order_relaxed);
+		Lock.lock();
 	}
-	else
+	return Lock;
+}
+
+template<typename T>
+void CMemPool<T>::FlushThreadCache(ThreadCache& Cache, int Count)
+{
+	for (int i = 0; i < Count; ++i)
 	{
-		instance = (T*)::operator new(size_);
+		T* Item = Cache.Items[--Cache.Count];
+		Item->m_next = m_list;
+		m_list = Item;
 	}
 
+	Allocs.fetch_add(Cache.Allocs, std::memory_order_relaxed);
+	Frees.fetch_add(Cache.Frees, std::memory_order_relaxed);
+	Cache.Allocs = 0;
+	Cache.Frees = 0;
+}
+
+// new
+template<typename T>
+void* CMemPool<T>::operator new( size_t size_ )
+{
 #ifdef _DEBUG
-	if(size_ != sizeof(*instance))
+	if(size_ != sizeof(T))
 		assert(0);
 #endif
 
-	return instance;
+	auto& Cache = GetThreadCache();
+	if (Cache.Exited)
+	{
+		Allocs.fetch_add(1, std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(Mutex);
+		if (m_list != NULL)
+		{
+			T* instance = m_list;
+			m_list = m_list->m_next;
+			return instance;
+		}
+		HeapAllocs.fetch_add(1, std::memory_order_relaxed);
+		return ::operator new(size_);
+	}
+
+	if (Cache.Count == 0)
+	{
+		auto Lock = LockList();
+		while (Cache.Count < BatchSize && m_list != NULL)
+		{
+			Cache.Items[Cache.Count++] = m_list;
+			m_list = m_list->m_next;
+		}
+		FlushThreadCache(Cache, 0);
+		Refills.fetch_add(1, std::memory_order_relaxed);
+		Lock.unlock();
+
+		// Nothing to share yet, so grow by a whole batch instead of coming back to
+		// the lock for every allocation.
+		if (Cache.Count == 0)
+		{
+			while (Cache.Count < BatchSize)
+				Cache.Items[Cache.Count++] = (T*)::operator new(size_);
+			HeapAllocs.fetch_add(BatchSize, std::memory_order_relaxed);
+		}
+	}
+
+	++Cache.Allocs;
+	return Cache.Items[--Cache.Count];
 }
 
 // delete
 template<typename T>
 void CMemPool<T>::operator delete( void* deadObject_, size_t size_ )
 {
-	std::lock_guard<std::mutex> lock(Mutex);
+	auto& Cache = GetThreadCache();
+	if (Cache.Exited)
+	{
+		Frees.fetch_add(1, std::memory_order_relaxed);
 
-	((T*)deadObject_)->m_next	= m_list;
-	m_list	= (T*)deadObject_;
+		std::lock_guard<std::mutex> lock(Mutex);
+		((T*)deadObject_)->m_next	= m_list;
+		m_list	= (T*)deadObject_;
+		return;
+	}
+
+	if (Cache.Count == CacheSize)
+	{
+		auto Lock = LockList();
+		FlushThreadCache(Cache, BatchSize);
+		Flushes.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	++Cache.Frees;
+	Cache.Items[Cache.Count++] = (T*)deadObject_;
 }
 
+// Frees the shared list and the calling thread's cache. Other threads' caches are
+// given back to the shared list when the threads exit.
 template<typename T>
 void CMemPool<T>::Release()
 {
-	if( NULL != m_list ) 
-	{
-		std::lock_guard<std::mutex> lock(Mutex);
+	auto& Cache = GetThreadCache();
 
-		T* pInstace		= m_list;
-		while( pInstace != NULL )
-		{
-			pInstace	= m_list->m_next;
-			::operator delete( m_list );
-			m_list	= pInstace;
-		}
+	std::lock_guard<std::mutex> lock(Mutex);
+
+	FlushThreadCache(Cache, Cache.Count);
+
+	T* pInstace		= m_list;
+	while( pInstace != NULL )
+	{
+		pInstace	= m_list->m_next;
+		::operator delete( m_list );
+		m_list	= pInstace;
 	}
 }
 
+template<typename T>
+CMemPoolStats CMemPool<T>::GetStats()
+{
+	CMemPoolStats Stats;
+	Stats.Allocs = Allocs.load(std::memory_order_relaxed);
+	Stats.Frees = Frees.load(std::memory_order_relaxed);
+	Stats.HeapAllocs = HeapAllocs.load(std::memory_order_relaxed);
+	Stats.Refills = Refills.load(std::memory_order_relaxed);
+	Stats.Flushes = Flushes.load(std::memory_order_relaxed);
+	Stats.Contentions = Contentions.load(std::memory_order_relaxed);
+	return Stats;
+}
+
 template<typename T> std::mutex CMemPool<T>::Mutex;
 template<typename T> T* CMemPool<T>::m_list;
+template<typename T> std::atomic<u64> CMemPool<T>::Allocs;
+template<typename T> std::atomic<u64> CMemPool<T>::Frees;
+template<typename T> std::atomic<u64> CMemPool<T>::HeapAllocs;
+template<typename T> std::atomic<u64> CMemPool<T>::Refills;
+template<typename T> std::atomic<u64> CMemPool<T>::Flushes;
+template<typename T> std::atomic<u64> CMemPool<T>::Contentions;
 
 template < typename T >
 class CMemPoolSm
@@ -10,7 +10,7 @@ struct defer : private std::tuple<std::decay_t<ArgsType>...>
 {
 	using Base = std::tuple<std::decay_t<ArgsType>...>;
 
-	defer(T&& fn, ArgsType&&... Args) : fn(std::forward<T>(fn)), Base{ std::forward<ArgsType>(Args)... } {}
+	defer(T&& fn, ArgsType&&... Args) : Base{ std::forward<ArgsType>(Args)... }, fn(std::forward<T>(fn)) {}
 	defer(const defer& src) = delete;
 	defer& operator=(const defer& src) = delete;
 	~defer() { /*std::*/::apply(fn, *static_cast<Base*>(this)); }
@@ -12,6 +12,7 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #endif
+#include <algorithm>
 
 #include "MSocket.h"
 #include "MSync.h"
@@ -674,4 +675,102 @@ MSocket::protoent * MSOCKET_CALL getprotobyname(const char * name) {
 	return reinterpret_cast<MSocket::protoent*>(::getprotobyname(name));
 }
 
+#ifdef __linux__
+
+// recvmmsg/sendmmsg take arrays of headers, so they're filled in chunks of this many.
+static constexpr int MaxMsgsPerCall = 64;
+
+static void FillMsgHdr(::mmsghdr& Msg, ::iovec& Iov, const Datagram& Datagram)
+{
+	Iov.iov_base = Datagram.Buffer;
+	Iov.iov_len = size_t(Datagram.Size);
+	Msg = {};
+	Msg.msg_hdr.msg_name = const_cast<sockaddr_in*>(&Datagram.Addr);
+	Msg.msg_hdr.msg_namelen = sizeof(Datagram.Addr);
+	Msg.msg_hdr.msg_iov = &Iov;
+	Msg.msg_hdr.msg_iovlen = 1;
+}
+
+int RecvFromBatch(SOCKET s, Datagram* Datagrams, int Count, int flags)
+{
+	int Total = 0;
+	while (Total < Count)
+	{
+		::mmsghdr Msgs[MaxMsgsPerCall];
+		::iovec Iovs[MaxMsgsPerCall];
+		const auto NumMsgs = (std::min)(Count - Total, MaxMsgsPerCall);
+		for (int i = 0; i < NumMsgs; ++i)
+			FillMsgHdr(Msgs[i], Iovs[i], Datagrams[Total + i]);
+
+		const auto ret = ::recvmmsg(int(s), Msgs, NumMsgs, flags, nullptr);
+		if (ret <= 0)
+			return Total > 0 ? Total : SocketError;
+
+		for (int i = 0; i < ret; ++i)
+			Datagrams[Total + i].Received = int(Msgs[i].msg_len);
+		Total += ret;
+
+		// The socket ran out of datagrams.
+		if (ret < NumMsgs)
+			break;
+	}
+	return Total;
+}
+
+int SendToBatch(SOCKET s, const Datagram* Datagrams, int Count, int flags)
+{
+	int Total = 0;
+	while (Total < Count)
+	{
+		::mmsghdr Msgs[MaxMsgsPerCall];
+		::iovec Iovs[MaxMsgsPerCall];
+		const auto NumMsgs = (std::min)(Count - Total, MaxMsgsPerCall);
+		for (int i = 0; i < NumMsgs; ++i)
+			FillMsgHdr(Msgs[i], Iovs[i], Datagrams[Total + i]);
+
+		const auto ret = ::sendmmsg(int(s), Msgs, NumMsgs, flags);
+		if (ret <= 0)
+			return Total > 0 ? Total : SocketError;
+
+		Total += ret;
+		if (ret < NumMsgs)
+			break;
+	}
+	return Total;
+}
+
+#else
+
+int RecvFromBatch(SOCKET s, Datagram* Datagrams, int Count, int flags)
+{
+	int Total = 0;
+	for (; Total < Count; ++Total)
+	{
+		auto& Datagram = Datagrams[Total];
+		int AddrLen = sizeof(Datagram.Addr);
+		const auto ret = recvfrom(s, Datagram.Buffer, Datagram.Size, flags,
+			reinterpret_cast<sockaddr*>(&Datagram.Addr), &AddrLen);
+		if (ret == SocketError)
+			return Total > 0 ? Total : SocketError;
+		Datagram.Received = ret;
+	}
+	return Total;
+}
+
+int SendToBatch(SOCKET s, const Datagram* Datagrams, int Count, int flags)
+{
+	int Total = 0;
+	for (; Total < Count; ++Total)
+	{
+		auto& Datagram = Datagrams[Total];
+		const auto ret = sendto(s, Datagram.Buffer, Datagram.Size, flags,
+			reinterpret_cast<const sockaddr*>(&Datagram.Addr), sizeof(Datagram.Addr));
+		if (ret == SocketError)
+			return Total > 0 ? Total : SocketError;
+	}
+	return Total;
+}
+
+#endif
+
 }